@@ -0,0 +1,62 @@
+#include <iostream>
+#include <chrono>
+
+#include "pbsm.hpp"
+
+/**
+ * Microbenchmark of the accesses which don't need other nodes:
+ * increments of an owned variable (on the master node) and reads of a cached one (on the others).
+ * Run it on all nodes, as the other applications.
+ */
+
+/// Number of accesses measured
+const long ITERATIONS = 100000000;
+
+/// Print the time of each access since start
+static void print_rate(const char* what, std::chrono::steady_clock::time_point start)
+{
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "Node " << pbsm_tid << ": " << what << ": " << elapsed.count() / ITERATIONS << " ns" << std::endl;
+}
+
+int main (int argc, char* argv[])
+{
+	pbsm_init(argc, argv);
+
+	shared<long> counter (DEF, 0);
+	shared<long> limit (DEF, ITERATIONS);
+
+	PBSM_BARRIER();
+
+	if (pbsm_tid == 0) {
+		// The first write invalidates the copies of other nodes: then the variable is not shared
+		counter = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (long i = 0; i < ITERATIONS; ++i)
+			counter++;
+		print_rate("owned increment", start);
+
+		start = std::chrono::steady_clock::now();
+		for (long i = 0; i < ITERATIONS; ++i)
+			++counter;
+		print_rate("owned prefix increment", start);
+	} else {
+		// The first read fetches the value: then it is cached
+		long sum = limit;
+		auto start = std::chrono::steady_clock::now();
+		for (long i = 0; i < ITERATIONS; ++i)
+			sum += limit;
+		print_rate("cached read", start);
+		if (sum != (ITERATIONS + 1) * ITERATIONS)
+			std::cout << "Node " << pbsm_tid << ": wrong value read" << std::endl;
+	}
+
+	PBSM_BARRIER();
+
+	if ((pbsm_tid != 0) && (counter != 2 * ITERATIONS))
+		std::cout << "Node " << pbsm_tid << ": wrong value of the counter" << std::endl;
+
+	PBSM_BARRIER();
+
+	return 0;
+}
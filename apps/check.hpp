@@ -0,0 +1,37 @@
+#ifndef CHECK_HPP_
+#define CHECK_HPP_
+
+#include <iostream>
+#include <atomic>
+
+/**
+ * Checks of the tests (e.g., test-codec, or test-local-access on each node).
+ * A failed check is printed, and the test goes on: check_report() tells whether any failed.
+ */
+
+/// Number of failed checks (also updated by concurrent threads)
+static std::atomic<int> failures (0);
+
+#define CHECK(condition, what) \
+	do { \
+		if (!(condition)) { \
+			std::cerr << "FAILED: " << what << " (" << #condition << ", line " << __LINE__ << ")" << std::endl; \
+			failures++; \
+		} \
+	} while (0)
+
+/**
+ * @brief Print the outcome of the checks
+ * @return Exit status of the test: 0 if all checks passed; 1 otherwise
+ */
+static int check_report()
+{
+	if (failures > 0) {
+		std::cerr << failures << " checks failed" << std::endl;
+		return 1;
+	}
+	std::cout << "All checks passed" << std::endl;
+	return 0;
+}
+
+#endif // CHECK_HPP_
@@ -0,0 +1,277 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+
+#include "pbsm.hpp"
+#include "compression.hpp"
+#include "delta.hpp"
+#include "check.hpp"
+
+/**
+ * Tests of the encodings of values sent to other nodes: compression (see compress())
+ * and deltas (see diff_ranges()). It runs on a single node, without the run-time.
+ */
+
+/// Bytes after the output buffers which must never be written
+const std::size_t GUARD_SIZE = 64;
+const char GUARD_BYTE = (char) 0xA5;
+
+static std::mt19937 generator (12345);
+
+static void fill_random(std::vector<char>& data)
+{
+	for (auto& c: data)
+		c = (char) generator();
+}
+
+/// Runs of the same byte, of random length (up to max_run)
+static void fill_runs(std::vector<char>& data, std::size_t max_run)
+{
+	std::size_t i = 0;
+	while (i < data.size()) {
+		char c = (char) generator();
+		std::size_t len = 1 + generator() % max_run;
+		for (; (len > 0) && (i < data.size()); --len)
+			data[i++] = c;
+	}
+}
+
+/// A short random pattern repeated (i.e., matches at every distance multiple of the period)
+static void fill_pattern(std::vector<char>& data, std::size_t period)
+{
+	std::vector<char> pattern (period);
+	fill_random(pattern);
+	for (std::size_t i = 0; i < data.size(); ++i)
+		data[i] = pattern[i % period];
+}
+
+/// Decompress into a buffer of the given capacity followed by guard bytes, checking that they are untouched
+static std::size_t guarded_decompress(const std::vector<char>& compressed, std::size_t size, std::vector<char>& out, std::size_t capacity)
+{
+	out.assign(capacity + GUARD_SIZE, GUARD_BYTE);
+	std::size_t ret = decompress(compressed.data(), size, out.data(), capacity);
+	for (std::size_t i = capacity; i < out.size(); ++i) {
+		if (out[i] != GUARD_BYTE) {
+			CHECK(false, "decompress() wrote beyond the capacity " << capacity);
+			break;
+		}
+	}
+	return ret;
+}
+
+static void test_round_trip(const char* kind, const std::vector<char>& value)
+{
+	std::size_t size = value.size();
+	std::vector<char> compressed (compress_bound(size) + GUARD_SIZE, GUARD_BYTE);
+	std::size_t len = compress(value.data(), size, compressed.data(), compress_bound(size));
+	CHECK(len > 0, kind << " value of " << size << " bytes not compressed within compress_bound()");
+	CHECK(len <= compress_bound(size), kind << " value of " << size << " bytes");
+	for (std::size_t i = compress_bound(size); i < compressed.size(); ++i) {
+		if (compressed[i] != GUARD_BYTE) {
+			CHECK(false, "compress() wrote beyond the capacity for a " << kind << " value of " << size << " bytes");
+			break;
+		}
+	}
+	if (len == 0)
+		return;
+
+	std::vector<char> out;
+	CHECK(guarded_decompress(compressed, len, out, size) == size, kind << " value of " << size << " bytes");
+	CHECK((size == 0) || (memcmp(out.data(), value.data(), size) == 0), kind << " value of " << size << " bytes decompressed differently");
+	if (size > 0)
+		CHECK(guarded_decompress(compressed, len, out, size - 1) == 0,
+		      kind << " value of " << size << " bytes decompressed into a smaller buffer");
+
+	// A buffer smaller than the compressed value is rejected
+	if (len > 1)
+		CHECK(compress(value.data(), size, compressed.data(), len - 1) == 0,
+		      kind << " value of " << size << " bytes compressed into a buffer too small");
+
+	// Truncated values are never taken for the whole value (a cut right after the literals
+	// of a sequence looks like the last sequence: only the size tells it)
+	for (std::size_t cut = 0; cut < len; cut += (len < 512) ? 1 : len / 256)
+		CHECK(guarded_decompress(compressed, cut, out, size) != size || size == 0,
+		      kind << " value of " << size << " bytes truncated at " << cut);
+
+	// Corrupted values never make decompress() write out of the buffer (see guarded_decompress())
+	std::vector<char> corrupted;
+	for (int i = 0; i < 32; ++i) {
+		corrupted.assign(compressed.begin(), compressed.begin() + len);
+		corrupted[generator() % len] ^= (char) (1 + generator() % 255);
+		guarded_decompress(corrupted, len, out, size);
+	}
+}
+
+static void test_compression()
+{
+	// Sizes around MATCH_LIMIT (12) and LAST_LITERALS (5), and around the lengths stored in the token (15 + 255 * n)
+	std::vector<std::size_t> sizes;
+	for (std::size_t size = 0; size <= 40; ++size)
+		sizes.push_back(size);
+	for (std::size_t size: {64, 255, 256, 270, 271, 272, 1000, 4096, 65535 + 100, 300000})
+		sizes.push_back(size);
+
+	for (std::size_t size: sizes) {
+		std::vector<char> value (size, 0);
+		test_round_trip("zero-filled", value);
+		if (size >= 256) {
+			std::vector<char> compressed (compress_bound(size));
+			std::size_t len = compress(value.data(), size, compressed.data(), compressed.size());
+			CHECK(len < size / 10, "zero-filled value of " << size << " bytes compressed only to " << len);
+		}
+		fill_random(value);
+		test_round_trip("random", value);
+		if (size >= 16) {
+			std::vector<char> small (size - 1);
+			CHECK(compress(value.data(), size, small.data(), small.size()) == 0,
+			      "random value of " << size << " bytes compressed into a smaller buffer");
+		}
+		fill_runs(value, 8);
+		test_round_trip("short runs", value);
+		fill_runs(value, 1000);
+		test_round_trip("long runs", value);
+		fill_pattern(value, 3);
+		test_round_trip("pattern", value);
+	}
+}
+
+/// Hand-made compressed values (token, literals, offset, match length)
+static void test_malformed()
+{
+	std::vector<char> out;
+	std::vector<char> compressed;
+
+	// Literal length continuing past the input
+	compressed = {(char) 0xF0, (char) 255};
+	CHECK(guarded_decompress(compressed, compressed.size(), out, 1000) == 0, "truncated literal length");
+	// More literals than the input holds
+	compressed = {(char) 0x50, 'a', 'b'};
+	CHECK(guarded_decompress(compressed, compressed.size(), out, 1000) == 0, "truncated literals");
+	// More literals than the capacity
+	compressed = {(char) 0x50, 'a', 'b', 'c', 'd', 'e'};
+	CHECK(guarded_decompress(compressed, compressed.size(), out, 4) == 0, "literals beyond the capacity");
+	// Offset cut in half
+	compressed = {(char) 0x10, 'a', 1};
+	CHECK(guarded_decompress(compressed, compressed.size(), out, 1000) == 0, "truncated offset");
+	// Offset 0
+	compressed = {(char) 0x10, 'a', 0, 0, 0x00};
+	CHECK(guarded_decompress(compressed, compressed.size(), out, 1000) == 0, "offset 0");
+	// Offset before the beginning of the value
+	compressed = {(char) 0x10, 'a', 2, 0, 0x00};
+	CHECK(guarded_decompress(compressed, compressed.size(), out, 1000) == 0, "offset beyond the output");
+	// Match length continuing past the input
+	compressed = {(char) 0x1F, 'a', 1, 0, (char) 255};
+	CHECK(guarded_decompress(compressed, compressed.size(), out, 1000) == 0, "truncated match length");
+	// Match longer than the capacity
+	compressed = {(char) 0x1F, 'a', 1, 0, 100, 0x00};
+	CHECK(guarded_decompress(compressed, compressed.size(), out, 50) == 0, "match beyond the capacity");
+	// Ending with a match, without the last sequence of literals
+	compressed = {(char) 0x10, 'a', 1, 0};
+	CHECK(guarded_decompress(compressed, compressed.size(), out, 1000) == 0, "missing last sequence");
+	// Well-formed: "a" followed by a match of 4 bytes at offset 1, then the last sequence
+	compressed = {(char) 0x10, 'a', 1, 0, 0x00};
+	CHECK(guarded_decompress(compressed, compressed.size(), out, 1000) == 5, "hand-made value");
+	CHECK(memcmp(out.data(), "aaaaa", 5) == 0, "hand-made value decompressed differently");
+}
+
+/// Check that the ranges of a delta contain only bytes changed with respect to the twin
+static void check_exact(const std::vector<char>& ranges, const std::vector<char>& twin, const std::vector<char>& value)
+{
+	std::size_t pos = 0;
+	while (pos + sizeof(delta_run) <= ranges.size()) {
+		delta_run run;
+		memcpy(&run, &ranges[pos], sizeof(run));
+		pos += sizeof(run) + run.length;
+		CHECK(run.length > 0, "empty exact range");
+		for (std::size_t i = run.offset; i < run.offset + run.length; ++i) {
+			if (twin[i] == value[i]) {
+				CHECK(false, "exact range [" << run.offset << ", " << run.offset + run.length << ") with byte " << i << " unchanged");
+				break;
+			}
+		}
+	}
+	CHECK(pos == ranges.size(), "exact ranges not ending at the end of the delta");
+}
+
+static void test_ranges(std::size_t size, std::size_t changes, bool exact)
+{
+	std::vector<char> twin (size);
+	fill_random(twin);
+	std::vector<char> value (twin);
+	for (std::size_t i = 0; (i < changes) && (size > 0); ++i)
+		value[generator() % size] ^= (char) (1 + generator() % 255);
+
+	std::vector<char> ranges;
+	std::size_t limit = exact ? exact_delta_bound(size) : delta_bound(size);
+	CHECK(diff_ranges(twin.data(), value.data(), size, ranges, limit, exact),
+	      "ranges of " << size << " bytes with " << changes << " changes not within the bound");
+	CHECK(ranges.size() <= limit, "ranges of " << size << " bytes");
+	if (exact)
+		check_exact(ranges, twin, value);
+
+	std::vector<char> copy (twin);
+	CHECK(apply_ranges(ranges.data(), ranges.size(), copy.data(), size),
+	      "ranges of " << size << " bytes with " << changes << " changes rejected");
+	CHECK(copy == value, "ranges of " << size << " bytes with " << changes << " changes applied differently");
+
+	// A limit too small is reported (the ranges are then meaningless)
+	if (!ranges.empty()) {
+		std::vector<char> small;
+		CHECK(!diff_ranges(twin.data(), value.data(), size, small, ranges.size() - 1, exact),
+		      "ranges of " << size << " bytes beyond the limit");
+	}
+}
+
+static void test_deltas()
+{
+	for (std::size_t size: {0, 1, 15, 16, 17, 31, 33, 100, 4096, 4099, 100000}) {
+		for (std::size_t changes: {0, 1, 5, 100, 10000}) {
+			test_ranges(size, changes, false);
+			test_ranges(size, changes, true);
+		}
+	}
+
+	// Every other byte changed: the worst case of exact ranges (see exact_delta_bound())
+	std::vector<char> twin (1001, 0);
+	std::vector<char> value (twin);
+	for (std::size_t i = 0; i < value.size(); i += 2)
+		value[i] = 1;
+	std::vector<char> ranges;
+	CHECK(diff_ranges(twin.data(), value.data(), value.size(), ranges, exact_delta_bound(value.size()), true),
+	      "alternate bytes not within exact_delta_bound()");
+	check_exact(ranges, twin, value);
+
+	// Malformed ranges are rejected
+	std::vector<char> target (100, 0);
+	delta_run run;
+	std::vector<char> malformed;
+	auto make = [&](uint32_t offset, uint32_t length, std::size_t content) {
+		run.offset = offset;
+		run.length = length;
+		malformed.assign((const char*) &run, (const char*) &run + sizeof(run));
+		malformed.resize(sizeof(run) + content, 'x');
+	};
+	CHECK(!apply_ranges(malformed.data(), sizeof(run) - 1, target.data(), target.size()), "truncated run");
+	make(0, 10, 9);
+	CHECK(!apply_ranges(malformed.data(), malformed.size(), target.data(), target.size()), "truncated content");
+	make(101, 0, 0);
+	CHECK(!apply_ranges(malformed.data(), malformed.size(), target.data(), target.size()), "offset beyond the value");
+	make(95, 10, 10);
+	CHECK(!apply_ranges(malformed.data(), malformed.size(), target.data(), target.size()), "range beyond the value");
+	make(50, std::numeric_limits<uint32_t>::max(), 10);
+	CHECK(!apply_ranges(malformed.data(), malformed.size(), target.data(), target.size()), "overflowing length");
+	make(90, 10, 10);
+	CHECK(apply_ranges(malformed.data(), malformed.size(), target.data(), target.size()), "range at the end of the value");
+	CHECK(apply_ranges(nullptr, 0, target.data(), target.size()), "empty ranges");
+}
+
+int main ()
+{
+	test_compression();
+	test_malformed();
+	test_deltas();
+	return check_report();
+}
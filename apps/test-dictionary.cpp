@@ -0,0 +1,164 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <cstdint>
+#include <cstdlib>
+
+#include "dictionary.hpp"
+#include "check.hpp"
+
+/**
+ * Tests of the table from variable IDs to their data (see dictionary): removed keys must not make it
+ * grow, and concurrent lookups must never see a value after its removal returned, nor keep a removal waiting
+ * forever. It runs on a single node, without the run-time.
+ */
+
+/// Value stored in the dictionary, marked dead once removed
+struct value {
+	explicit value(uint32_t k): key(k), alive(true) {}
+	uint32_t key;
+	std::atomic<bool> alive;
+};
+
+static void test_sequential()
+{
+	dictionary<value> d;
+	value a (1), b (1), c (2);
+	CHECK(d.find(1) == nullptr, "key found in an empty dictionary");
+	d.insert(1, &a);
+	d.insert(2, &c);
+	CHECK(d.find(1) == &a, "key not found after insertion");
+	CHECK(d.size() == 2, "size " << d.size() << " after 2 insertions");
+	d.insert(1, &b);
+	CHECK(d.find(1) == &b, "value not replaced");
+	CHECK(d.size() == 2, "size " << d.size() << " after replacing a value");
+	d.remove(1, &a);
+	CHECK(d.find(1) == &b, "key removed with a different value");
+	d.remove(1, &b);
+	CHECK(d.find(1) == nullptr, "key found after removal");
+	CHECK(d.find(2) == &c, "other key lost by a removal");
+	CHECK(d.size() == 1, "size " << d.size() << " after a removal");
+	d.insert(1, &a);
+	CHECK(d.find(1) == &a, "key not found after insertion again");
+	CHECK(d.size() == 2, "size " << d.size() << " after insertion again");
+}
+
+static void test_tombstones()
+{
+	dictionary<value> d;
+	value v (0);
+	std::size_t initial = d.capacity();
+
+	// Every ID used once, as variables created and destroyed in turn
+	for (uint32_t key = 0; key < 100000; ++key) {
+		d.insert(key, &v);
+		d.remove(key, &v);
+	}
+	CHECK(d.size() == 0, "size " << d.size() << " after removing all keys");
+	CHECK(d.capacity() == initial, "table grown to " << d.capacity() << " slots without keys");
+
+	// Growth is driven by the keys only, and the keys survive the rebuilds
+	for (uint32_t key = 0; key < 1000; ++key)
+		d.insert(key, &v);
+	for (uint32_t key = 1000; key < 50000; ++key) {
+		d.insert(key, &v);
+		d.remove(key, &v);
+	}
+	CHECK(d.size() == 1000, "size " << d.size() << " with 1000 keys");
+	CHECK(d.capacity() <= 4096, "table grown to " << d.capacity() << " slots for 1000 keys");
+	for (uint32_t key = 0; key < 1000; ++key)
+		CHECK(d.find(key) == &v, "key " << key << " lost by the rebuilds");
+	CHECK(d.find(1000) == nullptr, "removed key found after the rebuilds");
+}
+
+/// Readers, writers and keys of the concurrent test
+const int READERS = 4;
+const int WRITERS = 4;
+const uint32_t KEYS_PER_WRITER = 200;
+const int ROUNDS = 400;
+
+static void test_concurrent()
+{
+	dictionary<value> d;
+	std::atomic<bool> stop (false);
+	std::atomic<int> writers_done (0);
+	std::atomic<unsigned long> found (0);
+
+	// Each reader checks that the values it finds stay alive while it holds the reader
+	std::vector<std::thread> readers;
+	for (int r = 0; r < READERS; ++r) {
+		readers.emplace_back([&, r]() {
+			std::minstd_rand generator (r + 1);
+			while (!stop.load()) {
+				dictionary<value>::reader guard (d);
+				uint32_t key = generator() % (WRITERS * KEYS_PER_WRITER);
+				value* v = d.find(key);
+				if (v == nullptr)
+					continue;
+				found++;
+				CHECK(v->key == key, "key " << key << " found with the value of key " << v->key);
+				CHECK(v->alive.load(), "key " << key << " found after its removal");
+				std::this_thread::yield();
+				CHECK(v->alive.load(), "value of key " << key << " removed while holding a reader");
+			}
+		});
+	}
+
+	// This reader is never without a reader: a removal waiting for all readers to be released at once would never end
+	std::thread chain ([&]() {
+		std::unique_ptr<dictionary<value>::reader> held (new dictionary<value>::reader(d));
+		while (!stop.load())
+			held.reset(new dictionary<value>::reader(d));
+	});
+
+	// Each writer inserts and removes its own keys, marking the values removed once remove() returns
+	std::vector<std::thread> writers;
+	std::vector<std::vector<std::unique_ptr<value>>> graveyards (WRITERS);
+	for (int w = 0; w < WRITERS; ++w) {
+		writers.emplace_back([&, w]() {
+			std::minstd_rand generator (100 + w);
+			std::vector<value*> current (KEYS_PER_WRITER, nullptr);
+			for (int i = 0; i < ROUNDS; ++i) {
+				uint32_t k = generator() % KEYS_PER_WRITER;
+				uint32_t key = w * KEYS_PER_WRITER + k;
+				if (current[k] == nullptr) {
+					graveyards[w].emplace_back(new value(key));
+					current[k] = graveyards[w].back().get();
+					d.insert(key, current[k]);
+				} else {
+					d.remove(key, current[k]);
+					current[k]->alive.store(false);
+					current[k] = nullptr;
+				}
+			}
+			writers_done++;
+		});
+	}
+
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+	while ((writers_done.load() < WRITERS) && (std::chrono::steady_clock::now() < deadline))
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	if (writers_done.load() < WRITERS) {
+		std::cerr << "FAILED: removals still waiting for the readers after 60 s" << std::endl;
+		std::_Exit(1);
+	}
+	stop.store(true);
+	for (auto& t: writers)
+		t.join();
+	for (auto& t: readers)
+		t.join();
+	chain.join();
+	CHECK(found.load() > 0, "no key ever found by the readers");
+}
+
+int main ()
+{
+	test_sequential();
+	test_tombstones();
+	test_concurrent();
+	return check_report();
+}
@@ -0,0 +1,91 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include "pbsm.hpp"
+#include "check.hpp"
+
+/**
+ * Test of the accesses which don't call the policy (see AbstractShared::begin_local_access()) against
+ * their revocation: threads of the master node increment a variable it owns, while another node keeps
+ * taking the ownership away through its own increments. No increment may be lost, neither between
+ * the local threads nor across the handoffs. It is repeated with more threads than access slots,
+ * whose accesses beyond the slots call the policy.
+ * Run it on two nodes, as the other applications.
+ */
+
+/// Threads of the master node incrementing the variable in the first round
+const int WRITERS = 4;
+
+/// Increments of each writer in the first round
+const int INCREMENTS = 1000000;
+
+/// Threads of the master node in the second round (more than the access slots)
+const int MANY_WRITERS = 300;
+
+/// Increments of each writer in the second round
+const int FEW_INCREMENTS = 50;
+
+/// Increments of the other node in each round, taking the ownership away from the writers
+const int REMOTE_INCREMENTS = 200;
+
+/**
+ * @brief Increment a variable from several threads at once (on the master node) or from a single one,
+ * which moves the ownership at every increment (on the other node)
+ */
+static void increment(shared<long>& counter, int writers, int increments)
+{
+	if (pbsm_tid != 0) {
+		for (int i = 0; i < REMOTE_INCREMENTS; ++i) {
+			++counter;
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+		return;
+	}
+
+	// All threads are alive together, so that they hold their access slots at the same time
+	std::atomic<int> started (0);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < writers; ++t)
+		threads.emplace_back([&]() {
+			started++;
+			while (started < writers)
+				std::this_thread::yield();
+			for (int i = 0; i < increments; ++i) {
+				if (i % 2)
+					counter++;
+				else
+					++counter;
+			}
+		});
+	for (auto& t: threads)
+		t.join();
+}
+
+int main (int argc, char* argv[])
+{
+	LOG_FILE("/tmp/pbsm.log");
+	pbsm_init(argc, argv);
+
+	shared<long> counter (DEF, 0);
+	long expected = (long) WRITERS * INCREMENTS + REMOTE_INCREMENTS;
+
+	PBSM_BARRIER();
+	increment(counter, WRITERS, INCREMENTS);
+	PBSM_BARRIER();
+	long value = counter;
+	CHECK(value == expected, "node " << pbsm_tid << " read " << value << " after " << expected << " increments");
+
+	expected = value + (long) MANY_WRITERS * FEW_INCREMENTS + REMOTE_INCREMENTS;
+	PBSM_BARRIER();
+	increment(counter, MANY_WRITERS, FEW_INCREMENTS);
+	PBSM_BARRIER();
+	value = counter;
+	CHECK(value == expected, "node " << pbsm_tid << " read " << value << " after " << expected << " increments with "
+	      << MANY_WRITERS << " threads");
+
+	PBSM_BARRIER();
+	return check_report();
+}
@@ -0,0 +1,101 @@
+#include <iostream>
+#include <vector>
+#include <array>
+#include <thread>
+#include <atomic>
+
+#include "pbsm.hpp"
+#include "check.hpp"
+
+/**
+ * Test of the write-update protocol (see write_update) with readers running while values are received:
+ * the master node writes values whose elements are all equal, while threads of the other node keep reading
+ * them. Readers must never see a value partly updated, nor an older value after a newer one, and after
+ * the barrier the other node must hold the latest value. Values are small (a single datagram) and large
+ * (sent in fragments).
+ * Run it on two nodes, as the other applications.
+ */
+
+typedef std::array<long, 64> small_value;
+typedef std::array<long, 4096> large_value;
+
+/// Values written to the small variable
+const long VALUES = 2000;
+
+/// Values written to the large variable (one every LARGE_EVERY small ones)
+const long LARGE_EVERY = 20;
+
+/// Threads of the other node reading the variables
+const int READERS = 3;
+
+template<class V>
+static V filled(long n)
+{
+	V value;
+	value.fill(n);
+	return value;
+}
+
+/**
+ * @brief Check a value read while values are received
+ * @param value		Value read
+ * @param last		Value read before by the same thread (updated)
+ */
+template<class V>
+static void check_read(const V& value, long& last, const char* what)
+{
+	long first = value[0];
+	for (std::size_t i = 1; i < value.size(); ++i) {
+		if (value[i] != first) {
+			CHECK(value[i] == first, what << " value read partly updated: element " << i << " is " << value[i]
+			      << " instead of " << first);
+			break;
+		}
+	}
+	CHECK(first >= last, what << " value " << first << " read after " << last);
+	last = first;
+}
+
+int main (int argc, char* argv[])
+{
+	LOG_FILE("/tmp/pbsm.log");
+	pbsm_init(argc, argv);
+
+	shared<small_value> small (DEF, write_update);
+	shared<large_value> large (DEF, write_update);
+
+	PBSM_BARRIER();
+
+	std::atomic<bool> stop (false);
+	std::vector<std::thread> readers;
+	if (pbsm_tid == 0) {
+		for (long n = 1; n <= VALUES; ++n) {
+			small = filled<small_value>(n);
+			if (n % LARGE_EVERY == 0)
+				large = filled<large_value>(n / LARGE_EVERY);
+		}
+	} else {
+		for (int t = 0; t < READERS; ++t)
+			readers.emplace_back([&]() {
+				long last_small = 0, last_large = 0;
+				while (!stop) {
+					check_read(small.operator small_value(), last_small, "small");
+					check_read(large.operator large_value(), last_large, "large");
+				}
+			});
+	}
+
+	// The barrier waits for the values sent to be set
+	PBSM_BARRIER();
+	long value = small.operator small_value()[0];
+	CHECK(value == VALUES, "node " << pbsm_tid << " read " << value << " instead of " << VALUES << " after the barrier");
+	value = large.operator large_value()[0];
+	CHECK(value == VALUES / LARGE_EVERY, "node " << pbsm_tid << " read large value " << value << " instead of "
+	      << VALUES / LARGE_EVERY << " after the barrier");
+	stop = true;
+	for (auto& t: readers)
+		t.join();
+
+	PBSM_BARRIER();
+	return check_report();
+}
@@ -12,8 +12,6 @@ int main (int argc, char* argv[])
 	pbsm_init(argc, argv);
 	std::cout << "Starting application!" << std::endl;
 
-	std::this_thread::sleep_for(std::chrono::seconds(10));
-
 	DEBUG("pbsm_tid = " << pbsm_tid << "\t pbsm_hosts = " << pbsm_hosts);
 	DEBUG("Main.cpp thread id: " << std::this_thread::get_id());
 
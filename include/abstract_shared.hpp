@@ -2,25 +2,245 @@
 #define ABSTRACT_SHARED_HPP_
 
 #include <string>
+#include <cstdint>
+#include <atomic>
+
+#include "var_data.hpp"
+
+/**
+ * @brief Compression of the value of a variable sent to other nodes
+ */
+enum class compression_t {
+	DEFAULT,	//< Follow Config::compression
+	ENABLED,	//< Compress values larger than Config::compression_threshold
+	DISABLED	//< Never compress
+};
+
+/**
+ * @brief Coherence protocol of a variable, chosen when declaring it (see write_update)
+ */
+enum class coherence_t {
+	INVALIDATE,	//< Writes invalidate the copies of other nodes, which fetch the value when reading it
+	UPDATE,		//< Writes send the value to all nodes, whose reads never wait
+	RELEASE		//< Writes are recorded locally, and sent to all nodes at the next barrier
+};
+
+/// Type of the tag write_update
+struct write_update_t {};
+
+/// Tag for declaring a variable with the write-update protocol (e.g., shared<int> a (PBSM, 0, write_update))
+const write_update_t write_update = {};
+
+/// Type of the tag release_consistent
+struct release_consistent_t {};
+
+/**
+ * @brief Tag for declaring a variable with release consistency (e.g., shared<int> a (PBSM, 0, release_consistent))
+ *
+ * The changes made by a node are seen by the others only after the next barrier.
+ * Nodes can write the variable at the same time, as long as they write different bytes.
+ */
+const release_consistent_t release_consistent = {};
+
+/**
+ * @brief Write of a variable which can be executed by another node (see shipped_write)
+ */
+enum class write_op_t : uint8_t {
+	INCREMENT,	//< Prefix or postfix increment
+	ASSIGN		//< Assignment of a new value
+};
+
+class AbstractShared;
+
+/// Slot where the calling thread publishes the variable it is accessing without calling the policy (see AbstractShared::begin_local_access())
+extern __thread std::atomic<const AbstractShared*>* pbsm_access_slot __attribute__((tls_model("initial-exec")));
+
+/**
+ * @brief Write shipped to the node where the variable is pinned, instead of moving the ownership
+ *
+ * See Config::pingpong_migrations and Policy::before_local_write().
+ */
+struct shipped_write {
+	shipped_write(write_op_t o, const void* value = nullptr, void* prev = nullptr):
+		op(o), operand(value), previous(prev) {}
+
+	/// Operation
+	write_op_t op;
+	/// New value for ASSIGN (get_size() bytes, as for AbstractShared::set_value()); nullptr otherwise
+	const void* operand;
+	/// Buffer which gets the value before the write (e.g., for a postfix increment; get_size() bytes), or nullptr
+	void* previous;
+};
 
 /**
  * @brief Abstract class for shared<> variable
  *
  * This class stores the variable id and provides a basic interface for setting/getting value.
+ * It is the first base of shared<>, and the accesses allowed come first in it: the fields read by
+ * every access share the cache line of the start of the value. The policy data is kept apart
+ * (see get_var_data()).
  */
 class AbstractShared {
 public:
-	explicit AbstractShared(uint32_t s): id_(s) {}
+	explicit AbstractShared(uint32_t s, coherence_t c = coherence_t::INVALIDATE):
+		access_(ACCESS_NONE), accessed_(false), id_(s), compression_(compression_t::DEFAULT), coherence_(c),
+		var_data_(unregistered()) {}
+
+	/**
+	 * @brief Constructor of a temporary copy of a variable (e.g., a variable passed by value)
+	 *
+	 * Temporary copies are unknown to the policy (see var_data::variable_),
+	 * and their value can always be read and written locally.
+	 */
+	AbstractShared(const AbstractShared& other):
+		access_(ACCESS_READ | ACCESS_WRITE), accessed_(false), id_(0), compression_(other.compression_),
+		coherence_(other.coherence_), var_data_(unregistered()) {}
+
+	/// Accesses allowed without calling the policy (see set_access())
+	enum access_t {
+		ACCESS_NONE = 0,
+		ACCESS_READ = 1,	//< The local value is valid
+		ACCESS_WRITE = 2	//< The local value can be changed without informing other nodes
+	};
 
 	virtual bool get_value(void* buffer)=0;
 	virtual bool set_value(void* buffer)=0;
 	virtual std::size_t get_size() const=0;
+
+	/**
+	 * @brief Execute a write on behalf of another node (see shipped_write)
+	 * @param op		Operation
+	 * @param operand	New value for write_op_t::ASSIGN (get_size() bytes)
+	 * @param previous	Buffer where the value before the write must be written (get_size() bytes)
+	 * @return		false if the operation is not supported by the type
+	 */
+	virtual bool apply_write(write_op_t op, const void* operand, void* previous)=0;
+
+	/**
+	 * @brief Raw storage of the value, for sending/receiving it without intermediate copies
+	 *
+	 * The storage must be accessed only between lock_value() and unlock_value().
+	 * @return Pointer to get_size() bytes; nullptr if the value can't be
+	 * transferred as raw bytes (in this case get_value() and set_value() must be used)
+	 */
+	virtual void* value_buffer()=0;
+	virtual void lock_value()=0;
+	virtual void unlock_value()=0;
+
 	inline uint32_t get_id() const {
 		return id_;
 	}
 
+	/// Policy data of the variable (the one shared by the variables unknown to the policy, until registered)
+	inline var_data* get_var_data() {
+		return var_data_;
+	}
+
+	/// Set the policy data of the variable, when registered by the policy (see Policy::at_variable_creation())
+	inline void set_var_data(var_data* v) {
+		var_data_ = v;
+	}
+
+	/**
+	 * @brief Choose whether the value is compressed when sent to other nodes
+	 *
+	 * It overrides Config::compression for this variable (e.g., to disable it for values
+	 * known to be random, or to enable it only for sparse ones). It should be set
+	 * right after creating the variable, before other nodes access it.
+	 * @param c Compression of the value
+	 */
+	inline void set_compression(compression_t c) {
+		compression_ = c;
+	}
+
+	inline compression_t get_compression() const {
+		return compression_;
+	}
+
+	inline coherence_t get_coherence() const {
+		return coherence_;
+	}
+
+	/**
+	 * @brief Set the accesses allowed without calling the policy
+	 *
+	 * It is kept by the policy in line with the state of the variable,
+	 * so that the common accesses (i.e., reads of valid values and writes of values
+	 * not shared) take neither locks nor atomic read-modify-writes.
+	 * When accesses are revoked, it returns once the accesses in progress without calling
+	 * the policy have ended (see begin_local_access()): then, the value can be changed or given away.
+	 * Therefore, it must not be called while holding the lock of the value (see lock_value()).
+	 * @param access Bitmask of access_t
+	 */
+	void set_access(int access);
+
+	/// Check if the local value can be read without calling the policy
+	inline bool readable() const {
+		return access_.load(std::memory_order_acquire) & ACCESS_READ;
+	}
+
+	/// Check if the local value can be written without calling the policy
+	inline bool writable() const {
+		return access_.load(std::memory_order_acquire) & ACCESS_WRITE;
+	}
+
+	/**
+	 * @brief Start an access to the local value without calling the policy, if allowed
+	 *
+	 * The variable is published in the slot of the calling thread before checking the accesses,
+	 * so that set_access() waits for the access to end before revoking it. This takes plain stores
+	 * only: set_access() orders them with the load of the accesses (see membarrier()).
+	 * The first access since the last revocation also takes a fence, so that set_access()
+	 * can skip membarrier() when no thread has accessed the variable meanwhile.
+	 * Slots are limited (256 threads at a time, given back when threads exit): threads without
+	 * a slot always call the policy.
+	 * @param access Accesses needed (bitmask of access_t)
+	 * @return true if allowed (then, end_local_access() must be called); false if the policy must be called instead
+	 */
+	inline bool begin_local_access(int access) const {
+		std::atomic<const AbstractShared*>* slot = pbsm_access_slot;
+		if ((slot == nullptr) && ((slot = claim_access_slot()) == nullptr))
+			return false;
+		slot->store(this, std::memory_order_relaxed);
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		if (!accessed_.load(std::memory_order_relaxed)) {
+			accessed_.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+		}
+		if (access_.load(std::memory_order_acquire) & access)
+			return true;
+		slot->store(nullptr, std::memory_order_relaxed);
+		return false;
+	}
+
+	/// End an access started by begin_local_access()
+	inline void end_local_access() const {
+		pbsm_access_slot->store(nullptr, std::memory_order_release);
+	}
+
 private:
+	/// Accesses allowed without calling the policy (see set_access())
+	std::atomic<int> access_;
+
+	/// Set by the first access without calling the policy since the last revocation of accesses (see set_access())
+	mutable std::atomic<bool> accessed_;
+
 	const uint32_t id_;
+
+	/// Compression of the value (see set_compression())
+	compression_t compression_;
+
+	/// Coherence protocol (see coherence_t)
+	const coherence_t coherence_;
+
+	/// Policy data (see get_var_data())
+	var_data* var_data_;
+
+	/// Policy data of the variables unknown to the policy (i.e., temporary copies, and variables not yet registered)
+	static var_data* unregistered();
+
+	/// Claim a slot for the calling thread (see begin_local_access()); nullptr if none is free
+	static std::atomic<const AbstractShared*>* claim_access_slot();
 };
 
 	
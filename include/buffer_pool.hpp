@@ -0,0 +1,123 @@
+#ifndef BUFFER_POOL_HPP_
+#define BUFFER_POOL_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+/// Size of the smallest buffers kept by BufferPool (log2)
+const unsigned int POOL_MIN_CLASS = 6;
+
+/// Size of the biggest buffers kept by BufferPool (log2): bigger buffers are freed when released
+const unsigned int POOL_MAX_CLASS = 26;
+
+/// Bytes kept by BufferPool for each size class (at least 2 buffers are kept, anyway)
+const std::size_t POOL_CLASS_BYTES = 16 << 20;
+
+/// Maximum number of buffers kept by BufferPool for each size class
+const std::size_t POOL_CLASS_BUFFERS = 64;
+
+/**
+ * @brief Pool of the buffers of the message path (e.g., snapshots of values, compressed values and deltas)
+ *
+ * Buffers are grouped in size classes (powers of 2): a buffer taken from a class has room for
+ * all sizes of the class, and a buffer released keeps its memory for the next one taken.
+ * Buffers cross threads (e.g., a snapshot taken by an application thread is released by a receiving
+ * thread when the last fragment is acknowledged): therefore, there is one pool shared by all threads,
+ * with one lock for each size class.
+ *
+ * The pool counts the heap allocations of the message path (including the ones of object_pool),
+ * so that they can be checked (see pbsm_print_stats()): in steady state there should be none.
+ */
+class BufferPool {
+public:
+	static BufferPool& getInstance();
+
+	/**
+	 * @brief Get a buffer
+	 * @param buffer	Vector where the buffer must be put (its previous memory is released)
+	 * @param size		Size of the buffer (the content is not preserved)
+	 */
+	void acquire(std::vector<char>& buffer, std::size_t size);
+
+	/**
+	 * @brief Give back the memory of a buffer
+	 * @param buffer	Vector whose memory must be released (it is left empty)
+	 */
+	void release(std::vector<char>& buffer);
+
+	/// Note a heap allocation of the message path made outside the pool (see object_pool)
+	void count_allocation() {
+		allocations_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	/// Number of heap allocations of the message path
+	std::uint64_t get_allocations() const {
+		return allocations_.load(std::memory_order_relaxed);
+	}
+
+	/// Number of buffers taken from the pool without allocating
+	std::uint64_t get_reuses() const {
+		return reuses_.load(std::memory_order_relaxed);
+	}
+
+private:
+	/// Singleton pattern for a deterministic initialization order of objects
+	static std::atomic<BufferPool*> m_;
+	static std::mutex mutex_;
+
+	BufferPool();
+
+	/// Buffers of a size class
+	struct size_class {
+		std::mutex mutex;
+		std::vector<std::vector<char> > buffers;
+	};
+
+	/// Size classes (only the ones from POOL_MIN_CLASS are used)
+	size_class classes_ [POOL_MAX_CLASS + 1];
+
+	/// Heap allocations of the message path (see get_allocations())
+	std::atomic<std::uint64_t> allocations_;
+	/// Buffers taken from the pool (see get_reuses())
+	std::atomic<std::uint64_t> reuses_;
+};
+
+/**
+ * @brief Pool of objects of the message path (e.g., transfers of values and barrier semaphores)
+ *
+ * Objects released are kept, with the memory of their members, and returned by the next acquire():
+ * its caller must reset the members it needs. Not thread-safe: the user must serialize the calls.
+ */
+template<class T>
+class object_pool {
+public:
+	~object_pool() {
+		for (auto o: free_)
+			delete o;
+	}
+
+	/// Get an object (either a released one or a new one)
+	T* acquire() {
+		if (free_.empty()) {
+			BufferPool::getInstance().count_allocation();
+			return new T;
+		}
+		T* o = free_.back();
+		free_.pop_back();
+		return o;
+	}
+
+	/// Give back an object (nullptr is ignored)
+	void release(T* o) {
+		if (o != nullptr)
+			free_.push_back(o);
+	}
+
+private:
+	std::vector<T*> free_;
+};
+
+#endif // BUFFER_POOL_HPP_
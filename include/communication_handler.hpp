@@ -3,25 +3,175 @@
 
 #include <vector>
 #include <mutex>
-#include <array>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <utility>
+#include <ostream>
 #include <unistd.h>	// close()
 #include <cstring>	// memset()
+#include <cstdint>
+#include <cerrno>
 #include <arpa/inet.h>
+#include <netinet/udp.h>	// UDP_SEGMENT, UDP_GRO
 #include <sys/types.h>	// recv(), send(), socket(), connect()
-#include <sys/socket.h>	// recv(), send(), socket(), connect()
+#include <sys/socket.h>	// recv(), send(), socket(), connect(), sendmmsg(), recvmmsg()
+#include <sys/epoll.h>
 
 #include "abstract_shared.hpp"
+#include "config.hpp"
+#include "uring.hpp"
+#include "shm_ring.hpp"
+#include "mpsc_queue.hpp"
+#include "ring_queue.hpp"
+#include "buffer_pool.hpp"
 #include "logger.hpp"
 
 extern int pbsm_tid;
 
-const int MAX_NUMBER_OF_NODES = 100;
+/// Maximum number of nodes (each node receives on its own UDP port, see start_sockets())
+const int MAX_NUMBER_OF_NODES = 60000;
+
+/// Maximum size of a UDP datagram over IPv4
+const int MAX_DATAGRAM_SIZE = 65507;
+
+/// Maximum size of a datagram sent over the network without IP fragmentation (Ethernet MTU minus IP and UDP headers)
+const int NETWORK_DATAGRAM_SIZE = 1472;
+
+/// Maximum size of a datagram sent through shared memory, when splitting large data (see datagram_size())
+const int LOCAL_DATAGRAM_SIZE = 16384;
+
+/// Number of messages that can be queued for each node before being moved into its outbound batch (see send_to())
+const std::size_t SEND_QUEUE_SLOTS = 256;
+
+/// Timeout (in microseconds) for retransmissions before the round-trip time to a node is known
+const unsigned int RELIABLE_INITIAL_RTO_US = 20000;
+
+/// Maximum timeout (in microseconds) for retransmissions, reached through exponential backoff
+const unsigned int RELIABLE_MAX_RTO_US = 1000000;
+
+/// Maximum time (in microseconds) spent at exit waiting for the acknowledgment of the datagrams sent (see wait_acknowledged())
+const unsigned int RELIABLE_LINGER_US = 1000000;
+
+/// Number of datagrams received out of order that can be kept, waiting the missing ones (see reliable_header::sack).
+/// Datagrams further from the oldest one not acknowledged are not sent yet (see unacked_datagram::held)
+const unsigned int RELIABLE_WINDOW = 64;
+
+/**
+ * @brief Header preceding the content of every datagram sent over the network, when Config::reliable is set
+ *
+ * Besides numbering the datagram, it acknowledges the datagrams received from the recipient
+ * (i.e., acknowledgments are piggybacked on the traffic in the opposite direction).
+ */
+struct reliable_header {
+	/// Sequence number of the datagram (meaningful only if RELIABLE_SEQUENCED is set in flags)
+	std::uint32_t seq;
+	/// Sequence number of the next datagram expected from the recipient (all previous ones have been received)
+	std::uint32_t ack;
+	/// Datagrams received after the first gap (bit i set means datagram ack + 1 + i received)
+	std::uint64_t sack;
+	/// Sequence number of the next datagram expected from the multicast group by the recipient
+	std::uint32_t multicast_ack;
+	/// RELIABLE_SEQUENCED if the datagram must be sent again when lost (i.e., not for acknowledgments only)
+	std::uint32_t flags;
+};
+
+/// Flag of reliable_header for numbered datagrams
+const std::uint32_t RELIABLE_SEQUENCED = 1;
+
+/// Maximum size of a datagram of the outbound batch (room is left for the reliable_header)
+const int BATCH_DATAGRAM_SIZE = NETWORK_DATAGRAM_SIZE - sizeof(reliable_header);
+
+/// Receive channel of the multicast group (see Config::multicast_group), also used as its node id
+const int MULTICAST_CHANNEL = MAX_NUMBER_OF_NODES;
+
+/// Receive channel of the bulk lanes (see Config::bulk_lane)
+const int BULK_CHANNEL = MULTICAST_CHANNEL + 1;
+
+/// Id of the bulk lane of node 0: datagrams from the bulk lane of node i are reported as sent by BULK_LANE + i
+const int BULK_LANE = MULTICAST_CHANNEL + 1;
+
+/// Maximum number of datagrams handed to the kernel as a single buffer (see Config::udp_offload)
+const unsigned int UDP_OFFLOAD_MAX_SEGMENTS = 64;
+
+/// Maximum number of receive channels returned at once by wait_readable()
+const int MAX_READY_CHANNELS = 64;
+
+/**
+ * @brief Header preceding the content of every datagram sent to the multicast group
+ *
+ * Datagrams sent to the group come from a port other than the one of the sender, so the sender
+ * can't be identified by the source address as for unicast datagrams.
+ * When Config::reliable is set, it is followed by a reliable_header, numbering
+ * the datagrams sent to the group separately from the ones sent to each node.
+ */
+struct multicast_header {
+	/// Id of the sender node
+	std::uint32_t node;
+	std::uint32_t reserved;
+};
+
+/// Magic number of hello_datagram ("PBSM")
+const std::uint32_t HELLO_MAGIC = 0x5042534D;
+
+/// Initial interval (in microseconds) between hello datagrams sent to a node not yet reachable, doubled at every retry
+const unsigned int HELLO_MIN_INTERVAL_US = 1000;
+
+/// Maximum interval (in microseconds) between hello datagrams sent to a node not yet reachable
+const unsigned int HELLO_MAX_INTERVAL_US = 100000;
+
+/**
+ * @brief Datagram exchanged at startup, to check that the nodes can reach each other (see create_connections())
+ *
+ * It is shorter than any other datagram (i.e., than a reliable_header or a message),
+ * so it is recognized by its length only.
+ */
+struct hello_datagram {
+	std::uint32_t magic;
+	/// Id of the sender node
+	std::uint32_t node;
+	/// 1 if the sender has already received a hello_datagram from the recipient
+	std::uint32_t heard;
+};
 
 /**
  * @brief Class for network communications
  *
- * This class opens a set of peer to peer UDP connections among the nodes.
- * Every pair of nodes have a pair of dedicated UDP connection for sending/receiving messages.
+ * This class exchanges UDP datagrams among the nodes. Every node has its own UDP port, used
+ * both for sending to and receiving from all the other nodes: the sender of a datagram is identified
+ * by its source port, so the number of sockets doesn't depend on the number of nodes (see start_sockets()).
+ * The state kept for each node (see connection) is allocated only when the node is involved
+ * in a communication for the first time, so nodes that never talk cost nothing but their address.
+ * Messages sent to the same node are coalesced into datagrams of an outbound batch,
+ * which is sent through a single sendmmsg() when flushed.
+ * Small messages are first appended to a lock-free queue of the node, so that senders never wait
+ * for the send channel (see send_to()): the queue is moved into the batch by the thread holding the
+ * send channel, right after locking it (see lock_send_channel()).
+ * When Config::transport is transport_t::IO_URING, datagrams are instead sent and received
+ * through io_uring (see UringTransport): the batches of all nodes are flushed by a single submission.
+ * Nodes running on the same host are instead connected through shared memory rings (see ShmRing),
+ * unless Config::shared_memory is false.
+ * If Config::multicast_group is set, messages sent to all nodes needing no ordering with the other
+ * messages (i.e., barrier releases) are sent through a single datagram to the multicast group (see send_to_all()).
+ * If Config::udp_offload is set, runs of datagrams of the same size to a node (e.g., the fragments of a value)
+ * are handed to the kernel as a single buffer, split into datagrams by the kernel or by the NIC (UDP GSO, see
+ * send_segmented()); the bulk lane, if any, receives them coalesced again (UDP GRO, see recv_batch_from()).
+ * If Config::bulk_lane is set, values are sent through a second port of each node (its bulk lane),
+ * with its own socket and receive thread, so that protocol messages never wait behind them.
+ * The bulk lane of a node is handled as a separate peer (see BULK_LANE): it has its own state,
+ * its own numbering of datagrams and its own acknowledgments.
+ *
+ * If Config::reliable is set, datagrams sent over the network are preceded by a reliable_header:
+ * each node acknowledges the datagrams received (cumulatively and selectively, piggybacked on its own
+ * datagrams or, when it has nothing to send, through acknowledgments only, see flush_all()).
+ * Unacknowledged datagrams are kept and sent again either at once, when datagrams following them
+ * have been acknowledged (fast retransmit), or when the timeout computed from the round-trip time
+ * expires. Datagrams received out of order are kept until the missing ones arrive, so that
+ * messages from each node are always handled in the order they have been sent (see accept_datagram()).
+ * Before returning, create_connections() waits until all nodes can be reached (see handshake()).
  * The class is implemented as a Singleton for a deterministic initialization order of objects.
  * Note that connections are created only when explicitly invoking method create_connections().
  */
@@ -29,12 +179,16 @@ class CommunicationHandler {
 public:
 	static CommunicationHandler& getInstance() {
 		// Double-checked locking pattern for performance issues
-		if (m_ == nullptr) {
+		CommunicationHandler* p = m_.load(std::memory_order_acquire);
+		if (p == nullptr) {
 			std::unique_lock<std::mutex> lock (mutex_);
-			if (m_ == nullptr)
-				m_ = new CommunicationHandler();
+			p = m_.load(std::memory_order_relaxed);
+			if (p == nullptr) {
+				p = new CommunicationHandler();
+				m_.store(p, std::memory_order_release);
+			}
 		}
-		return *m_;
+		return *p;
 	}
 
 	/**
@@ -49,80 +203,167 @@ public:
 
 	/**
 	 * @brief Sends a message to all nodes excpect the node itself
+	 *
+	 * The message is appended to the send queue of each node (see send_to()).
+	 * When the multicast group is available and the message needs no ordering, the message is
+	 * instead sent at once to the group, and appended only to the batches of nodes running
+	 * on the same host (see multicast_to_all()).
+	 * If sending to the group fails, the message is sent to each node as usual.
 	 * @param msg_data Buffer containing the raw data to be sent
 	 * @param msg_size Size of data to be sent
+	 * @param ordered false if the message needs no ordering with respect to the other messages to the nodes
 	 * @return true in case of success; false in case of error
 	 */
-	bool send_to_all(void* msg_data, int msg_size) {
+	bool send_to_all(void* msg_data, int msg_size, bool ordered = true) {
+		bool multicast = !ordered && multicast_ && multicast_to_all(msg_data, msg_size);
 		bool ret = true;
 		for (int i = 0; i < number_of_nodes_; ++i){
-			if (i != pbsm_tid) {
-				DEBUG("Sending to entry " << i << " related to " << connections_[i].ip << ":" << connections_[i].send_port << "...");
-				lock_send_channel(i);
-				if (send(connections_[i].send_fd, msg_data, msg_size, 0) != msg_size) {
-					ERROR("ERROR: Sending data to " << connections_[i].ip << ":" << connections_[i].send_port);
+			if ((i != pbsm_tid) && (!multicast || is_local(i))) {
+				DEBUG("Sending to node " << i << " (" << addresses_[i].ip << ")...");
+				if (!enqueue(i, msg_data, msg_size)) {
+					ERROR("ERROR: Sending data to " << addresses_[i].ip);
 					ret = false;
 				}
-				unlock_send_channel(i);
+				if ((Config::getInstance().flush_deadline_us == 0) && (uring_ == nullptr))
+					try_drain(i);
 			}
 		}
+		if ((Config::getInstance().flush_deadline_us == 0) && (uring_ != nullptr))
+			ret = flush_batches() && ret;
 		return ret;
 	}
 
 	/**
-	 * @brief Sends a message to all nodes excpect the node itself
-	 * @param msg_data Buffer containing the raw data to be sent
-	 * @param msg_size Size of data to be sent
+	 * @brief Sends a message followed by a value to all nodes excpect the node itself
+	 *
+	 * See send_value_to(). With io_uring, the datagrams for all nodes are submitted at once
+	 * (unless sent through the bulk lanes).
+	 * @param msg_data Buffer containing the message
+	 * @param msg_size Size of the message
+	 * @param value_data Buffer containing the value
+	 * @param value_size Size of the value
+	 * @param bulk true to send through the bulk lanes, when enabled
 	 * @return true in case of success; false in case of error
 	 */
-	bool send_two_messages_to_all(void* msg1_data, int msg1_size, void* msg2_data, int msg2_size) {
+	bool send_value_to_all(void* msg_data, int msg_size, void* value_data, int value_size, bool bulk = false) {
+		if ((uring_ != nullptr) && !(bulk && uses_bulk_lane())) {
+			if (msg_size + value_size > MAX_DATAGRAM_SIZE - (int) sizeof(reliable_header)) {
+				ERROR("Value of size " << value_size << " too big for a datagram");
+				return false;
+			}
+			struct iovec iov[2];
+			iov[0].iov_base = msg_data;
+			iov[0].iov_len = msg_size;
+			iov[1].iov_base = value_data;
+			iov[1].iov_len = value_size;
+			return flush_batches(iov, 2);
+		}
 		bool ret = true;
 		for (int i = 0; i < number_of_nodes_; ++i){
-			if (i != pbsm_tid) {
-				DEBUG("Sending to entry " << i << " related to " << connections_[i].ip << ":" << connections_[i].send_port << "...");
-				lock_send_channel(i);
-				if (send(connections_[i].send_fd, msg1_data, msg1_size, 0) != msg1_size) {
-					ERROR("ERROR: Sending data to " << connections_[i].ip << ":" << connections_[i].send_port);
-					ret = false;
-				}
-				if (send(connections_[i].send_fd, msg2_data, msg2_size, 0) != msg2_size) {
-					ERROR("ERROR: Sending data to " << connections_[i].ip << ":" << connections_[i].send_port);
-					ret = false;
-				}
-				unlock_send_channel(i);
-			}
+			if (i != pbsm_tid)
+				ret = send_value_to(msg_data, msg_size, value_data, value_size, i, bulk) && ret;
 		}
 		return ret;
 	}
 
-
-	bool send_two_messages_to(void* msg1_data, int msg1_size, void* msg2_data, int msg2_size, unsigned long int rem_node_id) {
+	/**
+	 * @brief Sends a message followed by a value to a specific node
+	 *
+	 * Message and value are sent in a single datagram, gathered directly from the
+	 * two buffers (i.e., the value is not copied). The outbound batch is flushed
+	 * through the same system call, so the datagram keeps its order with respect to
+	 * messages previously sent to the same node.
+	 * If bulk is set and the bulk lanes are enabled (see Config::bulk_lane), the datagram
+	 * is sent through the bulk lane of the node instead: it keeps its order only with respect
+	 * to the other datagrams of the bulk lane.
+	 * @param msg_data Buffer containing the message
+	 * @param msg_size Size of the message
+	 * @param value_data Buffer containing the value
+	 * @param value_size Size of the value
+	 * @param rem_node_id Id of the recipient node
+	 * @param bulk true to send through the bulk lane of the node, when enabled
+	 * @return true in case of success; false in case of error
+	 */
+	bool send_value_to(void* msg_data, int msg_size, void* value_data, int value_size, unsigned long int rem_node_id, bool bulk = false) {
 		bool ret = true;
-		if (rem_node_id == pbsm_tid) {
+		if ((int) rem_node_id == pbsm_tid) {
 			ERROR("Trying to send data to myself");
 			ret = false;
+		} else if (msg_size + value_size > MAX_DATAGRAM_SIZE - (int) sizeof(reliable_header)) {
+			ERROR("Value of size " << value_size << " too big for a datagram");
+			ret = false;
 		} else {
-			DEBUG("Sending to " << connections_[rem_node_id].ip << ":" << connections_[rem_node_id].send_port << "...");
-			lock_send_channel(rem_node_id);
-			DEBUG("Sending msg1 of size " << msg1_size << "...");
-			if (send(connections_[rem_node_id].send_fd, msg1_data, msg1_size, 0) != msg1_size) {
-				ERROR("ERROR: Sending msg1 data to " << connections_[rem_node_id].ip << ":" << connections_[rem_node_id].send_port);
+			DEBUG("Sending to node " << rem_node_id << " (" << addresses_[rem_node_id].ip << ")...");
+			struct iovec iov[2];
+			iov[0].iov_base = msg_data;
+			iov[0].iov_len = msg_size;
+			iov[1].iov_base = value_data;
+			iov[1].iov_len = value_size;
+			int lane = bulk ? bulk_lane_of(rem_node_id) : rem_node_id;
+			lock_send_channel(lane);
+			DEBUG("Sending message of size " << msg_size << " with value of size " << value_size << "...");
+			if (!flush_batch(lane, iov, 2)) {
+				ERROR("ERROR: Sending data to " << addresses_[rem_node_id].ip);
 				ret = false;
 			}
-			DEBUG("Sending msg2 of size " << msg2_size << "...");
-			if (send(connections_[rem_node_id].send_fd, msg2_data, msg2_size, 0) != msg2_size) {
-				ERROR("ERROR: Sending msg2 data to " << connections_[rem_node_id].ip << ":" << connections_[rem_node_id].send_port);
-				ret = false;
-			}
-			unlock_send_channel(rem_node_id);
+			unlock_send_channel(lane);
 			DEBUG("Message sent!");
 		}
 
 		return ret;
 	}
 
+	/**
+	 * @brief Sends a set of datagrams to a specific node through a single system call
+	 *
+	 * Each datagram is gathered directly from iovcnt consecutive buffers of iov.
+	 * As for send_value_to(), the outbound batch (of the bulk lane, if bulk is set) is flushed before.
+	 * The datagrams are not sent again by CommunicationHandler if lost: the caller must
+	 * recover losses by itself (e.g., fragments of values, see MSG_VALUE_FRAGMENT_ACK).
+	 * @param iov Buffers composing the datagrams
+	 * @param iovcnt Number of buffers composing each datagram
+	 * @param datagrams Number of datagrams
+	 * @param rem_node_id Id of the recipient node
+	 * @param bulk true to send through the bulk lane of the node, when enabled
+	 * @return true in case of success; false in case of error
+	 */
+	bool send_datagrams_to(struct iovec* iov, int iovcnt, int datagrams, unsigned long int rem_node_id, bool bulk = false) {
+		bool ret = true;
+		if ((int) rem_node_id == pbsm_tid) {
+			ERROR("Trying to send data to myself");
+			return false;
+		}
+		DEBUG("Sending " << datagrams << " datagrams to node " << rem_node_id << " (" << addresses_[rem_node_id].ip << ")...");
+		int lane = bulk ? bulk_lane_of(rem_node_id) : rem_node_id;
+		lock_send_channel(lane);
+		if (!flush_batch(lane, iov, iovcnt, datagrams, false)) {
+			ERROR("ERROR: Sending data to " << addresses_[rem_node_id].ip);
+			ret = false;
+		}
+		unlock_send_channel(lane);
+		return ret;
+	}
+
+	/**
+	 * @brief Preferred maximum size of the datagrams sent to a node, when splitting large data
+	 *
+	 * It avoids IP fragmentation over the network, and keeps shared memory rings from filling up.
+	 * @param node Id of the node
+	 */
+	int datagram_size(int node) const {
+		return addresses_[node].local ? LOCAL_DATAGRAM_SIZE : BATCH_DATAGRAM_SIZE;
+	}
+
 	/**
 	 * @brief Sends a message to a specific node
+	 *
+	 * The message is appended to the send queue of the node without locking (see MpscQueue),
+	 * moved into the outbound batch by the next thread locking the send channel, and actually sent
+	 * when the batch is flushed: when the batch is full, when flush_all() is called
+	 * or, at the latest, after Config::flush_deadline_us microseconds (by the flushing thread).
+	 * If Config::flush_deadline_us is 0, the queue is flushed at once, unless another thread
+	 * holds the send channel: in such case, such thread flushes it when releasing the channel.
+	 * Errors in sending queued messages are only logged.
 	 * @param msg_data Buffer containing the raw data to be sent
 	 * @param msg_size Size of data to be sent
 	 * @param rem_node_id Id of the recipient node
@@ -130,63 +371,374 @@ public:
 	 */
 	bool send_to(void* msg_data, int msg_size, unsigned long int rem_node_id) {
 		bool ret = true;
-		if (rem_node_id == pbsm_tid) {
+		if ((int) rem_node_id == pbsm_tid) {
 			ERROR("Trying to send data to myself");
 			ret = false;
 		} else {
-			DEBUG("Sending to " << connections_[rem_node_id].ip << ":" << connections_[rem_node_id].send_port << "...");
-			lock_send_channel(rem_node_id);
-			if (send(connections_[rem_node_id].send_fd, msg_data, msg_size, 0) != msg_size) {
-				ERROR("ERROR: Sending data to " << connections_[rem_node_id].ip << ":" << connections_[rem_node_id].send_port);
+			DEBUG("Sending to node " << rem_node_id << " (" << addresses_[rem_node_id].ip << ")...");
+			if (!enqueue(rem_node_id, msg_data, msg_size)) {
+				ERROR("ERROR: Sending data to " << addresses_[rem_node_id].ip);
 				ret = false;
 			}
-			unlock_send_channel(rem_node_id);
-			DEBUG("Message sent!");
+			if (Config::getInstance().flush_deadline_us == 0)
+				try_drain(rem_node_id);
+			DEBUG("Message enqueued!");
 		}
 		return ret;
 	}
 
 	/**
-	 * @brief Receive data from a specific node
+	 * @brief Sends the outbound batches of all nodes
+	 *
+	 * This method must be called before blocking while waiting an answer from a remote node.
+	 * Pending acknowledgments are sent as well, to nodes that had nothing else to carry them.
+	 * @return true in case of success; false in case of error
+	 */
+	bool flush_all() {
+		return flush_batches();
+	}
+
+	/**
+	 * @brief Receive the datagram peeked from a receive channel
 	 * @param msg_data Buffer where read data must be put
 	 * @param msg_size Size of data read
-	 * @param rem_node_id Id of the sender node
+	 * @param channel Receive channel (see peek_from())
+	 * @param rem_node_id Id of the sender node (returned by peek_from())
 	 * @return true in case of success; false in case of error
 	 */
-	bool recv_from(void* msg_data, int msg_size, unsigned long int rem_node_id) {
-		if (recv(connections_[rem_node_id].recv_fd, msg_data, msg_size, 0) != msg_size) {
-			ERROR("Error in receiving data from " << connections_[rem_node_id].ip << ":" << connections_[rem_node_id].recv_port);
-			return false;
+	bool recv_from(void* msg_data, int msg_size, int channel, int rem_node_id) {
+		struct iovec iov;
+		iov.iov_base = msg_data;
+		iov.iov_len = msg_size;
+		return recv_datagram(&iov, 1, channel, rem_node_id, false) == msg_size;
+	}
+
+	/**
+	 * @brief Read the beginning of the next datagram of a receive channel, without consuming it
+	 *
+	 * Receive channels are the sockets of the node (numbered from 0, see start_sockets()), MULTICAST_CHANNEL
+	 * and BULK_CHANNEL.
+	 * When datagrams are numbered (see Config::reliable), the reliable_header is not returned,
+	 * and a datagram that can't be handled yet (i.e., received out of order) is reported as empty:
+	 * it must be received through recv_batch_from() and passed to accept_datagram().
+	 * So are a datagram from an unknown sender and datagrams coalesced by the kernel (see Config::udp_offload).
+	 * @param msg_data Buffer where read data must be put
+	 * @param msg_size Size of data read
+	 * @param channel Receive channel
+	 * @param rem_node_id Pointer where the id of the sender node must be put (-1 if unknown;
+	 * MULTICAST_CHANNEL for the multicast group, whose datagrams are returned as they are;
+	 * BULK_LANE plus the id of the node for its bulk lane, see node_of())
+	 * @param block true to wait until a datagram is available
+	 * @return Number of bytes read (less than msg_size if the datagram is shorter);
+	 * -1 if no datagram is available (only when not blocking) or in case of error
+	 */
+	int peek_from(void* msg_data, int msg_size, int channel, int* rem_node_id, bool block) {
+		struct iovec iov[2];
+		reliable_header hdr;
+		iov[0].iov_base = &hdr;
+		iov[0].iov_len = sizeof(hdr);
+		iov[1].iov_base = msg_data;
+		iov[1].iov_len = msg_size;
+		bool multicast = (channel == MULTICAST_CHANNEL);
+		bool sequenced = reliable_ && !multicast;
+		struct sockaddr_in from;
+		char control [CMSG_SPACE(sizeof(int))];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &from;
+		msg.msg_namelen = sizeof(from);
+		msg.msg_iov = sequenced ? &iov[0] : &iov[1];
+		msg.msg_iovlen = sequenced ? 2 : 1;
+		if (channel == BULK_CHANNEL) {
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+		}
+		if (block)
+			spin_until_readable(channel_fd(channel));
+		int ret;
+		do {
+			ret = recvmsg(channel_fd(channel), &msg, block ? MSG_PEEK : MSG_PEEK | MSG_DONTWAIT);
+		} while ((ret < 0) && (errno == EINTR));
+		if (ret < 0) {
+			if (block || (errno != EAGAIN && errno != EWOULDBLOCK))
+				ERROR("Error in receiving data from channel " << channel);
+			return ret;
 		}
-		return true;
+		if (multicast) {
+			*rem_node_id = MULTICAST_CHANNEL;
+			return ret;
+		}
+		*rem_node_id = sender_of(from);
+		if ((*rem_node_id < 0) || (gro_segment(msg) > 0))
+			return 0;
+		if (sequenced)
+			ret = in_order(*rem_node_id, hdr, ret) ? ret - sizeof(hdr) : 0;
+		return ret;
+	}
+
+	/**
+	 * @brief Receive a message followed by a value from a receive channel
+	 *
+	 * The datagram sent by send_value_to() is scattered directly into the two buffers.
+	 * @param msg_data Buffer where the message must be put
+	 * @param msg_size Size of the message
+	 * @param value_data Buffer where the value must be put
+	 * @param value_size Size of the value
+	 * @param channel Receive channel (see peek_from())
+	 * @param rem_node_id Id of the sender node (returned by peek_from())
+	 * @return true in case of success; false in case of error
+	 */
+	bool recv_value_from(void* msg_data, int msg_size, void* value_data, int value_size, int channel, int rem_node_id) {
+		struct iovec iov[2];
+		iov[0].iov_base = msg_data;
+		iov[0].iov_len = msg_size;
+		iov[1].iov_base = value_data;
+		iov[1].iov_len = value_size;
+		return recv_iov_from(iov, 2, channel, rem_node_id);
+	}
+
+	/**
+	 * @brief Receive a datagram from a receive channel, scattering it into a set of buffers
+	 *
+	 * The datagram must have been peeked through peek_from() (i.e., it can be handled now).
+	 * @param iov Buffers where the datagram must be put
+	 * @param iovcnt Number of buffers
+	 * @param channel Receive channel (see peek_from())
+	 * @param rem_node_id Id of the sender node (returned by peek_from())
+	 * @return true in case of success; false in case of error (e.g., datagram not filling exactly the buffers)
+	 */
+	bool recv_iov_from(struct iovec* iov, int iovcnt, int channel, int rem_node_id) {
+		std::size_t size = 0;
+		for (int i = 0; i < iovcnt; ++i)
+			size += iov[i].iov_len;
+		return recv_datagram(iov, iovcnt, channel, rem_node_id, true) == (ssize_t) size;
+	}
+
+	/**
+	 * @brief Buffers for receiving a batch of datagrams through a single recvmmsg()
+	 *
+	 * Every slot can contain a datagram of maximum size (or a set of datagrams coalesced by the kernel,
+	 * see Config::udp_offload, which are split again: a batch can thus return more datagrams than slots).
+	 * Memory is allocated once, when the object is created.
+	 */
+	class recv_batch {
+	public:
+		explicit recv_batch(unsigned int slots);
+
+		/// Number of slots (i.e., maximum number of system buffers received at once)
+		unsigned int slots() const {
+			return headers_.size();
+		}
+
+		/// Content of the i-th datagram received
+		char* data(unsigned int i) {
+			return datagrams_[i].data;
+		}
+
+		/// Length of the i-th datagram received
+		std::size_t size(unsigned int i) const {
+			return datagrams_[i].size;
+		}
+
+		/// Id of the sender of the i-th datagram received (as for peek_from())
+		int node(unsigned int i) const {
+			return datagrams_[i].node;
+		}
+
+	private:
+		friend class CommunicationHandler;
+
+		/// Datagram received, inside the buffer of a slot
+		struct datagram {
+			char* data;
+			std::size_t size;
+			int node;
+		};
+
+		std::vector<char> buffer_;
+		std::vector<struct iovec> iov_;
+		std::vector<struct mmsghdr> headers_;
+		std::vector<struct sockaddr_in> names_;
+		/// Ancillary data of each slot (i.e., the size of coalesced datagrams)
+		std::vector<char> control_;
+		std::vector<datagram> datagrams_;
+	};
+
+	int recv_batch_from(recv_batch& batch, int channel);
+
+	/// Number of sockets of the node (i.e., receive channels other than MULTICAST_CHANNEL)
+	int get_number_of_sockets() const {
+		return sockets_.size();
+	}
+
+	void start_polling();
+	int wait_readable(int* channels, int max_channels);
+	void rearm(int channel);
+
+	/// true if datagrams are sent and received through io_uring
+	bool uses_uring() const {
+		return uring_ != nullptr;
+	}
+
+	void start_completions();
+
+	/// true if messages sent to all nodes are sent to the multicast group
+	bool uses_multicast() const {
+		return multicast_;
+	}
+
+	/// true if values are sent through the bulk lanes (see Config::bulk_lane), received from BULK_CHANNEL
+	bool uses_bulk_lane() const {
+		return bulk_fd_ >= 0;
+	}
+
+	/// Id of the node a sender id returned by the receive methods belongs to (see BULK_LANE)
+	int node_of(int sender) const {
+		return (sender >= BULK_LANE) ? sender - BULK_LANE : sender;
+	}
+
+	bool accept_datagram(int* rem_node_id, char** data, std::size_t* len);
+	bool next_datagram(int rem_node_id, bool multicast, std::vector<char>& datagram);
+	bool next_early_datagram(int* rem_node_id, std::vector<char>& datagram);
+
+	/**
+	 * @brief Statistics about the datagrams exchanged with a node over the network
+	 *
+	 * See get_peer_stats().
+	 */
+	struct peer_stats {
+		/// Datagrams sent (first transmissions only)
+		std::uint64_t sent;
+		/// Datagrams received (duplicates included)
+		std::uint64_t received;
+		/// Retransmissions of datagrams
+		std::uint64_t retransmitted;
+		/// Datagrams sent again at least once (i.e., considered lost)
+		std::uint64_t lost;
+		/// Datagrams received more than once
+		std::uint64_t duplicates;
+		/// Datagrams dropped on purpose (see Config::loss_injection)
+		std::uint64_t injected;
+		/// Smoothed round-trip time (in microseconds; 0 if not yet measured)
+		double rtt_us;
+	};
+
+	peer_stats get_peer_stats(int node);
+
+	/**
+	 * @brief Time spent by create_connections() in each phase of the startup
+	 */
+	struct startup_stats {
+		/// Opening sockets and shared memory rings (in microseconds)
+		std::uint64_t open_us;
+		/// Waiting until all nodes can be reached (in microseconds; see handshake())
+		std::uint64_t handshake_us;
+		/// Whole create_connections() (in microseconds)
+		std::uint64_t total_us;
+		/// Hello datagrams sent during the handshake
+		std::uint64_t hellos_sent;
+		/// Last node that became reachable (-1 if none)
+		int last_node;
+	};
+
+	/// Get the time spent by create_connections() in each phase of the startup
+	const startup_stats& get_startup_stats() const {
+		return startup_;
+	}
+
+	void print_stats(std::ostream& out);
+	bool wait_acknowledged();
+
+	/// true if the node runs on the same host, and is connected through shared memory
+	bool is_local(int node) const {
+		return addresses_[slot(node)].local;
+	}
+
+	/**
+	 * @brief Get the next datagram received through shared memory from a node running on the same host
+	 *
+	 * The datagram is read in place, and must be released through consume_local() once handled.
+	 * @param rem_node_id Id of the sender node
+	 * @param size Pointer where the length of the datagram must be put
+	 * @param block true to wait until a datagram is available
+	 * @return Pointer to the datagram; nullptr if no datagram is available (only when not blocking)
+	 */
+	char* peek_local(int rem_node_id, std::size_t* size, bool block) {
+		return get_connection(rem_node_id).recv_ring->peek(size, block);
+	}
+
+	/// Release the datagram returned by the latest peek_local()
+	void consume_local(int rem_node_id) {
+		get_connection(rem_node_id).recv_ring->consume();
+	}
+
+	/**
+	 * @brief Wait datagrams from any node through io_uring
+	 *
+	 * See UringTransport::wait_datagrams(). The sender of each datagram is identified
+	 * by its source address (-1 if unknown; MULTICAST_CHANNEL for the multicast group).
+	 * Can be called only after start_completions().
+	 */
+	int wait_datagrams(received_datagram* datagrams, int max_datagrams) {
+		int n = uring_->wait_datagrams(datagrams, max_datagrams);
+		for (int i = 0; i < n; ++i)
+			datagrams[i].node = (datagrams[i].channel == MULTICAST_CHANNEL) ?
+			    MULTICAST_CHANNEL : sender_of(datagrams[i].source);
+		return n;
+	}
+
+	/**
+	 * @brief Give back the buffers of datagrams returned by wait_datagrams()
+	 *
+	 * See UringTransport::release_datagrams().
+	 */
+	void release_datagrams(const received_datagram* datagrams, int n) {
+		uring_->release_datagrams(datagrams, n);
 	}
 
 	void create_connections();
 
+	/**
+	 * @brief Get exclusive access to the send channel of a node
+	 *
+	 * Messages in the send queue of the node are moved into the outbound batch,
+	 * so that anything sent afterwards keeps its order with respect to them.
+	 * @param node Id of the node
+	 */
 	void lock_send_channel (int node) {
 		DEBUG("Locking channel for node " << node);
-		if (node > number_of_nodes_) {
+		if ((node < 0) || (slot(node) >= (int) addresses_.size())) {
 			ERROR("Lock channel on wrong entry");
 		} else {
-			connections_[node].send_channel_lock.lock();
+			get_connection(node).send_channel_lock.lock();
 			DEBUG("Channel for node " << node << " LOCKED");
+			drain_queue(node);
 		}
 	}
 
+	/**
+	 * @brief Release the send channel of a node
+	 *
+	 * If Config::flush_deadline_us is 0, messages queued in the meantime by other
+	 * threads (which found the channel locked) are sent.
+	 * @param node Id of the node
+	 */
 	void unlock_send_channel (int node) {
 		DEBUG("Unlocking channel for node " << node);
-		if (node > number_of_nodes_) {
+		if ((node < 0) || (slot(node) >= (int) addresses_.size())) {
 			ERROR("Unlock channel on wrong entry");
 		} else {
-			connections_[node].send_channel_lock.unlock();
+			get_connection(node).send_channel_lock.unlock();
 			DEBUG("Channel for node " << node << " UNLOCKED");
+			if (Config::getInstance().flush_deadline_us == 0)
+				try_drain(node);
 		}
 	}
 
 private:
 
 	/// Singleton pattern for a deterministic initialization order of objects
-	static CommunicationHandler* m_;
+	static std::atomic<CommunicationHandler*> m_;
 
 	/// Mutex for object creation and destruction (i.e., modify m_)
 	static std::mutex mutex_;
@@ -194,24 +746,260 @@ private:
 	CommunicationHandler();
 	~CommunicationHandler();
 
-	void start_send_client(int entry);
-	void start_recv_server(int entry);
+	void start_sockets();
+	void tune_socket(int fd, bool receive);
+	bool spin_until_readable(int fd) const;
+	void start_rings(int node);
+	void handshake();
+	void receive_hellos(std::vector<char>& buffer, std::vector<char>& heard, std::vector<char>& reached);
+	bool send_hello(int node, bool heard);
 
-	struct connection {
-		std::string ip;
+	/**
+	 * @brief Id of the node sending from an address (-1 if unknown)
+	 *
+	 * Each node sends from its own port (see start_sockets()), and from a second one for its bulk lane,
+	 * reported as BULK_LANE plus its id. The source address must be the one of the node in the config file
+	 * (e.g., not a process of another host using the same ports).
+	 */
+	int sender_of(const struct sockaddr_in& addr) const {
+		int node = (int) ntohs(addr.sin_port) - network_port_offset;
+		int lane = 0;
+		if ((bulk_fd_ >= 0) && (node >= number_of_nodes_)) {
+			node -= number_of_nodes_;
+			lane = BULK_LANE;
+		}
+		if ((node < 0) || (node >= number_of_nodes_) || (node == pbsm_tid) ||
+		    (addr.sin_addr.s_addr != addresses_[node].addr.sin_addr.s_addr))
+			return -1;
+		return lane + node;
+	}
 
-		int recv_port;
-		int recv_fd;
+	/// Socket of a receive channel (see peek_from())
+	int channel_fd(int channel) const {
+		if (channel == BULK_CHANNEL)
+			return bulk_fd_;
+		return (channel == MULTICAST_CHANNEL) ? multicast_recv_fd_ : sockets_[channel];
+	}
 
-		int send_port;
-		int send_fd;
+	/// Size of the datagrams coalesced by the kernel into a received buffer (0 if not coalesced, see Config::udp_offload)
+	static int gro_segment(const struct msghdr& msg) {
+		for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c != nullptr; c = CMSG_NXTHDR((struct msghdr*) &msg, c)) {
+			if ((c->cmsg_level == SOL_UDP) && (c->cmsg_type == UDP_GRO)) {
+				int size;
+				memcpy(&size, CMSG_DATA(c), sizeof(size));
+				return size;
+			}
+		}
+		return 0;
+	}
+
+	/// Socket for sending to a node (or to its bulk lane); the multicast group has its own (see send_datagram())
+	int send_fd(int node) const {
+		return (node >= BULK_LANE) ? bulk_fd_ : sockets_[0];
+	}
+
+	/// Id for sending values to a node: its bulk lane, if enabled and not on the same host
+	int bulk_lane_of(int node) const {
+		return ((bulk_fd_ >= 0) && !is_local(node)) ? BULK_LANE + node : node;
+	}
+
+	bool enqueue(int node, void* msg_data, int msg_size);
+	bool drain_queue(int node);
+	void try_drain(int node);
+	bool append_to_batch(int node, void* msg_data, int msg_size);
+	bool flush_batch(int node, struct iovec* tail_iov = nullptr, int tail_iovcnt = 0, int tail_datagrams = 1, bool tail_sequenced = true);
+	bool flush_batches(struct iovec* tail_iov = nullptr, int tail_iovcnt = 0);
+	unsigned int prepare_batch(int node, struct iovec* tail_iov, int tail_iovcnt, int tail_datagrams, bool tail_sequenced = true);
+	void clear_batch(int node);
+	bool write_to_ring(int node, unsigned int datagrams);
+	bool send_segmented(int node, unsigned int datagrams);
+	bool send_segments(int node, struct mmsghdr* headers, unsigned int count, std::size_t size);
+
+	/// true if the node has messages not yet sent, either in the outbound batch or in the send queue
+	bool has_unsent(int node) const {
+		connection* c = find_connection(node);
+		return (c != nullptr) && (c->batch_pending || !c->send_queue.empty());
+	}
+
+	void start_multicast();
+	bool multicast_to_all(void* msg_data, int msg_size);
+
+	/// true if datagrams exchanged with the node are numbered and acknowledged (see reliable_header)
+	bool is_sequenced(int node) const {
+		return reliable_ && !addresses_[slot(node)].local;
+	}
+
+	/// Datagram sent and not yet acknowledged
+	struct unacked_datagram {
+		std::uint32_t seq;
+		/// Content of the datagram (without reliable_header)
+		std::vector<char> data;
+		/// Time of the latest transmission
+		std::chrono::steady_clock::time_point sent;
+		/// Number of retransmissions
+		unsigned int retransmissions;
+		/// Set when acknowledged selectively (i.e., received after a gap)
+		bool sacked;
+		/// Set when sent again because of datagrams following it acknowledged
+		bool fast_retransmitted;
+		/// Set while beyond RELIABLE_WINDOW: not sent until the datagrams before it are acknowledged (see send_held())
+		bool held;
+	};
+
+	/// Sending side of a sequence of numbered datagrams
+	struct reliable_sender {
+		reliable_sender(): next_seq(0), srtt(0), rttvar(0), rto(RELIABLE_INITIAL_RTO_US) {}
+		std::uint32_t next_seq;
+		/// Datagrams not yet acknowledged, in order of sequence number (their buffers are reused, see sequence_datagram())
+		ring_queue<unacked_datagram> unacked;
+		/// Smoothed round-trip time and its variation (in microseconds; 0 until measured)
+		double srtt;
+		double rttvar;
+		/// Retransmission timeout (in microseconds)
+		unsigned int rto;
+	};
+
+	/// Receiving side of a sequence of numbered datagrams
+	struct reliable_receiver {
+		reliable_receiver(): expected(0), sack(0) {}
+		/// Sequence number of the next datagram to be handled
+		std::uint32_t expected;
+		/// Datagrams received after the first gap (see reliable_header::sack)
+		std::uint64_t sack;
+		/// Content of the datagrams received after the first gap
+		std::map<std::uint32_t, std::vector<char> > out_of_order;
+	};
+
+	bool in_order(int node, const reliable_header& hdr, int len);
+	ssize_t recv_datagram(struct iovec* iov, int iovcnt, int channel, int node, bool report_errors);
+	bool receive_sequenced(int node, bool multicast, const reliable_header& hdr, const char* data, std::size_t len);
+	bool pop_in_order(int node, reliable_receiver& r, std::vector<char>& datagram);
+	void fill_header(int node, reliable_header* hdr, std::uint32_t seq, bool sequenced);
+	std::uint32_t sequence_datagram(reliable_sender& s, const struct iovec* iov, int iovcnt);
+	bool handle_ack(int node, const reliable_header& hdr);
+	void sample_rtt(reliable_sender& s, double rtt_us);
+	void release_multicast();
+	bool send_unacked(int node, unacked_datagram& d);
+	void send_held(int node);
+	bool retransmit(int node, unacked_datagram& d);
+	bool retransmit_older(int node, std::chrono::microseconds timeout);
+	void retransmit_expired();
+	bool send_acks();
+	bool send_datagram(int node, struct iovec* iov, int iovcnt, peer_stats& stats);
+	bool inject_loss();
+
+	/**
+	 * @brief State of the communications with a node (or with the multicast group, see MULTICAST_CHANNEL,
+	 * or with the bulk lane of a node, see BULK_LANE)
+	 *
+	 * It is allocated when the node is involved in a communication for the first time (see get_connection()),
+	 * aligned to a cache line, so that threads working with different nodes never share cache lines.
+	 */
+	struct alignas(64) connection {
+		/// Rings for sending to and receiving from the node, when local
+		ShmRing* send_ring;
+		ShmRing* recv_ring;
 
 		std::mutex send_channel_lock;
 
+		/// Messages not yet moved into the outbound batch (consumed only with send_channel_lock held)
+		MpscQueue send_queue;
+
+		/// Datagrams of the outbound batch (protected by send_channel_lock)
+		std::vector<char> batch_buffer;
+
+		/// Start and length of each datagram of the outbound batch
+		std::vector<struct iovec> batch_iov;
+
+		/// Headers for sendmmsg() (one more than datagrams, for the tail datagram, unless grown for more)
+		std::vector<struct mmsghdr> batch_headers;
+
+		/// Number of datagrams of the outbound batch containing messages
+		unsigned int batch_used;
+
+		/// Set when the outbound batch contains messages not yet sent
+		std::atomic<bool> batch_pending;
+
+		/// Headers and buffers of the datagrams of the outbound batch, when numbered (see prepare_batch())
+		std::vector<reliable_header> batch_reliable;
+		std::vector<struct iovec> batch_send_iov;
+
+		/// Buffers of a run of datagrams sent as a single buffer (see send_segments())
+		std::vector<struct iovec> batch_segment_iov;
+
+		/// Protects the fields below (acquired after send_channel_lock, if both are needed)
+		std::mutex reliable_mutex;
+
+		/// Datagrams sent to the node (or to the multicast group, for MULTICAST_CHANNEL)
+		reliable_sender sender;
+
+		/// Datagrams received from the node, through its channel and through the multicast group
+		reliable_receiver receiver;
+		reliable_receiver multicast_receiver;
+
+		/// Set when datagrams have been received from the node and not yet acknowledged
+		std::atomic<bool> ack_pending;
+
+		/// Next datagram expected from the multicast group by the node
+		std::atomic<std::uint32_t> multicast_acked;
+
+		peer_stats stats;
+	};
+
+	/// Address of a node (or of the multicast group, or of the bulk lane of a node), known for all nodes since the construction
+	struct node_address {
+		std::string ip;
+		struct sockaddr_in addr;
+
+		/// true if the node runs on the same host (see is_local())
+		bool local;
 	};
 
-	/// UDP connections for sending/receiving data from other peers
-	std::array<connection, MAX_NUMBER_OF_NODES> connections_;
+	/// Entry of addresses_ and connections_ of a node (followed by the multicast group and by the bulk lanes)
+	int slot(int node) const {
+		if (node >= BULK_LANE)
+			return number_of_nodes_ + 1 + node - BULK_LANE;
+		return (node == MULTICAST_CHANNEL) ? number_of_nodes_ : node;
+	}
+
+	/// Id of the node (or of the multicast group, or of the bulk lane) of an entry of addresses_ and connections_
+	int id_at(int slot) const {
+		if (slot > number_of_nodes_)
+			return BULK_LANE + slot - number_of_nodes_ - 1;
+		return (slot == number_of_nodes_) ? MULTICAST_CHANNEL : slot;
+	}
+
+	/// State of the communications with a node, allocated if not yet done
+	connection& get_connection(int node) {
+		connection* c = connections_[slot(node)].load(std::memory_order_acquire);
+		return (c != nullptr) ? *c : create_connection(node);
+	}
+
+	/// State of the communications with a node (nullptr if the node has not been involved in any communication yet)
+	connection* find_connection(int node) const {
+		return connections_[slot(node)].load(std::memory_order_acquire);
+	}
+
+	connection& create_connection(int node);
+
+	/// Addresses of the nodes, plus the multicast group and the bulk lanes (see slot())
+	std::vector<node_address> addresses_;
+
+	/// State of the communications with each entry of addresses_ (nullptr until needed, see get_connection())
+	std::unique_ptr<std::atomic<connection*>[]> connections_;
+
+	/// Sockets bound to the UDP port of the node, for sending to and receiving from all nodes (see start_sockets())
+	std::vector<int> sockets_;
+
+	/// Sockets for receiving from and sending to the multicast group (see start_multicast())
+	int multicast_recv_fd_;
+	int multicast_send_fd_;
+
+	/// Socket bound to the port of the bulk lane of the node (-1 if Config::bulk_lane is not set)
+	int bulk_fd_;
+
+	/// Datagrams received during the handshake, to be handled before any other one (see next_early_datagram())
+	std::deque<std::pair<int, std::vector<char> > > early_datagrams_;
 
 	/**
 	 * @brief Offset for UDP port connections.
@@ -221,6 +1009,33 @@ private:
 	const int network_port_offset = 2000;
 
 	int number_of_nodes_;
+
+	/// Thread flushing the outbound batches when Config::flush_deadline_us expires
+	std::thread* flusher_;
+
+	/// epoll instance multiplexing the receive channels (see start_polling())
+	int epoll_fd_;
+
+	/// io_uring backend (nullptr when using plain sockets)
+	UringTransport* uring_;
+
+	/// Set when the multicast group has been joined (see start_multicast())
+	bool multicast_;
+
+	/// Set when datagrams sent over the network are numbered (see Config::reliable)
+	bool reliable_;
+
+	/// Set while the kernel accepts segmentation offload (see send_segmented())
+	std::atomic<bool> gso_;
+
+	/// Time receiving threads poll their channels before sleeping (see Config::spin_poll_us)
+	unsigned int spin_poll_us_;
+
+	/// Thread sending again the datagrams whose retransmission timeout expired
+	std::thread* retransmitter_;
+
+	/// Time spent in the startup (see get_startup_stats())
+	startup_stats startup_;
 };
 
 #endif // COMMUNICATION_HANDLER_HPP_
@@ -0,0 +1,28 @@
+#ifndef COMPRESSION_HPP_
+#define COMPRESSION_HPP_
+
+#include <cstddef>
+
+/**
+ * @brief Fast compression of values sent to other nodes (see Config::compression)
+ *
+ * Values are compressed with a byte-oriented LZ77 scheme, following the LZ4 block format:
+ * a sequence of literals followed by a match (offset and length) with the data already produced.
+ * It is meant for sparse or low-entropy values (e.g., zero-initialized arrays or counters),
+ * and it trades compression ratio for speed: both directions run at memory speed.
+ */
+
+/**
+ * @brief Maximum size of the compressed form of a value
+ * @param size Size of the value
+ * @return Size of the buffer which can hold any compressed value of that size
+ */
+inline std::size_t compress_bound(std::size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+std::size_t compress(const char* src, std::size_t size, char* dst, std::size_t capacity);
+std::size_t decompress(const char* src, std::size_t size, char* dst, std::size_t capacity);
+
+#endif // COMPRESSION_HPP_
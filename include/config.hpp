@@ -0,0 +1,277 @@
+#ifndef CONFIG_HPP_
+#define CONFIG_HPP_
+
+#include <string>
+#include <mutex>
+#include <atomic>
+
+/**
+ * @brief Backend used by CommunicationHandler for network communications
+ */
+enum class transport_t {
+	DEFAULT,	//< Keep the backend set in /etc/pbsm/hosts.conf (only for pbsm_init())
+	SOCKETS,	//< Plain UDP sockets (sendmmsg()/recvmmsg() and epoll)
+	IO_URING	//< io_uring (see UringTransport)
+};
+
+/**
+ * @brief Run-time configuration of the library
+ *
+ * Options are read from /etc/pbsm/hosts.conf together with the list of nodes
+ * (see CommunicationHandler::CommunicationHandler()).
+ * A line with the form "key = value" sets an option; any other line contains
+ * the IP address of a node. Options not present in the file keep their default value.
+ * Since the file must be the same on all hosts, options are the same for the whole cluster.
+ *
+ * The class is implemented as a Singleton for a deterministic initialization order of objects.
+ */
+class Config {
+public:
+	static Config& getInstance() {
+		// Double-checked locking pattern for performance issues
+		Config* p = m_.load(std::memory_order_acquire);
+		if (p == nullptr) {
+			std::unique_lock<std::mutex> lock (mutex_);
+			p = m_.load(std::memory_order_relaxed);
+			if (p == nullptr) {
+				p = new Config();
+				m_.store(p, std::memory_order_release);
+			}
+		}
+		return *p;
+	}
+
+	bool set(const std::string& key, const std::string& value);
+
+	/**
+	 * @brief Maximum time (in microseconds) a message can wait in the outbound batch
+	 *
+	 * Messages to the same node are coalesced into the same datagram until
+	 * the batch is flushed. A value equal to 0 disables batching.
+	 * Key: flush_deadline_us
+	 */
+	unsigned int flush_deadline_us;
+
+	/**
+	 * @brief Maximum number of datagrams sent or received by a single system call
+	 *
+	 * Key: batch_datagrams
+	 */
+	unsigned int batch_datagrams;
+
+	/**
+	 * @brief Number of threads receiving messages from the other nodes
+	 *
+	 * Each thread has its own socket, bound with SO_REUSEPORT to the port of the node,
+	 * and the threads multiplex all sockets through epoll.
+	 * A value equal to 0 starts, instead, a dedicated thread for a single socket.
+	 * Key: receive_threads
+	 */
+	unsigned int receive_threads;
+
+	/**
+	 * @brief Backend for network communications
+	 *
+	 * If io_uring is not available, the library falls back to plain sockets.
+	 * It can be overridden by the argument of pbsm_init().
+	 * Key: transport (values: sockets, io_uring)
+	 */
+	transport_t transport;
+
+	/**
+	 * @brief Connect nodes running on the same host through shared memory
+	 *
+	 * Nodes whose address belongs to the current host exchange messages through
+	 * rings in /dev/shm (see ShmRing) instead of the network.
+	 * Key: shared_memory (values: 0, 1)
+	 */
+	bool shared_memory;
+
+	/**
+	 * @brief Maximum number of fragments of a value sent and not yet acknowledged
+	 *
+	 * Values too big for a single datagram are split into fragments (see MSG_VALUE_FRAGMENT).
+	 * Key: fragment_window
+	 */
+	unsigned int fragment_window;
+
+	/**
+	 * @brief Time (in microseconds) without acknowledgments after which fragments are sent again
+	 *
+	 * Key: fragment_timeout_us
+	 */
+	unsigned int fragment_timeout_us;
+
+	/**
+	 * @brief IP multicast group for releasing barriers (empty to disable)
+	 *
+	 * MSG_BARRIER_UNBLOCK is sent through a single datagram to the group, instead of a datagram
+	 * for each node. It is the only message going through the group: since the group reaches the nodes
+	 * through another receive channel, it can't keep the order of the messages sent to each node,
+	 * which the other messages sent to all nodes need (e.g., invalidations, values of write-update variables).
+	 * If the group can't be joined, barrier releases are sent in unicast.
+	 * Key: multicast_group
+	 */
+	std::string multicast_group;
+
+	/**
+	 * @brief UDP port of the multicast group
+	 *
+	 * Key: multicast_port
+	 */
+	unsigned int multicast_port;
+
+	/**
+	 * @brief Retransmit datagrams lost over the network
+	 *
+	 * Datagrams sent to each node are numbered, acknowledged and sent again when lost,
+	 * and the ones received are handled in the order they have been sent
+	 * (see CommunicationHandler). Shared memory rings are reliable anyway.
+	 * Key: reliable (values: 0, 1)
+	 */
+	bool reliable;
+
+	/**
+	 * @brief Minimum time (in microseconds) before sending again an unacknowledged datagram
+	 *
+	 * The actual timeout depends on the round-trip time measured for each node.
+	 * Key: retransmit_min_us
+	 */
+	unsigned int retransmit_min_us;
+
+	/**
+	 * @brief Percentage of datagrams dropped on purpose before being sent over the network
+	 *
+	 * Only for testing the recovery of lost datagrams (e.g., on loopback).
+	 * Key: loss_injection
+	 */
+	unsigned int loss_injection;
+
+	/**
+	 * @brief Maximum time (in milliseconds) waited at startup until all nodes can be reached
+	 *
+	 * After such time, pbsm_init() throws std::runtime_error.
+	 * Key: handshake_timeout_ms
+	 */
+	unsigned int handshake_timeout_ms;
+
+	/**
+	 * @brief Send values through a bulk lane, apart from protocol messages
+	 *
+	 * Each node gets a second UDP port, with its own socket and receive thread, carrying
+	 * values and their fragments: protocol messages (e.g., grants, invalidations, barriers)
+	 * travel on the first port and are never queued behind large values.
+	 * Nodes on the same host keep using their shared memory ring.
+	 * Key: bulk_lane (values: 0, 1)
+	 */
+	bool bulk_lane;
+
+	/**
+	 * @brief Let the kernel split and coalesce datagrams (UDP GSO and GRO)
+	 *
+	 * Runs of datagrams with the same size (e.g., the fragments of a value) are handed to the kernel
+	 * as a single buffer, and datagrams received on the bulk lane may be coalesced into a single buffer.
+	 * Without kernel support (or with io_uring, for sending), datagrams are handled one by one.
+	 * Key: udp_offload (values: 0, 1)
+	 */
+	bool udp_offload;
+
+	/**
+	 * @brief Size (in KiB) of the send and receive buffers of the sockets (0 for the kernel default)
+	 *
+	 * Larger buffers absorb bursts of datagrams (e.g., the fragments of large values) without losses.
+	 * The size is capped by net.core.rmem_max and net.core.wmem_max, unless the process has CAP_NET_ADMIN.
+	 * Key: socket_buffer_kb
+	 */
+	unsigned int socket_buffer_kb;
+
+	/**
+	 * @brief Priority of the datagrams sent (SO_PRIORITY; 0 for the default)
+	 *
+	 * It selects the queue of the network device for the traffic of the library.
+	 * Values above 6 require CAP_NET_ADMIN.
+	 * Key: socket_priority
+	 */
+	unsigned int socket_priority;
+
+	/**
+	 * @brief Time (in microseconds) the kernel busy-polls the device for datagrams on a receive (SO_BUSY_POLL; 0 to disable)
+	 *
+	 * Values above net.core.busy_read require CAP_NET_ADMIN.
+	 * Key: busy_poll_us
+	 */
+	unsigned int busy_poll_us;
+
+	/**
+	 * @brief Time (in microseconds) receiving threads poll their channels before sleeping (0 to disable)
+	 *
+	 * Polling without blocking avoids the wake-up latency of a sleeping thread for datagrams arriving
+	 * shortly after the previous ones (e.g., the grant of an ownership just requested), at the cost of a busy core.
+	 * Key: spin_poll_us
+	 */
+	unsigned int spin_poll_us;
+
+	/**
+	 * @brief Compress values sent to nodes on other hosts
+	 *
+	 * Values of at least Config::compression_threshold bytes are compressed before being sent
+	 * (see compress()), and sent as they are if they can't be compressed.
+	 * It can be overridden for each variable (see AbstractShared::set_compression()).
+	 * Key: compression (values: 0, 1)
+	 */
+	bool compression;
+
+	/**
+	 * @brief Minimum size (in bytes) of a value to be compressed
+	 *
+	 * Key: compression_threshold
+	 */
+	unsigned int compression_threshold;
+
+	/**
+	 * @brief Send values as deltas against the copy last sent to each node
+	 *
+	 * When asking a value of at least Config::delta_threshold bytes, a node tells the owner the
+	 * version of its copy; if the owner still has a twin of that version, only the changed ranges
+	 * are sent (see diff_ranges()). Otherwise, a full copy is sent.
+	 * The owner keeps a twin of each value for each node it has sent the value to.
+	 * Key: delta_updates (values: 0, 1)
+	 */
+	bool delta_updates;
+
+	/**
+	 * @brief Minimum size (in bytes) of a value to be sent as a delta
+	 *
+	 * Key: delta_threshold
+	 */
+	unsigned int delta_threshold;
+
+	/**
+	 * @brief Migrations of the ownership of a variable within Config::pingpong_window_us after which it is pinned (0 to disable)
+	 *
+	 * The home node of a variable (see Policy::home_of()) counts the ownership requests it forwards:
+	 * past this number, it keeps the ownership, and the writes of other nodes are shipped to it
+	 * as operations (see shipped_write). Migration resumes after a window with fewer writes,
+	 * or with writes of a single node.
+	 * Key: pingpong_migrations
+	 */
+	unsigned int pingpong_migrations;
+
+	/**
+	 * @brief Window (in microseconds) of the detection of ownership ping-pong (see Config::pingpong_migrations)
+	 *
+	 * Key: pingpong_window_us
+	 */
+	unsigned int pingpong_window_us;
+
+private:
+	/// Singleton pattern for a deterministic initialization order of objects
+	static std::atomic<Config*> m_;
+
+	/// Mutex for object creation (i.e., modify m_)
+	static std::mutex mutex_;
+
+	Config();
+};
+
+#endif // CONFIG_HPP_
@@ -0,0 +1,45 @@
+#ifndef DELTA_HPP_
+#define DELTA_HPP_
+
+#include <cstddef>
+#include <vector>
+
+#include "messages.hpp"
+
+/**
+ * @brief Differences between versions of a value (see MSG_FLAG_DELTA)
+ *
+ * The node sending a value keeps a twin of the copy last sent to each node;
+ * the next time, only the ranges changed with respect to the twin are sent
+ * (as a sequence of delta_run, each one followed by its content).
+ * Values are compared in blocks of DELTA_BLOCK_SIZE bytes, through SIMD instructions when available.
+ */
+
+/// Granularity of the comparison of values
+const std::size_t DELTA_BLOCK_SIZE = 16;
+
+/**
+ * @brief Maximum size of a value sent as a delta (i.e., a full copy)
+ * @param size Size of the value
+ * @return Size of the delta_header followed by a single range with the whole value
+ */
+inline std::size_t delta_bound(std::size_t size)
+{
+	return sizeof(delta_header) + sizeof(delta_run) + size;
+}
+
+/**
+ * @brief Maximum size of a delta with exact ranges (see diff_ranges())
+ * @param size Size of the value
+ * @return Size of the delta_header followed by a range for every other byte
+ */
+inline std::size_t exact_delta_bound(std::size_t size)
+{
+	return sizeof(delta_header) + (size + 1) / 2 * sizeof(delta_run) + size;
+}
+
+bool diff_ranges(const char* twin, const char* value, std::size_t size, std::vector<char>& out, std::size_t limit,
+		 bool exact = false);
+bool apply_ranges(const char* ranges, std::size_t len, char* value, std::size_t size);
+
+#endif // DELTA_HPP_
@@ -0,0 +1,290 @@
+#ifndef DICTIONARY_HPP_
+#define DICTIONARY_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <thread>	// std::this_thread::yield()
+#include <vector>
+
+/**
+ * @brief Map from variable IDs to the data of the variables.
+ *
+ * Open-addressing hash table (with linear probing) where lookups are wait-free
+ * and never take a lock, while insertions and removals (rare: at creation and destruction of variables)
+ * are serialized by a mutex.
+ *
+ * A slot is empty as long as its value is nullptr: the key is written before the value is
+ * published, so that a lookup seeing a value sees its key too. The slot of a removed key keeps the key
+ * with a placeholder value (a tombstone, needed by the lookups probing past it), and it is used again
+ * if the key is inserted again. Tombstones are counted apart from the keys, and dropped when the table
+ * is rebuilt: the table is kept at most half full of keys and tombstones, and it is rebuilt (with twice
+ * the slots only if the keys alone need them) when it would be fuller. The new table is published and the
+ * old one is retired, because concurrent lookups may still be probing it: it is freed by the next removal,
+ * once the lookups started before have ended.
+ *
+ * Values are never freed by the dictionary: threads using them after the lookup must hold a reader,
+ * so that remove() returns only once they are done with the removed value, which can then be freed.
+ * Lookups must hold a reader as well, unless no removals happen concurrently.
+ */
+template<class V>
+class dictionary {
+public:
+	dictionary(): current_(new table(INITIAL_CAPACITY)), size_(0), tombstones_(0), epoch_(0) {}
+
+	/**
+	 * @brief Guard of the values found while it exists (see remove())
+	 *
+	 * Readers can be nested. Each thread counts its readers in one of READER_SLOTS pairs of counters,
+	 * the one of the current epoch (see wait_readers()).
+	 */
+	class reader {
+	public:
+		explicit reader(dictionary& d):
+		    count_(d.readers_[thread_slot()].count[d.epoch_.load(std::memory_order_relaxed) & 1]) {
+			count_.fetch_add(1);
+			// The lookups must not be reordered before the counter
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+		}
+
+		~reader() {
+			count_.fetch_sub(1, std::memory_order_release);
+		}
+
+	private:
+		std::atomic<unsigned int>& count_;
+	};
+
+	/// Destructor: free the tables (not the values)
+	~dictionary() {
+		delete current_.load();
+		for (auto t: retired_)
+			delete t;
+	}
+
+	/**
+	 * @brief Look up a key
+	 * @param key	Key
+	 * @return	Value associated to the key; nullptr if not found
+	 */
+	V* find(uint32_t key) const {
+		const table* t = current_.load(std::memory_order_acquire);
+		for (std::size_t i = t->index(key); ; i = (i + 1) & t->mask) {
+			V* value = t->slots[i].value.load(std::memory_order_acquire);
+			if ((value == nullptr) || (t->slots[i].key.load(std::memory_order_relaxed) == key))
+				return (value == removed()) ? nullptr : value;
+		}
+	}
+
+	/**
+	 * @brief Associate a value to a key (replacing the existing value, if any)
+	 * @param key	Key
+	 * @param value	Value (not nullptr)
+	 */
+	void insert(uint32_t key, V* value) {
+		std::unique_lock<std::mutex> lock (mutex_);
+		table* t = current_.load(std::memory_order_relaxed);
+		if (2 * (size_ + tombstones_ + 1) > t->mask + 1) {
+			std::size_t capacity = t->mask + 1;
+			if (2 * (size_ + 1) > capacity / 2)
+				capacity *= 2;
+			table* rebuilt = new table(capacity);
+			for (std::size_t i = 0; i <= t->mask; ++i) {
+				V* v = t->slots[i].value.load(std::memory_order_relaxed);
+				if ((v != nullptr) && (v != removed()))
+					place(rebuilt, t->slots[i].key.load(std::memory_order_relaxed), v);
+			}
+			current_.store(rebuilt, std::memory_order_release);
+			retired_.push_back(t);
+			tombstones_ = 0;
+			t = rebuilt;
+		}
+		switch (place(t, key, value)) {
+		case placed::NEW:
+			size_++;
+			break;
+		case placed::TOMBSTONE:
+			size_++;
+			tombstones_--;
+			break;
+		case placed::REPLACED:
+			break;
+		}
+	}
+
+	/**
+	 * @brief Remove a key, if associated to a given value
+	 *
+	 * It returns once the threads which may have found the value (i.e., holding a reader
+	 * since before the removal) have released their readers: readers created later are not waited.
+	 * Therefore, it must not be called while holding a reader.
+	 * @param key	Key
+	 * @param value	Value
+	 */
+	void remove(uint32_t key, V* value) {
+		std::vector<table*> retired;
+		{
+			std::unique_lock<std::mutex> lock (mutex_);
+			table* t = current_.load(std::memory_order_relaxed);
+			for (std::size_t i = t->index(key); ; i = (i + 1) & t->mask) {
+				slot& s = t->slots[i];
+				if (s.value.load(std::memory_order_relaxed) == nullptr)
+					return;
+				if (s.key.load(std::memory_order_relaxed) == key) {
+					if (s.value.load(std::memory_order_relaxed) != value)
+						return;
+					s.value.store(removed(), std::memory_order_release);
+					size_--;
+					tombstones_++;
+					break;
+				}
+			}
+			// Lookups probing the retired tables started before: they end within the same wait
+			retired.swap(retired_);
+		}
+		// Readers counted from now on can't find the value anymore
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		wait_readers();
+		for (auto t: retired)
+			delete t;
+	}
+
+	/**
+	 * @brief Call a function on each value (while insertions are blocked)
+	 * @param f	Function taking the key and the value
+	 */
+	template<class F>
+	void for_each(F f) {
+		std::unique_lock<std::mutex> lock (mutex_);
+		table* t = current_.load(std::memory_order_relaxed);
+		for (std::size_t i = 0; i <= t->mask; ++i) {
+			V* v = t->slots[i].value.load(std::memory_order_relaxed);
+			if ((v != nullptr) && (v != removed()))
+				f(t->slots[i].key.load(std::memory_order_relaxed), v);
+		}
+	}
+
+	/// Number of keys
+	std::size_t size() {
+		std::unique_lock<std::mutex> lock (mutex_);
+		return size_;
+	}
+
+	/// Number of slots of the table used by lookups
+	std::size_t capacity() {
+		std::unique_lock<std::mutex> lock (mutex_);
+		return current_.load(std::memory_order_relaxed)->mask + 1;
+	}
+
+private:
+	/// Initial number of slots (a power of 2)
+	static const std::size_t INITIAL_CAPACITY = 64;
+
+	/// Number of counters of readers
+	static const std::size_t READER_SLOTS = 64;
+
+	/// Counters of readers, one for each parity of the epoch (on their own cache line)
+	struct reader_count {
+		reader_count() { count[0] = 0; count[1] = 0; }
+		std::atomic<unsigned int> count [2];
+		char padding [64 - 2 * sizeof(std::atomic<unsigned int>)];
+	};
+
+	/// Counter of readers of the calling thread
+	static std::size_t thread_slot() {
+		static std::atomic<std::size_t> next (0);
+		static thread_local std::size_t slot = next++ % READER_SLOTS;
+		return slot;
+	}
+
+	/// Placeholder value of removed keys (never dereferenced)
+	static V* removed() {
+		static char placeholder;
+		return reinterpret_cast<V*>(&placeholder);
+	}
+
+	struct slot {
+		slot(): key(0), value(nullptr) {}
+		std::atomic<uint32_t> key;
+		std::atomic<V*> value;
+	};
+
+	struct table {
+		explicit table(std::size_t capacity): mask(capacity - 1), slots(new slot[capacity]) {}
+		~table() { delete[] slots; }
+
+		/// First slot probed for a key (IDs may be small integers: spread them through Fibonacci hashing)
+		std::size_t index(uint32_t key) const {
+			return ((uint64_t) key * 11400714819323198485ULL >> 32) & mask;
+		}
+
+		/// Number of slots minus 1
+		const std::size_t mask;
+		slot* const slots;
+	};
+
+	/// Outcome of place()
+	enum class placed {
+		NEW,		///< The key was not in the table
+		TOMBSTONE,	///< The key had been removed
+		REPLACED	///< The value of the key has been replaced
+	};
+
+	/**
+	 * @brief Put a value in a table with room for it
+	 * @return Whether the key was new, removed or present
+	 */
+	static placed place(table* t, uint32_t key, V* value) {
+		for (std::size_t i = t->index(key); ; i = (i + 1) & t->mask) {
+			slot& s = t->slots[i];
+			V* old = s.value.load(std::memory_order_relaxed);
+			if (old == nullptr) {
+				s.key.store(key, std::memory_order_relaxed);
+				s.value.store(value, std::memory_order_release);
+				return placed::NEW;
+			}
+			if (s.key.load(std::memory_order_relaxed) == key) {
+				s.value.store(value, std::memory_order_release);
+				return (old == removed()) ? placed::TOMBSTONE : placed::REPLACED;
+			}
+		}
+	}
+
+	/**
+	 * @brief Wait for the readers created before the call (i.e., a grace period)
+	 *
+	 * The epoch is advanced twice, waiting each time for the readers counted with the parity
+	 * it had: a reader reading the epoch just before an advance is counted with the old parity, and
+	 * waited by the next step. Readers created meanwhile are counted with the other parity, so
+	 * a steady flow of readers can't delay the wait indefinitely.
+	 */
+	void wait_readers() {
+		std::unique_lock<std::mutex> lock (grace_mutex_);
+		for (int step = 0; step < 2; ++step) {
+			std::size_t parity = epoch_.fetch_add(1) & 1;
+			for (std::size_t i = 0; i < READER_SLOTS; ++i)
+				while (readers_[i].count[parity].load(std::memory_order_acquire) != 0)
+					std::this_thread::yield();
+		}
+	}
+
+	/// Table used by lookups
+	std::atomic<table*> current_;
+	/// Tables replaced by new ones, not yet freed (see remove())
+	std::vector<table*> retired_;
+	/// Number of keys
+	std::size_t size_;
+	/// Number of slots of removed keys in the current table
+	std::size_t tombstones_;
+	/// Lock for insertions and removals
+	std::mutex mutex_;
+	/// Epoch of the readers (its parity selects the counters of new readers)
+	std::atomic<std::size_t> epoch_;
+	/// Lock serializing the grace periods of removals
+	std::mutex grace_mutex_;
+	/// Readers of each thread slot
+	reader_count readers_ [READER_SLOTS];
+};
+
+#endif // DICTIONARY_HPP_
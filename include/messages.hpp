@@ -4,17 +4,18 @@
 #include <cstdint>
 
 /// Type of messages
-enum class msg_type_t
+enum class msg_type_t : uint16_t
 {
-	/// Message sent when one node attempts to write on a variable not owned
+	/// Message sent to the home node of a variable when one node attempts to write on a variable not owned
 	MSG_REQUEST_OWNERSHIP		= 1,
 
 	/// Message sent to grant ownership of a variable to a node that wants to write on it.
-	/// Message sent in response to MSG_REQUEST_OWNERSHIP.
+	/// Message sent in response to MSG_FORWARD_OWNERSHIP.
 	MSG_GRANT_OWNERSHIP		= 2,
 
 	/// Message sent to specify the new owner.
-	/// Message sent in response to MSG_REQUEST_OWNERSHIP if the owner has changed in the meantime.
+	/// Message sent in response to MSG_ASK_CURRENT_VALUE if the owner has changed in the meantime:
+	/// the value is then requested to the new owner.
 	MSG_SET_NEW_OWNER		= 3,
 
 	/// Message sent to get the latest value of a variable when a node is reading a variable not owned.
@@ -36,6 +37,68 @@ enum class msg_type_t
 
 	/// Message sent by a non-owner node in response to MSG_INVALIDATE_COPY
 	MSG_INVALIDATE_COPY_ACK		= 9,
+
+	/// Message sent instead of MSG_SET_NEW_VALUE, for values too big for a single datagram.
+	/// Each message carries a fragment of the value (see fragment_t).
+	MSG_VALUE_FRAGMENT		= 10,
+
+	/// Message sent to acknowledge the fragments of a value received so far (see fragment_ack_t).
+	/// Message sent in response to MSG_VALUE_FRAGMENT.
+	MSG_VALUE_FRAGMENT_ACK		= 11,
+
+	/// Message sent to acknowledge a value with MSG_FLAG_RELEASE (once queued) or MSG_FLAG_UPDATE (once set),
+	/// whether the variable exists or not.
+	/// Message sent in response to MSG_SET_NEW_VALUE or to the last MSG_VALUE_FRAGMENT.
+	MSG_RELEASE_ACK			= 12,
+
+	/// Message sent by the home node of a variable to its owner (or to the node going to be the owner),
+	/// to give the ownership to the node in data.
+	/// Message sent in response to MSG_REQUEST_OWNERSHIP.
+	MSG_FORWARD_OWNERSHIP		= 13,
+
+	/// Message sent by the home node of a variable pinned there (see Config::pingpong_migrations),
+	/// to tell that writes must be shipped to it (data is the home node).
+	/// Message sent in response to MSG_REQUEST_OWNERSHIP.
+	MSG_PINNED			= 14,
+
+	/// Message sent to the home node of a pinned variable to execute a write there (see shipped_op_t).
+	MSG_SHIP_WRITE			= 15,
+
+	/// Message sent once a shipped write has been executed, followed by the value before the write.
+	/// Message sent in response to MSG_SHIP_WRITE.
+	MSG_WRITE_DONE			= 16,
+};
+
+/// Flags of messages (see msg_t)
+enum msg_flags_t : uint16_t
+{
+	/// The value following a MSG_SET_NEW_VALUE (or the value split into MSG_VALUE_FRAGMENT) is compressed
+	/// (see compress()), and var_size is the size of its compressed form
+	MSG_FLAG_COMPRESSED		= 1,
+
+	/// In a MSG_ASK_CURRENT_VALUE, the sender accepts a delta, and version is the version of its copy.
+	/// In a MSG_SET_NEW_VALUE (or MSG_VALUE_FRAGMENT), the value is a delta (see delta_header),
+	/// and var_size is its size (applied after decompression, with MSG_FLAG_COMPRESSED too)
+	MSG_FLAG_DELTA			= 2,
+
+	/// With MSG_FLAG_DELTA, the delta carries the writes of a release-consistent variable
+	/// (see release_consistent): its ranges are exact, and they are applied to any version at the
+	/// next barrier (base and version of the delta_header are meaningless). The receiver answers MSG_RELEASE_ACK
+	/// (or, in fragments, acknowledges the last ones)
+	MSG_FLAG_RELEASE		= 4,
+
+	/// The value is a write-update (see write_update), sent to all nodes by the writer:
+	/// the receiver answers MSG_RELEASE_ACK (or acknowledges the last fragments) once set, so that the next
+	/// barrier of the writer waits for it
+	MSG_FLAG_UPDATE			= 8,
+
+	/// In a MSG_WRITE_DONE, the variable is not pinned anymore: the next writes request the ownership.
+	/// The current value follows the previous one (var_size is the size of both)
+	MSG_FLAG_UNPINNED		= 16,
+
+	/// In a MSG_GRANT_OWNERSHIP, the value follows the nodes sharing the variable (var_size is the size of both):
+	/// the new owner had no valid copy (e.g., the home node taking a variable back to pin it)
+	MSG_FLAG_VALUE			= 32,
 };
 
 #pragma pack(1)
@@ -48,6 +111,8 @@ struct msg_t
 {
 	/// Type of message
 	msg_type_t type;
+	/// Flags (see msg_flags_t)
+	uint16_t flags = 0;
 	/// Variable or barrier ID
 	uint32_t id;
 	union {
@@ -55,10 +120,91 @@ struct msg_t
 		unsigned long int node;
 		/// Variable size
 		unsigned long int var_size;
+		/// Version of a value (see MSG_FLAG_DELTA)
+		uint64_t version;
 	} data;
 	// In case of MSG_SET_NEW_VALUE, the value is sent after this message
 };
 
+/**
+ * @brief Fragment of a value
+ *
+ * Sent after a msg_t of type MSG_VALUE_FRAGMENT, whose var_size is the size of the whole value.
+ * The content of the fragment follows.
+ */
+struct fragment_t
+{
+	/// Id of the transfer (unique for the sender node)
+	uint32_t transfer;
+	/// Index of the fragment
+	uint32_t index;
+	/// Total number of fragments of the value
+	uint32_t count;
+	/// Position of the fragment in the value
+	uint32_t offset;
+	/// Length of the fragment
+	uint32_t length;
+};
+
+/// Headers of a datagram carrying a fragment of a value
+struct fragment_header {
+	msg_t msg;
+	fragment_t fragment;
+};
+
+/**
+ * @brief Acknowledgment of the fragments of a value
+ *
+ * Sent after a msg_t of type MSG_VALUE_FRAGMENT_ACK.
+ */
+struct fragment_ack_t
+{
+	/// Id of the transfer
+	uint32_t transfer;
+	/// Number of fragments received without gaps from the beginning
+	uint32_t received;
+	/// Fragments received after the first gap (bit i set means fragment received + 1 + i received)
+	uint64_t selective;
+};
+
+/**
+ * @brief Write shipped to the home node of a pinned variable
+ *
+ * Sent after a msg_t of type MSG_SHIP_WRITE, whose var_size is the size of this header
+ * plus the operand, which follows (the new value, for an assignment).
+ */
+struct shipped_op_t
+{
+	/// Operation (see write_op_t)
+	uint8_t op;
+};
+
+/**
+ * @brief Header of a value sent as a delta (see MSG_FLAG_DELTA)
+ *
+ * It is followed by the ranges of the value changed with respect to the base version,
+ * each one as a delta_run followed by its content.
+ * A base version equal to 0 means a full copy: a single range with the whole value.
+ */
+struct delta_header
+{
+	/// Version of the copy the delta applies to (0 for a full copy)
+	uint64_t base;
+	/// Version of the value once the delta has been applied
+	uint64_t version;
+};
+
+/**
+ * @brief Range of a value changed, within a delta (see delta_header)
+ */
+struct delta_run
+{
+	/// Position of the range in the value
+	uint32_t offset;
+	/// Length of the range
+	uint32_t length;
+};
+
 #pragma pack()
 
 ///////////////////////////////////////////////
@@ -0,0 +1,110 @@
+#ifndef MPSC_QUEUE_HPP_
+#define MPSC_QUEUE_HPP_
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>	// memcpy()
+
+/// Maximum size of a message stored in a MpscQueue
+const std::size_t MPSC_MESSAGE_SIZE = 32;
+
+/**
+ * @brief Bounded lock-free queue of small messages, with many producers and a single consumer
+ *
+ * Every slot carries a sequence number telling whether it is free for the producer of a given
+ * position or ready for the consumer (D. Vyukov's bounded queue): producers reserve a position
+ * through a single compare-and-swap, and then copy the message into the slot without
+ * blocking each other. Memory is allocated once, by init().
+ * The consumer must be serialized by the user (i.e., one thread at a time).
+ */
+class MpscQueue {
+public:
+	MpscQueue(): mask_(0), head_(0), tail_(0) {}
+
+	/**
+	 * @brief Allocate the slots of the queue
+	 * @param slots Number of slots (must be a power of 2)
+	 */
+	void init(std::size_t slots) {
+		slots_.reset(new slot[slots]);
+		mask_ = slots - 1;
+		for (std::size_t i = 0; i < slots; ++i)
+			slots_[i].sequence.store(i, std::memory_order_relaxed);
+		head_ = 0;
+		tail_ = 0;
+	}
+
+	/**
+	 * @brief Append a message to the queue (any thread)
+	 * @param data Buffer containing the message
+	 * @param size Size of the message (at most MPSC_MESSAGE_SIZE)
+	 * @return true in case of success; false if the queue is full
+	 */
+	bool push(const void* data, std::size_t size) {
+		std::size_t pos = tail_.load(std::memory_order_relaxed);
+		slot* s;
+		for (;;) {
+			s = &slots_[pos & mask_];
+			std::size_t sequence = s->sequence.load(std::memory_order_acquire);
+			std::intptr_t diff = (std::intptr_t) sequence - (std::intptr_t) pos;
+			if (diff == 0) {
+				if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = tail_.load(std::memory_order_relaxed);
+			}
+		}
+		memcpy(s->data, data, size);
+		s->size = size;
+		s->sequence.store(pos + 1, std::memory_order_seq_cst);
+		return true;
+	}
+
+	/**
+	 * @brief Remove the first message of the queue (consumer only)
+	 * @param data Buffer where the message must be put (at least MPSC_MESSAGE_SIZE bytes)
+	 * @param size Pointer where the size of the message must be put
+	 * @return true in case of success; false if the queue is empty (or the first message is still being written)
+	 */
+	bool pop(void* data, std::size_t* size) {
+		std::size_t pos = head_.load(std::memory_order_relaxed);
+		slot* s = &slots_[pos & mask_];
+		if (s->sequence.load(std::memory_order_acquire) != pos + 1)
+			return false;
+		memcpy(data, s->data, s->size);
+		*size = s->size;
+		s->sequence.store(pos + mask_ + 1, std::memory_order_release);
+		head_.store(pos + 1, std::memory_order_seq_cst);
+		return true;
+	}
+
+	/// true if no message has been appended since the latest pop() (any thread)
+	bool empty() const {
+		return head_.load(std::memory_order_seq_cst) == tail_.load(std::memory_order_seq_cst);
+	}
+
+private:
+	struct slot {
+		std::atomic<std::size_t> sequence;
+		std::uint32_t size;
+		char data [MPSC_MESSAGE_SIZE];
+	};
+
+	std::unique_ptr<slot[]> slots_;
+	std::size_t mask_;
+
+	/// Position of the consumer
+	std::atomic<std::size_t> head_;
+
+	/// Keeps head_ and tail_ on different cache lines (alignas() is not honored by new before C++17)
+	char padding_ [64];
+
+	/// Position reserved by the latest producer
+	std::atomic<std::size_t> tail_;
+};
+
+#endif // MPSC_QUEUE_HPP_
@@ -0,0 +1,97 @@
+#ifndef NODE_SET_HPP_
+#define NODE_SET_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>	// memcpy()
+#include <vector>
+
+/**
+ * @brief Set of node IDs, as a bitmap (e.g., the nodes holding a copy of a variable)
+ *
+ * The bitmap grows to the highest node inserted, and it keeps its memory when cleared.
+ * It can be copied as raw bytes into a message (see data() and assign()).
+ * Not thread-safe.
+ */
+class node_set {
+public:
+	void insert(int node) {
+		std::size_t w = node / 64;
+		if (w >= words_.size())
+			words_.resize(w + 1, 0);
+		words_[w] |= (1ULL << (node % 64));
+	}
+
+	void erase(int node) {
+		std::size_t w = node / 64;
+		if (w < words_.size())
+			words_[w] &= ~(1ULL << (node % 64));
+	}
+
+	bool contains(int node) const {
+		std::size_t w = node / 64;
+		return (w < words_.size()) && (words_[w] & (1ULL << (node % 64)));
+	}
+
+	/// Insert all nodes from 0 to a given number (excluded)
+	void fill(int nodes) {
+		for (int i = 0; i < nodes; ++i)
+			insert(i);
+	}
+
+	void clear() {
+		for (auto& w: words_)
+			w = 0;
+	}
+
+	bool empty() const {
+		for (auto w: words_)
+			if (w != 0)
+				return false;
+		return true;
+	}
+
+	/// Number of nodes in the set
+	int size() const {
+		int n = 0;
+		for (auto w: words_)
+			n += __builtin_popcountll(w);
+		return n;
+	}
+
+	/**
+	 * @brief Call a function on each node of the set
+	 * @param f	Function taking the node ID
+	 */
+	template<class F>
+	void for_each(F f) const {
+		for (std::size_t w = 0; w < words_.size(); ++w)
+			for (uint64_t bits = words_[w]; bits != 0; bits &= bits - 1)
+				f((int) (w * 64 + __builtin_ctzll(bits)));
+	}
+
+	/// Raw content of the bitmap (bytes() bytes)
+	const void* data() const {
+		return words_.data();
+	}
+
+	std::size_t bytes() const {
+		return words_.size() * sizeof(uint64_t);
+	}
+
+	/**
+	 * @brief Replace the set with a raw content (as returned by data())
+	 * @param data	Raw content
+	 * @param bytes	Size of the raw content (a multiple of 8 bytes)
+	 */
+	void assign(const void* data, std::size_t bytes) {
+		words_.resize(bytes / sizeof(uint64_t));
+		if (!words_.empty())
+			memcpy(&words_[0], data, words_.size() * sizeof(uint64_t));
+	}
+
+private:
+	std::vector<uint64_t> words_;
+};
+
+#endif // NODE_SET_HPP_
@@ -24,10 +24,28 @@ int pbsm_tid = -1;
 // FIXME: check if something here is needed.
 void pbsm_cleanup()
 {
+	CommunicationHandler::getInstance().wait_acknowledged();
 	std::cerr << "Exiting from program!" << std::endl;
 }
 
-void pbsm_init(int argc, char* argv [])
+/**
+ * @brief Print statistics of the run-time (e.g., startup time, datagrams lost and sent again for each node,
+ * variables pinned because of ownership ping-pong)
+ * @param out Stream where statistics must be printed
+ */
+void pbsm_print_stats(std::ostream& out = std::cerr)
+{
+	CommunicationHandler::getInstance().print_stats(out);
+	Policy::getInstance().print_stats(out);
+}
+
+/**
+ * @brief Initialization of the library
+ * @param argc Number of command-line arguments (the only argument is the id of the node)
+ * @param argv Command-line arguments
+ * @param transport Backend for network communications (by default, the one set in /etc/pbsm/hosts.conf)
+ */
+void pbsm_init(int argc, char* argv [], transport_t transport = transport_t::DEFAULT)
 {
 	if (argc != 2) {
 		ERROR("Wrong number of arguments. Please specyfy node id.");
@@ -39,6 +57,12 @@ void pbsm_init(int argc, char* argv [])
 
 	atexit(pbsm_cleanup);
 	pbsm_tid = atoi (argv[1]);
+
+	// Read the configuration before overriding it
+	CommunicationHandler::getInstance();
+	if (transport != transport_t::DEFAULT)
+		Config::getInstance().transport = transport;
+
 	if (pbsm_tid == 0)
 		// We are the master
 		Policy::getInstance().master_node_init();
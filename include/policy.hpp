@@ -8,10 +8,18 @@
 #include <atomic>
 #include <condition_variable>
 #include <map>
+#include <algorithm>	// std::min(), std::max()
 
 #include "communication_handler.hpp"
 #include "abstract_shared.hpp"
+#include "var_data.hpp"
 #include "messages.hpp"
+#include "compression.hpp"
+#include "delta.hpp"
+#include "dictionary.hpp"
+#include "buffer_pool.hpp"
+#include "node_set.hpp"
+#include "ring_queue.hpp"
 
 /**
  * @brief Policy for data synchronization among nodes.
@@ -24,12 +32,16 @@ class Policy {
 public:
 	static Policy& getInstance() {
 		// Double-checked locking pattern for performance issues
-		if (m_ == nullptr) {
+		Policy* p = m_.load(std::memory_order_acquire);
+		if (p == nullptr) {
 			std::unique_lock<std::mutex> lock (mutex_);
-			if (m_ == nullptr)
-				m_ = new Policy();
+			p = m_.load(std::memory_order_relaxed);
+			if (p == nullptr) {
+				p = new Policy();
+				m_.store(p, std::memory_order_release);
+			}
 		}
-		return *m_;
+		return *p;
 	}
 
 	// This was called disable_ ownership()
@@ -40,12 +52,12 @@ public:
 	 */
 	void slave_node_init(){
 		std::unique_lock<std::mutex> lock (mutex_);
-		for (auto& i: dictionary_){
+		dictionary_.for_each([this](uint32_t, var_data* v) {
 			// At beginning the master node becomes owner of all variables:
-			std::unique_lock<std::mutex> data_lock (i.second->policy_data_.mutex_);
-			i.second->policy_data_.state_ = state::REMOTE_OWNER_CACHED;
-			i.second->policy_data_.remote_owner_ = 0;
-		}
+			std::unique_lock<std::mutex> data_lock (v->policy_data_.mutex_);
+			set_state(v, state::REMOTE_OWNER_CACHED);
+			v->policy_data_.remote_owner_ = 0;
+		});
 	}
 
 	/**
@@ -55,11 +67,12 @@ public:
 	 */
 	void master_node_init(){
 		std::unique_lock<std::mutex> lock (mutex_);
-		for (auto& i: dictionary_){
+		dictionary_.for_each([this](uint32_t, var_data* v) {
 			// At beginning the master node becomes owner of all variables:
-			std::unique_lock<std::mutex> data_lock (i.second->policy_data_.mutex_);
-			i.second->policy_data_.state_ = state::OWNER_SHARED;
-		}
+			std::unique_lock<std::mutex> data_lock (v->policy_data_.mutex_);
+			set_state(v, state::OWNER_SHARED);
+			v->policy_data_.sharers_.fill(CommunicationHandler::getInstance().get_number_of_nodes());
+		});
 	}
 
 
@@ -72,19 +85,26 @@ public:
 	 * operation (either local or remote).
 	 *
 	 * This method is called when a node wants to read a variable not owned.
-	 * @param var_id	Id of the written variable
+	 * @param v	Policy data of the read variable
 	 */
-	void before_local_read(uint32_t var_id) {
+	void before_local_read(var_data* v) {
 		DEBUG("Attempt local read");
-		var_data* v = dictionary_[var_id];
-		if (v != nullptr){
-			std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+		std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+		// Temporary copies of variables are not known to the policy
+		if (v->variable_ != nullptr){
 			if (v->policy_data_.state_ == state::REMOTE_OWNER_NO_CACHED) {
 				DEBUG("No owner and no cached: need to request new value");
+				unsigned int invalidations = v->policy_data_.invalidations_;
 				requestCurrentValue(v);
+				CommunicationHandler::getInstance().flush_all();
 				DEBUG("BLOCKING on wait_value_updated_");
 				v->policy_data_.wait_value_updated_.wait(lock);
-				v->policy_data_.state_ = state::REMOTE_OWNER_CACHED;
+				// The value travels on the bulk lane:
+				// if an invalidation overtook it, the value is good for this read only.
+				// Neither is the state changed if the ownership came meanwhile (see MSG_PINNED).
+				if ((v->policy_data_.invalidations_ == invalidations) &&
+				    (v->policy_data_.state_ == state::REMOTE_OWNER_NO_CACHED))
+					set_state(v, state::REMOTE_OWNER_CACHED);
 			}
 		}
 	}
@@ -94,71 +114,165 @@ public:
 	 * @brief Method to acquire ownership of a variable that is going to be locally written.
 	 *
 	 * This method is called when a node wants to write a local variable.
-	 * @param var_id	Id of the written variable
-	 * @return		false in case of network error or variable unknown
+	 * Writes of release-consistent variables are only recorded instead.
+	 * Writes of a variable pinned at its home node (see Config::pingpong_migrations) are shipped
+	 * to the home, which executes them (see ship_write()): then, the caller must not write
+	 * the variable, nor call after_local_write().
+	 * @param v	Policy data of the written variable
+	 * @param w	Write, if it can be shipped (nullptr otherwise)
+	 * @return	false if the write has been executed by the home node; true if it must be done
+	 *		locally (also in case of network error or variable unknown)
 	 */
-	bool before_local_write(uint32_t var_id) {
-		bool ret = true;
+	bool before_local_write(var_data* v, const shipped_write* w = nullptr) {
 		DEBUG("Checking variable ownership...");
-		struct var_data* v = dictionary_[var_id];
-		if (v != nullptr){
-			std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
-			if ((v->policy_data_.state_ == state::REMOTE_OWNER_NO_CACHED) ||
-			    (v->policy_data_.state_ == state::REMOTE_OWNER_CACHED)) {
-				// We're not owners: request ownership and wait grant
-				DEBUG("We're not owners. Sending request to owner");
-				send_request_ownership(v);
-				DEBUG("BLOCKING on waiting_ownership_grant_...");
+		std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+		if (v->variable_ == nullptr)
+			return true;
+		if (v->variable_->get_coherence() == coherence_t::RELEASE) {
+			// The write is only recorded: it is sent at the next barrier (see release_writes())
+			if (!v->policy_data_.dirty_)
+				record_write(v);
+			return true;
+		}
+		// Writes of other threads go first (e.g., the ones shipped by other nodes, see execute_shipped_writes())
+		while (v->policy_data_.writing_ && (v->variable_ != nullptr))
+			v->policy_data_.write_done_.wait(lock);
+		if (v->variable_ == nullptr)
+			return true;
+		// Only other nodes ship their writes: the home waits for the ownership, as usual
+		bool home = (home_of(v->variable_->get_id()) == pbsm_tid);
+		if (v->policy_data_.pinned_ && (w != nullptr) && home)
+			count_pinned_write(v, pbsm_tid);
+		while ((v->policy_data_.state_ == state::REMOTE_OWNER_NO_CACHED) ||
+		       (v->policy_data_.state_ == state::REMOTE_OWNER_CACHED)) {
+			if ((w != nullptr) && ship_write(v, *w, lock))
+				return false;
+			// The ownership can't be given away until after_local_write() (see change_owner())
+			v->policy_data_.writing_ = true;
+			// We're not owners: request ownership and wait grant (or, if pinned, ship the write)
+			DEBUG("We're not owners. Sending request to owner");
+			send_request_ownership(v);
+			CommunicationHandler::getInstance().flush_all();
+			DEBUG("BLOCKING on waiting_ownership_grant_...");
+			while (((v->policy_data_.state_ == state::REMOTE_OWNER_NO_CACHED) ||
+			        (v->policy_data_.state_ == state::REMOTE_OWNER_CACHED)) &&
+			       !(v->policy_data_.pinned_ && (w != nullptr) && !home) && (v->variable_ != nullptr))
 				v->policy_data_.waiting_ownership_grant_.wait(lock);
-				DEBUG("Waked up from waiting_ownership_grant_. Changing ownership.");
-				v->policy_data_.state_ = state::OWNER_NO_SHARED;
-			} else if (v->policy_data_.state_ == state::OWNER_SHARED) {
-				// We need to invalidate all nodes' copies
-				DEBUG("Sending MSG__INVALIDATE_COPY...");
-				msg_t ans;
-				ans.type = msg_type_t::MSG_INVALIDATE_COPY;
-				ans.data.node = pbsm_tid;
-				ans.id = var_id;
-				if (!CommunicationHandler::getInstance().send_to_all(&ans, sizeof(ans))) {
-					ERROR("ERROR in sending MSG_INVALIDATE_COPY");
-					ret = false;
-				}
-				v->policy_data_.waiting_invalidate_copies_.counter_ = CommunicationHandler::getInstance().get_number_of_nodes() -1;
-				DEBUG("BLOCKING on waiting_invalidate_copies_");
-				v->policy_data_.waiting_invalidate_copies_.wait_condition_.wait(lock);
-				v->policy_data_.state_ = state::OWNER_NO_SHARED;
-			}
-		} else {
-			ret = false;
+			v->policy_data_.writing_ = false;
+			v->policy_data_.write_done_.notify_all();
+			// Destroyed in the meantime (see at_variable_destruction())
+			if (v->variable_ == nullptr)
+				return true;
 		}
-		return ret;
+		// The ownership can't be given away until after_local_write() (see change_owner()),
+		// and writes of other threads without calling the policy wait meanwhile (see set_state())
+		v->policy_data_.writing_ = true;
+		set_state(v, v->policy_data_.state_);
+		if ((v->policy_data_.state_ == state::OWNER_SHARED) &&
+		    (v->variable_->get_coherence() == coherence_t::INVALIDATE)) {
+			// We need to invalidate the copies of the nodes sharing the variable
+			invalidate_copies(v, lock);
+			set_state(v, state::OWNER_NO_SHARED);
+		}
+		// The copy is going to differ from any version sent by other nodes
+		v->policy_data_.version_ = 0;
+		return true;
 	}
 
 	/**
 	 * @brief Method invoked after a local write happened.
 	 *
-	 * This method is empty, since the current Policy does not do any operation after writing a local variable.
-	 * A possibly different approach is to inform all nodes about the new value.
-	 * @param var_id	Id of the written variable
+	 * With the write-invalidate protocol, it does nothing: the copies of other nodes have
+	 * already been invalidated by before_local_write(). Neither does it with release consistency.
+	 * With the write-update protocol, the new value is sent to the nodes sharing it (see send_update()),
+	 * unless the ownership has been granted to another node in the meantime.
+	 * Then, the nodes which asked the value during the write get the new one (see MSG_ASK_CURRENT_VALUE),
+	 * and the ownership requested by another node while waiting for it is granted (see change_owner()).
+	 * @param v	Policy data of the written variable
+	 */
+	void after_local_write(var_data* v) {
+		// Temporary copies of variables are not known to the policy
+		if (v->variable_ == nullptr)
+			return;
+		std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+		if (v->variable_ == nullptr)
+			return;
+		v->policy_data_.writing_ = false;
+		v->policy_data_.write_done_.notify_all();
+		set_state(v, v->policy_data_.state_);
+		if ((v->variable_->get_coherence() == coherence_t::UPDATE) &&
+		    ((v->policy_data_.state_ == state::OWNER_SHARED) || (v->policy_data_.state_ == state::OWNER_NO_SHARED))) {
+			if (!send_update(v))
+				ERROR("ERROR in sending the new value of variable " << v->variable_->get_id());
+		}
+		if (!v->policy_data_.deferred_readers_.empty()) {
+			v->policy_data_.deferred_readers_.for_each([&](int node) {
+				send_current_value(v, node);
+			});
+			v->policy_data_.deferred_readers_.clear();
+			CommunicationHandler::getInstance().flush_all();
+		}
+		if (v->policy_data_.forward_to_ >= 0) {
+			int node = v->policy_data_.forward_to_;
+			v->policy_data_.forward_to_ = -1;
+			change_owner(v, node);
+			CommunicationHandler::getInstance().flush_all();
+		}
+	}
+
+	/**
+	 * @brief Method invoked before changing the local value with one received from another node.
+	 *
+	 * The copy may be readable without calling the policy meanwhile (e.g., with the write-update protocol,
+	 * or with release consistency): the accesses are revoked, so that the ones in progress end before
+	 * the value changes (see shared::begin_read()), and the following ones wait for the lock.
+	 * They are allowed again by end_remote_write().
+	 * Must be called with lock already acquired (not the lock of the value).
+	 * @param v	Policy data of the variable
 	 */
-	void after_local_write(uint32_t  var_id) {}
+	void begin_remote_write(var_data* v) {
+		v->variable_->set_access(AbstractShared::ACCESS_NONE);
+	}
+
+	/**
+	 * @brief Method invoked once the local value has been changed (see begin_remote_write()).
+	 * @param v	Policy data of the variable
+	 */
+	void end_remote_write(var_data* v) {
+		set_state(v, v->policy_data_.state_);
+	}
+
+	/**
+	 * @brief Check if a value received from another node can replace the local one
+	 *
+	 * Values are sent to nodes not owning the variable (e.g., replies to MSG_ASK_CURRENT_VALUE, or values
+	 * of write-update variables): once this node has got the ownership, a value still in transit
+	 * (e.g., on the bulk lane, which the grant doesn't wait for) is older than the local one.
+	 * Writes released by other nodes are only queued for the next barrier instead (see MSG_FLAG_RELEASE).
+	 * Must be called with lock already acquired.
+	 * @param v	Policy data of the variable
+	 * @param flags	Flags of the value (see msg_flags_t)
+	 * @return	true if the value must be set; false if it must be dropped
+	 */
+	bool accepts_value(var_data* v, uint16_t flags) {
+		if ((flags & MSG_FLAG_RELEASE) ||
+		    (v->policy_data_.state_ == state::REMOTE_OWNER_CACHED) ||
+		    (v->policy_data_.state_ == state::REMOTE_OWNER_NO_CACHED))
+			return true;
+		DEBUG("Dropping a value of variable " << v->variable_->get_id() << " received by its owner");
+		return false;
+	}
 
 	// This was called wake_up_waiting_update()
 	/**
 	 * @brief Method invoked after the value of a not-owned variable has been refreshed.
 	 *
 	 * This method is called when the node attempted to read a non-cached variable.
-	 * @param var_id	Id of the updated variable
+	 * @param v	Policy data of the updated variable
 	 */
-	void after_remote_write(uint32_t var_id) {
-		DEBUG("Waking up blocked nodes...");
-		var_data* v = dictionary_[var_id];
-		if (v != nullptr){
-			DEBUG("UNBLOCKING wait_value_updated_");
-			v->policy_data_.wait_value_updated_.notify_all();
-		} else {
-			WARNING ("Not unblocking wait_value_updated_");
-		}
+	void after_remote_write(var_data* v) {
+		DEBUG("UNBLOCKING wait_value_updated_");
+		v->policy_data_.wait_value_updated_.notify_all();
 	}
 
 	/**
@@ -170,47 +284,80 @@ public:
 	 */
 	void at_variable_creation(AbstractShared* data) {
 		DEBUG("Policy informed of new variable " << data->get_id() << " created");
-		var_data* v = new var_data;
+		{
+			dictionary<var_data>::reader guard (dictionary_);
+			if (dictionary_.find(data->get_id()) != nullptr)
+				WARNING("Variable " << data->get_id() << " already exists");
+		}
+		var_data* v;
+		{
+			std::unique_lock<std::mutex> lock (cold_mutex_);
+			v = var_pool_.acquire();
+		}
+		data->set_var_data(v);
+		std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
 		v->variable_ = data;
+		v->policy_data_.waiting_invalidate_copies_.counter_ = 0;
+		v->policy_data_.invalidations_ = 0;
+		v->policy_data_.version_ = 0;
+		v->policy_data_.forward_to_ = -1;
+		v->policy_data_.writing_ = false;
+		v->policy_data_.executing_ = false;
+		v->policy_data_.sharers_.clear();
+		v->policy_data_.deferred_readers_.clear();
+		v->policy_data_.pinned_ = false;
+		v->policy_data_.shipping_ = nullptr;
+		v->policy_data_.window_start_ = std::chrono::steady_clock::time_point();
+		v->policy_data_.window_count_ = 0;
+		v->policy_data_.window_writer_ = -1;
+		v->policy_data_.pins_ = 0;
+		v->policy_data_.shipped_writes_ = 0;
+		v->policy_data_.dirty_ = false;
 
 		// This works also when pbsm_tid has not yet been set (because it is initialized to -1)
 		if (pbsm_tid == 0) {
 			// Master node
 			// Shared because other nodes may create their own copies
 			DEBUG("We're master. Setting ownership to us");
-			v->policy_data_.state_ = state::OWNER_SHARED;
+			set_state(v, state::OWNER_SHARED);
+			v->policy_data_.sharers_.fill(CommunicationHandler::getInstance().get_number_of_nodes());
 		} else {
 			// Slave node
 			DEBUG("We're slave. Setting ownership to master");
-			v->policy_data_.state_ = state::REMOTE_OWNER_CACHED;
+			set_state(v, state::REMOTE_OWNER_CACHED);
 			// Master node is owner
 			v->policy_data_.remote_owner_= 0;
 		}
-		dictionary_[data->get_id()] = v;
+		dictionary_.insert(data->get_id(), v);
 	}
 
 	/**
 	 * @brief Method invoked when a (either global, stack or heap) variable is destroyed.
 	 *
 	 * This method sends a message to all nodes with the latest value of the variable.
-	 * Moreover, it removes the variable from the internal dictionary.
+	 * Moreover, it removes the variable from the internal dictionary, waiting for the threads
+	 * which may be using its policy data (which is then given back to var_pool_),
+	 * and from the directory (if this node is its home, see directory_).
 	 *
 	 * Note: this method is called by the variable destructor. Therefore, we can only rely on
-	 * the function parameters, and we cannot access dictionary_[var_id].second->variable_
-	 * @param var_id	ID of the variable that is going to be destroyed
+	 * the function parameters and on the AbstractShared part of the variable.
+	 * @param var		Variable that is going to be destroyed
 	 * @param data		Pointer to the buffer containing the value
 	 * @param size		Size of the buffer
 	 * @return		true in case of success (also of network communication); false otherwise
 	 */
-	bool at_variable_destruction(uint32_t var_id, void* data, int size) {
+	bool at_variable_destruction(AbstractShared* var, void* data, int size) {
 		bool ret = true;
+		uint32_t var_id = var->get_id();
+		var_data* v = var->get_var_data();
 		DEBUG("Sending new value of variable " << var_id << " to all");
 
-		var_data* v = dictionary_[var_id];
-		if (v == nullptr){
-			ERROR ("Variable not found!");
-			ret = false;
-		} else {
+		// Release-consistent variables must not be destroyed while releasing or applying writes
+		std::unique_lock<std::mutex> release_lock (release_mutex_, std::defer_lock);
+		if (var->get_coherence() == coherence_t::RELEASE)
+			release_lock.lock();
+
+		{
 			std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
 
 			msg_t ans;
@@ -218,35 +365,81 @@ public:
 			ans.id = var_id;
 			ans.data.var_size = size;
 
-			ret = CommunicationHandler::getInstance().send_two_messages_to_all(&ans, sizeof(ans), data, size);
+			if (sizeof(ans) + size <= BATCH_DATAGRAM_SIZE) {
+				ret = CommunicationHandler::getInstance().send_value_to_all(&ans, sizeof(ans), data, size, true);
+			} else {
+				for (int i = 0; i < CommunicationHandler::getInstance().get_number_of_nodes(); ++i){
+					if (i != pbsm_tid)
+						ret = send_raw_value(i, var_id, data, size, v->variable_->get_compression()) && ret;
+				}
+			}
 
-			delete v;
-			dictionary_[var_id] = nullptr;
+			// Messages still being handled must not touch the variable
+			v->variable_ = nullptr;
+
+			// Threads waiting for other nodes give up (see before_local_write() and ship_write()),
+			// and the shipped write being executed, if any, ends (see execute_shipped_writes())
+			v->policy_data_.shipping_ = nullptr;
+			v->policy_data_.waiting_ownership_grant_.notify_all();
+			v->policy_data_.waiting_invalidate_copies_.wait_condition_.notify_all();
+			v->policy_data_.write_done_.notify_all();
+			while (v->policy_data_.executing_)
+				v->policy_data_.write_done_.wait(lock);
+
+			if (release_lock.owns_lock()) {
+				// The value sent replaces the writes not yet released
+				std::unique_lock<std::mutex> dirty_lock (dirty_mutex_);
+				dirty_variables_.erase(std::remove(dirty_variables_.begin(), dirty_variables_.end(), v), dirty_variables_.end());
+				pending_variables_.erase(std::remove(pending_variables_.begin(), pending_variables_.end(), v), pending_variables_.end());
+				v->policy_data_.dirty_ = false;
+			}
+		}
+		dictionary_.remove(var_id, v);
+		release_cold_data(v);
+		var->set_var_data(nullptr);
+		{
+			std::unique_lock<std::mutex> lock (cold_mutex_);
+			var_pool_.release(v);
 		}
+
+		// A new variable with the same ID is owned by the master node again
+		std::unique_lock<std::mutex> lock (directory_mutex_);
+		directory_.erase(var_id);
 		return ret;
 	}
 
 
 
 
+	void print_stats(std::ostream& out);
+
 	/**
 	 * @brief Method invoked when reaching a barrier
 	 *
+	 * The writes of release-consistent variables are sent to all nodes before reaching the barrier
+	 * (once the write-update values sent are set too), and the ones of other nodes are applied after passing it.
 	 * @param s	ID of the barrier
 	 */
 	void thread_wait_barrier(uint32_t s) {
 		DEBUG("Barrier " << s << " locally reached");
+		release_writes();
 		if (pbsm_tid == 0)
 			thread_wait_master_barrier(s);
 		else
 			thread_wait_slave_barrier(s);
+		apply_released_writes();
 	}
 
 	/**
 	 * @brief Method invoked to start receiving from receiving sockets.
 	 *
-	 * This method starts a set of new threads, each one listening from a specific UDP channel
-	 * (connected to a specific node).
+	 * This method starts Config::receive_threads new threads, multiplexing the UDP channels
+	 * (i.e., the sockets of the node and the multicast group). If Config::receive_threads is 0, it starts
+	 * instead a dedicated thread for each UDP channel.
+	 * With io_uring, a single thread collects the datagrams received from all nodes.
+	 * Nodes running on the same host have, in any case, a dedicated thread reading their shared memory ring,
+	 * and so has the bulk lane (see Config::bulk_lane), so that values never delay protocol messages.
+	 * Datagrams received during the handshake are handled before starting the threads.
 	 * It can be called only when CommunicationHandler::getInstance().create_connections() and pbsm_tid have been set.
 	 */
 	void start_receiving() {
@@ -254,65 +447,127 @@ public:
 		DEBUG("TID of Policy constructor is " << std::this_thread::get_id());
 		int hosts_nb = CommunicationHandler::getInstance().get_number_of_nodes();
 
+		DEBUG("Starting new thread for sending again lost fragments...");
+		std::thread* resender = new std::thread ([=] {this->resend_fragments();});
+		resender->detach();
+		threads_.push_back(resender);
+
+		DEBUG("Starting new thread for executing the writes shipped by other nodes...");
+		std::thread* executor = new std::thread ([=] {this->execute_shipped_writes();});
+		executor->detach();
+		threads_.push_back(executor);
+
 		for (int i = 0; i < hosts_nb; ++i){
-			DEBUG("Checking node " << i << "...");
-			if (i != pbsm_tid) {
-				DEBUG("Node " << i << " is not me. Starting new thread for node " << i << "...");
-				std::thread* t = new std::thread ([=] {this->receive_messages(i);});
+			if ((i != pbsm_tid) && CommunicationHandler::getInstance().is_local(i)) {
+				DEBUG("Node " << i << " is on the same host. Starting new thread for its ring...");
+				std::thread* t = new std::thread ([=] {this->receive_local_messages(i);});
+				t->detach();
+				threads_.push_back(t);
+			}
+		}
+
+		// Datagrams received by CommunicationHandler::create_connections() come before any other one
+		std::vector<char> datagram;
+		int rem_node;
+		while (CommunicationHandler::getInstance().next_early_datagram(&rem_node, datagram))
+			dispatch_datagram(rem_node, &datagram[0], datagram.size());
+		CommunicationHandler::getInstance().flush_all();
+
+		if (CommunicationHandler::getInstance().uses_bulk_lane()) {
+			DEBUG("Starting new thread for the bulk lane...");
+			std::thread* t = new std::thread ([=] {this->receive_messages(BULK_CHANNEL);});
+			t->detach();
+			threads_.push_back(t);
+		}
+
+		if (CommunicationHandler::getInstance().uses_uring()) {
+			CommunicationHandler::getInstance().start_completions();
+			DEBUG("Starting new thread for receiving through io_uring...");
+			std::thread* t = new std::thread ([=] {this->receive_completions();});
+			t->detach();
+			threads_.push_back(t);
+			return;
+		}
+
+		unsigned int receive_threads = Config::getInstance().receive_threads;
+		if (receive_threads > 0) {
+			CommunicationHandler::getInstance().start_polling();
+			for (unsigned int i = 0; i < receive_threads; ++i){
+				DEBUG("Starting new thread for receiving from all nodes...");
+				std::thread* t = new std::thread ([=] {this->receive_messages_from_all();});
 				t->detach();
 				threads_.push_back(t);
 			}
+			return;
+		}
+
+		for (int i = 0; i < CommunicationHandler::getInstance().get_number_of_sockets(); ++i){
+			DEBUG("Starting new thread for channel " << i << "...");
+			std::thread* t = new std::thread ([=] {this->receive_messages(i);});
+			t->detach();
+			threads_.push_back(t);
+		}
+		if (CommunicationHandler::getInstance().uses_multicast()) {
+			DEBUG("Starting new thread for the multicast group...");
+			std::thread* t = new std::thread ([=] {this->receive_messages(MULTICAST_CHANNEL);});
+			t->detach();
+			threads_.push_back(t);
 		}
 	}
 
 
 private:
-	/**
-	 * @brief Possible states of a shared variable.
-	 */
-	enum class state {
-		OWNER_NO_SHARED = 1,		//< We are owner of data; value not (yet) shared.
-		OWNER_SHARED = 2,		//< We are owner of data; value already shared.
-		REMOTE_OWNER_CACHED = 3,	//< We are not owner of data; we have a valid cached value
-		REMOTE_OWNER_NO_CACHED = 4,	//< We are not owner of data; we have not a valid cached value.
-	};
+	/// Possible states of a shared variable
+	typedef var_state state;
+	typedef var_data::semaphore semaphore;
+	typedef var_data::incoming_value incoming_value;
+	typedef var_data::twin twin;
+	typedef var_data::cold_data cold_data;
 
 	/**
-	 * @brief Semaphore for blocking waiting a certain amount of events.
-	 *
-	 * Implemented since C++11 does not provide semaphores.
+	 * @brief Value being sent in fragments to a node (see MSG_VALUE_FRAGMENT)
 	 */
-	struct semaphore {
-		std::atomic_ulong counter_;		//< Counter. When reaches 0 wait_condition_ is notified.
-		std::condition_variable wait_condition_;
+	struct outgoing_value {
+		/// Recipient node
+		int node;
+		/// Id of the variable
+		uint32_t var_id;
+		/// Id of the transfer
+		uint32_t transfer;
+		/// Flags of the fragments (see msg_flags_t)
+		uint16_t flags;
+		/// Snapshot of the value (encoded, see msg_flags_t)
+		std::vector<char> data;
+		/// Size of each fragment (but the last one)
+		uint32_t fragment_size;
+		/// Number of fragments
+		uint32_t count;
+		/// Number of fragments acknowledged without gaps from the beginning
+		uint32_t acked;
+		/// First fragment never sent
+		uint32_t next;
+		/// Fragments selectively acknowledged
+		std::vector<bool> arrived;
+		/// Fragments already sent again since the latest timeout
+		std::vector<bool> resent;
+		/// Number of consecutive timeouts
+		unsigned int retries;
+		/// Time of the latest acknowledgment (or timeout)
+		std::chrono::steady_clock::time_point last_ack;
 	};
 
 	/**
-	 * @brief Policy data associated to a shared variable.
+	 * @brief Write shipped by another node, waiting to be executed (see MSG_SHIP_WRITE)
 	 */
-	struct var_data {
-		/// Pointer to the actual shared<> variable
-		AbstractShared* variable_;
-
-		struct {
-			/// State of the shared<> variable
-			Policy::state state_;
-
-			/// Condition variable to wait when waiting for value refresh
-			std::condition_variable wait_value_updated_;
-
-			/// Remote owner (meaningful only if this node isn't the owner)
-			unsigned long int remote_owner_;
-
-			/// Lock for mutual exclusion to access data
-			std::mutex mutex_;
-
-			/// Condition variable to wait variable refresh when reading and value is not cached
-			std::condition_variable waiting_ownership_grant_;
-
-			/// Semaphore to wait all nodes to invalidate their own copies
-			semaphore waiting_invalidate_copies_;
-		} policy_data_;
+	struct incoming_write {
+		/// Sender node
+		int node;
+		/// Id of the variable
+		uint32_t var_id;
+		/// Operation
+		write_op_t op;
+		/// Operand (the new value, for an assignment)
+		std::vector<char> operand;
 	};
 
 	/**
@@ -333,6 +588,11 @@ private:
 		msg.type = msg_type_t::MSG_ASK_CURRENT_VALUE;
 		msg.data.node = pbsm_tid;
 		msg.id = v->variable_->get_id();
+		if (delta_updates(v->variable_->get_size())) {
+			// The owner replies to the sender of the message
+			msg.flags = MSG_FLAG_DELTA;
+			msg.data.version = v->policy_data_.version_;
+		}
 
 		if (!CommunicationHandler::getInstance().send_to(&msg, sizeof(msg), owner)) {
 			ERROR("ERROR in sending MSG_ASK_CURRENT_VALUE");
@@ -345,19 +605,25 @@ private:
 	/**
 	 * @brief Method to request ownership of a variable to the current owner
 	 *
-	 * This method sends a message on the network to the current owner to get ownership.
+	 * This method sends a message to the home node of the variable (see home_of()),
+	 * which forwards it to the current owner; if this node is the home, it forwards it directly.
+	 * Must be called with lock already acquired.
 	 * @param var	Pointer to var_data of the variable
 	 * @return	true in case of success; false in case of network error
 	 */
 	bool send_request_ownership(struct var_data* var) {
 		bool ret = true;
-		DEBUG("Sending MSG_REQUEST_OWNERSHIP message...");
+		uint32_t var_id = var->variable_->get_id();
+		int home = home_of(var_id);
+		if (home == pbsm_tid)
+			return forward_ownership_request(var_id, pbsm_tid, var);
 
+		DEBUG("Sending MSG_REQUEST_OWNERSHIP message to home node " << home << "...");
 		msg_t msg;
 		msg.type = msg_type_t::MSG_REQUEST_OWNERSHIP;
 		msg.data.node = pbsm_tid;
-		msg.id = var->variable_->get_id();
-		if (!CommunicationHandler::getInstance().send_to_all(&msg, sizeof(msg))) {
+		msg.id = var_id;
+		if (!CommunicationHandler::getInstance().send_to(&msg, sizeof(msg), home)) {
 				ERROR("ERROR in sending MSG_REQUEST_OWNERSHIP");
 				ret = false;
 		}
@@ -365,58 +631,181 @@ private:
 		return ret;
 	}
 
-	void receive_messages(int rem_node);
+	/**
+	 * @brief Home node of a variable, which tracks its owner (see directory_)
+	 *
+	 * IDs may be small integers: spread them through Fibonacci hashing.
+	 * @param var_id	ID of the variable
+	 * @return		ID of the home node
+	 */
+	int home_of(uint32_t var_id) {
+		return ((uint64_t) var_id * 11400714819323198485ULL >> 32) % CommunicationHandler::getInstance().get_number_of_nodes();
+	}
+
+	void receive_messages(int channel);
+	void receive_messages_from_all();
+	bool receive_datagrams(int channel, CommunicationHandler::recv_batch& batch, bool block);
+	bool receive_value(int sender, int channel, const msg_t& msg);
+	void receive_completions();
+	void receive_local_messages(int rem_node);
+	void dispatch_datagram(int sender, char* data, std::size_t len);
+	void deliver_in_order(int sender, bool multicast);
+	void handle_datagram(int rem_node, char* data, std::size_t len);
+	void handle_message(int rem_node, const msg_t& msg, void* value);
+	bool send_value(var_data* v, unsigned long int rem_node, uint16_t flags = 0);
+	void send_current_value(var_data* v, int rem_node);
+	bool send_update(var_data* v);
+	bool send_raw_value(unsigned long int rem_node, uint32_t var_id, void* data, std::size_t size, compression_t compression);
+	bool compressible(compression_t compression, std::size_t size, unsigned long int rem_node);
+	bool send_encoded_value(unsigned long int rem_node, uint32_t var_id, std::vector<char>& data, uint16_t flags, bool compress);
+	bool delta_updates(std::size_t size);
+	bool send_delta(var_data* v, unsigned long int rem_node, uint64_t base);
+	bool set_encoded_value(var_data* v, uint16_t flags, const char* data, std::size_t size);
+	bool send_fragmented_value(unsigned long int rem_node, uint32_t var_id, std::vector<char>& data, uint16_t flags = 0);
+	bool send_fragments(outgoing_value* t, const std::vector<uint32_t>& indexes);
+	void release_transfer(outgoing_value* t);
+	void handle_fragment(int sender, const msg_t& msg, const fragment_t& frag, const char* payload, int channel);
+	void handle_fragment_ack(int rem_node, const msg_t& msg, const fragment_ack_t& ack);
+	void send_fragment_ack(int rem_node, uint32_t var_id, incoming_value& in);
+	void resend_fragments();
+	void record_write(var_data* v);
+	void release_writes();
+	void queue_released_writes(var_data* v, const char* ranges, std::size_t len);
+	void apply_released_writes();
+	void send_release_ack(int rem_node, uint32_t var_id);
+	void expect_release_acks(long int count);
+	bool forward_ownership_request(uint32_t var_id, int node, var_data* v);
+	bool count_migration(var_data* v);
+	void count_pinned_write(var_data* v, int node);
+	bool ship_write(var_data* v, const shipped_write& w, std::unique_lock<std::mutex>& lock);
+	void execute_shipped_writes();
+	bool invalidate_copies(var_data* v, std::unique_lock<std::mutex>& lock);
 	void thread_wait_master_barrier(uint32_t s);
 	void thread_wait_slave_barrier(uint32_t s);
+	cold_data& cold_data_of(var_data* v);
+	void release_cold_data(var_data* v);
 
 	/**
-	 * @brief Method to change the owner of a owned variable.
+	 * @brief Method to change the state of a variable.
 	 *
-	 * This method is called when receiving MSG_REQUEST_OWNERSHIP or MSG_SET_NEW_OWNER:
-	 * <ul>
-	 * <li> In case of MSG_SET_NEW_OWNER (we requested the ownership to an old owner),
-	 * a message MSG_REQUEST_OWNERSHIP will be re-issued after this method
-	 * (by calling send_request_ownership()).
-	 * <li> In case of MSG_REQUEST_OWNERSHIP a message MSG_GRANT_OWNERSHIP message will
-	 * be sent after this method.
-	 * </ul>
-	 * @param var		Pointer to written variable data
-	 * @param rem_node_id	New owner
-	 * @return		True in case this node was the owner; false otherwise
+	 * It also sets the accesses that the variable can do without calling the policy
+	 * (see AbstractShared::readable() and AbstractShared::writable()):
+	 * reads if the value is valid, and writes too if no other node has a copy
+	 * (never with the write-update protocol, whose writes must be sent to other nodes,
+	 * nor on the home node of a pinned variable, whose writes are counted, see count_pinned_write(),
+	 * nor while a write goes through the policy, see before_local_write()).
+	 * With release consistency, the value is always valid, and writes are allowed once recorded
+	 * (see record_write()).
+	 * It returns once the writes in progress without calling the policy have ended (see
+	 * AbstractShared::set_access()): therefore, it must be called before reading the value
+	 * to give it away (e.g., see change_owner()).
+	 * Must be called with lock already acquired.
+	 * @param v	Pointer to var_data of the variable
+	 * @param s	New state
 	 */
-	bool change_owner(var_data* var, unsigned long int node) {
-		DEBUG("Changing owner of the variable...");
-		bool ret = false;
-		std::unique_lock<std::mutex> lock (var->policy_data_.mutex_);
-		if ((var->policy_data_.state_ == state::OWNER_NO_SHARED) ||
-		    (var->policy_data_.state_ == state::OWNER_SHARED))
-			ret = true;
-		var->policy_data_.state_ = state::REMOTE_OWNER_NO_CACHED;
-		var->policy_data_.remote_owner_= node;
+	void set_state(var_data* v, state s) {
+		v->policy_data_.state_ = s;
+		if (v->variable_ == nullptr)
+			return;
+		int access = AbstractShared::ACCESS_NONE;
+		if (v->variable_->get_coherence() == coherence_t::RELEASE)
+			access = AbstractShared::ACCESS_READ | (v->policy_data_.dirty_ ? AbstractShared::ACCESS_WRITE : 0);
+		else if ((s == state::OWNER_NO_SHARED) && (v->variable_->get_coherence() == coherence_t::INVALIDATE) &&
+		    !v->policy_data_.pinned_ && !v->policy_data_.writing_)
+			access = AbstractShared::ACCESS_READ | AbstractShared::ACCESS_WRITE;
+		else if ((s == state::OWNER_NO_SHARED) || (s == state::OWNER_SHARED) || (s == state::REMOTE_OWNER_CACHED))
+			access = AbstractShared::ACCESS_READ;
+		v->variable_->set_access(access);
+	}
+
+	/**
+	 * @brief Method to give the ownership of a variable to a node which requested it.
+	 *
+	 * This method is called when the home node forwards a request (see MSG_FORWARD_OWNERSHIP).
+	 * If this node is not yet the owner (i.e., the home has already recorded that it is going
+	 * to be, while it is waiting for the grant), or it is writing the variable, the request is
+	 * served after its own write (see after_local_write()).
+	 * The nodes sharing the variable are sent together with the grant, so that the new owner
+	 * invalidates their copies before writing. So is the value of write-invalidate variables,
+	 * if the new owner is not among them (i.e., its copy is not valid) and it fits the datagram.
+	 * Must be called with lock already acquired.
+	 * @param v		Pointer to var_data of the variable
+	 * @param node		New owner
+	 * @return		true in case of success; false in case of network error
+	 */
+	bool change_owner(var_data* v, int node) {
+		if (v->policy_data_.writing_ ||
+		    ((v->policy_data_.state_ != state::OWNER_NO_SHARED) &&
+		     (v->policy_data_.state_ != state::OWNER_SHARED))) {
+			DEBUG("Not yet owners: granting ownership to node " << node << " after our write");
+			v->policy_data_.forward_to_ = node;
+			return true;
+		}
+
+		// With the write-update protocol, the copy is kept up to date by the new owner
+		DEBUG("Changing owner of the variable to node " << node);
+		bool update = (v->variable_->get_coherence() == coherence_t::UPDATE);
+		set_state(v, update ? state::REMOTE_OWNER_CACHED : state::REMOTE_OWNER_NO_CACHED);
+		v->policy_data_.remote_owner_= node;
+
+		node_set& sharers = v->policy_data_.sharers_;
+		if (update)
+			sharers.insert(pbsm_tid);
+		else
+			sharers.erase(pbsm_tid);
+
+		// The copy of the new owner is valid only if it is among the sharers
+		std::size_t size = v->variable_->get_size();
+		bool value = !update && !sharers.contains(node) &&
+		    (sizeof(msg_t) + sharers.bytes() + size <= BATCH_DATAGRAM_SIZE);
+		sharers.erase(node);
+
+		DEBUG("Sending MSG_GRANT_OWNERSHIP with " << sharers.size() << " nodes sharing the variable...");
+		msg_t ans;
+		ans.type = msg_type_t::MSG_GRANT_OWNERSHIP;
+		ans.data.var_size = sharers.bytes();
+		ans.id = v->variable_->get_id();
+		bool ret;
+		if (value) {
+			std::vector<char> payload;
+			BufferPool::getInstance().acquire(payload, sharers.bytes() + size);
+			if (sharers.bytes() > 0)
+				memcpy(&payload[0], sharers.data(), sharers.bytes());
+			v->variable_->get_value(&payload[sharers.bytes()]);
+			ans.flags = MSG_FLAG_VALUE;
+			ans.data.var_size = payload.size();
+			ret = CommunicationHandler::getInstance().send_value_to(&ans, sizeof(ans), &payload[0], payload.size(), node);
+			BufferPool::getInstance().release(payload);
+		} else {
+			ret = CommunicationHandler::getInstance().send_value_to(&ans, sizeof(ans), (void*) sharers.data(), sharers.bytes(), node);
+		}
+		sharers.clear();
+		if (!ret)
+			ERROR("ERROR in sending grant message to " << node);
 		return ret;
 	}
 
 	/// Singleton pattern for a deterministic initialization order of objects
-	static Policy* m_;
+	static std::atomic<Policy*> m_;
 	static std::mutex mutex_;
 
-	Policy(){}
+	Policy(): next_transfer_(0), next_version_(0), release_acks_(0) {}
 
-	/// Destructor: just clean up data (i.e., threads and dictionary)
+	/// Destructor: just clean up data (i.e., threads; var_data structures belong to variables)
 	~Policy(){
 		for (auto i: threads_)
 			delete i;
 		threads_.clear();
-		for (auto i: dictionary_)
-			delete i.second;
-		dictionary_.clear();
-
 	}
 
 	/**
-	 * @brief Main data structure of to map variable IDs to var_data structures.
+	 * @brief Main data structure of to map variable IDs to the var_data structures of the variables.
+	 *
+	 * It is used only to route incoming messages (local accesses reach var_data through the variable):
+	 * lookups are lock-free, because they happen concurrently on receiving threads, which hold
+	 * a reader while using the var_data found (see at_variable_destruction()).
 	 */
-	std::map<uint32_t, var_data*> dictionary_;
+	dictionary<var_data> dictionary_;
 
 	/**
 	 * @brief Data structure for barriers on the master node
@@ -426,6 +815,9 @@ private:
 	 */
 	std::map<uint32_t, semaphore*> master_waiting_barrier_grants_;
 
+	/// Semaphores of barriers already passed, reused by the next ones (protected by mutex_)
+	object_pool<semaphore> semaphore_pool_;
+
 	/**
 	 * @brief Condition variable for barrier on the slave node
 	 *
@@ -441,6 +833,88 @@ private:
 	 * on a specific channel connected to a specific node.
 	 */
 	std::vector<std::thread*> threads_;
+
+	/**
+	 * @brief Values being sent in fragments
+	 *
+	 * This data structure maps pairs (recipient node, variable ID) to the transfers
+	 * not yet completely acknowledged (nullptr once done: entries are kept for the next transfers).
+	 * It is protected by outgoing_mutex_.
+	 */
+	std::map<std::pair<int, uint32_t>, outgoing_value*> outgoing_values_;
+	std::mutex outgoing_mutex_;
+
+	/// Transfers done, reused by the next ones (protected by outgoing_mutex_)
+	object_pool<outgoing_value> outgoing_pool_;
+
+	/// Policy data of the variables, given back by the variables destroyed (see at_variable_creation())
+	object_pool<var_data> var_pool_;
+
+	/// Data needed only by some variables, given back by the variables destroyed (see cold_data_of())
+	object_pool<cold_data> cold_pool_;
+
+	/// Lock of var_pool_ and cold_pool_
+	std::mutex cold_mutex_;
+
+	/// Buffers of send_fragments() and of its callers, reused by each call (protected by outgoing_mutex_)
+	std::vector<uint32_t> fragment_indexes_;
+	std::vector<fragment_header> fragment_headers_;
+	std::vector<struct iovec> fragment_iov_;
+
+	/**
+	 * @brief Owners of the variables whose home is this node (see home_of())
+	 *
+	 * The owner recorded is the latest node which requested the ownership, even if it
+	 * has not yet been granted to it: requests are forwarded to it, so that they are served
+	 * in the order of arrival at the home. Variables not found are owned by the master node.
+	 * It is protected by directory_mutex_.
+	 */
+	std::map<uint32_t, int> directory_;
+	std::mutex directory_mutex_;
+
+	/// Id of the next transfer of a fragmented value
+	std::atomic<uint32_t> next_transfer_;
+
+	/// Counter of the versions of values sent as deltas
+	std::atomic<uint64_t> next_version_;
+
+	/**
+	 * @brief Release-consistent variables written since the latest barrier (see record_write())
+	 *
+	 * Protected by dirty_mutex_, which is taken last (i.e., after the lock of a variable).
+	 */
+	std::vector<var_data*> dirty_variables_;
+	std::mutex dirty_mutex_;
+
+	/// Release-consistent variables with writes of other nodes to be applied (protected by dirty_mutex_)
+	std::vector<var_data*> pending_variables_;
+
+	/// Variables being handled by release_writes() or apply_released_writes() (protected by release_mutex_)
+	std::vector<var_data*> released_variables_;
+
+	/// Lock serializing release_writes(), apply_released_writes() and the destruction of release-consistent variables
+	std::mutex release_mutex_;
+
+	/// MSG_RELEASE_ACK still expected (protected by dirty_mutex_, see expect_release_acks())
+	long int release_acks_;
+
+	/// Condition variable to wait for MSG_RELEASE_ACK
+	std::condition_variable release_acked_;
+
+	/// Writes shipped by other nodes, in order of arrival (see execute_shipped_writes())
+	ring_queue<incoming_write> shipped_queue_;
+	std::mutex shipped_mutex_;
+
+	/// Condition variable to wait for writes shipped by other nodes
+	std::condition_variable shipped_available_;
+
+	/**
+	 * @brief Method to get a new version for a value sent as a delta
+	 * @return	Version unique among all nodes (never 0)
+	 */
+	uint64_t new_version() {
+		return ((uint64_t) (pbsm_tid + 1) << 48) | ++next_version_;
+	}
 };
 
 
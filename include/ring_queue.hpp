@@ -0,0 +1,78 @@
+#ifndef RING_QUEUE_HPP_
+#define RING_QUEUE_HPP_
+
+#include <cstddef>
+#include <utility>	// std::swap()
+#include <vector>
+
+/**
+ * @brief FIFO queue on a circular buffer which reuses the elements removed
+ *
+ * Removing an element does not destroy it: the next element appended gets its slot as it is
+ * (e.g., with the memory of its buffers), and the caller must reset the members it needs.
+ * Therefore, once the queue has grown to the needed size, appending and removing never allocate.
+ * Not thread-safe.
+ */
+template<class T>
+class ring_queue {
+public:
+	ring_queue(): slots_(1), head_(0), size_(0) {}
+
+	class iterator {
+	public:
+		iterator(ring_queue* q, std::size_t i): q_(q), i_(i) {}
+		T& operator*() const { return q_->at(i_); }
+		T* operator->() const { return &q_->at(i_); }
+		iterator& operator++() { ++i_; return *this; }
+		bool operator!=(const iterator& other) const { return i_ != other.i_; }
+		bool operator==(const iterator& other) const { return i_ == other.i_; }
+	private:
+		ring_queue* q_;
+		std::size_t i_;
+	};
+
+	bool empty() const { return size_ == 0; }
+	std::size_t size() const { return size_; }
+	T& front() { return at(0); }
+	T& back() { return at(size_ - 1); }
+	iterator begin() { return iterator(this, 0); }
+	iterator end() { return iterator(this, size_); }
+
+	/**
+	 * @brief Append an element
+	 * @return Element appended (in the state left by its previous use, if any)
+	 */
+	T& push_back() {
+		if (size_ == slots_.size())
+			grow();
+		size_++;
+		return back();
+	}
+
+	/// Remove the first element (kept for reuse)
+	void pop_front() {
+		head_ = (head_ + 1) & (slots_.size() - 1);
+		size_--;
+	}
+
+private:
+	/// Element at a position from the front
+	T& at(std::size_t i) {
+		return slots_[(head_ + i) & (slots_.size() - 1)];
+	}
+
+	/// Double the slots (a power of 2), moving the elements to the beginning
+	void grow() {
+		std::vector<T> bigger (2 * slots_.size());
+		for (std::size_t i = 0; i < slots_.size(); ++i)
+			std::swap(bigger[i], at(i));
+		slots_.swap(bigger);
+		head_ = 0;
+	}
+
+	std::vector<T> slots_;
+	std::size_t head_;
+	std::size_t size_;
+};
+
+#endif // RING_QUEUE_HPP_
@@ -2,6 +2,7 @@
 #define SHARED_HPP_
 
 #include <mutex>
+#include <type_traits>
 
 #include "abstract_shared.hpp"
 #include "logger.hpp"
@@ -38,13 +39,13 @@
 
 /// Base template class for non-fundamental (i.e., user-defined) types
 template<class T, class=void>
-class shared : public T, public AbstractShared {
+class shared : public AbstractShared, public T {
 public:
 	/// Mechanism for exposing the methods of the user-defined type
 	using T::T;
 
 	/// Constructor
-	explicit shared(uint32_t s): T(), AbstractShared(s), temp_object_(false)  {
+	explicit shared(uint32_t s): AbstractShared(s), T(), temp_object_(false)  {
 		DEBUG("New variable " << get_id() << " created.");
 
 		// Inform the policy that a new variable has been created:
@@ -52,25 +53,49 @@ public:
 	}
 
 	/// Constructor
-	explicit shared(uint32_t s, T init): T(init), AbstractShared(s), temp_object_(false)  {
+	explicit shared(uint32_t s, T init): AbstractShared(s), T(init), temp_object_(false)  {
 		DEBUG("New variable " << get_id() << " created.");
 
 		// Inform the policy that a new variable has been created:
 		Policy::getInstance().at_variable_creation(this);
 	}
 
+	/// Constructor of a variable with the write-update protocol (see coherence_t)
+	shared(uint32_t s, write_update_t): AbstractShared(s, coherence_t::UPDATE), T(), temp_object_(false)  {
+		DEBUG("New variable " << get_id() << " created (write-update).");
+		Policy::getInstance().at_variable_creation(this);
+	}
+
+	/// Constructor of a variable with the write-update protocol (see coherence_t)
+	shared(uint32_t s, T init, write_update_t): AbstractShared(s, coherence_t::UPDATE), T(init), temp_object_(false)  {
+		DEBUG("New variable " << get_id() << " created (write-update).");
+		Policy::getInstance().at_variable_creation(this);
+	}
+
+	/// Constructor of a variable with release consistency (see coherence_t)
+	shared(uint32_t s, release_consistent_t): AbstractShared(s, coherence_t::RELEASE), T(), temp_object_(false)  {
+		DEBUG("New variable " << get_id() << " created (release consistency).");
+		Policy::getInstance().at_variable_creation(this);
+	}
+
+	/// Constructor of a variable with release consistency (see coherence_t)
+	shared(uint32_t s, T init, release_consistent_t): AbstractShared(s, coherence_t::RELEASE), T(init), temp_object_(false)  {
+		DEBUG("New variable " << get_id() << " created (release consistency).");
+		Policy::getInstance().at_variable_creation(this);
+	}
+
 	/// Copy constructor
-	shared(shared& other): T(other), AbstractShared(0), temp_object_(true) {
+	shared(shared& other): AbstractShared(other), T(other), temp_object_(true) {
 		// Inform the policy that a new variable has been created:
 		// Policy::getInstance().at_variable_creation(this);
-		DEBUG("Temporary object created from variable " << other.id_);
+		DEBUG("Temporary object created from variable " << other.get_id());
 	}
 
 	/// Const copy constructor
-	shared(const shared& other): T(other), AbstractShared(0), temp_object_(true) {
+	shared(const shared& other): AbstractShared(other), T(other), temp_object_(true) {
 		// Inform the policy that a new variable has been created:
 		// Policy::getInstance().at_variable_creation(this);
-		DEBUG("Temporary object created from variable " << other.id_);
+		DEBUG("Temporary object created from variable " << other.get_id());
 	}
 
 	/// Destructor
@@ -78,69 +103,92 @@ public:
 		DEBUG("Variable's destructor called!");
 		if (!temp_object_) {
 			DEBUG("Destroying not temporary object");
-			std::unique_lock<std::mutex> lock (mutex_);
-			// Inform the policy that a new variable has been destroyed:
-			Policy::getInstance().at_variable_destruction(get_id(), (T*) this , sizeof(T));
+			// Inform the policy that a new variable has been destroyed
+			// (not holding mutex_: receiving threads take it after the lock of the policy,
+			// which protects the value from remote writes during the call):
+			Policy::getInstance().at_variable_destruction(this, (T*) this , sizeof(T));
 		} else {
 			DEBUG("Destroying temporary object");
 		}
 	}
 
+	/*
+	 * Writes allowed without calling the policy are published in the slot of the thread (see begin_local_access()).
+	 * Writes not done locally (see Policy::before_local_write()) have been executed
+	 * by the node where the variable is pinned (see shipped_write).
+	 */
+
 	/// Prefix increment
-	shared operator++(){
-		Policy::getInstance().before_local_write(get_id());
+	shared& operator++(){
+		bool local = begin_local_access(ACCESS_WRITE);
+		shipped_write w (write_op_t::INCREMENT);
+		if (!local && !Policy::getInstance().before_local_write(get_var_data(), &w))
+			return *this;
 		mutex_.lock();
 		T::operator++();
 		mutex_.unlock();
-		Policy::getInstance().after_local_write(get_id());
+		end_write(local);
 		return *this;
 	}
 
 	/// Postfix increment
-	shared operator++(int){
-		Policy::getInstance().before_local_write(get_id());
+	T operator++(int){
+		bool local = begin_local_access(ACCESS_WRITE);
+		if (!local) {
+			T previous (static_cast<T&>(*this));
+			shipped_write w (write_op_t::INCREMENT, nullptr, &previous);
+			if (!Policy::getInstance().before_local_write(get_var_data(), &w))
+				return previous;
+		}
 		mutex_.lock();
-		shared<T> ret = *this;
+		T ret (static_cast<T&>(*this));
 		T::operator++();
 		mutex_.unlock();
-		Policy::getInstance().after_local_write(get_id());
+		end_write(local);
 		return ret;
 	}
 
 	/// Assignment operator
 	shared& operator=(shared& other) {
 		if (this != (&other)){
-			Policy::getInstance().before_local_write(get_id());
+			bool local = begin_local_access(ACCESS_WRITE);
+			shipped_write w (write_op_t::ASSIGN, static_cast<T*>(&other));
+			if (!local && !Policy::getInstance().before_local_write(get_var_data(), &w))
+				return *this;
 			mutex_.lock();
 			other.mutex_.lock();
 			T::operator=(other);
 			other.mutex_.unlock();
 			mutex_.unlock();
-			Policy::getInstance().after_local_write(get_id());
+			end_write(local);
 		}
 		return *this;
 	}
 	
 	/// T assignment operator
 	shared& operator=(T other) {
-		Policy::getInstance().before_local_write(get_id());
+		bool local = begin_local_access(ACCESS_WRITE);
+		shipped_write w (write_op_t::ASSIGN, &other);
+		if (!local && !Policy::getInstance().before_local_write(get_var_data(), &w))
+			return *this;
 		mutex_.lock();
 		T::operator=(other);
 		mutex_.unlock();
-		Policy::getInstance().after_local_write(get_id());
+		end_write(local);
 		return *this;
 	}
 
+	/// Access to the members (not protected from values received meanwhile, unlike conversions to T)
 	T* operator->() {
 		// Refresh the value:
-		Policy::getInstance().before_local_read(get_id());
+		local_read();
 		return (T*) this;
 	}
 
 #if 0
 	shared& operator*() {
 		// Refresh the value:
-		Policy::getInstance().before_local_read(get_id());
+		local_read();
 		return *this;
 	}
 
@@ -152,8 +200,10 @@ public:
 
 	/// Conversion to T (e.g., conversion to int)
 	operator T() {
-		Policy::getInstance().before_local_read(get_id());
-		return (T) this;
+		bool local = begin_read();
+		T ret (static_cast<T&>(*this));
+		end_read(local);
+		return ret;
 	}
 
 	/**
@@ -189,6 +239,18 @@ public:
 		return sizeof(T);
 	}
 
+	/// Execute a write on behalf of another node (see shipped_write)
+	bool apply_write(write_op_t op, const void* operand, void* previous) {
+		std::unique_lock<std::mutex> lock (mutex_);
+		T* fill = (T*) previous;
+		*fill = *this;
+		if (op == write_op_t::ASSIGN) {
+			T::operator=(*((const T*) operand));
+			return true;
+		}
+		return increment(static_cast<T&>(*this), 0);
+	}
+
 	/**
 	 * @brief Get the value of the variable
 	 *
@@ -207,40 +269,127 @@ public:
 		}
 	}
 
+	/**
+	 * @brief Get the raw storage of the variable
+	 *
+	 * Only trivially copyable types can be transferred as raw bytes.
+	 */
+	void* value_buffer() {
+		return std::is_trivially_copyable<T>::value ? (void*) static_cast<T*>(this) : nullptr;
+	}
+
+	void lock_value() {
+		mutex_.lock();
+	}
+
+	void unlock_value() {
+		mutex_.unlock();
+	}
+
 	bool operator== (const T& oth) {
 		DEBUG("operator== called");
-		Policy::getInstance().before_local_read(get_id());
-		return T::operator==(oth);
+		bool local = begin_read();
+		bool ret = T::operator==(oth);
+		end_read(local);
+		return ret;
 	}
 
 	bool operator== (const shared& oth) {
 		DEBUG("operator== called");
-		Policy::getInstance().before_local_read(get_id());
 		T t = oth;
-		return T::operator==(t);
+		bool local = begin_read();
+		bool ret = T::operator==(t);
+		end_read(local);
+		return ret;
 	}
 
 	bool operator!= (const T& oth) {
 		DEBUG("operator!= called");
-		Policy::getInstance().before_local_read(get_id());
-		return T::operator!=(oth);
+		bool local = begin_read();
+		bool ret = T::operator!=(oth);
+		end_read(local);
+		return ret;
 	}
 
 	bool operator!= (const shared& oth) {
 		DEBUG("operator!= called");
-		Policy::getInstance().before_local_read(get_id());
 		T t = oth;
-		return T::operator!=(t);
+		bool local = begin_read();
+		bool ret = T::operator!=(t);
+		end_read(local);
+		return ret;
 	}
 
 	T operator% (T oth) {
 		DEBUG("operator% called");
-		Policy::getInstance().before_local_read(get_id());
-		return T::operator%(oth);
+		bool local = begin_read();
+		T ret = T::operator%(oth);
+		end_read(local);
+		return ret;
 	}
 
 
 private:
+	/**
+	 * @brief Refresh the value before a local read, unless the local value is valid
+	 *
+	 * The common case (see AbstractShared::readable()) is a single atomic load.
+	 * The read is not protected from values received meanwhile (see begin_read()).
+	 */
+	inline void local_read() {
+		if (!readable())
+			Policy::getInstance().before_local_read(get_var_data());
+	}
+
+	/**
+	 * @brief Start a read of the local value, refreshing it unless valid
+	 *
+	 * A value may span several words, while another node updates the copy (e.g., with the write-update
+	 * protocol): the read is published in the slot of the thread, as writes are (see begin_local_access()),
+	 * so that the policy waits for it before changing the value (see Policy::begin_remote_write()).
+	 * Threads without a slot read while holding mutex_, as the value is changed.
+	 * @return true if published; false if mutex_ is held (to be passed to end_read())
+	 */
+	inline bool begin_read() {
+		if (begin_local_access(ACCESS_READ))
+			return true;
+		Policy::getInstance().before_local_read(get_var_data());
+		if (begin_local_access(ACCESS_READ))
+			return true;
+		mutex_.lock();
+		return false;
+	}
+
+	/// End a read started by begin_read()
+	inline void end_read(bool local) {
+		if (local)
+			end_local_access();
+		else
+			mutex_.unlock();
+	}
+
+	/**
+	 * @brief End a write, either started without calling the policy or allowed by it
+	 * @param local true if started by begin_local_access(); false if the policy has been called
+	 */
+	inline void end_write(bool local) {
+		if (local)
+			end_local_access();
+		else
+			Policy::getInstance().after_local_write(get_var_data());
+	}
+
+	/// Prefix increment of a value, for types which have it (see apply_write())
+	template<class U>
+	static auto increment(U& value, int) -> decltype(++value, bool()) {
+		++value;
+		return true;
+	}
+
+	template<class U>
+	static bool increment(U&, long) {
+		return false;
+	}
 
 	/// Lock for mutual exclusion to access data
 	std::mutex mutex_;
@@ -269,15 +418,39 @@ public:
 		Policy::getInstance().at_variable_creation(this);
 	}
 
+	/// Constructor of a variable with the write-update protocol (see coherence_t)
+	shared(uint32_t s, write_update_t): AbstractShared(s, coherence_t::UPDATE), temp_object_(false) {
+		DEBUG("New variable " << get_id() << " created (write-update).");
+		Policy::getInstance().at_variable_creation(this);
+	}
+
+	/// Constructor of a variable with the write-update protocol (see coherence_t)
+	shared(uint32_t s, T init, write_update_t): AbstractShared(s, coherence_t::UPDATE), data_(init), temp_object_(false) {
+		DEBUG("New variable " << get_id() << " created (write-update).");
+		Policy::getInstance().at_variable_creation(this);
+	}
+
+	/// Constructor of a variable with release consistency (see coherence_t)
+	shared(uint32_t s, release_consistent_t): AbstractShared(s, coherence_t::RELEASE), temp_object_(false) {
+		DEBUG("New variable " << get_id() << " created (release consistency).");
+		Policy::getInstance().at_variable_creation(this);
+	}
+
+	/// Constructor of a variable with release consistency (see coherence_t)
+	shared(uint32_t s, T init, release_consistent_t): AbstractShared(s, coherence_t::RELEASE), data_(init), temp_object_(false) {
+		DEBUG("New variable " << get_id() << " created (release consistency).");
+		Policy::getInstance().at_variable_creation(this);
+	}
+
 	/// Copy constructor
-	shared(shared& other): AbstractShared(0), data_(other.data_), temp_object_(true) {
+	shared(shared& other): AbstractShared(other), data_(other.data_), temp_object_(true) {
 		// Inform the policy that a new variable has been created:
 		//P olicy::getInstance().at_variable_creation(this);
 		DEBUG("Temporary object created from variable " << other.get_id());
 	}
 
 	/// Const copy constructor
-	shared(const shared& other): AbstractShared(0), data_(other.data_), temp_object_(true) {
+	shared(const shared& other): AbstractShared(other), data_(other.data_), temp_object_(true) {
 		// Inform the policy that a new variable has been created:
 		// Policy::getInstance().at_variable_creation(this);
 		DEBUG("Temporary object created from variable " << other.get_id());
@@ -289,62 +462,87 @@ public:
 
 		if (!temp_object_) {
 			DEBUG("Destroying not temporary object");
-			std::unique_lock<std::mutex> lock (mutex_);
-			// Inform the policy that a new variable has been destroyed:
-			Policy::getInstance().at_variable_destruction(get_id(), (void*) &data_, sizeof(T));
+			// Inform the policy that a new variable has been destroyed
+			// (not holding mutex_: receiving threads take it after the lock of the policy,
+			// which protects the value from remote writes during the call):
+			Policy::getInstance().at_variable_destruction(this, (void*) &data_, sizeof(T));
 		} else {
 			DEBUG("Destroying temporary object");
 		}
 	}
 
+	/*
+	 * Writes of values not shared take neither the policy nor mutex_: no other node has a copy,
+	 * and other threads of this node write the value through atomic operations too (see fetch_increment()).
+	 * They are published in the slot of the thread (see AbstractShared::begin_local_access()),
+	 * so that the policy waits for them before reading the value or giving it away.
+	 * Writes of variables with the write-update protocol always go through the policy,
+	 * which may execute them on the node where the variable is pinned instead (see shipped_write).
+	 */
+
 	/// Prefix increment
-	shared operator++(){
-		Policy::getInstance().before_local_write(get_id());
-		mutex_.lock();
-		data_++;
-		mutex_.unlock();
-		Policy::getInstance().after_local_write(get_id());
+	shared& operator++(){
+		if (begin_atomic_access(ACCESS_WRITE)) {
+			fetch_increment();
+			end_local_access();
+		} else {
+			shipped_write w (write_op_t::INCREMENT);
+			if (Policy::getInstance().before_local_write(get_var_data(), &w)) {
+				mutex_.lock();
+				fetch_increment();
+				mutex_.unlock();
+				Policy::getInstance().after_local_write(get_var_data());
+			}
+		}
 		return *this;
 	}
 
 	/// Postfix increment
-	shared operator++(int){
-		Policy::getInstance().before_local_write(get_id());
-		mutex_.lock();
-		shared<T> ret = *this;
-		data_++;
-		mutex_.unlock();
-		Policy::getInstance().after_local_write(get_id());
+	T operator++(int){
+		T ret;
+		if (begin_atomic_access(ACCESS_WRITE)) {
+			ret = fetch_increment();
+			end_local_access();
+		} else {
+			ret = load();
+			shipped_write w (write_op_t::INCREMENT, nullptr, &ret);
+			if (Policy::getInstance().before_local_write(get_var_data(), &w)) {
+				mutex_.lock();
+				ret = fetch_increment();
+				mutex_.unlock();
+				Policy::getInstance().after_local_write(get_var_data());
+			}
+		}
 		return ret;
 	}
 
 	/// Assignment operator
 	shared& operator=(shared& other) {
-		if (this != (&other)){
-			Policy::getInstance().before_local_write(get_id());
-			mutex_.lock();
-			other.mutex_.lock();
-			data_ = other.data_;
-			other.mutex_.unlock();
-			mutex_.unlock();
-			Policy::getInstance().after_local_write(get_id());
-		}
+		if (this != (&other))
+			*this = (T) other;
 		return *this;
 	}
 
 	/// T assignment operator
 	shared& operator=(T other) {
 		DEBUG("Called operator=(T)");
-		Policy::getInstance().before_local_write(get_id());
-		mutex_.lock();
-		data_ = other;
-		mutex_.unlock();
-		Policy::getInstance().after_local_write(get_id());
+		if (begin_atomic_access(ACCESS_WRITE)) {
+			store(other);
+			end_local_access();
+		} else {
+			shipped_write w (write_op_t::ASSIGN, &other);
+			if (Policy::getInstance().before_local_write(get_var_data(), &w)) {
+				mutex_.lock();
+				store(other);
+				mutex_.unlock();
+				Policy::getInstance().after_local_write(get_var_data());
+			}
+		}
 		return *this;
 	}
 
 	T* operator->() {
-		Policy::getInstance().before_local_read(get_id());
+		local_read();
 		return (T*) &data_;
 	}
 
@@ -360,8 +558,10 @@ public:
 
 	/// Conversion to T (e.g., conversion to int)
 	operator T() {
-		Policy::getInstance().before_local_read(get_id());
-		return data_;
+		bool local = begin_read();
+		T ret = load();
+		end_read(local);
+		return ret;
 	}
 
 	/**
@@ -382,7 +582,7 @@ public:
 			return false;
 		} else {
 			std::unique_lock<std::mutex> lock (mutex_);
-			data_ = *((T*) new_value_buffer);
+			store(*((T*) new_value_buffer));
 
 			return true;
 		}
@@ -397,6 +597,18 @@ public:
 		return sizeof(T);
 	}
 
+	/// Execute a write on behalf of another node (see shipped_write)
+	bool apply_write(write_op_t op, const void* operand, void* previous) {
+		std::unique_lock<std::mutex> lock (mutex_);
+		if (op == write_op_t::INCREMENT) {
+			*((T*) previous) = fetch_increment();
+		} else {
+			*((T*) previous) = load();
+			store(*((const T*) operand));
+		}
+		return true;
+	}
+
 	/**
 	 * @brief Get the value of the variable
 	 *
@@ -410,45 +622,152 @@ public:
 		} else {
 			std::unique_lock<std::mutex> lock (mutex_);
 			T* fill = (T*) current_value_buffer;
-			*fill = data_;
+			*fill = load();
 			return true;
 		}
 	}
 
+	/// Get the raw storage of the variable
+	void* value_buffer() {
+		return (void*) &data_;
+	}
+
+	void lock_value() {
+		mutex_.lock();
+	}
+
+	void unlock_value() {
+		mutex_.unlock();
+	}
+
 	bool operator== (const T& oth) {
 		DEBUG("operator== called");
-		Policy::getInstance().before_local_read(get_id());
-		return (data_==oth);
+		return ((T) *this == oth);
 	}
 
 	bool operator== (const shared& oth) {
 		DEBUG("operator== called");
-		Policy::getInstance().before_local_read(get_id());
-		return (data_==oth.data_);
+		return ((T) *this == oth.load());
 	}
 
 	bool operator!= (const T& oth) {
 		DEBUG("operator!= called");
-		Policy::getInstance().before_local_read(get_id());
-		return (data_!=oth);
+		return ((T) *this != oth);
 	}
 
 	bool operator!= (const shared& oth) {
 		DEBUG("operator!= called");
-		Policy::getInstance().before_local_read(get_id());
-		return (data_!=oth.data_);
+		return ((T) *this != oth.load());
 	}
 
 	T operator% (int oth) {
 		DEBUG("operator% called");
-		Policy::getInstance().before_local_read(get_id());
-		return data_%oth;
+		return (T) *this % oth;
 	}
 
 
 private:
+	/**
+	 * @brief Refresh the value before a local read, unless the local value is valid
+	 *
+	 * The common case (see AbstractShared::readable()) is a single atomic load.
+	 * The read is not protected from values received meanwhile (see begin_read()).
+	 */
+	inline void local_read() {
+		if (!readable())
+			Policy::getInstance().before_local_read(get_var_data());
+	}
+
+	/**
+	 * @brief Start a read of the local value, refreshing it unless valid
+	 *
+	 * As for user-defined types, the read is published in the slot of the thread, so that the policy waits
+	 * for it before changing the value (see Policy::begin_remote_write()); otherwise, mutex_ is held.
+	 * @return true if published; false if mutex_ is held (to be passed to end_read())
+	 */
+	inline bool begin_read() {
+		if (begin_atomic_access(ACCESS_READ))
+			return true;
+		Policy::getInstance().before_local_read(get_var_data());
+		if (begin_atomic_access(ACCESS_READ))
+			return true;
+		mutex_.lock();
+		return false;
+	}
+
+	/// End a read started by begin_read()
+	inline void end_read(bool local) {
+		if (local)
+			end_local_access();
+		else
+			mutex_.unlock();
+	}
+
+	/**
+	 * Values up to a word are accessed through atomic operations, since threads accessing them
+	 * without calling the policy don't take mutex_. Larger values (e.g., long double) would need
+	 * libatomic: they are always accessed through the policy, holding mutex_.
+	 */
+	typedef std::integral_constant<bool, (sizeof(T) <= sizeof(long))> lock_free;
+
+	/// Start an access without calling the policy, if allowed for the type (see lock_free) and the state
+	inline bool begin_atomic_access(int access) const {
+		return lock_free::value && begin_local_access(access);
+	}
+
+	inline T load() const {
+		return load(lock_free());
+	}
+
+	inline T load(std::true_type) const {
+		T value;
+		__atomic_load(&data_, &value, __ATOMIC_ACQUIRE);
+		return value;
+	}
+
+	inline T load(std::false_type) const {
+		return data_;
+	}
+
+	inline void store(T value) {
+		store(value, lock_free());
+	}
+
+	inline void store(T value, std::true_type) {
+		__atomic_store(&data_, &value, __ATOMIC_RELEASE);
+	}
+
+	inline void store(T value, std::false_type) {
+		data_ = value;
+	}
+
+	/// Increment the value, so that increments of concurrent threads are never lost; it returns the previous value
+	inline T fetch_increment() {
+		return fetch_increment(lock_free(), std::integral_constant<bool, std::is_integral<T>::value && !std::is_same<T, bool>::value>());
+	}
+
+	/// Increment of integers
+	inline T fetch_increment(std::true_type, std::true_type) {
+		return __atomic_fetch_add(&data_, 1, __ATOMIC_ACQ_REL);
+	}
+
+	/// Increment of other types (e.g., floating point, pointers)
+	inline T fetch_increment(std::true_type, std::false_type) {
+		T previous = load();
+		T next;
+		do {
+			next = previous;
+			next++;
+		} while (!__atomic_compare_exchange(&data_, &previous, &next, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+		return previous;
+	}
+
+	template<class U>
+	inline T fetch_increment(std::false_type, U) {
+		return data_++;
+	}
 
-	/// Actual data
+	/// Actual data, in the cache line of the accesses allowed (see AbstractShared)
 	T data_;
 
 	/// Lock for mutual exclusion to access data
@@ -0,0 +1,73 @@
+#ifndef SHM_RING_HPP_
+#define SHM_RING_HPP_
+
+#include <atomic>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <sys/uio.h>	// struct iovec
+
+/// Size of the data area of each ring (must be a power of 2)
+const std::uint32_t SHM_RING_SIZE = 4 * 1024 * 1024;
+
+/**
+ * @brief Lock-free single-producer single-consumer ring in shared memory
+ *
+ * The ring connects two processes running on the same host: the consumer creates
+ * the mapping in /dev/shm (see create()), and the producer maps it afterwards (see open()).
+ * Once the producer has mapped it, the file is removed from /dev/shm (see connected()).
+ * Records are written contiguously in the ring, each one preceded by its length,
+ * and read in place by the consumer (i.e., without copying them out of the ring).
+ * A consumer finding the ring empty spins for a while and then sleeps on a futex,
+ * which is woken up by the producer only when the consumer is actually sleeping.
+ * Producer and consumer must be serialized by the user (i.e., one thread at a time on each side).
+ */
+class ShmRing {
+public:
+	static ShmRing* create(const std::string& name);
+	static ShmRing* open(const std::string& name);
+	~ShmRing();
+
+	bool connected();
+	bool write(const struct iovec* iov, int iovcnt);
+	char* peek(std::size_t* size, bool block);
+	void consume();
+
+private:
+	/// Control data at the beginning of the mapping
+	struct header {
+		/// Producer position (futex word the consumer sleeps on)
+		alignas(64) std::atomic<std::uint32_t> tail;
+
+		/// Set while the consumer is sleeping (or going to sleep)
+		std::atomic<std::uint32_t> consumer_waiting;
+
+		/// Consumer position
+		alignas(64) std::atomic<std::uint32_t> head;
+
+		/// Process id of the consumer, set once the ring has been initialized
+		alignas(64) std::atomic<std::uint32_t> owner;
+
+		/// Set by the producer once it has mapped the ring
+		std::atomic<std::uint32_t> attached;
+	};
+
+	ShmRing(const std::string& name, int fd, bool owner);
+
+	/// Name of the file in /dev/shm
+	std::string name_;
+
+	/// true for the consumer, until the file has been unlinked
+	bool owner_;
+
+	/// Mapping of the file
+	void* mapping_;
+
+	header* header_;
+	char* data_;
+
+	/// Length of the record returned by the latest peek()
+	std::uint32_t peeked_;
+};
+
+#endif // SHM_RING_HPP_
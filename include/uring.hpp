@@ -0,0 +1,155 @@
+#ifndef URING_HPP_
+#define URING_HPP_
+
+#include <mutex>
+#include <vector>
+#include <cstddef>
+#include <sys/socket.h>
+#include <netinet/in.h>	// struct sockaddr_in
+#include <linux/io_uring.h>
+
+/// Number of buffers provided to the kernel for multishot receives
+const unsigned int URING_RECV_BUFFERS = 64;
+
+/// Size of each buffer provided to the kernel for multishot receives
+const unsigned int URING_BUFFER_SIZE = 65536;
+
+/**
+ * @brief Minimal io_uring instance
+ *
+ * Thin wrapper around the raw io_uring system calls, so that the library doesn't
+ * depend on liburing.
+ * The class is not thread-safe: accesses must be serialized by the user.
+ */
+class Uring {
+public:
+	explicit Uring(unsigned int entries);
+	~Uring();
+
+	struct io_uring_sqe* get_sqe();
+	int submit(unsigned int wait_nr);
+	struct io_uring_cqe* peek_cqe();
+	void cqe_seen();
+
+	/// File descriptor of the instance
+	int fd() const {
+		return fd_;
+	}
+
+private:
+	int fd_;
+
+	void* sq_ptr_;
+	std::size_t sq_size_;
+	void* cq_ptr_;
+	std::size_t cq_size_;
+	struct io_uring_sqe* sqes_;
+	std::size_t sqes_size_;
+
+	unsigned* sq_head_;
+	unsigned* sq_tail_;
+	unsigned* sq_array_;
+	unsigned sq_mask_;
+	unsigned sq_entries_;
+
+	/// Tail of the submission queue, including entries not yet submitted
+	unsigned sqe_tail_;
+
+	unsigned* cq_head_;
+	unsigned* cq_tail_;
+	unsigned cq_mask_;
+	struct io_uring_cqe* cqes_;
+};
+
+/**
+ * @brief Datagram received through UringTransport
+ *
+ * The datagram lies in a buffer provided to the kernel, which must be given back
+ * through UringTransport::release_datagrams() once handled.
+ */
+struct received_datagram {
+	/// Id of the sender node (set by CommunicationHandler::wait_datagrams() from source)
+	int node;
+	/// Receive channel (see UringTransport::start_receiving())
+	int channel;
+	/// Source address
+	struct sockaddr_in source;
+	/// Content of the datagram
+	char* data;
+	/// Length of the datagram
+	std::size_t size;
+	/// Id of the provided buffer
+	unsigned short buffer;
+};
+
+/**
+ * @brief io_uring backend for the network communications of CommunicationHandler
+ *
+ * Sends and receives use two separate io_uring instances:
+ * <ul>
+ * <li> Sends of any number of datagrams, possibly to different nodes, are queued and then
+ * submitted all together through a single system call (see queue_send() and submit_sends()).
+ * The send ring is protected by a mutex, since sends can be issued by any thread.
+ * <li> Every receive channel has a multishot receive always posted, which puts the incoming datagrams,
+ * preceded by their source address, into a group of buffers provided to the kernel (IORING_OP_PROVIDE_BUFFERS). The receive ring
+ * is used by a single thread, which collects the datagrams through wait_datagrams().
+ * </ul>
+ */
+class UringTransport {
+public:
+	explicit UringTransport(unsigned int spin_poll_us);
+	~UringTransport();
+
+	/// Get exclusive access to the send ring
+	void lock_send() {
+		send_mutex_.lock();
+	}
+
+	/// Release exclusive access to the send ring
+	void unlock_send() {
+		send_mutex_.unlock();
+	}
+
+	bool queue_send(int fd, struct msghdr* msg);
+	bool submit_sends();
+
+	void start_receiving(int channel, int fd);
+	int wait_datagrams(received_datagram* datagrams, int max_datagrams);
+	void release_datagrams(const received_datagram* datagrams, int n);
+
+private:
+	bool probe_multishot();
+	void post_receive(unsigned int index);
+	void provide_buffers(unsigned short id, unsigned int count);
+
+	/// Ring for sending datagrams (protected by send_mutex_)
+	Uring send_ring_;
+	std::mutex send_mutex_;
+
+	/// Sends queued since the latest submit_sends()
+	unsigned int queued_sends_;
+
+	/// Result of the sends completed since the latest submit_sends()
+	bool send_error_;
+
+	/// Ring for receiving datagrams
+	Uring recv_ring_;
+
+	/// Memory of the buffers provided to the kernel
+	char* buffers_;
+
+	/// Message header of the multishot receives (it only tells the room for the source address)
+	struct msghdr recv_msg_;
+
+	/// Id and socket of each receive channel (the index is the tag of the completions)
+	std::vector<int> channels_;
+	std::vector<int> recv_fds_;
+
+	/// Receive channels whose multishot receive has terminated and must be posted again
+	std::vector<bool> rearm_;
+
+	/// Time wait_datagrams() polls the completions before sleeping (see Config::spin_poll_us)
+	unsigned int spin_poll_us_;
+};
+
+#endif // URING_HPP_
@@ -0,0 +1,183 @@
+#ifndef VAR_DATA_HPP_
+#define VAR_DATA_HPP_
+
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+
+#include "node_set.hpp"
+
+class AbstractShared;
+struct shipped_write;
+
+/**
+ * @brief Possible states of a shared variable.
+ */
+enum class var_state {
+	OWNER_NO_SHARED = 1,		//< We are owner of data; value not (yet) shared.
+	OWNER_SHARED = 2,		//< We are owner of data; value already shared.
+	REMOTE_OWNER_CACHED = 3,	//< We are not owner of data; we have a valid cached value
+	REMOTE_OWNER_NO_CACHED = 4,	//< We are not owner of data; we have not a valid cached value.
+};
+
+/**
+ * @brief Policy data associated to a shared variable.
+ *
+ * The variable points to it (see AbstractShared::get_var_data()), so that it is reached without
+ * lookups, while it stays out of the cache lines of the value. It is taken from a pool when the
+ * variable is registered (see Policy::at_variable_creation()), and the data needed only by some
+ * variables (values in transit and copies of values) when first needed (see Policy::cold_data_of()).
+ * Temporary copies of variables are unknown to the policy: they share one whose variable_ stays nullptr.
+ */
+struct var_data {
+	/**
+	 * @brief Semaphore for blocking waiting a certain amount of events.
+	 *
+	 * Implemented since C++11 does not provide semaphores.
+	 */
+	struct semaphore {
+		std::atomic_ulong counter_;		//< Counter. When reaches 0 wait_condition_ is notified.
+		std::condition_variable wait_condition_;
+	};
+
+	/**
+	 * @brief Value being received in fragments (see MSG_VALUE_FRAGMENT)
+	 *
+	 * Fragments are put directly into the variable, if its value can be transferred as raw bytes
+	 * and it can't be read meanwhile (i.e., its copy is not valid); otherwise, they are put
+	 * into a staging buffer and the value is set once complete.
+	 */
+	struct incoming_value {
+		incoming_value(): node(-1), transfer(0), received(0), unacked(0), scattered(false) {}
+
+		/// Sender node (-1 if none)
+		int node;
+		/// Id of the transfer
+		uint32_t transfer;
+		/// Fragments already received
+		std::vector<bool> arrived;
+		/// Number of fragments received without gaps from the beginning
+		uint32_t received;
+		/// Fragments received since the latest acknowledgment
+		uint32_t unacked;
+		/// Some fragments have been put directly into the variable
+		bool scattered;
+		/// Staging buffer (empty if fragments are put directly into the variable, which is not the case for encoded values)
+		std::vector<char> staging;
+	};
+
+	/**
+	 * @brief Copy of a value last sent to a node as a delta (see MSG_FLAG_DELTA)
+	 */
+	struct twin {
+		twin(): version(0) {}
+		/// Version of the copy (0 if none)
+		uint64_t version;
+		/// Content of the copy
+		std::vector<char> data;
+	};
+
+	/**
+	 * @brief Policy data needed only by some variables
+	 *
+	 * Its members are reset when taken from the pool (see Policy::cold_data_of()).
+	 */
+	struct cold_data {
+		/// Values being received in fragments from each node
+		std::map<int, incoming_value> incoming_;
+
+		/// Copies last sent to each node as a delta
+		std::map<int, twin> twins_;
+
+		/// Value before the first write since the latest barrier (meaningful only if dirty_)
+		std::vector<char> release_twin_;
+
+		/// Ranges written by other nodes, to be applied at the next barrier (see MSG_FLAG_RELEASE)
+		std::vector<char> released_writes_;
+	};
+
+	var_data(): variable_(nullptr) {
+		policy_data_.dirty_ = false;
+		policy_data_.cold_ = nullptr;
+	}
+
+	/// Pointer to the actual shared<> variable (nullptr until registered)
+	AbstractShared* variable_;
+
+	struct {
+		/// State of the shared<> variable
+		var_state state_;
+
+		/// Condition variable to wait when waiting for value refresh
+		std::condition_variable wait_value_updated_;
+
+		/// Remote owner (meaningful only if this node isn't the owner; it may be stale, see MSG_SET_NEW_OWNER)
+		unsigned long int remote_owner_;
+
+		/// Node to grant the ownership to once obtained and written (-1 if none, see MSG_FORWARD_OWNERSHIP)
+		int forward_to_;
+
+		/// The variable is being written (between before_local_write() and after_local_write())
+		bool writing_;
+
+		/// A write shipped by another node is being executed: the variable can't be destroyed until it ends
+		bool executing_;
+
+		/// Nodes which may hold a copy (meaningful only if this node is the owner)
+		node_set sharers_;
+
+		/// Nodes which asked the value while it was being written: answered by after_local_write()
+		node_set deferred_readers_;
+
+		/// Lock for mutual exclusion to access data
+		std::mutex mutex_;
+
+		/// Condition variable to wait variable refresh when reading and value is not cached
+		std::condition_variable waiting_ownership_grant_;
+
+		/// Semaphore to wait all nodes to invalidate their own copies
+		semaphore waiting_invalidate_copies_;
+
+		/// Number of MSG_INVALIDATE_COPY received (see before_local_read())
+		unsigned int invalidations_;
+
+		/// Version of the value held, as received in a delta (0 if unknown)
+		uint64_t version_;
+
+		/// Written since the latest barrier (only for release-consistent variables)
+		bool dirty_;
+
+		/// Data needed only by some variables (nullptr until needed)
+		cold_data* cold_;
+
+		/// The home node keeps the ownership (see MSG_PINNED): other nodes ship their writes to it
+		bool pinned_;
+
+		/// Write being shipped by this node, until MSG_WRITE_DONE (nullptr if none)
+		const shipped_write* shipping_;
+
+		/// Condition variable to wait for MSG_WRITE_DONE, or for the end of the write of another thread (see writing_)
+		std::condition_variable write_done_;
+
+		/// Start of the current window of the ping-pong detection (only on the home node)
+		std::chrono::steady_clock::time_point window_start_;
+
+		/// Migrations of the ownership (or, if pinned, writes) in the current window (only on the home node)
+		unsigned int window_count_;
+
+		/// Node which wrote in the current window, if pinned (-1 if none, -2 if several)
+		int window_writer_;
+
+		/// Times the variable has been pinned (only on the home node)
+		unsigned int pins_;
+
+		/// Writes shipped to the home node (on the home node: writes of other nodes executed)
+		uint64_t shipped_writes_;
+	} policy_data_;
+};
+
+#endif // VAR_DATA_HPP_
@@ -0,0 +1,129 @@
+#include <atomic>
+#include <mutex>
+#include <thread>	// std::this_thread::yield()
+#include <unistd.h>	// syscall()
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+
+#include "abstract_shared.hpp"
+#include "logger.hpp"
+
+/// Maximum number of threads accessing variables without calling the policy (the others always call it)
+const int MAX_ACCESS_SLOTS = 256;
+
+/// Slot where a thread publishes the variable it is accessing (on its own cache line)
+struct access_slot {
+	access_slot(): var(nullptr), used(false) {}
+	std::atomic<const AbstractShared*> var;
+	std::atomic<bool> used;
+	char padding [64 - sizeof(std::atomic<const AbstractShared*>) - sizeof(std::atomic<bool>)];
+};
+
+static access_slot access_slots [MAX_ACCESS_SLOTS];
+
+/// Number of slots ever claimed (the ones scanned by AbstractShared::set_access())
+static std::atomic<int> access_slots_used (0);
+
+__thread std::atomic<const AbstractShared*>* pbsm_access_slot = nullptr;
+
+/// Set for threads which found no free slot
+static __thread bool no_access_slot = false;
+
+/// Owner of the slot of a thread, which frees it when the thread exits
+struct slot_owner {
+	slot_owner(): slot(nullptr) {
+		for (int i = 0; i < MAX_ACCESS_SLOTS; ++i) {
+			bool used = false;
+			if (!access_slots[i].used.load(std::memory_order_relaxed) &&
+			    access_slots[i].used.compare_exchange_strong(used, true)) {
+				int n = access_slots_used.load();
+				while ((n <= i) && !access_slots_used.compare_exchange_weak(n, i + 1))
+					;
+				slot = &access_slots[i];
+				return;
+			}
+		}
+		WARNING("More than " << MAX_ACCESS_SLOTS << " threads accessing shared variables: all accesses call the policy");
+	}
+
+	~slot_owner() {
+		pbsm_access_slot = nullptr;
+		if (slot != nullptr)
+			slot->used.store(false, std::memory_order_release);
+	}
+
+	access_slot* slot;
+};
+
+std::atomic<const AbstractShared*>* AbstractShared::claim_access_slot()
+{
+	if (no_access_slot)
+		return nullptr;
+	static thread_local slot_owner owner;
+	if (owner.slot == nullptr) {
+		no_access_slot = true;
+		return nullptr;
+	}
+	pbsm_access_slot = &owner.slot->var;
+	return pbsm_access_slot;
+}
+
+var_data* AbstractShared::unregistered()
+{
+	// Never registered: its variable_ stays nullptr
+	static var_data data;
+	return &data;
+}
+
+/**
+ * @brief Command of membarrier() making the stores of the threads of the process visible
+ *
+ * The private expedited one (Linux 4.14) is registered at the first call. The global one is not used
+ * instead, since it waits for a scheduling of all CPUs of the system at every revocation of accesses.
+ * @return Command; -1 if not supported (then, accesses without calling the policy are disabled)
+ */
+static int membarrier_command()
+{
+	static std::once_flag once;
+	static int command = -1;
+	std::call_once(once, []() {
+		int supported = syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0);
+		if (supported < 0)
+			supported = 0;
+		if ((supported & MEMBARRIER_CMD_PRIVATE_EXPEDITED) &&
+		    (syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0))
+			command = MEMBARRIER_CMD_PRIVATE_EXPEDITED;
+		else
+			WARNING("Expedited membarrier() not supported (Linux 4.14 or later): local accesses disabled, all accesses call the policy");
+	});
+	return command;
+}
+
+/**
+ * @brief Set the accesses allowed without calling the policy
+ *
+ * Granting accesses takes a single store. Revoking some of them waits for the accesses
+ * in progress (see begin_local_access()): membarrier() makes the slot stored by each thread
+ * before loading the accesses visible, so that a thread not found in the slots loads the new accesses.
+ * If no thread has accessed the variable since the last revocation (see accessed_), none can be
+ * accessing it: the fence taken by the first access orders its load of the accesses with the
+ * exchange below, so that the access either is seen here or finds the new accesses.
+ * Without expedited membarrier(), no access is ever allowed.
+ * @param access Bitmask of access_t
+ */
+void AbstractShared::set_access(int access)
+{
+	if (membarrier_command() < 0)
+		access = ACCESS_NONE;
+	int previous = access_.exchange(access);
+	if (((previous & ~access) == 0) || !accessed_.load())
+		return;
+	// Cleared before membarrier(), so that threads see it again only after a fence
+	accessed_.store(false, std::memory_order_relaxed);
+	if (syscall(__NR_membarrier, membarrier_command(), 0) != 0)
+		ERROR("membarrier()");
+	int used = access_slots_used.load();
+	for (int i = 0; i < used; ++i)
+		while (access_slots[i].var.load(std::memory_order_acquire) == this)
+			std::this_thread::yield();
+}
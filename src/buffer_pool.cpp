@@ -0,0 +1,91 @@
+#include "buffer_pool.hpp"
+
+std::atomic<BufferPool*> BufferPool::m_ (nullptr);
+std::mutex BufferPool::mutex_;
+
+BufferPool& BufferPool::getInstance()
+{
+	// Double-checked locking pattern for performance issues
+	BufferPool* p = m_.load(std::memory_order_acquire);
+	if (p == nullptr) {
+		std::unique_lock<std::mutex> lock (mutex_);
+		p = m_.load(std::memory_order_relaxed);
+		if (p == nullptr) {
+			p = new BufferPool();
+			m_.store(p, std::memory_order_release);
+		}
+	}
+	return *p;
+}
+
+/// Smallest size class whose buffers all have room for a given size
+static unsigned int class_of_size(std::size_t size)
+{
+	unsigned int c = POOL_MIN_CLASS;
+	while ((c < 8 * sizeof(std::size_t) - 1) && (((std::size_t) 1 << c) < size))
+		c++;
+	return c;
+}
+
+/// Biggest size class whose buffers all have room for a given capacity (not 0)
+static unsigned int class_of_capacity(std::size_t capacity)
+{
+	return 8 * sizeof(unsigned long) - 1 - __builtin_clzl(capacity);
+}
+
+/// Number of buffers kept for a size class
+static std::size_t class_limit(unsigned int c)
+{
+	std::size_t limit = POOL_CLASS_BYTES >> c;
+	if (limit > POOL_CLASS_BUFFERS)
+		return POOL_CLASS_BUFFERS;
+	return (limit < 2) ? 2 : limit;
+}
+
+BufferPool::BufferPool(): allocations_(0), reuses_(0)
+{
+	// Releasing buffers never allocates
+	for (unsigned int c = POOL_MIN_CLASS; c <= POOL_MAX_CLASS; ++c)
+		classes_[c].buffers.reserve(class_limit(c));
+}
+
+void BufferPool::acquire(std::vector<char>& buffer, std::size_t size)
+{
+	if (buffer.capacity() < size) {
+		release(buffer);
+		unsigned int c = class_of_size(size);
+		if (c <= POOL_MAX_CLASS) {
+			size_class& sc = classes_[c];
+			std::unique_lock<std::mutex> lock (sc.mutex);
+			if (!sc.buffers.empty()) {
+				buffer.swap(sc.buffers.back());
+				sc.buffers.pop_back();
+			}
+		}
+		if (buffer.capacity() < size) {
+			allocations_.fetch_add(1, std::memory_order_relaxed);
+			buffer.reserve((c <= POOL_MAX_CLASS) ? ((std::size_t) 1 << c) : size);
+		} else {
+			reuses_.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+	buffer.resize(size);
+}
+
+void BufferPool::release(std::vector<char>& buffer)
+{
+	buffer.clear();
+	if (buffer.capacity() >= ((std::size_t) 1 << POOL_MIN_CLASS)) {
+		unsigned int c = class_of_capacity(buffer.capacity());
+		if (c <= POOL_MAX_CLASS) {
+			size_class& sc = classes_[c];
+			std::unique_lock<std::mutex> lock (sc.mutex);
+			if (sc.buffers.size() < class_limit(c)) {
+				sc.buffers.emplace_back();
+				sc.buffers.back().swap(buffer);
+				return;
+			}
+		}
+	}
+	std::vector<char>().swap(buffer);
+}
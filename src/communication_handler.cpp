@@ -1,31 +1,115 @@
 #include <stdexcept>
 #include <fstream>
+#include <sstream>
 #include <iostream>
 #include <thread>	// std::this_thread::get_id()
+#include <cerrno>
+#include <cmath>	// std::fabs()
+#include <random>
+#include <algorithm>
+#include <cstdlib>	// posix_memalign()
+#include <new>
+#include <ifaddrs.h>	// getifaddrs()
+#include <poll.h>	// poll()
 
 #include "communication_handler.hpp"
 #include "logger.hpp"
 
+/**
+ * @brief Check if an IP address belongs to the current host
+ * @param ip IP address
+ * @return true if the address is a loopback address or the address of a local interface
+ */
+static bool is_local_address(const std::string& ip)
+{
+	struct in_addr addr;
+	if (inet_aton(ip.c_str(), &addr) == 0)
+		return false;
+	if ((ntohl(addr.s_addr) >> 24) == 127)
+		return true;
+
+	bool ret = false;
+	struct ifaddrs* interfaces;
+	if (getifaddrs(&interfaces) < 0) {
+		ERROR("getifaddrs()");
+		return false;
+	}
+	for (struct ifaddrs* i = interfaces; i != nullptr; i = i->ifa_next) {
+		if ((i->ifa_addr != nullptr) && (i->ifa_addr->sa_family == AF_INET) &&
+		    (((struct sockaddr_in*) i->ifa_addr)->sin_addr.s_addr == addr.s_addr)) {
+			ret = true;
+			break;
+		}
+	}
+	freeifaddrs(interfaces);
+	return ret;
+}
+
+/// Name of the file in /dev/shm of the ring from node "from" to node "to"
+static std::string ring_name(int from, int to)
+{
+	return "pbsm-" + std::to_string(from) + "-" + std::to_string(to);
+}
+
+/// Total length of the buffers of a datagram
+static std::size_t datagram_length(const struct msghdr& msg)
+{
+	std::size_t len = 0;
+	for (std::size_t i = 0; i < msg.msg_iovlen; ++i)
+		len += msg.msg_iov[i].iov_len;
+	return len;
+}
+
+/**
+ * @brief Send a set of datagrams through sendmmsg(), until all of them have been sent
+ * @param fd Socket
+ * @param headers Headers of the datagrams
+ * @param count Number of datagrams
+ * @return true in case of success; false in case of error
+ */
+static bool send_all(int fd, struct mmsghdr* headers, unsigned int count)
+{
+	unsigned int sent = 0;
+	while (sent < count) {
+		int n = sendmmsg(fd, &headers[sent], count - sent, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		sent += n;
+	}
+	return true;
+}
+
 // Initialization of static attributes:
-CommunicationHandler* CommunicationHandler::m_ = nullptr;
+std::atomic<CommunicationHandler*> CommunicationHandler::m_ (nullptr);
 std::mutex CommunicationHandler::mutex_;
 
 /**
  * @brief Constructor
  *
- * This constructor is in charge of filling the connections_ data structure that contains
- * information about the peer-to-peer UDP connections to be open by create_connections().
+ * This constructor is in charge of filling the addresses_ data structure that contains
+ * the address of every node, used by create_connections() and by the sends.
  *
  * Information about nodes IP addresses is stored in file /etc/pbsm/hosts.conf.
- * This file contains a list of IP addresses. The file must be the same on all hosts.
+ * This file contains a list of IP addresses, one per line. The file must be the same on all hosts.
+ * Lines with the form "key = value" set options of the run-time (see Config), while
+ * anything following a '#' is a comment.
+ * The tables are sized on the number of nodes (twice, with Config::bulk_lane), and no state is allocated
+ * yet for any node (see get_connection()).
  *
  * Note that object construction does not automatically open the connections.
  * These are open only when create_connections() is explicitly invoked.
 
  */
-CommunicationHandler::CommunicationHandler(): number_of_nodes_(0)
+CommunicationHandler::CommunicationHandler(): multicast_recv_fd_(-1), multicast_send_fd_(-1), bulk_fd_(-1), number_of_nodes_(0), flusher_(nullptr),
+	epoll_fd_(-1), uring_(nullptr), multicast_(false), reliable_(false), gso_(false), spin_poll_us_(0),
+	retransmitter_(nullptr)
 {
 	DEBUG("Creating CommunicationHandler...");
+	startup_ = startup_stats();
+	startup_.last_node = -1;
 
 	std::ifstream config_file ("/etc/pbsm/hosts.conf", std::ios::in);
 	if (!config_file.is_open())
@@ -33,13 +117,30 @@ CommunicationHandler::CommunicationHandler(): number_of_nodes_(0)
 		ERROR("Can't open config file /etc/pbsm/hosts.conf");
 		throw std::runtime_error ("Config file missing");
 	} else {
-		for (int i = 0; ; ++i) {
-			config_file >> connections_[i].ip;
-			if (config_file.eof())
-				break;
-			DEBUG("Node " << i << " is " << connections_[i].ip);
-			connections_[i].recv_port = network_port_offset + i;
-			connections_[i].send_port = network_port_offset + pbsm_tid;
+		std::string line;
+		while (std::getline(config_file, line)) {
+			line = line.substr(0, line.find('#'));
+			std::size_t separator = line.find('=');
+			if (separator != std::string::npos) {
+				std::string key, value;
+				std::istringstream (line.substr(0, separator)) >> key;
+				std::istringstream (line.substr(separator + 1)) >> value;
+				Config::getInstance().set(key, value);
+				continue;
+			}
+			node_address a;
+			if (!(std::istringstream (line) >> a.ip))
+				continue;
+			DEBUG("Node " << number_of_nodes_ << " is " << a.ip);
+			memset(&a.addr, 0, sizeof(a.addr));
+			a.addr.sin_family = AF_INET;
+			a.addr.sin_port = htons(network_port_offset + number_of_nodes_);
+			if (inet_aton(a.ip.c_str(), &a.addr.sin_addr) == 0) {
+				ERROR("Wrong address " << a.ip << " in config file");
+				throw std::runtime_error ("Config file error");
+			}
+			a.local = false;
+			addresses_.push_back(a);
 			number_of_nodes_++;
 			if (number_of_nodes_ == MAX_NUMBER_OF_NODES) {
 				WARNING("Maximum number of nodes in config file reached");
@@ -48,7 +149,27 @@ CommunicationHandler::CommunicationHandler(): number_of_nodes_(0)
 		}
 	}
 
-	// Data structure connections_ is now ready.
+	// Entry for the multicast group (see start_multicast())
+	addresses_.emplace_back();
+	addresses_.back().local = false;
+
+	// Entries for the bulk lanes, on the ports following the ones of all nodes
+	if (Config::getInstance().bulk_lane) {
+		if (network_port_offset + 2 * number_of_nodes_ > 65535) {
+			ERROR("Too many nodes for bulk lanes");
+			throw std::runtime_error ("Config file error");
+		}
+		for (int i = 0; i < number_of_nodes_; ++i){
+			node_address a = addresses_[i];
+			a.addr.sin_port = htons(network_port_offset + number_of_nodes_ + i);
+			addresses_.push_back(a);
+		}
+	}
+	connections_.reset(new std::atomic<connection*> [addresses_.size()]);
+	for (std::size_t i = 0; i < addresses_.size(); ++i)
+		connections_[i].store(nullptr, std::memory_order_relaxed);
+
+	// Data structure addresses_ is now ready.
 	// Connections will be open when create_connections() will be explicitly invoked.
 }
 
@@ -58,120 +179,1852 @@ CommunicationHandler::~CommunicationHandler()
 {
 	DEBUG("Destroying CommunicationHandler...");
 	std::unique_lock<std::mutex> lock (mutex_);
-	for (int i = 0; i < number_of_nodes_; ++i){
-		close(connections_[i].recv_fd);
-		close(connections_[i].send_fd);
+	for (std::size_t i = 0; i < addresses_.size(); ++i){
+		connection* c = connections_[i].load();
+		if (c == nullptr)
+			continue;
+		delete c->recv_ring;
+		delete c->send_ring;
+		c->~connection();
+		free(c);
+	}
+	for (int fd: sockets_)
+		close(fd);
+	if (bulk_fd_ >= 0)
+		close(bulk_fd_);
+	if (multicast_) {
+		close(multicast_recv_fd_);
+		close(multicast_send_fd_);
 	}
-	delete m_;
+	if (epoll_fd_ >= 0)
+		close(epoll_fd_);
+	delete uring_;
+	delete m_.load();
 	DEBUG("CommunicationHandler destroyed");
 }
 
+/**
+ * @brief Method to allocate the state of the communications with a node
+ *
+ * The state is aligned to a cache line (operator new does not honor alignas() before C++17),
+ * and published through a compare-and-swap: if another thread allocates it at the same time,
+ * the state of such thread is kept.
+ * @param node Id of the node (or MULTICAST_CHANNEL, or the bulk lane of a node)
+ * @return State of the communications with the node
+ */
+CommunicationHandler::connection& CommunicationHandler::create_connection(int node)
+{
+	void* memory;
+	if (posix_memalign(&memory, alignof(connection), sizeof(connection)) != 0)
+		throw std::bad_alloc();
+	connection* c = new (memory) connection();
+	c->send_ring = nullptr;
+	c->recv_ring = nullptr;
+	c->ack_pending = false;
+	c->multicast_acked = 0;
+	c->stats = peer_stats();
+
+	// Outbound batch
+	unsigned int datagrams = Config::getInstance().batch_datagrams;
+	c->batch_buffer.resize(datagrams * BATCH_DATAGRAM_SIZE);
+	c->batch_iov.resize(datagrams);
+	c->batch_headers.resize(datagrams + 1);	// Grown by prepare_batch() if needed
+	for (unsigned int i = 0; i < datagrams; ++i)
+		c->batch_iov[i].iov_base = &c->batch_buffer[i * BATCH_DATAGRAM_SIZE];
+	c->batch_used = 0;
+	c->batch_pending = false;
+	c->send_queue.init(SEND_QUEUE_SLOTS);
+
+	connection* expected = nullptr;
+	if (!connections_[slot(node)].compare_exchange_strong(expected, c, std::memory_order_acq_rel)) {
+		c->~connection();
+		free(c);
+		return *expected;
+	}
+	DEBUG("State of node " << node << " allocated");
+	return *c;
+}
+
 /**
  * @brief Methos to open UDP network connections.
  *
  * This method, explicitly invoked by pbsm_init(),
- * opens the UDP connections according to the information stored
- * by the constructor inside the connections_ data structure.
- *
- * It starts the receive connections (by calling start_recv_server)
- * and then starts the send connections (by calling start_send_client).
+ * opens the sockets of the node (by calling start_sockets()), whose number doesn't depend on the number of nodes.
+ * Nodes running on the same host are connected through shared memory rings instead
+ * (if Config::shared_memory is true, see start_rings()).
  *
  * All connections are started by the same thread.
+ * If Config::transport is transport_t::IO_URING, the io_uring backend is created as well;
+ * if io_uring is not available, plain sockets are used.
+ * If Config::multicast_group is set, the multicast group is joined too (see start_multicast()).
+ * The method returns once all nodes can be reached (see handshake()).
+ * @throw std::runtime_error in case of error, or if some node can't be reached within Config::handshake_timeout_ms
  */
 void CommunicationHandler::create_connections()
 {
 	DEBUG("CommunicationHandler starting...");
 	DEBUG("My entry is " << pbsm_tid);
-	DEBUG("Starting connections for receiving data...");
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	reliable_ = Config::getInstance().reliable;
+	spin_poll_us_ = Config::getInstance().spin_poll_us;
+
+	if (Config::getInstance().transport == transport_t::IO_URING) {
+		try {
+			uring_ = new UringTransport(spin_poll_us_);
+		} catch (const std::runtime_error& e) {
+			WARNING("io_uring not available: using plain sockets");
+			Config::getInstance().transport = transport_t::SOCKETS;
+		}
+	}
 
+	DEBUG("Starting connections...");
+	start_sockets();
 	for (int i = 0; i < number_of_nodes_; ++i){
-		DEBUG("Checking entry " << i << "...");
-		if (i != pbsm_tid)
-			start_recv_server(i);
-		else
-			DEBUG("Entry " << i << " is me. Skipping.");
+		addresses_[i].local = (i != pbsm_tid) && Config::getInstance().shared_memory &&
+			is_local_address(addresses_[i].ip);
+		if (addresses_[i].local) {
+			DEBUG("Node " << i << " is on the same host: using shared memory");
+			start_rings(i);
+		}
 	}
 
-	std::this_thread::sleep_for(std::chrono::seconds(5));
+	if (!Config::getInstance().multicast_group.empty())
+		start_multicast();
 
-	DEBUG("Starting connections for sending data...");
-	for (int i = 0; i < number_of_nodes_; ++i){
-		if (i != pbsm_tid)
-			start_send_client(i);
+	std::chrono::steady_clock::time_point opened = std::chrono::steady_clock::now();
+	startup_.open_us = std::chrono::duration_cast<std::chrono::microseconds>(opened - start).count();
+	handshake();
+	startup_.handshake_us = std::chrono::duration_cast<std::chrono::microseconds>(
+	    std::chrono::steady_clock::now() - opened).count();
+
+	unsigned int deadline = Config::getInstance().flush_deadline_us;
+	if (deadline > 0) {
+		DEBUG("Starting thread for flushing outbound batches every " << deadline << " us...");
+		flusher_ = new std::thread ([=] {
+			for (;;) {
+				std::this_thread::sleep_for(std::chrono::microseconds(deadline));
+				this->flush_all();
+			}
+		});
+		flusher_->detach();
+	}
+
+	if (reliable_) {
+		unsigned int period = std::max(1U, Config::getInstance().retransmit_min_us / 2);
+		DEBUG("Starting thread for sending again lost datagrams every " << period << " us...");
+		retransmitter_ = new std::thread ([=] {
+			for (;;) {
+				std::this_thread::sleep_for(std::chrono::microseconds(period));
+				this->retransmit_expired();
+			}
+		});
+		retransmitter_->detach();
+	}
+	startup_.total_us = std::chrono::duration_cast<std::chrono::microseconds>(
+	    std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * @brief Method to open the sockets of the node
+ *
+ * This is a private method called by CommunicationHandler::create_connections().
+ * All sockets are bound, through SO_REUSEPORT, to the UDP port of the node (network_port_offset plus its id):
+ * the kernel spreads the senders among them by source address, so datagrams from the same node always
+ * arrive on the same socket (i.e., they are received in order by the thread draining it).
+ * There is a socket for each thread receiving through epoll (see Config::receive_threads), and only one
+ * with io_uring or dedicated threads. Datagrams are sent through the first socket, so that their
+ * source port identifies the node (see sender_of()).
+ * With Config::bulk_lane, one more socket is bound to the port of the bulk lane of the node,
+ * for both sending and receiving values.
+ * With Config::udp_offload, segmentation offload is enabled if the kernel supports it (see send_segmented()),
+ * and so is receive offload on the bulk lane (see recv_batch_from()).
+ * All sockets are then tuned according to the configuration (see tune_socket()).
+ * @throw std::runtime_error in case of error (e.g., the port is already in use)
+ */
+void CommunicationHandler::start_sockets()
+{
+	struct sockaddr_in serv_addr;
+	memset(&serv_addr, 0, sizeof(serv_addr));
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_port = addresses_[pbsm_tid].addr.sin_port;
+	serv_addr.sin_addr.s_addr = INADDR_ANY;
+	DEBUG("\t Port for server is " << ntohs(serv_addr.sin_port));
+
+	// A socket without SO_REUSEPORT can't be bound if the port is held by anyone else (e.g., a previous run)
+	int probe = socket(AF_INET, SOCK_DGRAM, 0);
+	if ((probe < 0) || (bind(probe, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)) {
+		if (probe >= 0)
+			close(probe);
+		ERROR("Socket binding");
+		throw std::runtime_error ("Bind error");
+	}
+	close(probe);
+
+	unsigned int count = Config::getInstance().receive_threads;
+	if ((uring_ != nullptr) || (count == 0))
+		count = 1;
+	int reuse = 1;
+	for (unsigned int i = 0; i < count; ++i) {
+		int fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (fd < 0) {
+			ERROR("Socket creation");
+			throw std::runtime_error ("Socket error");
+		}
+		if ((setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) ||
+		    (bind(fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)) {
+			close(fd);
+			ERROR("Socket binding");
+			throw std::runtime_error ("Bind error");
+		}
+		tune_socket(fd, true);
+		sockets_.push_back(fd);
+	}
+
+	if (Config::getInstance().bulk_lane) {
+		serv_addr.sin_port = addresses_[slot(BULK_LANE + pbsm_tid)].addr.sin_port;
+		DEBUG("\t Port for bulk lane is " << ntohs(serv_addr.sin_port));
+		bulk_fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+		if ((bulk_fd_ < 0) || (bind(bulk_fd_, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)) {
+			ERROR("Socket binding for bulk lane");
+			throw std::runtime_error ("Bind error");
+		}
+		tune_socket(bulk_fd_, true);
+	}
+
+	if (Config::getInstance().udp_offload) {
+		int segment = 0;
+		if ((uring_ == nullptr) && (setsockopt(sockets_[0], SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0))
+			gso_ = true;
 		else
-			DEBUG("Entry " << i << " is me. Skipping.");
+			WARNING("UDP segmentation offload not available: sending datagrams one by one");
+		if ((bulk_fd_ >= 0) && (setsockopt(bulk_fd_, SOL_UDP, UDP_GRO, &reuse, sizeof(reuse)) < 0))
+			WARNING("UDP receive offload not available");
 	}
 }
 
 /**
- * @brief Method to start send connections
+ * @brief Method to set the options of a socket for low latency
  *
- * This is a private method called by CommunicationHandler::create_connections() to start send connections
- * @param entry Entry in the connections_ data structure related to the connection to be open.
+ * Buffer sizes (see Config::socket_buffer_kb) and priority (see Config::socket_priority) are set
+ * on every socket, and kernel busy polling (see Config::busy_poll_us) on sockets receiving datagrams.
+ * Buffer sizes above the system limits are forced when the process has CAP_NET_ADMIN.
+ * Options that can't be set only raise a warning, since the library works anyway.
+ * @param fd Socket
+ * @param receive true if the socket receives datagrams
+ */
+void CommunicationHandler::tune_socket(int fd, bool receive)
+{
+	const Config& config = Config::getInstance();
+	if (config.socket_buffer_kb > 0) {
+		int size = config.socket_buffer_kb * 1024;
+		if ((setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) < 0) &&
+		    (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0))
+			WARNING("Can't set the send buffer size to " << config.socket_buffer_kb << " KiB");
+		if ((setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0) &&
+		    (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0))
+			WARNING("Can't set the receive buffer size to " << config.socket_buffer_kb << " KiB");
+	}
+	if (config.socket_priority > 0) {
+		int priority = config.socket_priority;
+		if (setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(priority)) < 0)
+			WARNING("Can't set the socket priority to " << priority);
+	}
+	if (receive && (config.busy_poll_us > 0)) {
+		int busy_poll = config.busy_poll_us;
+		if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) < 0)
+			WARNING("Can't set busy polling to " << busy_poll << " us (CAP_NET_ADMIN may be needed)");
+	}
+}
+
+/**
+ * @brief Method to poll a socket without blocking until a datagram is available, for at most Config::spin_poll_us
+ *
+ * Called by receiving threads before blocking on the socket, so that datagrams arriving
+ * shortly don't pay the wake-up latency of a sleeping thread.
+ * With Config::busy_poll_us, every poll also busy-polls the network device.
+ * @param fd Socket
+ * @return true if a datagram is available; false if the time expired (or polling is disabled)
+ */
+bool CommunicationHandler::spin_until_readable(int fd) const
+{
+	if (spin_poll_us_ == 0)
+		return false;
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+	    std::chrono::microseconds(spin_poll_us_);
+	char byte;
+	do {
+		if (recv(fd, &byte, 0, MSG_PEEK | MSG_DONTWAIT) >= 0)
+			return true;
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+			return false;
+	} while (std::chrono::steady_clock::now() < deadline);
+	return false;
+}
+
+/**
+ * @brief Method to create the shared memory rings of a node running on the same host
+ *
+ * This is a private method called by CommunicationHandler::create_connections().
+ * The ring for receiving from the node is created at once; the one for sending to the node
+ * is opened as soon as the node creates it (see handshake()).
+ * @param node Id of the node
  * @throw std::runtime_error in case of error
  */
-void CommunicationHandler::start_send_client(int entry)
+void CommunicationHandler::start_rings(int node)
+{
+	connection& c = get_connection(node);
+	c.recv_ring = ShmRing::create(ring_name(node, pbsm_tid));
+	c.send_ring = ShmRing::open(ring_name(pbsm_tid, node));
+}
+
+/**
+ * @brief Method to wait until all nodes can be reached
+ *
+ * This is a private method called by CommunicationHandler::create_connections(), once all channels are open.
+ * Each pair of nodes on different hosts exchanges hello datagrams (see hello_datagram), sent again at increasing
+ * intervals, until each node has received a hello datagram from the other one telling that its own hello
+ * datagrams are received as well. Hello datagrams received afterwards are answered by accept_datagram().
+ * Nodes on the same host are connected once each one has opened the ring created by the other one.
+ * @throw std::runtime_error if some node can't be reached within Config::handshake_timeout_ms
+ */
+void CommunicationHandler::handshake()
+{
+	DEBUG("Waiting until all nodes can be reached...");
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point deadline = now +
+	    std::chrono::milliseconds(Config::getInstance().handshake_timeout_ms);
+	std::chrono::steady_clock::time_point next_hello = now;
+	std::chrono::microseconds interval (HELLO_MIN_INTERVAL_US);
+	std::vector<char> buffer (MAX_DATAGRAM_SIZE);
+	std::vector<char> heard (number_of_nodes_), reached (number_of_nodes_), told (number_of_nodes_);
+	std::vector<char> connected (number_of_nodes_);
+	connected[pbsm_tid] = true;
+	int remaining = number_of_nodes_ - 1;
+	std::vector<struct pollfd> fds (sockets_.size());
+	for (std::size_t i = 0; i < sockets_.size(); ++i) {
+		fds[i].fd = sockets_[i];
+		fds[i].events = POLLIN;
+	}
+
+	for (;;) {
+		bool send_hellos = (now >= next_hello);
+		bool local_pending = false;
+		receive_hellos(buffer, heard, reached);
+		for (int i = 0; i < number_of_nodes_; ++i){
+			if (connected[i])
+				continue;
+			if (addresses_[i].local) {
+				connection& c = get_connection(i);
+				if (c.send_ring == nullptr)
+					c.send_ring = ShmRing::open(ring_name(pbsm_tid, i));
+				connected[i] = (c.send_ring != nullptr) && c.recv_ring->connected();
+				if (!connected[i])
+					local_pending = true;
+			} else {
+				connected[i] = reached[i];
+				// The node is told at once when its hello datagrams start being received
+				if (send_hellos || connected[i] || (heard[i] && !told[i])) {
+					send_hello(i, heard[i]);
+					told[i] = heard[i];
+					startup_.hellos_sent++;
+				}
+			}
+			if (connected[i]) {
+				DEBUG("Node " << i << " can be reached");
+				startup_.last_node = i;
+				--remaining;
+			}
+		}
+		if (remaining == 0)
+			break;
+
+		if (send_hellos) {
+			next_hello = now + interval;
+			interval = std::min(2 * interval, std::chrono::microseconds(HELLO_MAX_INTERVAL_US));
+		}
+		if (now >= deadline) {
+			for (int i = 0; i < number_of_nodes_; ++i){
+				if (!connected[i])
+					ERROR("Node " << i << " (" << addresses_[i].ip << ") can't be reached");
+			}
+			throw std::runtime_error ("Handshake timeout");
+		}
+		// Rings are checked every millisecond; sockets as soon as a datagram arrives
+		int timeout = local_pending ? 1 :
+		    std::chrono::duration_cast<std::chrono::milliseconds>(next_hello - now).count() + 1;
+		if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR)
+			ERROR("poll() of sockets");
+		now = std::chrono::steady_clock::now();
+	}
+	DEBUG("All nodes can be reached");
+}
+
+/**
+ * @brief Method to receive the datagrams queued on the sockets of the node, during the handshake
+ *
+ * A datagram other than a hello datagram means that its sender has already completed the handshake:
+ * it is kept, to be handled once receiving starts (see next_early_datagram()).
+ * @param buffer Buffer for receiving a datagram of maximum size
+ * @param heard Flags telling if a hello datagram has been received from each node (updated)
+ * @param reached Flags telling if each node receives the hello datagrams of this node (updated)
+ */
+void CommunicationHandler::receive_hellos(std::vector<char>& buffer, std::vector<char>& heard, std::vector<char>& reached)
+{
+	for (int fd: sockets_) {
+		for (;;) {
+			struct sockaddr_in from;
+			socklen_t from_len = sizeof(from);
+			ssize_t len = recvfrom(fd, &buffer[0], buffer.size(), MSG_DONTWAIT, (struct sockaddr *) &from, &from_len);
+			if ((len < 0) && (errno == EINTR))
+				continue;
+			if (len < 0)
+				break;
+			int node = sender_of(from);
+			if ((node < 0) || addresses_[node].local) {
+				WARNING("Datagram from unknown sender " << inet_ntoa(from.sin_addr) << ":" << ntohs(from.sin_port));
+				continue;
+			}
+			if (len != sizeof(hello_datagram)) {
+				heard[node] = true;
+				reached[node] = true;
+				early_datagrams_.emplace_back(node, std::vector<char> (buffer.begin(), buffer.begin() + len));
+				continue;
+			}
+			hello_datagram hello;
+			memcpy(&hello, &buffer[0], sizeof(hello));
+			if ((hello.magic != HELLO_MAGIC) || (hello.node != (std::uint32_t) node)) {
+				WARNING("Wrong hello datagram from " << addresses_[node].ip);
+				continue;
+			}
+			heard[node] = true;
+			if (hello.heard)
+				reached[node] = true;
+		}
+	}
+}
+
+/**
+ * @brief Method to get a datagram received during the handshake (see receive_hellos())
+ *
+ * Such datagrams must be passed to accept_datagram() before receiving any other datagram,
+ * so that messages from each node are handled in order.
+ * @param rem_node_id Pointer where the id of the sender node must be put
+ * @param datagram Buffer where the datagram must be put
+ * @return true if a datagram has been returned; false otherwise
+ */
+bool CommunicationHandler::next_early_datagram(int* rem_node_id, std::vector<char>& datagram)
+{
+	if (early_datagrams_.empty())
+		return false;
+	*rem_node_id = early_datagrams_.front().first;
+	datagram.swap(early_datagrams_.front().second);
+	early_datagrams_.pop_front();
+	return true;
+}
+
+/**
+ * @brief Method to send a hello datagram to a node
+ * @param node Id of the node
+ * @param heard true if a hello datagram has already been received from the node
+ * @return true in case of success; false in case of error
+ */
+bool CommunicationHandler::send_hello(int node, bool heard)
+{
+	hello_datagram hello;
+	hello.magic = HELLO_MAGIC;
+	hello.node = pbsm_tid;
+	hello.heard = heard ? 1 : 0;
+	return sendto(sockets_[0], &hello, sizeof(hello), 0, (struct sockaddr *) &addresses_[node].addr,
+	    sizeof(addresses_[node].addr)) == sizeof(hello);
+}
+
+/**
+ * @brief Method to join the multicast group
+ *
+ * This is a private method called by CommunicationHandler::create_connections().
+ * The receive channel of the group is bound to the group (and shared with the other nodes
+ * running on the same host), while the send channel is connected to the group, through the
+ * interface of the node itself.
+ * The group is not used if all the other nodes run on the same host.
+ * In case of error, messages sent to all nodes are sent in unicast.
+ */
+void CommunicationHandler::start_multicast()
+{
+	bool remote = false;
+	for (int i = 0; i < number_of_nodes_; ++i){
+		if ((i != pbsm_tid) && !addresses_[i].local)
+			remote = true;
+	}
+	if (!remote) {
+		DEBUG("No node on other hosts: multicast group not needed");
+		return;
+	}
+
+	node_address& s = addresses_[slot(MULTICAST_CHANNEL)];
+	s.ip = Config::getInstance().multicast_group;
+	int port = Config::getInstance().multicast_port;
+	DEBUG("Joining multicast group " << s.ip << ":" << port);
+
+	struct sockaddr_in& group_addr = s.addr;
+	memset(&group_addr, 0, sizeof(group_addr));
+	group_addr.sin_family = AF_INET;
+	group_addr.sin_port = htons(port);
+	if ((inet_aton(s.ip.c_str(), &group_addr.sin_addr) == 0) ||
+	    !IN_MULTICAST(ntohl(group_addr.sin_addr.s_addr))) {
+		WARNING("Wrong multicast group " << s.ip << ": sending to all nodes in unicast");
+		return;
+	}
+	struct in_addr interface = addresses_[pbsm_tid].addr.sin_addr;
+
+	// Receive channel
+	int reuse = 1;
+	struct ip_mreq membership;
+	membership.imr_multiaddr = group_addr.sin_addr;
+	membership.imr_interface = interface;
+	multicast_recv_fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+	if ((multicast_recv_fd_ < 0) ||
+	    (setsockopt(multicast_recv_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) ||
+	    (bind(multicast_recv_fd_, (struct sockaddr *) &group_addr, sizeof(group_addr)) < 0) ||
+	    (setsockopt(multicast_recv_fd_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0)) {
+		WARNING("Can't join multicast group " << s.ip << ": sending to all nodes in unicast");
+		if (multicast_recv_fd_ >= 0)
+			close(multicast_recv_fd_);
+		return;
+	}
+
+	// Send channel
+	unsigned char loop = 1;
+	multicast_send_fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+	if ((multicast_send_fd_ < 0) ||
+	    (setsockopt(multicast_send_fd_, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface)) < 0) ||
+	    (setsockopt(multicast_send_fd_, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0) ||
+	    (connect(multicast_send_fd_, (struct sockaddr *) &group_addr, sizeof(group_addr)) < 0)) {
+		WARNING("Can't send to multicast group " << s.ip << ": sending to all nodes in unicast");
+		if (multicast_send_fd_ >= 0)
+			close(multicast_send_fd_);
+		close(multicast_recv_fd_);
+		return;
+	}
+	tune_socket(multicast_recv_fd_, true);
+	tune_socket(multicast_send_fd_, false);
+	get_connection(MULTICAST_CHANNEL);
+	multicast_ = true;
+}
+
+/**
+ * @brief Method to send a message to the multicast group
+ *
+ * The datagram, preceded by a multicast_header, is gathered directly from the buffers and sent
+ * immediately. Nodes running on the same host ignore the datagram (see accept_datagram()),
+ * so the caller must send to them separately.
+ * The group reaches the nodes through a receive channel other than the one of the datagrams
+ * sent to each of them, so the datagram may be handled before the messages previously sent
+ * to a node, or after the ones sent later: only messages needing no ordering go through the group
+ * (see send_to_all()).
+ * @param msg_data Buffer containing the message
+ * @param msg_size Size of the message
+ * @return true in case of success; false if the datagram must be sent in unicast instead
+ *	   (also when RELIABLE_WINDOW datagrams to the group are not yet acknowledged)
+ */
+bool CommunicationHandler::multicast_to_all(void* msg_data, int msg_size)
+{
+	if (sizeof(multicast_header) + sizeof(reliable_header) + msg_size > NETWORK_DATAGRAM_SIZE)
+		return false;
+
+	multicast_header header;
+	header.node = pbsm_tid;
+	header.reserved = 0;
+	reliable_header sequence;
+	memset(&sequence, 0, sizeof(sequence));
+	sequence.flags = RELIABLE_SEQUENCED;
+	struct iovec iov[3];
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = &sequence;
+	iov[1].iov_len = sizeof(sequence);
+	iov[2].iov_base = msg_data;
+	iov[2].iov_len = msg_size;
+
+	connection& c = get_connection(MULTICAST_CHANNEL);
+	const std::string& group = addresses_[slot(MULTICAST_CHANNEL)].ip;
+	DEBUG("Sending to multicast group " << group << "...");
+	bool ret;
+	c.send_channel_lock.lock();
+	if (reliable_) {
+		std::unique_lock<std::mutex> lock (c.reliable_mutex);
+		if (!c.sender.unacked.empty() && (c.sender.next_seq - c.sender.unacked.front().seq >= RELIABLE_WINDOW)) {
+			// Datagrams are never held for the group (see release_multicast())
+			c.send_channel_lock.unlock();
+			DEBUG("Multicast window full: sending to all nodes in unicast");
+			return false;
+		}
+		sequence.seq = sequence_datagram(c.sender, &iov[2], 1);
+		c.stats.sent++;
+		ret = send_datagram(MULTICAST_CHANNEL, iov, 3, c.stats);
+	} else {
+		iov[1] = iov[0];
+		ret = send_datagram(MULTICAST_CHANNEL, &iov[1], 2, c.stats);
+	}
+	c.send_channel_lock.unlock();
+	if (!ret) {
+		WARNING("Sending to multicast group " << group << " failed: sending to all nodes in unicast");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Method to append a message to the send queue of a node
+ *
+ * Messages too big for the queue are appended directly to the outbound batch, locking the send channel
+ * (and flushing it if Config::flush_deadline_us is 0). If the queue is full, it is moved into the batch
+ * (flushed in turn when full) by locking the send channel.
+ * @param node Id of the recipient node
+ * @param msg_data Buffer containing the raw data to be sent
+ * @param msg_size Size of data to be sent
+ * @return true in case of success; false in case of error
+ */
+bool CommunicationHandler::enqueue(int node, void* msg_data, int msg_size)
+{
+	connection& c = get_connection(node);
+	if (msg_size > (int) MPSC_MESSAGE_SIZE) {
+		lock_send_channel(node);
+		bool ret = append_to_batch(node, msg_data, msg_size);
+		if (Config::getInstance().flush_deadline_us == 0)
+			ret = flush_batch(node) && ret;
+		unlock_send_channel(node);
+		return ret;
+	}
+	while (!c.send_queue.push(msg_data, msg_size)) {
+		DEBUG("Send queue for node " << node << " full");
+		lock_send_channel(node);
+		unlock_send_channel(node);
+	}
+	return true;
+}
+
+/**
+ * @brief Method to move the messages of the send queue of a node into its outbound batch
+ *
+ * Must be called with the send channel already locked.
+ * @param node Id of the recipient node
+ * @return true if some message has been moved
+ */
+bool CommunicationHandler::drain_queue(int node)
+{
+	connection& c = get_connection(node);
+	char msg [MPSC_MESSAGE_SIZE];
+	std::size_t size;
+	bool ret = false;
+	while (c.send_queue.pop(msg, &size)) {
+		if (!append_to_batch(node, msg, size))
+			ERROR("ERROR: Sending data to " << addresses_[slot(node)].ip);
+		ret = true;
+	}
+	return ret;
+}
+
+/**
+ * @brief Method to send the messages of the send queue of a node, unless another thread holds the send channel
+ *
+ * The thread holding the send channel calls this method in turn after releasing it
+ * (see unlock_send_channel()), so queued messages are never left behind.
+ * @param node Id of the recipient node
+ */
+void CommunicationHandler::try_drain(int node)
+{
+	connection& c = get_connection(node);
+	while (!c.send_queue.empty() && c.send_channel_lock.try_lock()) {
+		bool drained = drain_queue(node);
+		flush_batch(node);
+		c.send_channel_lock.unlock();
+		if (!drained)
+			break;	// The producer is still writing its message: it will drain it by itself
+	}
+}
+
+/**
+ * @brief Method to append a message to the outbound batch of a node
+ *
+ * The message is appended to the latest datagram of the batch, if there is room enough.
+ * Otherwise, it is put in a new datagram. If all datagrams are already used,
+ * the batch is flushed before.
+ * Must be called with the send channel already locked.
+ * @param node Id of the recipient node
+ * @param msg_data Buffer containing the raw data to be sent
+ * @param msg_size Size of data to be sent
+ * @return true in case of success; false in case of error
+ */
+bool CommunicationHandler::append_to_batch(int node, void* msg_data, int msg_size)
+{
+	connection& c = get_connection(node);
+	if (msg_size > BATCH_DATAGRAM_SIZE) {
+		ERROR("Message of size " << msg_size << " too big for the outbound batch");
+		return false;
+	}
+
+	bool ret = true;
+	if ((c.batch_used == 0) ||
+	    (c.batch_iov[c.batch_used - 1].iov_len + msg_size > BATCH_DATAGRAM_SIZE)) {
+		// A new datagram is needed
+		if (c.batch_used == Config::getInstance().batch_datagrams) {
+			DEBUG("Outbound batch for node " << node << " full");
+			ret = flush_batch(node);
+		}
+		c.batch_iov[c.batch_used].iov_len = 0;
+		c.batch_used++;
+	}
+	struct iovec& iov = c.batch_iov[c.batch_used - 1];
+	memcpy((char*) iov.iov_base + iov.iov_len, msg_data, msg_size);
+	iov.iov_len += msg_size;
+	c.batch_pending = true;
+	return ret;
+}
+
+/**
+ * @brief Method to prepare the headers for sending the outbound batch of a node
+ *
+ * Optional tail datagrams, each one gathered from a set of buffers, can be added after the batch.
+ * When datagrams to the node are numbered (see is_sequenced()), each datagram is preceded by its
+ * reliable_header, and a copy of its content is kept until acknowledged (see sequence_datagram()).
+ * Datagrams dropped by Config::loss_injection are left out of the headers, and so are the ones
+ * beyond the window of the node (sent once acknowledgments arrive, see send_held()).
+ * Every header is addressed to the node (see start_sockets()).
+ * Must be called with the send channel already locked.
+ * @param node Id of the recipient node
+ * @param tail_iov Buffers composing the tail datagrams (nullptr if none), tail_iovcnt per datagram
+ * @param tail_iovcnt Number of buffers composing each tail datagram
+ * @param tail_datagrams Number of tail datagrams
+ * @param tail_sequenced false if tail datagrams must not be sent again when lost
+ * @return Number of datagrams to be sent
+ */
+unsigned int CommunicationHandler::prepare_batch(int node, struct iovec* tail_iov, int tail_iovcnt, int tail_datagrams, bool tail_sequenced)
+{
+	connection& c = get_connection(node);
+	unsigned int datagrams = c.batch_used;
+	if (tail_iov == nullptr)
+		tail_datagrams = 0;
+	if (c.batch_headers.size() < datagrams + tail_datagrams)
+		c.batch_headers.resize(datagrams + tail_datagrams);
+	memset(&c.batch_headers[0], 0, (datagrams + tail_datagrams) * sizeof(struct mmsghdr));
+	for (unsigned int i = 0; i < datagrams; ++i) {
+		c.batch_headers[i].msg_hdr.msg_iov = &c.batch_iov[i];
+		c.batch_headers[i].msg_hdr.msg_iovlen = 1;
+	}
+	for (int i = 0; i < tail_datagrams; ++i) {
+		c.batch_headers[datagrams].msg_hdr.msg_iov = &tail_iov[i * tail_iovcnt];
+		c.batch_headers[datagrams].msg_hdr.msg_iovlen = tail_iovcnt;
+		datagrams++;
+	}
+	for (unsigned int i = 0; i < datagrams; ++i) {
+		c.batch_headers[i].msg_hdr.msg_name = &addresses_[slot(node)].addr;
+		c.batch_headers[i].msg_hdr.msg_namelen = sizeof(addresses_[slot(node)].addr);
+	}
+	if (!is_sequenced(node))
+		return datagrams;
+
+	std::size_t iovs = c.batch_used * 2 + tail_datagrams * (tail_iovcnt + 1);
+	if (c.batch_reliable.size() < datagrams)
+		c.batch_reliable.resize(datagrams);
+	if (c.batch_send_iov.size() < iovs)
+		c.batch_send_iov.resize(iovs);
+	struct iovec* iov = &c.batch_send_iov[0];
+	unsigned int sent = 0;
+	std::unique_lock<std::mutex> lock (c.reliable_mutex);
+	for (unsigned int i = 0; i < datagrams; ++i) {
+		struct iovec* content = c.batch_headers[i].msg_hdr.msg_iov;
+		int iovcnt = c.batch_headers[i].msg_hdr.msg_iovlen;
+		bool sequenced = (i < c.batch_used) || tail_sequenced;
+		std::uint32_t seq = sequenced ? sequence_datagram(c.sender, content, iovcnt) : 0;
+		fill_header(node, &c.batch_reliable[i], seq, sequenced);
+		c.stats.sent++;
+		if (sequenced && c.sender.unacked.back().held) {
+			DEBUG("Datagram " << seq << " to node " << node << " beyond the window: holding it");
+			continue;
+		}
+		if (inject_loss()) {
+			c.stats.injected++;
+			continue;
+		}
+		iov[0].iov_base = &c.batch_reliable[i];
+		iov[0].iov_len = sizeof(reliable_header);
+		memcpy(&iov[1], content, iovcnt * sizeof(struct iovec));
+		c.batch_headers[sent].msg_hdr.msg_iov = iov;
+		c.batch_headers[sent].msg_hdr.msg_iovlen = iovcnt + 1;
+		iov += iovcnt + 1;
+		sent++;
+	}
+	return sent;
+}
+
+/**
+ * @brief Method to empty the outbound batch of a node, once sent
+ *
+ * Must be called with the send channel already locked.
+ * @param node Id of the recipient node
+ */
+void CommunicationHandler::clear_batch(int node)
+{
+	connection& c = get_connection(node);
+	c.batch_used = 0;
+	c.batch_pending = false;
+}
+
+/**
+ * @brief Method to send the outbound batch of a node
+ *
+ * All datagrams of the batch are sent through a single sendmmsg() (or a single io_uring submission),
+ * or through UDP segmentation offload when enabled (see send_segmented()).
+ * Optional tail datagrams, each one gathered from a set of buffers, can be sent
+ * through the same system call after the batch.
+ * Must be called with the send channel already locked.
+ * @param node Id of the recipient node
+ * @param tail_iov Buffers composing the tail datagrams (nullptr if none), tail_iovcnt per datagram
+ * @param tail_iovcnt Number of buffers composing each tail datagram
+ * @param tail_datagrams Number of tail datagrams
+ * @param tail_sequenced false if tail datagrams must not be sent again when lost (see send_datagrams_to())
+ * @return true in case of success; false in case of error
+ */
+bool CommunicationHandler::flush_batch(int node, struct iovec* tail_iov, int tail_iovcnt, int tail_datagrams, bool tail_sequenced)
+{
+	connection& c = get_connection(node);
+	unsigned int datagrams = prepare_batch(node, tail_iov, tail_iovcnt, tail_datagrams, tail_sequenced);
+	if (datagrams == 0) {
+		// Nothing to send, or all datagrams dropped by Config::loss_injection
+		clear_batch(node);
+		return true;
+	}
+
+	DEBUG("Flushing " << datagrams << " datagrams to node " << node << "...");
+	bool ret = true;
+	if (is_local(node)) {
+		ret = write_to_ring(node, datagrams);
+	} else if (uring_ != nullptr) {
+		uring_->lock_send();
+		for (unsigned int i = 0; i < datagrams; ++i)
+			ret = uring_->queue_send(send_fd(node), &c.batch_headers[i].msg_hdr) && ret;
+		ret = uring_->submit_sends() && ret;
+		uring_->unlock_send();
+	} else if (gso_) {
+		ret = send_segmented(node, datagrams);
+	} else {
+		ret = send_all(send_fd(node), &c.batch_headers[0], datagrams);
+	}
+	if (!ret)
+		ERROR("ERROR: Sending data to " << addresses_[slot(node)].ip);
+
+	clear_batch(node);
+	return ret;
+}
+
+/**
+ * @brief Method to send the datagrams prepared for a node, handing runs of datagrams of the same size to the kernel at once
+ *
+ * A run of consecutive datagrams with the same size (the last one possibly shorter), such as the fragments
+ * of a value, is sent as a single buffer through UDP_SEGMENT: the kernel (or the NIC) splits it into
+ * datagrams, so the per-datagram cost of the network stack is paid once (UDP GSO).
+ * Other datagrams are sent through sendmmsg(), as usual.
+ * If the kernel refuses segmentation (e.g., no checksum offload on the device), it is disabled
+ * for good and the run is sent through sendmmsg().
+ * Must be called with the send channel already locked, after prepare_batch().
+ * @param node Id of the recipient node
+ * @param datagrams Number of datagrams returned by prepare_batch()
+ * @return true in case of success; false in case of error
+ */
+bool CommunicationHandler::send_segmented(int node, unsigned int datagrams)
+{
+	connection& c = get_connection(node);
+	int fd = send_fd(node);
+	bool ret = true;
+	unsigned int plain = 0;	// First datagram not yet sent
+	unsigned int i = 0;
+	while (i < datagrams) {
+		std::size_t size = datagram_length(c.batch_headers[i].msg_hdr);
+		std::size_t total = size;
+		unsigned int n = 1;
+		while ((i + n < datagrams) && (n < UDP_OFFLOAD_MAX_SEGMENTS)) {
+			std::size_t next = datagram_length(c.batch_headers[i + n].msg_hdr);
+			if ((next > size) || (total + next > (std::size_t) MAX_DATAGRAM_SIZE))
+				break;
+			total += next;
+			n++;
+			if (next < size)
+				break;	// Only the last datagram of a run can be shorter
+		}
+		if ((n > 1) && (size <= (std::size_t) NETWORK_DATAGRAM_SIZE) && gso_) {
+			if (plain < i)
+				ret = send_all(fd, &c.batch_headers[plain], i - plain) && ret;
+			if (send_segments(node, &c.batch_headers[i], n, size)) {
+				plain = i + n;
+			} else if ((errno == EIO) || (errno == EINVAL) || (errno == ENOPROTOOPT) || (errno == EOPNOTSUPP)) {
+				WARNING("UDP segmentation offload refused: sending datagrams one by one");
+				gso_ = false;
+				plain = i;
+			} else {
+				ret = false;
+				plain = i + n;
+			}
+		}
+		i += n;
+	}
+	if (plain < datagrams)
+		ret = send_all(fd, &c.batch_headers[plain], datagrams - plain) && ret;
+	return ret;
+}
+
+/**
+ * @brief Method to send a run of datagrams to a node as a single buffer (see send_segmented())
+ *
+ * Must be called with the send channel already locked.
+ * @param node Id of the recipient node
+ * @param headers Headers of the datagrams
+ * @param count Number of datagrams
+ * @param size Size of every datagram (but the last one, possibly shorter)
+ * @return true in case of success; false in case of error (errno is set)
+ */
+bool CommunicationHandler::send_segments(int node, struct mmsghdr* headers, unsigned int count, std::size_t size)
+{
+	std::vector<struct iovec>& iov = get_connection(node).batch_segment_iov;
+	iov.clear();
+	for (unsigned int i = 0; i < count; ++i)
+		iov.insert(iov.end(), headers[i].msg_hdr.msg_iov, headers[i].msg_hdr.msg_iov + headers[i].msg_hdr.msg_iovlen);
+
+	char control [CMSG_SPACE(sizeof(std::uint16_t))];
+	memset(control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = headers[0].msg_hdr.msg_name;
+	msg.msg_namelen = headers[0].msg_hdr.msg_namelen;
+	msg.msg_iov = &iov[0];
+	msg.msg_iovlen = iov.size();
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(std::uint16_t));
+	std::uint16_t segment = size;
+	memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+
+	DEBUG("Sending " << count << " datagrams of " << size << " bytes to node " << node << " as a single buffer");
+	ssize_t n;
+	do {
+		n = sendmsg(send_fd(node), &msg, 0);
+	} while ((n < 0) && (errno == EINTR));
+	return n >= 0;
+}
+
+/**
+ * @brief Method to write the outbound batch of a node running on the same host into its ring
+ *
+ * Every datagram becomes a record of the ring, gathered directly from its buffers
+ * (i.e., a value is copied only once, into the ring).
+ * Must be called with the send channel already locked, after prepare_batch().
+ * @param node Id of the recipient node
+ * @param datagrams Number of datagrams returned by prepare_batch()
+ * @return true in case of success; false in case of error
+ */
+bool CommunicationHandler::write_to_ring(int node, unsigned int datagrams)
+{
+	connection& c = get_connection(node);
+	bool ret = true;
+	for (unsigned int i = 0; i < datagrams; ++i)
+		ret = c.send_ring->write(c.batch_headers[i].msg_hdr.msg_iov, c.batch_headers[i].msg_hdr.msg_iovlen) && ret;
+	return ret;
+}
+
+/**
+ * @brief Method to send the outbound batches of all nodes
+ *
+ * With plain sockets, the batch of each node is sent by a separate sendmmsg().
+ * Bulk lanes are not involved, since their batches are always sent at once (see send_value_to()).
+ * With io_uring, the send channels of all involved nodes are locked (in order of id, to
+ * avoid deadlocks) and the datagrams for all of them are submitted at once.
+ * An optional tail datagram, gathered from a set of buffers, is sent to every node after its batch.
+ * Pending acknowledgments not carried by the batches are sent afterwards (see send_acks()).
+ * @param tail_iov Buffers composing the tail datagram (nullptr if none; in such case,
+ * only nodes having messages in the batch or in the send queue are involved)
+ * @param tail_iovcnt Number of buffers composing the tail datagram
+ * @return true in case of success; false in case of error
+ */
+bool CommunicationHandler::flush_batches(struct iovec* tail_iov, int tail_iovcnt)
 {
-	DEBUG("Starting send client for entry " << entry);
-	connection& s = connections_[entry];
-	DEBUG("Opening client connection to " << s.ip << ":" << s.send_port);
+	bool ret = true;
+	if (uring_ == nullptr) {
+		for (int i = 0; i < number_of_nodes_; ++i){
+			if ((i != pbsm_tid) && ((tail_iov != nullptr) || has_unsent(i))) {
+				lock_send_channel(i);
+				ret = flush_batch(i, tail_iov, tail_iovcnt) && ret;
+				unlock_send_channel(i);
+			}
+		}
+		if (reliable_)
+			ret = send_acks() && ret;
+		return ret;
+	}
 
-	// socket()
-	s.send_fd = socket(AF_INET, SOCK_DGRAM, 0);
-	if (s.send_fd < 0) {
-		ERROR("Send socket creation");
-		throw std::runtime_error ("Send socket error");
+	static thread_local std::vector<int> involved;
+	involved.clear();
+	bool queued = false;
+	for (int i = 0; i < number_of_nodes_; ++i){
+		if ((i != pbsm_tid) && ((tail_iov != nullptr) || has_unsent(i))) {
+			involved.push_back(i);
+			lock_send_channel(i);
+		}
 	}
 
-	// connect()
-	 struct sockaddr_in serv_addr;
-	 memset (&serv_addr, 0, sizeof(serv_addr));
-	 serv_addr.sin_family = AF_INET;
-	 serv_addr.sin_port = htons(s.send_port);
-	 struct in_addr addr;
-	 inet_aton(s.ip.c_str(), &addr);
-	 memcpy(&addr, &serv_addr.sin_addr.s_addr, sizeof(addr));
-	 if (connect(s.send_fd, (struct sockaddr *) &serv_addr,
-					 sizeof(serv_addr)) < 0) {
-		 close(s.send_fd);
-		 ERROR("connect()");
-		 throw std::runtime_error ("Client socket error");
-	 }
+	// The send ring is always locked after the send channels
+	uring_->lock_send();
+	for (int i: involved) {
+		unsigned int datagrams = prepare_batch(i, tail_iov, tail_iovcnt, 1);
+		if (is_local(i)) {
+			ret = write_to_ring(i, datagrams) && ret;
+			continue;
+		}
+		connection& c = get_connection(i);
+		for (unsigned int k = 0; k < datagrams; ++k) {
+			ret = uring_->queue_send(send_fd(i), &c.batch_headers[k].msg_hdr) && ret;
+			queued = true;
+		}
+	}
+	if (queued) {
+		DEBUG("Flushing outbound batches through io_uring...");
+		ret = uring_->submit_sends() && ret;
+	}
+	uring_->unlock_send();
+
+	for (int i: involved) {
+		clear_batch(i);
+		unlock_send_channel(i);
+	}
+	if (!ret)
+		ERROR("ERROR: Sending data through io_uring");
+	if (reliable_)
+		ret = send_acks() && ret;
+	return ret;
 }
 
 /**
- * @brief Method to start receive connections
+ * @brief Constructor of the buffers for receiving a batch of datagrams
+ * @param slots Maximum number of datagrams received at once
+ */
+CommunicationHandler::recv_batch::recv_batch(unsigned int slots):
+	buffer_(slots * MAX_DATAGRAM_SIZE),
+	iov_(slots),
+	headers_(slots),
+	names_(slots),
+	control_(slots * CMSG_SPACE(sizeof(int)))
+{
+	memset(&headers_[0], 0, slots * sizeof(struct mmsghdr));
+	for (unsigned int i = 0; i < slots; ++i) {
+		iov_[i].iov_base = &buffer_[i * MAX_DATAGRAM_SIZE];
+		iov_[i].iov_len = MAX_DATAGRAM_SIZE;
+		headers_[i].msg_hdr.msg_iov = &iov_[i];
+		headers_[i].msg_hdr.msg_iovlen = 1;
+		headers_[i].msg_hdr.msg_name = &names_[i];
+		headers_[i].msg_hdr.msg_control = &control_[i * CMSG_SPACE(sizeof(int))];
+	}
+	datagrams_.reserve(slots);
+}
+
+/**
+ * @brief Receive a batch of datagrams from a receive channel
  *
- * This is a private method called by CommunicationHandler::create_connections() to start receive connections
- * @param entry Entry in the connections_ data structure related to the connection to be open.
+ * The method blocks until at least one datagram is available, and then
+ * returns all the datagrams already queued (up to the number of slots of the batch)
+ * through a single recvmmsg(). The sender of each datagram is identified by its
+ * source address (see recv_batch::node()).
+ * Datagrams coalesced by the kernel into a single buffer (UDP GRO, see Config::udp_offload)
+ * are split again, using the size reported by the kernel.
+ * @param batch Buffers where datagrams must be put
+ * @param channel Receive channel (see peek_from())
+ * @return Number of datagrams received; -1 in case of error
+ */
+int CommunicationHandler::recv_batch_from(recv_batch& batch, int channel)
+{
+	for (unsigned int i = 0; i < batch.slots(); ++i) {
+		batch.headers_[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		batch.headers_[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(int));
+	}
+	int n;
+	do {
+		n = recvmmsg(channel_fd(channel), &batch.headers_[0], batch.slots(), MSG_WAITFORONE, nullptr);
+	} while ((n < 0) && (errno == EINTR));
+	if (n < 0) {
+		ERROR("Error in receiving data from channel " << channel);
+		return n;
+	}
+	batch.datagrams_.clear();
+	for (int i = 0; i < n; ++i) {
+		recv_batch::datagram d;
+		d.data = (char*) batch.iov_[i].iov_base;
+		d.node = (channel == MULTICAST_CHANNEL) ? MULTICAST_CHANNEL : sender_of(batch.names_[i]);
+		std::size_t len = batch.headers_[i].msg_len;
+		std::size_t segment = gro_segment(batch.headers_[i].msg_hdr);
+		if (segment == 0)
+			segment = len;
+		for (std::size_t offset = 0; offset < len; offset += segment) {
+			d.size = std::min(segment, len - offset);
+			batch.datagrams_.push_back(d);
+			d.data += segment;
+		}
+		if (len == 0) {
+			d.size = 0;
+			batch.datagrams_.push_back(d);
+		}
+	}
+	return batch.datagrams_.size();
+}
+
+/**
+ * @brief Method to start multiplexing the receive channels
+ *
+ * All receive channels (i.e., the sockets of the node and the one of the multicast group, see MULTICAST_CHANNEL)
+ * but the bulk lane (see BULK_CHANNEL, which has a dedicated thread) are registered in a single epoll instance, with one-shot notification:
+ * once a channel has been returned by wait_readable(), it is not returned again (i.e., to
+ * another thread) until rearm() is called. Since datagrams from the same node always arrive
+ * on the same socket (see start_sockets()), messages from the same node are always handled in order.
+ * It can be called only after create_connections().
  * @throw std::runtime_error in case of error
  */
-void CommunicationHandler::start_recv_server(int entry)
+void CommunicationHandler::start_polling()
+{
+	DEBUG("Starting epoll for receive channels...");
+	epoll_fd_ = epoll_create1(0);
+	if (epoll_fd_ < 0) {
+		ERROR("epoll_create1()");
+		throw std::runtime_error ("epoll error");
+	}
+	for (int i = 0; i <= (int) sockets_.size(); ++i){
+		int channel = (i < (int) sockets_.size()) ? i : MULTICAST_CHANNEL;
+		if ((channel == MULTICAST_CHANNEL) && !multicast_)
+			continue;
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.u32 = channel;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, channel_fd(channel), &ev) < 0) {
+			ERROR("epoll_ctl() for channel " << channel);
+			throw std::runtime_error ("epoll error");
+		}
+	}
+}
+
+/**
+ * @brief Wait until some receive channels have data available
+ *
+ * The method blocks until at least one channel is readable (polling for Config::spin_poll_us before sleeping).
+ * Every returned channel must be re-enabled through rearm() after reading it.
+ * @param channels Array where the receive channels must be put
+ * @param max_channels Size of the array
+ * @return Number of channels returned; -1 in case of error
+ */
+int CommunicationHandler::wait_readable(int* channels, int max_channels)
+{
+	struct epoll_event events [MAX_READY_CHANNELS];
+	if (max_channels > MAX_READY_CHANNELS)
+		max_channels = MAX_READY_CHANNELS;
+	// Poll without blocking for at most Config::spin_poll_us, then sleep
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+	    std::chrono::microseconds(spin_poll_us_);
+	bool spin = (spin_poll_us_ > 0);
+	int n;
+	do {
+		n = epoll_wait(epoll_fd_, events, max_channels, spin ? 0 : -1);
+		if ((n == 0) && (std::chrono::steady_clock::now() >= deadline))
+			spin = false;
+	} while ((n == 0) || ((n < 0) && (errno == EINTR)));
+	if (n < 0) {
+		ERROR("epoll_wait()");
+		return -1;
+	}
+	for (int i = 0; i < n; ++i)
+		channels[i] = events[i].data.u32;
+	return n;
+}
+
+/**
+ * @brief Re-enable notifications for a receive channel
+ *
+ * See start_polling().
+ * @param channel Receive channel
+ */
+void CommunicationHandler::rearm(int channel)
 {
-	DEBUG("Starting receive server for entry " << entry);
-	connection& s = connections_[entry];
-	DEBUG("Opening server connection at " << s.ip << ":" << s.recv_port);
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.u32 = channel;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, channel_fd(channel), &ev) < 0)
+		ERROR("epoll_ctl() for channel " << channel);
+}
+
+/**
+ * @brief Method to start receiving through io_uring from all receive channels
+ *
+ * A multishot receive is posted on every receive channel (including the one of the
+ * multicast group, see MULTICAST_CHANNEL, but not the bulk lane, see BULK_CHANNEL); datagrams are then
+ * collected through wait_datagrams().
+ * It can be called only after create_connections(), and only if uses_uring() is true.
+ */
+void CommunicationHandler::start_completions()
+{
+	DEBUG("Starting io_uring receives...");
+	for (std::size_t i = 0; i < sockets_.size(); ++i)
+		uring_->start_receiving(i, sockets_[i]);
+	if (multicast_)
+		uring_->start_receiving(MULTICAST_CHANNEL, multicast_recv_fd_);
+}
 
+/**
+ * @brief Method to check if a peeked datagram from a node can be handled now
+ *
+ * A numbered datagram can be handled only if it is the next one expected from the node.
+ * @param node Id of the sender node
+ * @param hdr Header of the datagram
+ * @param len Length of the peeked data (header included)
+ * @return true if the datagram can be handled now; false if it must go through accept_datagram()
+ */
+bool CommunicationHandler::in_order(int node, const reliable_header& hdr, int len)
+{
+	if (len < (int) sizeof(hdr))
+		return false;
+	if (!(hdr.flags & RELIABLE_SEQUENCED))
+		return true;
+	connection& c = get_connection(node);
+	std::unique_lock<std::mutex> lock (c.reliable_mutex);
+	return hdr.seq == c.receiver.expected;
+}
+
+/**
+ * @brief Method to receive a datagram from a receive channel, scattering it into a set of buffers
+ *
+ * The reliable_header, if any, is received apart and handled (the datagram must have been
+ * found in order by peek_from()).
+ * @param iov Buffers where the datagram must be put
+ * @param iovcnt Number of buffers
+ * @param channel Receive channel
+ * @param node Id of the sender node
+ * @param report_errors false if a datagram longer than the buffers is not an error
+ * @return Number of bytes put into the buffers; -1 in case of error
+ */
+ssize_t CommunicationHandler::recv_datagram(struct iovec* iov, int iovcnt, int channel, int node, bool report_errors)
+{
+	const int MAX_IOVCNT = 8;
+	if (iovcnt >= MAX_IOVCNT) {
+		ERROR("Too many buffers for receiving a datagram");
+		return -1;
+	}
+	reliable_header hdr;
+	struct iovec all [MAX_IOVCNT];
+	all[0].iov_base = &hdr;
+	all[0].iov_len = sizeof(hdr);
+	memcpy(&all[1], iov, iovcnt * sizeof(struct iovec));
+	bool sequenced = is_sequenced(node);
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = sequenced ? &all[0] : &all[1];
+	msg.msg_iovlen = sequenced ? iovcnt + 1 : iovcnt;
 
-	// socket()
-	s.recv_fd = socket(AF_INET, SOCK_DGRAM, 0);
-	if (s.recv_fd < 0) {
-		ERROR("Receive socket creation");
-		throw std::runtime_error ("Receive socket error");
+	ssize_t ret;
+	do {
+		ret = recvmsg(channel_fd(channel), &msg, 0);
+	} while ((ret < 0) && (errno == EINTR));
+	if (sequenced && (ret >= (ssize_t) sizeof(hdr))) {
+		ret -= sizeof(hdr);
+		receive_sequenced(node, false, hdr, nullptr, 0);
+	} else if (sequenced) {
+		ret = -1;
+	}
+	if ((ret < 0) || (report_errors && (msg.msg_flags & MSG_TRUNC))) {
+		ERROR("Error in receiving data from " << addresses_[slot(node)].ip);
+		return -1;
 	}
+	return ret;
+}
 
-	// bind()
-	struct sockaddr_in serv_addr;
-	memset(&serv_addr, 0, sizeof(serv_addr));
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_port = htons(s.recv_port);
-	DEBUG("\t Port for server is " << s.recv_port);
-	serv_addr.sin_addr.s_addr = INADDR_ANY;
-	if (bind(s.recv_fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-		close(s.recv_fd);
-		ERROR("Socket binding");
-		throw std::runtime_error ("Bind error");
+/**
+ * @brief Method to strip the headers of a datagram and check if it can be handled now
+ *
+ * Datagrams from unknown senders are ignored.
+ * Datagrams received from the multicast group (see MULTICAST_CHANNEL) are stripped of their
+ * multicast_header; the ones sent by the node itself (looped back by the kernel) and by nodes
+ * running on the same host (which send through shared memory as well) are ignored.
+ * Hello datagrams received after the handshake are answered and ignored (see handshake()).
+ * Numbered datagrams (see Config::reliable) are stripped of their reliable_header, which
+ * acknowledges the datagrams sent to the node; a datagram received out of order is kept
+ * until the missing ones arrive, and then returned by next_datagram().
+ * @param rem_node_id Pointer to the id of the sender node (see recv_batch::node()); for MULTICAST_CHANNEL,
+ * the id of the sender node is put there
+ * @param data Pointer to the content of the datagram (moved after the headers)
+ * @param len Pointer to the length of the datagram (decreased by the headers)
+ * @return true if the datagram must be handled now; false if it must be ignored
+ * (e.g., acknowledgments only, duplicates, out of order)
+ */
+bool CommunicationHandler::accept_datagram(int* rem_node_id, char** data, std::size_t* len)
+{
+	int node = *rem_node_id;
+	bool multicast = (node == MULTICAST_CHANNEL);
+	if (node < 0) {
+		WARNING("Datagram from unknown sender");
+		return false;
+	}
+	if (!multicast && !is_local(node) && (*len == sizeof(hello_datagram))) {
+		// The node has not received yet the last hello datagram sent by handshake()
+		DEBUG("Answering hello datagram from node " << node);
+		send_hello(node, true);
+		return false;
+	}
+	if (multicast) {
+		if (*len < sizeof(multicast_header)) {
+			ERROR("Malformed multicast datagram of " << *len << " bytes");
+			return false;
+		}
+		node = ((multicast_header*) *data)->node;
+		if ((node < 0) || (node >= number_of_nodes_)) {
+			ERROR("Multicast datagram from unknown node " << node);
+			return false;
+		}
+		if ((node == pbsm_tid) || is_local(node))
+			return false;
+		*rem_node_id = node;
+		*data += sizeof(multicast_header);
+		*len -= sizeof(multicast_header);
+	}
+	if (is_sequenced(node)) {
+		if (*len < sizeof(reliable_header)) {
+			ERROR("Malformed datagram of " << *len << " bytes");
+			return false;
+		}
+		reliable_header hdr;
+		memcpy(&hdr, *data, sizeof(hdr));
+		*data += sizeof(hdr);
+		*len -= sizeof(hdr);
+		if (!receive_sequenced(node, multicast, hdr, *data, *len))
+			return false;
+	}
+	return *len > 0;
+}
+
+/**
+ * @brief Method to get a datagram from a node, received out of order, that can be handled now
+ *
+ * Must be called after handling every datagram passed to accept_datagram(), until it returns false.
+ * @param rem_node_id Id of the sender node, as set by accept_datagram()
+ * @param multicast true if the datagram has been received from the multicast group
+ * @param datagram Buffer where the content of the datagram must be put
+ * @return true if a datagram has been returned; false otherwise
+ */
+bool CommunicationHandler::next_datagram(int rem_node_id, bool multicast, std::vector<char>& datagram)
+{
+	if (!reliable_ || (rem_node_id < 0) || (rem_node_id == MULTICAST_CHANNEL) ||
+	    (slot(rem_node_id) >= (int) addresses_.size()) || !is_sequenced(rem_node_id))
+		return false;
+	connection& c = get_connection(rem_node_id);
+	return pop_in_order(rem_node_id, multicast ? c.multicast_receiver : c.receiver, datagram);
+}
+
+/**
+ * @brief Method to remove the next expected datagram from the ones received out of order
+ * @param node Id of the sender node
+ * @param r Receiving side of the sequence of the datagram
+ * @param datagram Buffer where the content of the datagram must be put
+ * @return true if the datagram has been returned; false if it has not been received yet
+ */
+bool CommunicationHandler::pop_in_order(int node, reliable_receiver& r, std::vector<char>& datagram)
+{
+	std::unique_lock<std::mutex> lock (get_connection(node).reliable_mutex);
+	auto i = r.out_of_order.find(r.expected);
+	if (i == r.out_of_order.end())
+		return false;
+	datagram.swap(i->second);
+	r.out_of_order.erase(i);
+	r.expected++;
+	r.sack >>= 1;
+	return true;
+}
+
+/**
+ * @brief Method to handle the reliable_header of a datagram received from a node
+ *
+ * The acknowledgments carried by the header are handled, and the datagram is checked against
+ * the ones already received. A datagram following a gap is copied, waiting the missing ones.
+ * @param node Id of the sender node
+ * @param multicast true if the datagram has been received from the multicast group
+ * @param hdr Header of the datagram
+ * @param data Content of the datagram (only needed if it can be received out of order)
+ * @param len Length of the content
+ * @return true if the datagram must be handled now; false otherwise
+ */
+bool CommunicationHandler::receive_sequenced(int node, bool multicast, const reliable_header& hdr, const char* data, std::size_t len)
+{
+	connection& c = get_connection(node);
+	reliable_receiver& r = multicast ? c.multicast_receiver : c.receiver;
+	bool multicast_acked = false;
+	std::unique_lock<std::mutex> lock (c.reliable_mutex);
+	c.stats.received++;
+	if (!multicast)
+		multicast_acked = handle_ack(node, hdr);
+
+	bool ret = true;
+	if (hdr.flags & RELIABLE_SEQUENCED) {
+		c.ack_pending = true;
+		std::int32_t distance = hdr.seq - r.expected;
+		if ((distance < 0) ||
+		    ((distance > 0) && (distance <= (std::int32_t) RELIABLE_WINDOW) && (r.sack & (1ULL << (distance - 1))))) {
+			DEBUG("Duplicate datagram " << hdr.seq << " from node " << node);
+			c.stats.duplicates++;
+			ret = false;
+		} else if (distance == 0) {
+			r.expected++;
+			r.sack >>= 1;
+		} else if (distance > (std::int32_t) RELIABLE_WINDOW) {
+			DEBUG("Datagram " << hdr.seq << " from node " << node << " beyond the window");
+			ret = false;
+		} else {
+			DEBUG("Datagram " << hdr.seq << " from node " << node << " out of order (expected " << r.expected << ")");
+			r.sack |= 1ULL << (distance - 1);
+			r.out_of_order[hdr.seq].assign(data, data + len);
+			ret = false;
+		}
+	}
+	lock.unlock();
+
+	if (multicast_acked)
+		release_multicast();
+	return ret;
+}
+
+/**
+ * @brief Method to fill the reliable_header of a datagram to a node
+ *
+ * The header acknowledges the datagrams received so far from the node.
+ * Must be called with reliable_mutex of the node already locked.
+ * @param node Id of the recipient node
+ * @param hdr Header to be filled
+ * @param seq Sequence number of the datagram
+ * @param sequenced true if the datagram is numbered
+ */
+void CommunicationHandler::fill_header(int node, reliable_header* hdr, std::uint32_t seq, bool sequenced)
+{
+	connection& c = get_connection(node);
+	hdr->seq = seq;
+	hdr->ack = c.receiver.expected;
+	hdr->sack = c.receiver.sack;
+	hdr->multicast_ack = c.multicast_receiver.expected;
+	hdr->flags = sequenced ? RELIABLE_SEQUENCED : 0;
+	c.ack_pending = false;
+}
+
+/**
+ * @brief Method to number a datagram and keep a copy of it until acknowledged
+ *
+ * The copy is put into the buffer of a datagram already acknowledged, if big enough
+ * (otherwise, the allocation is counted, see BufferPool::count_allocation()).
+ * Must be called with reliable_mutex of the recipient already locked.
+ * @param s Sending side of the sequence
+ * @param iov Buffers composing the datagram
+ * @param iovcnt Number of buffers
+ * @return Sequence number of the datagram
+ */
+std::uint32_t CommunicationHandler::sequence_datagram(reliable_sender& s, const struct iovec* iov, int iovcnt)
+{
+	unacked_datagram& d = s.unacked.push_back();
+	d.seq = s.next_seq++;
+	std::size_t len = 0;
+	for (int i = 0; i < iovcnt; ++i)
+		len += iov[i].iov_len;
+	if (d.data.capacity() < len) {
+		BufferPool::getInstance().count_allocation();
+		d.data.reserve(std::max<std::size_t>(len, NETWORK_DATAGRAM_SIZE));
+	}
+	d.data.clear();
+	for (int i = 0; i < iovcnt; ++i)
+		d.data.insert(d.data.end(), (char*) iov[i].iov_base, (char*) iov[i].iov_base + iov[i].iov_len);
+	d.sent = std::chrono::steady_clock::now();
+	d.retransmissions = 0;
+	d.sacked = false;
+	d.fast_retransmitted = false;
+	// The recipient drops datagrams too far from the ones it is waiting for (see receive_sequenced())
+	d.held = (d.seq - s.unacked.front().seq >= RELIABLE_WINDOW);
+	return d.seq;
+}
+
+/**
+ * @brief Method to handle the acknowledgments carried by a reliable_header received from a node
+ *
+ * Datagrams acknowledged cumulatively are released, and the ones held beyond the window
+ * sent if now within it (see send_held()). Datagrams missing before the latest one
+ * acknowledged selectively are sent again at once (only once until the timeout expires).
+ * Datagrams never sent again provide samples of the round-trip time (Karn's algorithm).
+ * Must be called with reliable_mutex of the node already locked.
+ * @param node Id of the node
+ * @param hdr Header received from the node
+ * @return true if the node acknowledged new datagrams sent to the multicast group (see release_multicast())
+ */
+bool CommunicationHandler::handle_ack(int node, const reliable_header& hdr)
+{
+	connection& c = get_connection(node);
+	reliable_sender& s = c.sender;
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	while (!s.unacked.empty() && ((std::int32_t) (hdr.ack - s.unacked.front().seq) > 0)) {
+		unacked_datagram& d = s.unacked.front();
+		if ((d.retransmissions == 0) && !d.sacked)
+			sample_rtt(s, std::chrono::duration<double, std::micro>(now - d.sent).count());
+		s.unacked.pop_front();
+	}
+	send_held(node);
+
+	if (hdr.sack != 0) {
+		std::uint32_t highest = hdr.ack + 64 - __builtin_clzll(hdr.sack);
+		for (unacked_datagram& d: s.unacked) {
+			std::int32_t bit = d.seq - hdr.ack - 1;
+			if ((bit >= 0) && (bit < 64) && (hdr.sack & (1ULL << bit))) {
+				if ((d.retransmissions == 0) && !d.sacked)
+					sample_rtt(s, std::chrono::duration<double, std::micro>(now - d.sent).count());
+				d.sacked = true;
+			} else if (!d.sacked && !d.fast_retransmitted && !d.held && ((std::int32_t) (highest - d.seq) > 0)) {
+				DEBUG("Fast retransmit of datagram " << d.seq << " to node " << node);
+				d.fast_retransmitted = true;
+				retransmit(node, d);
+			}
+		}
+	}
+
+	if (multicast_ && ((std::int32_t) (hdr.multicast_ack - c.multicast_acked) > 0)) {
+		c.multicast_acked = hdr.multicast_ack;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Method to update the round-trip time of a node, and the retransmission timeout (RFC 6298)
+ * @param s Sending side of the sequence
+ * @param rtt_us Round-trip time sample (in microseconds)
+ */
+void CommunicationHandler::sample_rtt(reliable_sender& s, double rtt_us)
+{
+	if (s.srtt == 0) {
+		s.srtt = rtt_us;
+		s.rttvar = rtt_us / 2;
+	} else {
+		s.rttvar = 0.75 * s.rttvar + 0.25 * std::fabs(s.srtt - rtt_us);
+		s.srtt = 0.875 * s.srtt + 0.125 * rtt_us;
+	}
+	double rto = s.srtt + 4 * s.rttvar;
+	rto = std::max(rto, (double) Config::getInstance().retransmit_min_us);
+	s.rto = std::min(rto, (double) RELIABLE_MAX_RTO_US);
+}
+
+/**
+ * @brief Method to release the datagrams sent to the multicast group acknowledged by all nodes
+ *
+ * Nodes not yet involved in any communication have acknowledged nothing.
+ */
+void CommunicationHandler::release_multicast()
+{
+	connection& m = get_connection(MULTICAST_CHANNEL);
+	std::unique_lock<std::mutex> lock (m.reliable_mutex);
+	while (!m.sender.unacked.empty()) {
+		std::uint32_t seq = m.sender.unacked.front().seq;
+		for (int i = 0; i < number_of_nodes_; ++i){
+			if ((i == pbsm_tid) || is_local(i))
+				continue;
+			connection* c = find_connection(i);
+			if ((c == nullptr) || ((std::int32_t) (c->multicast_acked - seq) <= 0))
+				return;
+		}
+		m.sender.unacked.pop_front();
+	}
+}
+
+/**
+ * @brief Method to send the copy of a datagram not yet acknowledged
+ *
+ * Must be called with reliable_mutex of the node already locked.
+ * @param node Id of the recipient node (or MULTICAST_CHANNEL)
+ * @param d Datagram
+ * @return true in case of success; false in case of error
+ */
+bool CommunicationHandler::send_unacked(int node, unacked_datagram& d)
+{
+	connection& c = get_connection(node);
+	multicast_header group;
+	reliable_header hdr;
+	struct iovec iov[3];
+	int iovcnt = 0;
+	if (node == MULTICAST_CHANNEL) {
+		group.node = pbsm_tid;
+		group.reserved = 0;
+		iov[iovcnt].iov_base = &group;
+		iov[iovcnt++].iov_len = sizeof(group);
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.seq = d.seq;
+		hdr.flags = RELIABLE_SEQUENCED;
+	} else {
+		fill_header(node, &hdr, d.seq, true);
+	}
+	iov[iovcnt].iov_base = &hdr;
+	iov[iovcnt++].iov_len = sizeof(hdr);
+	iov[iovcnt].iov_base = d.data.data();
+	iov[iovcnt++].iov_len = d.data.size();
+	d.sent = std::chrono::steady_clock::now();
+	return send_datagram(node, iov, iovcnt, c.stats);
+}
+
+/**
+ * @brief Method to send the datagrams to a node held beyond the window, once within it
+ *
+ * Must be called with reliable_mutex of the node already locked.
+ * @param node Id of the recipient node
+ */
+void CommunicationHandler::send_held(int node)
+{
+	reliable_sender& s = get_connection(node).sender;
+	for (unacked_datagram& d: s.unacked) {
+		if (d.seq - s.unacked.front().seq >= RELIABLE_WINDOW)
+			break;
+		if (d.held) {
+			d.held = false;
+			if (!send_unacked(node, d))
+				ERROR("ERROR: Sending data to " << addresses_[slot(node)].ip);
+		}
+	}
+}
+
+/**
+ * @brief Method to send again a datagram not yet acknowledged
+ *
+ * Must be called with reliable_mutex of the node already locked.
+ * @param node Id of the recipient node (or MULTICAST_CHANNEL)
+ * @param d Datagram
+ * @return true in case of success; false in case of error
+ */
+bool CommunicationHandler::retransmit(int node, unacked_datagram& d)
+{
+	connection& c = get_connection(node);
+	if (d.retransmissions == 0)
+		c.stats.lost++;
+	d.retransmissions++;
+	c.stats.retransmitted++;
+	return send_unacked(node, d);
+}
+
+/**
+ * @brief Method to send again the datagrams to a node not acknowledged within a timeout
+ *
+ * Must be called with reliable_mutex of the node already locked.
+ * @param node Id of the recipient node (or MULTICAST_CHANNEL)
+ * @param timeout Timeout
+ * @return true if some datagram has been sent again
+ */
+bool CommunicationHandler::retransmit_older(int node, std::chrono::microseconds timeout)
+{
+	std::chrono::steady_clock::time_point limit = std::chrono::steady_clock::now() - timeout;
+	bool ret = false;
+	for (unacked_datagram& d: get_connection(node).sender.unacked) {
+		if (!d.sacked && !d.held && (d.sent <= limit)) {
+			DEBUG("Timeout of datagram " << d.seq << " to node " << node);
+			d.fast_retransmitted = false;
+			retransmit(node, d);
+			ret = true;
+		}
+	}
+	return ret;
+}
+
+/**
+ * @brief Method to send again the datagrams whose retransmission timeout expired
+ *
+ * This method is executed periodically by the thread started by create_connections().
+ * The timeout of a node is doubled at every expiration, until new round-trip time samples arrive.
+ * Datagrams sent to the multicast group are sent again after twice the largest timeout of the nodes.
+ * Nodes (and bulk lanes) not yet involved in any communication are skipped.
+ */
+void CommunicationHandler::retransmit_expired()
+{
+	unsigned int largest = 0;
+	for (int k = 0; k < (int) addresses_.size(); ++k){
+		int i = id_at(k);
+		connection* p = find_connection(i);
+		if ((i == MULTICAST_CHANNEL) || (node_of(i) == pbsm_tid) || !is_sequenced(i) || (p == nullptr))
+			continue;
+		connection& c = *p;
+		std::unique_lock<std::mutex> lock (c.reliable_mutex);
+		largest = std::max(largest, c.sender.rto);
+		if (retransmit_older(i, std::chrono::microseconds(c.sender.rto)))
+			c.sender.rto = std::min(c.sender.rto * 2, RELIABLE_MAX_RTO_US);
+	}
+	if (multicast_) {
+		std::unique_lock<std::mutex> lock (get_connection(MULTICAST_CHANNEL).reliable_mutex);
+		retransmit_older(MULTICAST_CHANNEL, std::chrono::microseconds(2 * largest));
 	}
 }
 
+/**
+ * @brief Method to send acknowledgments to the nodes having datagrams not yet acknowledged
+ *
+ * It is used when there are no datagrams to the node carrying the acknowledgments.
+ * @return true in case of success; false in case of error
+ */
+bool CommunicationHandler::send_acks()
+{
+	bool ret = true;
+	for (int k = 0; k < (int) addresses_.size(); ++k){
+		int i = id_at(k);
+		connection* p = find_connection(i);
+		if ((i == MULTICAST_CHANNEL) || (node_of(i) == pbsm_tid) || !is_sequenced(i) || (p == nullptr) || !p->ack_pending)
+			continue;
+		connection& c = *p;
+		std::unique_lock<std::mutex> lock (c.reliable_mutex);
+		if (!c.ack_pending)
+			continue;
+		reliable_header hdr;
+		fill_header(i, &hdr, 0, false);
+		struct iovec iov;
+		iov.iov_base = &hdr;
+		iov.iov_len = sizeof(hdr);
+		c.stats.sent++;
+		ret = send_datagram(i, &iov, 1, c.stats) && ret;
+	}
+	return ret;
+}
 
+/**
+ * @brief Method to send a single datagram, gathered from a set of buffers
+ *
+ * The datagram may be dropped on purpose (see Config::loss_injection).
+ * @param node Id of the recipient node (or MULTICAST_CHANNEL, or the bulk lane of a node)
+ * @param iov Buffers composing the datagram
+ * @param iovcnt Number of buffers
+ * @param stats Statistics of the recipient (must be protected by the caller)
+ * @return true in case of success; false in case of error
+ */
+bool CommunicationHandler::send_datagram(int node, struct iovec* iov, int iovcnt, peer_stats& stats)
+{
+	if (inject_loss()) {
+		stats.injected++;
+		return true;
+	}
+	struct msghdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = iov;
+	hdr.msg_iovlen = iovcnt;
+	int fd = multicast_send_fd_;
+	if (node != MULTICAST_CHANNEL) {
+		fd = send_fd(node);
+		hdr.msg_name = &addresses_[slot(node)].addr;
+		hdr.msg_namelen = sizeof(addresses_[slot(node)].addr);
+	}
+	ssize_t n;
+	do {
+		n = sendmsg(fd, &hdr, 0);
+	} while ((n < 0) && (errno == EINTR));
+	return n >= 0;
+}
+
+/**
+ * @brief Method to decide whether to drop a datagram on purpose (see Config::loss_injection)
+ *
+ * Only datagrams carrying a reliable_header can be dropped, since the others are never sent again.
+ */
+bool CommunicationHandler::inject_loss()
+{
+	unsigned int percent = Config::getInstance().loss_injection;
+	if (!reliable_ || (percent == 0))
+		return false;
+	static thread_local std::minstd_rand generator (std::random_device{}());
+	return (generator() % 100) < percent;
+}
+
+/**
+ * @brief Method to get the statistics about the datagrams exchanged with a node
+ * @param node Id of the node (or MULTICAST_CHANNEL)
+ */
+CommunicationHandler::peer_stats CommunicationHandler::get_peer_stats(int node)
+{
+	connection* p = find_connection(node);
+	if (p == nullptr)
+		return peer_stats();
+	connection& c = *p;
+	std::unique_lock<std::mutex> lock (c.reliable_mutex);
+	peer_stats ret = c.stats;
+	ret.rtt_us = c.sender.srtt;
+	return ret;
+}
+
+/**
+ * @brief Method to wait until all datagrams sent over the network have been acknowledged
+ *
+ * Called at exit, so that datagrams lost just before (e.g., the last ones of a barrier) are still
+ * sent again: the wait ends, anyway, after RELIABLE_LINGER_US microseconds (e.g., if the recipient has already exited).
+ * @return true if all datagrams have been acknowledged; false otherwise
+ */
+bool CommunicationHandler::wait_acknowledged()
+{
+	if (!reliable_)
+		return true;
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+	    std::chrono::microseconds(RELIABLE_LINGER_US);
+	for (;;) {
+		flush_all();
+		bool pending = false;
+		for (std::size_t i = 0; (i < addresses_.size()) && !pending; ++i){
+			connection* c = connections_[i].load(std::memory_order_acquire);
+			if (c == nullptr)
+				continue;
+			std::unique_lock<std::mutex> lock (c->reliable_mutex);
+			pending = !c->sender.unacked.empty();
+		}
+		if (!pending)
+			return true;
+		if (std::chrono::steady_clock::now() >= deadline) {
+			WARNING("Exiting with datagrams not yet acknowledged");
+			return false;
+		}
+		std::this_thread::sleep_for(std::chrono::microseconds(Config::getInstance().retransmit_min_us));
+	}
+}
+
+/**
+ * @brief Method to print the statistics about the startup, the buffers and the datagrams exchanged with the nodes over the network
+ *
+ * Heap allocations of the message path are the ones not served by BufferPool (none expected in steady state).
+ * Loss rate and retransmission rate are relative to the datagrams sent.
+ * Statistics about datagrams are collected only when Config::reliable is set.
+ * @param out Stream where statistics must be printed
+ */
+void CommunicationHandler::print_stats(std::ostream& out)
+{
+	out << "Startup: " << startup_.total_us << " us (opening channels " << startup_.open_us
+	    << " us, handshake " << startup_.handshake_us << " us, " << startup_.hellos_sent << " hello datagrams";
+	if (startup_.last_node >= 0)
+		out << ", last node reached " << startup_.last_node;
+	out << ")" << std::endl;
+	out << "Buffers: " << BufferPool::getInstance().get_allocations() << " heap allocations, "
+	    << BufferPool::getInstance().get_reuses() << " reused" << std::endl;
+	if (!reliable_)
+		return;
+	for (int k = 0; k < (int) addresses_.size(); ++k){
+		int i = id_at(k);
+		if ((node_of(i) == pbsm_tid) || ((i == MULTICAST_CHANNEL) && !multicast_) || addresses_[k].local ||
+		    (find_connection(i) == nullptr))
+			continue;
+		peer_stats s = get_peer_stats(i);
+		double sent = std::max<std::uint64_t>(s.sent, 1);
+		if (i == MULTICAST_CHANNEL)
+			out << "Multicast group " << addresses_[k].ip << ": ";
+		else if (i >= BULK_LANE)
+			out << "Node " << node_of(i) << " bulk lane (" << addresses_[k].ip << "): ";
+		else
+			out << "Node " << i << " (" << addresses_[k].ip << "): ";
+		out << "sent " << s.sent << ", received " << s.received
+		    << ", lost " << s.lost << " (" << 100 * s.lost / sent << "%)"
+		    << ", retransmitted " << s.retransmitted << " (" << 100 * s.retransmitted / sent << "%)"
+		    << ", duplicates " << s.duplicates << ", dropped by loss_injection " << s.injected;
+		if (i != MULTICAST_CHANNEL)
+			out << ", RTT " << s.rtt_us << " us";
+		out << std::endl;
+	}
+}
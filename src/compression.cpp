@@ -0,0 +1,214 @@
+#include <cstring>	// memcpy(), memset()
+#include <cstdint>
+
+#include "compression.hpp"
+
+/// Minimum length of a match
+const std::size_t MIN_MATCH = 4;
+
+/// Number of bytes at the end of a value always sent as literals
+const std::size_t LAST_LITERALS = 5;
+
+/// Minimum distance from the end of a value for the beginning of a match
+const std::size_t MATCH_LIMIT = 12;
+
+/// Maximum distance of a match (offsets are 16 bits)
+const std::size_t MAX_OFFSET = 65535;
+
+/// Number of bits of the hash of 4-byte sequences
+const int HASH_BITS = 12;
+
+static inline std::uint32_t read32(const unsigned char* p)
+{
+	std::uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline std::uint32_t hash(std::uint32_t sequence)
+{
+	return (sequence * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/**
+ * @brief Write a length exceeding the 4 bits of the token, as a run of bytes
+ * @return Pointer after the written bytes; nullptr if there is no room
+ */
+static inline unsigned char* write_length(unsigned char* op, const unsigned char* end, std::size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op >= end)
+			return nullptr;
+		*op++ = 255;
+	}
+	if (op >= end)
+		return nullptr;
+	*op++ = len;
+	return op;
+}
+
+/**
+ * @brief Write a sequence (literals, possibly followed by a match)
+ * @param op Position in the output
+ * @param end End of the output
+ * @param literals Literals
+ * @param literals_len Number of literals
+ * @param offset Distance of the match (0 for the last sequence, without a match)
+ * @param match_len Length of the match
+ * @return Pointer after the sequence; nullptr if there is no room
+ */
+static unsigned char* write_sequence(unsigned char* op, const unsigned char* end, const unsigned char* literals,
+				     std::size_t literals_len, std::size_t offset, std::size_t match_len)
+{
+	if (op >= end)
+		return nullptr;
+	unsigned char* token = op++;
+	*token = (literals_len < 15 ? literals_len : 15) << 4;
+	if ((literals_len >= 15) && ((op = write_length(op, end, literals_len - 15)) == nullptr))
+		return nullptr;
+	if ((std::size_t) (end - op) < literals_len)
+		return nullptr;
+	if (literals_len > 0)
+		memcpy(op, literals, literals_len);
+	op += literals_len;
+	if (offset == 0)
+		return op;
+
+	if (end - op < 2)
+		return nullptr;
+	*op++ = offset & 0xFF;
+	*op++ = offset >> 8;
+	std::size_t code = match_len - MIN_MATCH;
+	*token |= (code < 15 ? code : 15);
+	if (code >= 15)
+		op = write_length(op, end, code - 15);
+	return op;
+}
+
+/**
+ * @brief Compress a value
+ *
+ * Matches are found through a hash table of the latest position of every 4-byte sequence;
+ * the search skips faster and faster over data without matches.
+ * @param src Value
+ * @param size Size of the value
+ * @param dst Buffer where the compressed value must be put
+ * @param capacity Size of the buffer
+ * @return Size of the compressed value; 0 if it doesn't fit the buffer
+ * (e.g., with capacity less than size, because the value can't be compressed enough)
+ */
+std::size_t compress(const char* src, std::size_t size, char* dst, std::size_t capacity)
+{
+	const unsigned char* in = (const unsigned char*) src;
+	unsigned char* op = (unsigned char*) dst;
+	const unsigned char* end = op + capacity;
+	std::size_t anchor = 0;
+
+	if (size > MATCH_LIMIT) {
+		std::uint32_t table [1 << HASH_BITS];
+		memset(table, 0, sizeof(table));
+		std::size_t limit = size - MATCH_LIMIT;
+		std::size_t ip = 0;
+		while (ip < limit) {
+			std::uint32_t sequence = read32(in + ip);
+			std::uint32_t h = hash(sequence);
+			std::size_t ref = table[h];
+			table[h] = ip;
+			if ((ref >= ip) || (ip - ref > MAX_OFFSET) || (read32(in + ref) != sequence)) {
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+			while ((ip > anchor) && (ref > 0) && (in[ip - 1] == in[ref - 1])) {
+				ip--;
+				ref--;
+			}
+			std::size_t len = MIN_MATCH;
+			while ((ip + len < size - LAST_LITERALS) && (in[ip + len] == in[ref + len]))
+				len++;
+			op = write_sequence(op, end, in + anchor, ip - anchor, ip - ref, len);
+			if (op == nullptr)
+				return 0;
+			ip += len;
+			anchor = ip;
+			if (ip < limit)
+				table[hash(read32(in + ip - 2))] = ip - 2;
+		}
+	}
+
+	op = write_sequence(op, end, in + anchor, size - anchor, 0, 0);
+	if (op == nullptr)
+		return 0;
+	return op - (unsigned char*) dst;
+}
+
+/**
+ * @brief Decompress a value
+ *
+ * Malformed input (e.g., a truncated or corrupted buffer) is detected and never
+ * makes the method read or write out of the buffers. Truncated input can't always be detected
+ * (e.g., if cut right after the literals of a sequence): the caller must check the size returned.
+ * @param src Compressed value
+ * @param size Size of the compressed value
+ * @param dst Buffer where the value must be put
+ * @param capacity Size of the buffer
+ * @return Size of the value; 0 if the compressed value is malformed or doesn't fit the buffer
+ */
+std::size_t decompress(const char* src, std::size_t size, char* dst, std::size_t capacity)
+{
+	const unsigned char* ip = (const unsigned char*) src;
+	const unsigned char* in_end = ip + size;
+	unsigned char* op = (unsigned char*) dst;
+	unsigned char* out_end = op + capacity;
+
+	while (ip < in_end) {
+		unsigned int token = *ip++;
+		std::size_t len = token >> 4;
+		if (len == 15) {
+			unsigned char b;
+			do {
+				if (ip >= in_end)
+					return 0;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		if (((std::size_t) (in_end - ip) < len) || ((std::size_t) (out_end - op) < len))
+			return 0;
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+		if (ip == in_end)
+			return op - (unsigned char*) dst;	// Last sequence, without a match
+
+		if (in_end - ip < 2)
+			return 0;
+		std::size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if ((offset == 0) || (offset > (std::size_t) (op - (unsigned char*) dst)))
+			return 0;
+		len = token & 15;
+		if (len == 15) {
+			unsigned char b;
+			do {
+				if (ip >= in_end)
+					return 0;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		len += MIN_MATCH;
+		if ((std::size_t) (out_end - op) < len)
+			return 0;
+		const unsigned char* match = op - offset;
+		if (offset >= len) {
+			memcpy(op, match, len);
+			op += len;
+		} else {
+			// Overlapping match (e.g., a run of the same byte)
+			for (std::size_t i = 0; i < len; ++i)
+				*op++ = *match++;
+		}
+	}
+	// The last sequence is always made of literals only (see compress())
+	return 0;
+}
@@ -0,0 +1,146 @@
+#include <stdexcept>
+
+#include "config.hpp"
+#include "logger.hpp"
+
+// Initialization of static attributes:
+std::atomic<Config*> Config::m_ (nullptr);
+std::mutex Config::mutex_;
+
+/**
+ * @brief Constructor
+ *
+ * It only sets the default value of all options.
+ */
+Config::Config():
+	flush_deadline_us(100),
+	batch_datagrams(8),
+	receive_threads(2),
+	transport(transport_t::SOCKETS),
+	shared_memory(true),
+	fragment_window(64),
+	fragment_timeout_us(20000),
+	multicast_port(1999),
+	reliable(true),
+	retransmit_min_us(1000),
+	loss_injection(0),
+	handshake_timeout_ms(60000),
+	bulk_lane(false),
+	udp_offload(false),
+	socket_buffer_kb(0),
+	socket_priority(0),
+	busy_poll_us(0),
+	spin_poll_us(0),
+	compression(false),
+	compression_threshold(512),
+	delta_updates(false),
+	delta_threshold(4096),
+	pingpong_migrations(0),
+	pingpong_window_us(10000)
+{
+}
+
+/**
+ * @brief Method to set an option
+ *
+ * This method is called by CommunicationHandler::CommunicationHandler() for every
+ * "key = value" line found in /etc/pbsm/hosts.conf.
+ * @param key Name of the option
+ * @param value Value of the option (not yet parsed)
+ * @return true in case of success; false if the option is unknown or the value is malformed
+ */
+bool Config::set(const std::string& key, const std::string& value)
+{
+	DEBUG("Setting option " << key << " to " << value);
+	try {
+		if (key == "flush_deadline_us") {
+			flush_deadline_us = std::stoul(value);
+		} else if (key == "batch_datagrams") {
+			batch_datagrams = std::stoul(value);
+			if (batch_datagrams < 2) {
+				WARNING("batch_datagrams must be at least 2");
+				batch_datagrams = 2;
+			}
+		} else if (key == "receive_threads") {
+			receive_threads = std::stoul(value);
+		} else if (key == "transport") {
+			if (value == "sockets") {
+				transport = transport_t::SOCKETS;
+			} else if (value == "io_uring") {
+				transport = transport_t::IO_URING;
+			} else {
+				ERROR("Wrong value " << value << " for option " << key);
+				return false;
+			}
+		} else if (key == "shared_memory") {
+			shared_memory = (std::stoul(value) != 0);
+		} else if (key == "fragment_window") {
+			fragment_window = std::stoul(value);
+			if (fragment_window < 4) {
+				WARNING("fragment_window must be at least 4");
+				fragment_window = 4;
+			}
+		} else if (key == "fragment_timeout_us") {
+			fragment_timeout_us = std::stoul(value);
+			if (fragment_timeout_us == 0) {
+				WARNING("fragment_timeout_us must be greater than 0");
+				fragment_timeout_us = 1;
+			}
+		} else if (key == "multicast_group") {
+			multicast_group = value;
+		} else if (key == "multicast_port") {
+			multicast_port = std::stoul(value);
+		} else if (key == "reliable") {
+			reliable = (std::stoul(value) != 0);
+		} else if (key == "retransmit_min_us") {
+			retransmit_min_us = std::stoul(value);
+			if (retransmit_min_us == 0) {
+				WARNING("retransmit_min_us must be greater than 0");
+				retransmit_min_us = 1;
+			}
+		} else if (key == "loss_injection") {
+			loss_injection = std::stoul(value);
+			if (loss_injection > 100) {
+				WARNING("loss_injection must be at most 100");
+				loss_injection = 100;
+			}
+		} else if (key == "handshake_timeout_ms") {
+			handshake_timeout_ms = std::stoul(value);
+			if (handshake_timeout_ms == 0) {
+				WARNING("handshake_timeout_ms must be greater than 0");
+				handshake_timeout_ms = 1;
+			}
+		} else if (key == "bulk_lane") {
+			bulk_lane = (std::stoul(value) != 0);
+		} else if (key == "udp_offload") {
+			udp_offload = (std::stoul(value) != 0);
+		} else if (key == "socket_buffer_kb") {
+			socket_buffer_kb = std::stoul(value);
+		} else if (key == "socket_priority") {
+			socket_priority = std::stoul(value);
+		} else if (key == "busy_poll_us") {
+			busy_poll_us = std::stoul(value);
+		} else if (key == "spin_poll_us") {
+			spin_poll_us = std::stoul(value);
+		} else if (key == "compression") {
+			compression = (std::stoul(value) != 0);
+		} else if (key == "compression_threshold") {
+			compression_threshold = std::stoul(value);
+		} else if (key == "delta_updates") {
+			delta_updates = (std::stoul(value) != 0);
+		} else if (key == "delta_threshold") {
+			delta_threshold = std::stoul(value);
+		} else if (key == "pingpong_migrations") {
+			pingpong_migrations = std::stoul(value);
+		} else if (key == "pingpong_window_us") {
+			pingpong_window_us = std::stoul(value);
+		} else {
+			WARNING("Unknown option " << key);
+			return false;
+		}
+	} catch (const std::exception& e) {
+		ERROR("Wrong value " << value << " for option " << key);
+		return false;
+	}
+	return true;
+}
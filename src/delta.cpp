@@ -0,0 +1,113 @@
+#include <cstring>	// memcmp(), memcpy()
+#include <algorithm>	// std::min()
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "delta.hpp"
+
+/// Check if two blocks of DELTA_BLOCK_SIZE bytes are equal
+static inline bool same_block(const char* a, const char* b)
+{
+#ifdef __SSE2__
+	__m128i x = _mm_loadu_si128((const __m128i*) a);
+	__m128i y = _mm_loadu_si128((const __m128i*) b);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xFFFF;
+#else
+	return memcmp(a, b, DELTA_BLOCK_SIZE) == 0;
+#endif
+}
+
+/// Check if two (possibly partial) blocks are equal
+static inline bool same(const char* a, const char* b, std::size_t len)
+{
+	return (len == DELTA_BLOCK_SIZE) ? same_block(a, b) : (memcmp(a, b, len) == 0);
+}
+
+/**
+ * @brief Append a range of a value to a buffer
+ * @return true in case of success; false if the range doesn't fit the limit
+ */
+static inline bool append_range(const char* value, std::size_t start, std::size_t end, std::vector<char>& out, std::size_t limit)
+{
+	delta_run run;
+	run.offset = start;
+	run.length = end - start;
+	if (out.size() + sizeof(run) + run.length > limit)
+		return false;
+	out.insert(out.end(), (const char*) &run, (const char*) &run + sizeof(run));
+	out.insert(out.end(), value + start, value + end);
+	return true;
+}
+
+/**
+ * @brief Append to a buffer the ranges of a value changed with respect to its twin
+ *
+ * Consecutive changed blocks are merged into a single range.
+ * Exact ranges contain only changed bytes (i.e., ranges are split at the unchanged bytes
+ * of the changed blocks), so that they can be merged with the ranges changed by other nodes
+ * (see MSG_FLAG_RELEASE).
+ * @param twin Previous version of the value
+ * @param value Current version of the value
+ * @param size Size of the value
+ * @param out Buffer where the ranges must be appended
+ * @param limit Maximum size of the buffer
+ * @param exact true for exact ranges
+ * @return true in case of success; false if the ranges don't fit the limit (the buffer is then meaningless)
+ */
+bool diff_ranges(const char* twin, const char* value, std::size_t size, std::vector<char>& out, std::size_t limit, bool exact)
+{
+	std::size_t pos = 0;
+	while (pos < size) {
+		std::size_t len = std::min(DELTA_BLOCK_SIZE, size - pos);
+		if (same(twin + pos, value + pos, len)) {
+			pos += len;
+			continue;
+		}
+		std::size_t start = pos;
+		for (pos += len; pos < size; pos += len) {
+			len = std::min(DELTA_BLOCK_SIZE, size - pos);
+			if (same(twin + pos, value + pos, len))
+				break;
+		}
+
+		if (!exact) {
+			if (!append_range(value, start, pos, out, limit))
+				return false;
+			continue;
+		}
+		for (std::size_t i = start; i < pos;) {
+			for (; (i < pos) && (twin[i] == value[i]); ++i);
+			std::size_t first = i;
+			for (; (i < pos) && (twin[i] != value[i]); ++i);
+			if ((i > first) && !append_range(value, first, i, out, limit))
+				return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Apply to a value the ranges produced by diff_ranges()
+ * @param ranges Ranges
+ * @param len Size of the ranges
+ * @param value Value to be updated
+ * @param size Size of the value
+ * @return true in case of success; false if the ranges are malformed (the value may be partially updated)
+ */
+bool apply_ranges(const char* ranges, std::size_t len, char* value, std::size_t size)
+{
+	const char* end = ranges + len;
+	while (ranges < end) {
+		delta_run run;
+		if ((std::size_t) (end - ranges) < sizeof(run))
+			return false;
+		memcpy(&run, ranges, sizeof(run));
+		ranges += sizeof(run);
+		if (((std::size_t) (end - ranges) < run.length) || (run.offset > size) || (run.length > size - run.offset))
+			return false;
+		memcpy(value + run.offset, ranges, run.length);
+		ranges += run.length;
+	}
+	return true;
+}
@@ -1,236 +1,1988 @@
 #include "policy.hpp"
 
-Policy* Policy::m_ = nullptr;
+std::atomic<Policy*> Policy::m_ (nullptr);
 std::mutex Policy::mutex_;
 
+/// Number of consecutive timeouts after which a fragmented transfer is abandoned
+const unsigned int FRAGMENT_MAX_RETRIES = 100;
+
 /**
- * @brief Method for receiving messages on a specific UDP channel connected to a specific node.
+ * @brief Method for receiving messages on a specific UDP channel.
  *
- * We have several concurrent executions of this method, executed on different threads.
- * @param node_id	ID of the remote node
+ * This method is executed by the dedicated thread of the channel, when Config::receive_threads is 0 (and always for BULK_CHANNEL).
+ * Messages sent while handling a batch are flushed once the whole batch has been handled.
+ * @param channel	Receive channel (see CommunicationHandler::peek_from())
  */
 
-void Policy::receive_messages(int rem_node)
+void Policy::receive_messages(int channel)
 {
-	DEBUG("TID of thread for receiving data for rem_node " << rem_node << " is " << std::this_thread::get_id());
+	DEBUG("TID of thread for receiving data from channel " << channel << " is " << std::this_thread::get_id());
+	CommunicationHandler::recv_batch batch (Config::getInstance().batch_datagrams);
 	for(;;) {
-		msg_t msg;
-		DEBUG("Receiving new message...");
-		if (!CommunicationHandler::getInstance().recv_from(&msg, sizeof(msg), rem_node)){
-			ERROR("Error in receiving message");
-		} else {
-			DEBUG(sizeof(msg) << " bytes received.");
+		DEBUG("Waiting new messages...");
+		receive_datagrams(channel, batch, true);
+		CommunicationHandler::getInstance().flush_all();
+	}
+}
+
+/**
+ * @brief Method for receiving messages on all UDP channels.
+ *
+ * This method is executed by each one of the Config::receive_threads threads.
+ * It waits until some channels become readable and then drains them.
+ * Thanks to one-shot notification, a channel is drained by a single thread at a time,
+ * so messages from the same node (which always arrive on the same channel) are handled in order.
+ * Messages sent while handling the channels are flushed once all channels have been drained.
+ */
+void Policy::receive_messages_from_all()
+{
+	DEBUG("TID of thread for receiving data from all nodes is " << std::this_thread::get_id());
+	CommunicationHandler::recv_batch batch (Config::getInstance().batch_datagrams);
+	int channels [MAX_READY_CHANNELS];
+	for(;;) {
+		DEBUG("Waiting new messages...");
+		int n = CommunicationHandler::getInstance().wait_readable(channels, MAX_READY_CHANNELS);
+		for (int i = 0; i < n; ++i) {
+			DEBUG("Draining channel " << channels[i]);
+			while (receive_datagrams(channels[i], batch, false))
+				;
+			CommunicationHandler::getInstance().rearm(channels[i]);
 		}
+		CommunicationHandler::getInstance().flush_all();
+	}
+}
 
-		switch (msg.type) {
-		case (msg_type_t::MSG_REQUEST_OWNERSHIP): {
-			DEBUG("Received new message of type MSG_REQUEST_OWNERSHIP");
+/**
+ * @brief Method for receiving and handling the datagrams queued on a UDP channel.
+ *
+ * The beginning of the next datagram is peeked first: a datagram carrying a value
+ * (i.e., MSG_SET_NEW_VALUE) is received directly into the destination variable by receive_value(),
+ * and a fragment of a value (i.e., MSG_VALUE_FRAGMENT) by handle_fragment().
+ * Otherwise, all queued datagrams are received in a batch (each datagram possibly containing several
+ * messages) and their messages are dispatched one by one to handle_message().
+ * Datagrams of the multicast group are always received in a batch, since they start with a multicast_header.
+ * So are datagrams received out of order (see CommunicationHandler::peek_from()).
+ * @param channel	Receive channel (see CommunicationHandler::peek_from())
+ * @param batch		Buffers for receiving the datagrams
+ * @param block		true to wait until a datagram is available
+ * @return		false if no datagram was available (only when not blocking); true otherwise
+ */
+bool Policy::receive_datagrams(int channel, CommunicationHandler::recv_batch& batch, bool block)
+{
+	fragment_header first;
+	int sender;
+	int ret = CommunicationHandler::getInstance().peek_from(&first, sizeof(first), channel, &sender, block);
+	if (ret < 0)
+		return block;
+	if (sender != MULTICAST_CHANNEL) {
+		if ((ret >= (int) sizeof(msg_t)) &&
+		    (first.msg.type == msg_type_t::MSG_SET_NEW_VALUE) &&
+		    receive_value(sender, channel, first.msg)) {
+			deliver_in_order(sender, false);
+			return true;
+		}
+		if ((ret == sizeof(first)) && (first.msg.type == msg_type_t::MSG_VALUE_FRAGMENT)) {
+			handle_fragment(sender, first.msg, first.fragment, nullptr, channel);
+			return true;
+		}
+	}
 
-			// Check if we're still owners of the variable
-			bool ret = false;
-			var_data* v = dictionary_[msg.id];
-			if (v != nullptr){
-				std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
-				//DEBUG("Current state of variable is " << v->policy_data_.state_ );
-				if ((v->policy_data_.state_ == state::OWNER_NO_SHARED) ||
-				    (v->policy_data_.state_ == state::OWNER_SHARED)) {
-
-					// We are owners: disable ownership and grant ownership.
-					DEBUG("We are still owners of the variable. Change owner.");
-					v->policy_data_.state_ = state::REMOTE_OWNER_NO_CACHED;
-					v->policy_data_.remote_owner_= msg.data.node;
-
-					DEBUG("Sending MSG_GRANT_OWNERSHIP...");
-					msg_t ans;
-					ans.type = msg_type_t::MSG_GRANT_OWNERSHIP;
-					ans.data.node = pbsm_tid;
-					ans.id = msg.id;
-					if (!CommunicationHandler::getInstance().send_to(&ans, sizeof(ans), msg.data.node))
-						ERROR("ERROR in sending grant message to " << msg.data.node);
-				} else {
-					// We are not owners: send the new owner to the requesting node.
-					DEBUG("We are not owners anymore. Sending MSG_SET_NEW_OWNER to the requesting node...");
+	DEBUG("Receiving new batch of messages...");
+	int n = CommunicationHandler::getInstance().recv_batch_from(batch, channel);
+	if (n < 0){
+		ERROR("Error in receiving messages");
+		return block;
+	}
+	DEBUG(n << " datagrams received.");
 
-					DEBUG("Sending MSG_SET_NEW_OWNER...");
-					msg_t ans;
-					ans.type = msg_type_t::MSG_SET_NEW_OWNER;
-					ans.data.node = v->policy_data_.remote_owner_;
-					ans.id = msg.id;
+	for (int i = 0; i < n; ++i)
+		dispatch_datagram(batch.node(i), batch.data(i), batch.size(i));
+	return true;
+}
 
-					if (!CommunicationHandler::getInstance().send_to(&ans, sizeof(ans), msg.data.node))
-						ERROR("ERROR in sending MSG_SET_NEW_OWNER message to " << msg.data.node);
-				}
+/**
+ * @brief Method for receiving messages through io_uring from all nodes.
+ *
+ * This method is executed by the single receiving thread started when CommunicationHandler
+ * uses io_uring. Datagrams are received by the multishot receives into the buffers provided
+ * to the kernel, and given back once handled.
+ * Messages sent while handling the datagrams are flushed once all datagrams have been handled.
+ */
+void Policy::receive_completions()
+{
+	DEBUG("TID of thread for receiving data through io_uring is " << std::this_thread::get_id());
+	std::vector<received_datagram> datagrams (URING_RECV_BUFFERS);
+	for(;;) {
+		DEBUG("Waiting new messages...");
+		int n = CommunicationHandler::getInstance().wait_datagrams(&datagrams[0], datagrams.size());
+		DEBUG(n << " datagrams received.");
+		for (int i = 0; i < n; ++i)
+			dispatch_datagram(datagrams[i].node, datagrams[i].data, datagrams[i].size);
+		CommunicationHandler::getInstance().release_datagrams(&datagrams[0], n);
+		CommunicationHandler::getInstance().flush_all();
+	}
+}
+
+/**
+ * @brief Method for receiving messages from a node running on the same host.
+ *
+ * This method is executed by the dedicated thread of the node, and reads the datagrams
+ * in place from the shared memory ring (i.e., values are copied only into the destination variable).
+ * Messages sent while handling the datagrams are flushed once the ring is empty.
+ * @param rem_node	ID of the remote node
+ */
+void Policy::receive_local_messages(int rem_node)
+{
+	DEBUG("TID of thread for receiving data through shared memory from rem_node " << rem_node << " is " << std::this_thread::get_id());
+	for(;;) {
+		DEBUG("Waiting new messages...");
+		std::size_t len;
+		char* data = CommunicationHandler::getInstance().peek_local(rem_node, &len, true);
+		do {
+			dispatch_datagram(rem_node, data, len);
+			CommunicationHandler::getInstance().consume_local(rem_node);
+			data = CommunicationHandler::getInstance().peek_local(rem_node, &len, false);
+		} while (data != nullptr);
+		CommunicationHandler::getInstance().flush_all();
+	}
+}
+
+/**
+ * @brief Method for handling a datagram received from a remote node.
+ *
+ * The headers added by CommunicationHandler are stripped first (see CommunicationHandler::accept_datagram()).
+ * Then the datagram, and any datagram previously received out of order that can now be handled
+ * (see deliver_in_order()), are passed to handle_datagram().
+ * @param sender	ID of the sender (-1 if unknown, MULTICAST_CHANNEL for the multicast group,
+ *			see CommunicationHandler::node_of() for bulk lanes)
+ * @param data		Content of the datagram
+ * @param len		Length of the datagram
+ */
+void Policy::dispatch_datagram(int sender, char* data, std::size_t len)
+{
+	int rem_node = sender;
+	if (CommunicationHandler::getInstance().accept_datagram(&rem_node, &data, &len))
+		handle_datagram(CommunicationHandler::getInstance().node_of(rem_node), data, len);
+	deliver_in_order(rem_node, sender == MULTICAST_CHANNEL);
+}
+
+/**
+ * @brief Method for handling the datagrams received out of order from a remote node, once the missing ones arrived.
+ * @param sender	ID of the sender, as set by CommunicationHandler::accept_datagram()
+ * @param multicast	true for the datagrams received from the multicast group
+ */
+void Policy::deliver_in_order(int sender, bool multicast)
+{
+	std::vector<char> datagram;
+	while (CommunicationHandler::getInstance().next_datagram(sender, multicast, datagram))
+		handle_datagram(CommunicationHandler::getInstance().node_of(sender), &datagram[0], datagram.size());
+}
+
+/**
+ * @brief Method for handling a datagram received from a remote node.
+ *
+ * A datagram contains either a MSG_SET_NEW_VALUE followed by the value, a MSG_VALUE_FRAGMENT
+ * or MSG_VALUE_FRAGMENT_ACK followed by its data, a MSG_GRANT_OWNERSHIP followed by the nodes
+ * sharing the variable, a MSG_SHIP_WRITE or MSG_WRITE_DONE followed by its data, or a sequence
+ * of messages, which are dispatched one by one to handle_message().
+ * @param rem_node	ID of the remote node
+ * @param data		Content of the datagram
+ * @param len		Length of the datagram
+ */
+void Policy::handle_datagram(int rem_node, char* data, std::size_t len)
+{
+	msg_t* msg = (msg_t*) data;
+	if ((len >= sizeof(msg_t)) && (msg->type == msg_type_t::MSG_SET_NEW_VALUE)) {
+		// Value not received directly into the variable: it is set from the datagram
+		if (len == sizeof(msg_t) + msg->data.var_size)
+			handle_message(rem_node, *msg, msg + 1);
+		else
+			ERROR("Malformed datagram of MSG_SET_NEW_VALUE of " << len << " bytes");
+		return;
+	}
+	if ((len >= sizeof(fragment_header)) && (msg->type == msg_type_t::MSG_VALUE_FRAGMENT)) {
+		fragment_header* hdr = (fragment_header*) data;
+		if (len == sizeof(fragment_header) + hdr->fragment.length)
+			handle_fragment(rem_node, hdr->msg, hdr->fragment, data + sizeof(fragment_header), -1);
+		else
+			ERROR("Malformed datagram of MSG_VALUE_FRAGMENT of " << len << " bytes");
+		return;
+	}
+	if ((len >= sizeof(msg_t)) && ((msg->type == msg_type_t::MSG_GRANT_OWNERSHIP) ||
+	    (msg->type == msg_type_t::MSG_SHIP_WRITE) || (msg->type == msg_type_t::MSG_WRITE_DONE))) {
+		if (len == sizeof(msg_t) + msg->data.var_size)
+			handle_message(rem_node, *msg, msg + 1);
+		else
+			ERROR("Malformed datagram of message " << (int) msg->type << " of " << len << " bytes");
+		return;
+	}
+	if ((len >= sizeof(msg_t)) && (msg->type == msg_type_t::MSG_VALUE_FRAGMENT_ACK)) {
+		if (len == sizeof(msg_t) + sizeof(fragment_ack_t))
+			handle_fragment_ack(rem_node, *msg, *(fragment_ack_t*) (msg + 1));
+		else
+			ERROR("Malformed datagram of MSG_VALUE_FRAGMENT_ACK of " << len << " bytes");
+		return;
+	}
+	if ((len == 0) || (len % sizeof(msg_t) != 0)) {
+		ERROR("Malformed datagram of " << len << " bytes");
+		return;
+	}
+	for (std::size_t k = 0; k < len / sizeof(msg_t); ++k)
+		handle_message(rem_node, msg[k], nullptr);
+}
+
+/**
+ * @brief Method for receiving a value directly into the destination variable
+ *
+ * This method is called by receive_messages() when the next datagram carries a value.
+ * The datagram is scattered into the raw storage of the variable, without intermediate copies.
+ * @param sender	ID of the sender (as returned by CommunicationHandler::peek_from())
+ * @param channel	Receive channel the datagram has been peeked from
+ * @param msg		Message at the beginning of the datagram (already peeked)
+ * @return		true if the datagram has been consumed; false if it must be received
+ *			through the ordinary path (e.g., variable unknown, not transferable as raw bytes,
+ *			or encoded: it is then decoded from the datagram into the variable, see set_encoded_value())
+ */
+bool Policy::receive_value(int sender, int channel, const msg_t& msg)
+{
+	if ((msg.flags & ~MSG_FLAG_UPDATE) != 0)
+		return false;
+	dictionary<var_data>::reader guard (dictionary_);
+	var_data* v = dictionary_.find(msg.id);
+	if (v == nullptr)
+		return false;
+
+	std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+	AbstractShared* var = v->variable_;
+	if ((var == nullptr) || (var->get_size() != msg.data.var_size))
+		return false;
+
+	// Values dropped are acknowledged through the ordinary path
+	if ((var->value_buffer() == nullptr) || !accepts_value(v, msg.flags))
+		return false;
+
+	begin_remote_write(v);
+	var->lock_value();
+	DEBUG("Receiving " << msg.data.var_size << " bytes directly into variable " << msg.id);
+	msg_t hdr;
+	bool ret = CommunicationHandler::getInstance().recv_value_from(&hdr, sizeof(hdr), var->value_buffer(), msg.data.var_size, channel, sender);
+	var->unlock_value();
+	end_remote_write(v);
+	v->policy_data_.version_ = 0;
+	if (ret) {
+		after_remote_write(v);
+		DEBUG("New value succesfully set");
+	} else {
+		ERROR("Error in receiving data of MSG_SET_NEW_VALUE");
+	}
+	if (msg.flags & MSG_FLAG_UPDATE)
+		send_release_ack(CommunicationHandler::getInstance().node_of(sender), msg.id);
+	return true;
+}
+
+/**
+ * @brief Method for answering MSG_ASK_CURRENT_VALUE: the requester is recorded as sharer and gets the value.
+ *
+ * Must be called with lock already acquired.
+ * @param v		Pointer to var_data of the variable (owned by this node)
+ * @param rem_node	ID of the requesting node
+ */
+void Policy::send_current_value(var_data* v, int rem_node)
+{
+	DEBUG("Setting cached status to variable " << v->variable_->get_id());
+	set_state(v, state::OWNER_SHARED);
+	v->policy_data_.sharers_.insert(rem_node);
+	if (!send_value(v, rem_node))
+		ERROR("ERROR in sending MSG_SET_NEW_VALUE message to " << rem_node);
+}
+
+/**
+ * @brief Method for sending the current value of a variable to a remote node.
+ *
+ * The value is sent directly from the raw storage of the variable, if possible.
+ * Otherwise, it is serialized through get_value().
+ * Values too big for a single datagram are sent in fragments from a snapshot (see send_fragmented_value()),
+ * and so are values to be compressed (see compressible()) before compressing them.
+ * Must be called with lock already acquired.
+ * @param v		Pointer to var_data of the variable
+ * @param rem_node	ID of the recipient node
+ * @param flags		Flags of the value (MSG_FLAG_UPDATE for a write-update)
+ * @return		true in case of success; false in case of network error
+ */
+bool Policy::send_value(var_data* v, unsigned long int rem_node, uint16_t flags)
+{
+	AbstractShared* var = v->variable_;
+	msg_t ans;
+	ans.type = msg_type_t::MSG_SET_NEW_VALUE;
+	ans.flags = flags;
+	ans.id = var->get_id();
+	ans.data.var_size = var->get_size();
+
+	bool compress = compressible(var->get_compression(), ans.data.var_size, rem_node);
+	if (compress || (sizeof(ans) + ans.data.var_size > (std::size_t) CommunicationHandler::getInstance().datagram_size(rem_node))) {
+		std::vector<char> data;
+		BufferPool::getInstance().acquire(data, ans.data.var_size);
+		var->lock_value();
+		void* buffer = var->value_buffer();
+		if (buffer != nullptr)
+			memcpy(&data[0], buffer, ans.data.var_size);
+		var->unlock_value();
+		if (buffer == nullptr)
+			var->get_value(&data[0]);
+		return send_encoded_value(rem_node, ans.id, data, flags, compress);
+	}
+
+	DEBUG("Sending MSG_SET_NEW_VALUE...");
+	bool ret;
+	var->lock_value();
+	void* buffer = var->value_buffer();
+	if (buffer != nullptr) {
+		ret = CommunicationHandler::getInstance().send_value_to(&ans, sizeof(ans), buffer, ans.data.var_size, rem_node, true);
+		var->unlock_value();
+	} else {
+		var->unlock_value();
+		std::vector<char> data;
+		BufferPool::getInstance().acquire(data, ans.data.var_size);
+		var->get_value(&data[0]);
+		ret = CommunicationHandler::getInstance().send_value_to(&ans, sizeof(ans), &data[0], ans.data.var_size, rem_node, true);
+		BufferPool::getInstance().release(data);
+	}
+	return ret;
+}
+
+/**
+ * @brief Method for sending the new value of a variable with the write-update protocol to the nodes sharing it.
+ *
+ * Small values are sent in a single datagram to each node, through a single call if all nodes share the
+ * variable (see CommunicationHandler::send_value_to_all()), keeping their order with respect to the other
+ * messages (e.g., the ownership grants); other values are sent to each node as replies to
+ * MSG_ASK_CURRENT_VALUE (see send_value()).
+ * Each node acknowledges the value once set (see MSG_FLAG_UPDATE), so that the next barrier
+ * of this node waits for it (see release_writes()).
+ * Must be called with lock already acquired.
+ * @param v		Pointer to var_data of the variable
+ * @return		true in case of success; false in case of network error
+ */
+bool Policy::send_update(var_data* v)
+{
+	AbstractShared* var = v->variable_;
+	node_set& sharers = v->policy_data_.sharers_;
+	sharers.erase(pbsm_tid);
+	v->policy_data_.version_ = 0;
+	int count = sharers.size();
+	if (count == 0)
+		return true;
+	msg_t ans;
+	ans.type = msg_type_t::MSG_SET_NEW_VALUE;
+	ans.flags = MSG_FLAG_UPDATE;
+	ans.id = var->get_id();
+	ans.data.var_size = var->get_size();
+	// Counted before sending, since the acknowledgments may arrive at once
+	expect_release_acks(count);
+
+	int failed = 0;
+	if (sizeof(ans) + ans.data.var_size <= BATCH_DATAGRAM_SIZE) {
+		var->lock_value();
+		void* buffer = var->value_buffer();
+		if (buffer != nullptr) {
+			DEBUG("Sending MSG_SET_NEW_VALUE of variable " << ans.id << " to " << count << " nodes");
+			if (count == CommunicationHandler::getInstance().get_number_of_nodes() - 1) {
+				if (!CommunicationHandler::getInstance().send_value_to_all(&ans, sizeof(ans), buffer, ans.data.var_size))
+					failed = count;
+			} else {
+				sharers.for_each([&](int node) {
+					if (!CommunicationHandler::getInstance().send_value_to(&ans, sizeof(ans), buffer, ans.data.var_size, node))
+						failed++;
+				});
 			}
-			break;
+			var->unlock_value();
+			expect_release_acks(-failed);
+			return (failed == 0);
 		}
-		case (msg_type_t::MSG_GRANT_OWNERSHIP): {
-			DEBUG("Received MSG_GRANT_OWNERSHIP");
+		var->unlock_value();
+	}
 
-			var_data* v = dictionary_[msg.id];
-			if (v == nullptr){
-				ERROR("Received MSG_GRANT_OWNERSHIP but no ownership was requested");
-			} else {
-				DEBUG("Waking up sleeping thread");
-				std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
-				DEBUG("UNBLOCKING waiting_ownership_grant_");
-				v->policy_data_.waiting_ownership_grant_.notify_all();
+	sharers.for_each([&](int node) {
+		if (!send_value(v, node, MSG_FLAG_UPDATE))
+			failed++;
+	});
+	expect_release_acks(-failed);
+	return (failed == 0);
+}
+
+/**
+ * @brief Method for counting the MSG_RELEASE_ACK expected before the next barrier (see release_writes()).
+ *
+ * The count of the datagrams not handed to the network (given back with a negative count) never
+ * goes below zero, as some of their acknowledgments may arrive anyway (e.g., if sending to all nodes
+ * failed only for some of them).
+ * @param count		Number of acknowledgments (negative for the ones of datagrams not sent)
+ */
+void Policy::expect_release_acks(long int count)
+{
+	std::unique_lock<std::mutex> lock (dirty_mutex_);
+	release_acks_ = std::max(release_acks_ + count, 0L);
+	if (release_acks_ == 0)
+		release_acked_.notify_all();
+}
+
+/**
+ * @brief Method for sending a value, contained in a buffer, to a remote node.
+ *
+ * The value is sent either in a single datagram or, if too big, in fragments (possibly compressed).
+ * @param rem_node	ID of the recipient node
+ * @param var_id	ID of the variable
+ * @param data		Buffer containing the value
+ * @param size		Size of the value
+ * @param compression	Compression of the value (see AbstractShared::set_compression())
+ * @return		true in case of success; false in case of network error
+ */
+bool Policy::send_raw_value(unsigned long int rem_node, uint32_t var_id, void* data, std::size_t size, compression_t compression)
+{
+	bool compress = compressible(compression, size, rem_node);
+	if (compress || (sizeof(msg_t) + size > (std::size_t) CommunicationHandler::getInstance().datagram_size(rem_node))) {
+		std::vector<char> snapshot;
+		BufferPool::getInstance().acquire(snapshot, size);
+		memcpy(&snapshot[0], data, size);
+		return send_encoded_value(rem_node, var_id, snapshot, 0, compress);
+	}
+	msg_t ans;
+	ans.type = msg_type_t::MSG_SET_NEW_VALUE;
+	ans.id = var_id;
+	ans.data.var_size = size;
+	return CommunicationHandler::getInstance().send_value_to(&ans, sizeof(ans), data, size, rem_node, true);
+}
+
+/**
+ * @brief Method to check if a value sent to a remote node must be compressed
+ *
+ * Values are compressed if they are at least Config::compression_threshold bytes, compression
+ * is enabled (either by Config::compression or for the variable), and the node is on another host
+ * (shared memory rings are faster than compressing).
+ * @param compression	Compression of the variable (see AbstractShared::set_compression())
+ * @param size		Size of the value
+ * @param rem_node	ID of the recipient node
+ * @return		true if the value must be compressed
+ */
+bool Policy::compressible(compression_t compression, std::size_t size, unsigned long int rem_node)
+{
+	if ((compression == compression_t::DISABLED) ||
+	    ((compression == compression_t::DEFAULT) && !Config::getInstance().compression))
+		return false;
+	return (size >= Config::getInstance().compression_threshold) && !CommunicationHandler::getInstance().is_local(rem_node);
+}
+
+/**
+ * @brief Method for sending a value (or a delta), possibly compressed, to a remote node.
+ *
+ * The value is sent either in a single datagram or, if too big, in fragments.
+ * If requested, it is compressed first (with MSG_FLAG_COMPRESSED set), unless it can't be compressed.
+ * @param rem_node	ID of the recipient node
+ * @param var_id	ID of the variable
+ * @param data		Snapshot of the value, or delta (its content is either moved into a transfer
+ *			or given back to BufferPool)
+ * @param flags		Flags of the value (MSG_FLAG_DELTA for a delta)
+ * @param compress	true to compress the value
+ * @return		true in case of success; false in case of network error
+ */
+bool Policy::send_encoded_value(unsigned long int rem_node, uint32_t var_id, std::vector<char>& data, uint16_t flags, bool compress)
+{
+	if (compress && (data.size() > 1)) {
+		std::vector<char> compressed;
+		BufferPool::getInstance().acquire(compressed, data.size() - 1);
+		std::size_t size = ::compress(&data[0], data.size(), &compressed[0], compressed.size());
+		if (size == 0) {
+			DEBUG("Value of variable " << var_id << " can't be compressed");
+		} else {
+			DEBUG("Value of variable " << var_id << " compressed from " << data.size() << " to " << size << " bytes");
+			compressed.resize(size);
+			data.swap(compressed);
+			flags |= MSG_FLAG_COMPRESSED;
+		}
+		BufferPool::getInstance().release(compressed);
+	}
+
+	if (sizeof(msg_t) + data.size() > (std::size_t) CommunicationHandler::getInstance().datagram_size(rem_node))
+		return send_fragmented_value(rem_node, var_id, data, flags);
+	msg_t ans;
+	ans.type = msg_type_t::MSG_SET_NEW_VALUE;
+	ans.flags = flags;
+	ans.id = var_id;
+	ans.data.var_size = data.size();
+	bool ret = CommunicationHandler::getInstance().send_value_to(&ans, sizeof(ans), &data[0], data.size(), rem_node, true);
+	BufferPool::getInstance().release(data);
+	return ret;
+}
+
+/**
+ * @brief Method to check if values of a given size are sent as deltas (see Config::delta_updates)
+ * @param size		Size of the value
+ * @return		true if the value is sent as a delta
+ */
+bool Policy::delta_updates(std::size_t size)
+{
+	return Config::getInstance().delta_updates && (size >= Config::getInstance().delta_threshold);
+}
+
+/**
+ * @brief Method for sending the current value of a variable to a remote node as a delta.
+ *
+ * If the node still holds the copy last sent to it (i.e., the version of its copy is the one of
+ * the twin kept for it), only the ranges changed since then are sent (see diff_ranges());
+ * otherwise, or if the delta would not be smaller, a full copy is sent.
+ * Either way, the twin is replaced by the value sent, with a new version.
+ * Must be called with lock already acquired.
+ * @param v		Pointer to var_data of the variable
+ * @param rem_node	ID of the recipient node
+ * @param base		Version of the copy held by the node (0 if unknown)
+ * @return		true in case of success; false in case of network error
+ */
+bool Policy::send_delta(var_data* v, unsigned long int rem_node, uint64_t base)
+{
+	AbstractShared* var = v->variable_;
+	std::size_t size = var->get_size();
+	std::vector<char> value;
+	BufferPool::getInstance().acquire(value, size);
+	var->lock_value();
+	void* buffer = var->value_buffer();
+	if (buffer != nullptr)
+		memcpy(&value[0], buffer, size);
+	var->unlock_value();
+	if (buffer == nullptr)
+		var->get_value(&value[0]);
+
+	twin& t = cold_data_of(v).twins_[rem_node];
+	delta_header h;
+	h.base = ((base != 0) && (base == t.version) && (t.data.size() == size)) ? base : 0;
+	h.version = new_version();
+	std::vector<char> delta;
+	BufferPool::getInstance().acquire(delta, delta_bound(size));
+	delta.resize(sizeof(h));
+	if ((h.base == 0) || !diff_ranges(&t.data[0], &value[0], size, delta, delta_bound(size) - 1)) {
+		h.base = 0;
+		delta_run run;
+		run.offset = 0;
+		run.length = size;
+		delta.resize(sizeof(h));
+		delta.insert(delta.end(), (char*) &run, (char*) &run + sizeof(run));
+		delta.insert(delta.end(), value.begin(), value.end());
+	}
+	memcpy(&delta[0], &h, sizeof(h));
+	DEBUG("Sending " << (h.base == 0 ? "full copy" : "delta") << " of " << delta.size() << " bytes of variable " << var->get_id() << " to node " << rem_node);
+	t.version = h.version;
+	t.data.swap(value);
+	BufferPool::getInstance().release(value);
+	return send_encoded_value(rem_node, var->get_id(), delta, MSG_FLAG_DELTA,
+	    compressible(var->get_compression(), delta.size(), rem_node));
+}
+
+/**
+ * @brief Method for getting the data needed only by some variables (see var_data::cold_data)
+ *
+ * The data is taken from cold_pool_ the first time (counted as a heap allocation by the pool
+ * if none was given back, see BufferPool::count_allocation()).
+ * Must be called with lock already acquired.
+ * @param v		Pointer to var_data of the variable
+ * @return		Data of the variable
+ */
+Policy::cold_data& Policy::cold_data_of(var_data* v)
+{
+	if (v->policy_data_.cold_ == nullptr) {
+		std::unique_lock<std::mutex> lock (cold_mutex_);
+		cold_data* c = cold_pool_.acquire();
+		c->incoming_.clear();
+		c->twins_.clear();
+		v->policy_data_.cold_ = c;
+	}
+	return *v->policy_data_.cold_;
+}
+
+/**
+ * @brief Method for giving back the data needed only by some variables, and its buffers, when destroying a variable
+ *
+ * Must be called once no other thread can use the data (see dictionary::remove()).
+ * @param v		Pointer to var_data of the variable
+ */
+void Policy::release_cold_data(var_data* v)
+{
+	cold_data* c = v->policy_data_.cold_;
+	if (c == nullptr)
+		return;
+	v->policy_data_.cold_ = nullptr;
+	for (auto& i: c->incoming_)
+		BufferPool::getInstance().release(i.second.staging);
+	for (auto& i: c->twins_)
+		BufferPool::getInstance().release(i.second.data);
+	BufferPool::getInstance().release(c->release_twin_);
+	BufferPool::getInstance().release(c->released_writes_);
+	std::unique_lock<std::mutex> lock (cold_mutex_);
+	cold_pool_.release(c);
+}
+
+/**
+ * @brief Method for setting the value of a variable from its encoded form (i.e., compressed and/or delta).
+ *
+ * A compressed value is decompressed directly into the raw storage of the variable, if possible
+ * (otherwise, into a temporary buffer set through set_value()).
+ * A delta is applied only if its base version is the one of the copy held, and so on;
+ * otherwise (or if the value is malformed), the current value is requested again.
+ * A delta of release-consistent writes (see MSG_FLAG_RELEASE) is only queued: it is applied
+ * to any version at the next barrier (see apply_released_writes()).
+ * Must be called with lock already acquired.
+ * @param v		Pointer to var_data of the variable
+ * @param flags		Flags of the value (see msg_flags_t)
+ * @param data		Encoded value
+ * @param size		Size of the encoded value
+ * @return		true if the value has been set; false if it has been requested again
+ */
+bool Policy::set_encoded_value(var_data* v, uint16_t flags, const char* data, std::size_t size)
+{
+	AbstractShared* var = v->variable_;
+	std::size_t var_size = var->get_size();
+	std::vector<char> value;
+	bool release = (flags & MSG_FLAG_RELEASE);
+	bool ok = true;
+	if (flags & MSG_FLAG_COMPRESSED) {
+		if (!(flags & MSG_FLAG_DELTA)) {
+			var->lock_value();
+			char* buffer = (char*) var->value_buffer();
+			if (buffer != nullptr)
+				ok = (decompress(data, size, buffer, var_size) == var_size);
+			var->unlock_value();
+			if (buffer == nullptr) {
+				BufferPool::getInstance().acquire(value, var_size);
+				ok = (decompress(data, size, &value[0], var_size) == var_size);
+				if (ok)
+					var->set_value(&value[0]);
 			}
+			v->policy_data_.version_ = 0;
+			data = nullptr;
+		} else {
+			BufferPool::getInstance().acquire(value, release ? exact_delta_bound(var_size) : delta_bound(var_size));
+			size = decompress(data, size, &value[0], value.size());
+			ok = (size > 0);
+			data = &value[0];
+		}
+	}
 
-			break;
+	if (release) {
+		ok = ok && (size >= sizeof(delta_header));
+		if (ok)
+			queue_released_writes(v, data + sizeof(delta_header), size - sizeof(delta_header));
+		else
+			ERROR("Malformed writes of variable " << var->get_id() << " released by another node");
+		BufferPool::getInstance().release(value);
+		return ok;
+	}
+
+	if (ok && (data != nullptr)) {
+		delta_header h;
+		if (size >= sizeof(h))
+			memcpy(&h, data, sizeof(h));
+		if ((size < sizeof(h)) || ((h.base == 0) && (size != delta_bound(var_size)))) {
+			ok = false;
+		} else if ((h.base != 0) && (h.base != v->policy_data_.version_)) {
+			DEBUG("Delta of variable " << var->get_id() << " for a version not held: requesting a full copy");
+			v->policy_data_.version_ = 0;
+			BufferPool::getInstance().release(value);
+			requestCurrentValue(v);
+			return false;
+		} else {
+			var->lock_value();
+			char* buffer = (char*) var->value_buffer();
+			if (buffer != nullptr)
+				ok = apply_ranges(data + sizeof(h), size - sizeof(h), buffer, var_size);
+			var->unlock_value();
+			if (buffer == nullptr) {
+				std::vector<char> copy;
+				BufferPool::getInstance().acquire(copy, var_size);
+				if (h.base != 0)
+					var->get_value(&copy[0]);
+				ok = apply_ranges(data + sizeof(h), size - sizeof(h), &copy[0], var_size);
+				if (ok)
+					var->set_value(&copy[0]);
+				BufferPool::getInstance().release(copy);
+			}
+			v->policy_data_.version_ = ok ? h.version : 0;
 		}
-		case (msg_type_t::MSG_ASK_CURRENT_VALUE): {
-			DEBUG("Received MSG_ASK_CURRENT_VALUE");
+	}
 
-			var_data* v = dictionary_[msg.id];
-			if (v != nullptr){
-				std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
-				if ((v->policy_data_.state_ == state::REMOTE_OWNER_CACHED) ||
-				    (v->policy_data_.state_ == state::REMOTE_OWNER_NO_CACHED)) {
-					DEBUG("We are not owners anymore. Sending MSG_SET_NEW_OWNER to the requesting node...");
+	BufferPool::getInstance().release(value);
+	if (!ok) {
+		ERROR("Malformed value of variable " << var->get_id() << ": requesting it again");
+		v->policy_data_.version_ = 0;
+		requestCurrentValue(v);
+	}
+	return ok;
+}
 
-					DEBUG("Sending MSG_SET_NEW_OWNER...");
-					msg_t ans;
-					ans.type = msg_type_t::MSG_SET_NEW_OWNER;
-					ans.data.node = v->policy_data_.remote_owner_;
-					ans.id = msg.id;
+/**
+ * @brief Method for starting to send a value in fragments to a remote node.
+ *
+ * The value is split into fragments fitting a datagram. The first Config::fragment_window fragments
+ * are sent at once; the following ones are sent as acknowledgments arrive (see handle_fragment_ack()),
+ * so that at most Config::fragment_window fragments are in flight.
+ * A previous transfer of the same variable to the same node is abandoned.
+ * @param rem_node	ID of the recipient node
+ * @param var_id	ID of the variable
+ * @param data		Snapshot of the value (its content is moved into the transfer)
+ * @param flags		Flags of the fragments (see msg_flags_t)
+ * @return		true in case of success; false in case of network error
+ */
+bool Policy::send_fragmented_value(unsigned long int rem_node, uint32_t var_id, std::vector<char>& data, uint16_t flags)
+{
+	std::unique_lock<std::mutex> lock (outgoing_mutex_);
+	outgoing_value* t = outgoing_pool_.acquire();
+	t->node = rem_node;
+	t->var_id = var_id;
+	t->transfer = next_transfer_++;
+	t->flags = flags;
+	t->data.swap(data);
+	t->fragment_size = CommunicationHandler::getInstance().datagram_size(rem_node) - sizeof(fragment_header);
+	t->count = (t->data.size() + t->fragment_size - 1) / t->fragment_size;
+	t->acked = 0;
+	t->next = 0;
+	t->arrived.assign(t->count, false);
+	t->resent.assign(t->count, false);
+	t->retries = 0;
+	t->last_ack = std::chrono::steady_clock::now();
+	DEBUG("Sending value of variable " << var_id << " in " << t->count << " fragments");
 
-					if (!CommunicationHandler::getInstance().send_to(&ans, sizeof(ans), msg.data.node))
-						ERROR("ERROR in sending MSG_SET_NEW_OWNER message to " << msg.data.node);
+	outgoing_value*& slot = outgoing_values_[std::make_pair(t->node, var_id)];
+	release_transfer(slot);
+	slot = t;
 
-				} else {
-					DEBUG("Setting cached status to variable " << msg.id);
-					v->policy_data_.state_ = state::OWNER_SHARED;
+	std::vector<uint32_t>& indexes = fragment_indexes_;
+	indexes.clear();
+	for (uint32_t i = 0; (i < t->count) && (i < Config::getInstance().fragment_window); ++i)
+		indexes.push_back(i);
+	if (send_fragments(t, indexes))
+		return true;
+	// The caller gives back the acknowledgment of a value not sent (see expect_release_acks())
+	t->flags &= ~(MSG_FLAG_RELEASE | MSG_FLAG_UPDATE);
+	release_transfer(t);
+	slot = nullptr;
+	return false;
+}
 
-					msg_t ans;
-					ans.type = msg_type_t::MSG_SET_NEW_VALUE;
-					ans.id = msg.id;
+/**
+ * @brief Method for giving back the memory of a transfer (see outgoing_pool_ and BufferPool)
+ *
+ * The transfer of a released or write-update value counts as its MSG_RELEASE_ACK, whether it ended
+ * (the receiver acknowledges the last fragments once the value is set) or it was abandoned: a newer
+ * value of the variable replaces it, or the node is not reachable (as for datagrams not sent).
+ * Must be called with outgoing_mutex_ already acquired.
+ * @param t		Transfer of the value (nullptr is ignored)
+ */
+void Policy::release_transfer(outgoing_value* t)
+{
+	if (t == nullptr)
+		return;
+	if (t->flags & (MSG_FLAG_RELEASE | MSG_FLAG_UPDATE))
+		expect_release_acks(-1);
+	BufferPool::getInstance().release(t->data);
+	outgoing_pool_.release(t);
+}
 
-					DEBUG("Sending MSG_SET_NEW_VALUE...");
-					ans.data.var_size = v->variable_->get_size();
-					char* data = new char [ans.data.var_size];
-					v->variable_->get_value(data);
+/**
+ * @brief Method for sending a set of fragments of a value through a single system call.
+ *
+ * Fragments are gathered directly from the snapshot of the value.
+ * Must be called with outgoing_mutex_ already acquired.
+ * @param t		Transfer of the value
+ * @param indexes	Indexes of the fragments to be sent
+ * @return		true in case of success; false in case of network error
+ */
+bool Policy::send_fragments(outgoing_value* t, const std::vector<uint32_t>& indexes)
+{
+	if (indexes.empty())
+		return true;
+	std::vector<fragment_header>& headers = fragment_headers_;
+	std::vector<struct iovec>& iov = fragment_iov_;
+	headers.resize(indexes.size());
+	iov.resize(2 * indexes.size());
+	for (std::size_t k = 0; k < indexes.size(); ++k) {
+		uint32_t i = indexes[k];
+		fragment_header& h = headers[k];
+		h.msg.type = msg_type_t::MSG_VALUE_FRAGMENT;
+		h.msg.flags = t->flags;
+		h.msg.id = t->var_id;
+		h.msg.data.var_size = t->data.size();
+		h.fragment.transfer = t->transfer;
+		h.fragment.index = i;
+		h.fragment.count = t->count;
+		h.fragment.offset = i * t->fragment_size;
+		h.fragment.length = std::min<std::size_t>(t->fragment_size, t->data.size() - h.fragment.offset);
+		iov[2 * k].iov_base = &h;
+		iov[2 * k].iov_len = sizeof(h);
+		iov[2 * k + 1].iov_base = &t->data[h.fragment.offset];
+		iov[2 * k + 1].iov_len = h.fragment.length;
+		if (i >= t->next)
+			t->next = i + 1;
+	}
+	DEBUG("Sending " << indexes.size() << " fragments of variable " << t->var_id << " to node " << t->node);
+	return CommunicationHandler::getInstance().send_datagrams_to(&iov[0], 2, indexes.size(), t->node, true);
+}
 
-					CommunicationHandler::getInstance().send_two_messages_to(&ans, sizeof(ans), data, ans.data.var_size, msg.data.node);
+/**
+ * @brief Method for handling a fragment of a value received from a remote node.
+ *
+ * The fragment is put directly into the variable while its copy is not valid, so that it can't be
+ * read meanwhile (otherwise, into the staging buffer, see incoming_value): readers of a valid copy (e.g., with
+ * the write-update protocol) never see a value partly received, nor one abandoned. The complete value is set
+ * once the reads in progress have ended (see begin_remote_write()).
+ * Encoded values (see MSG_FLAG_COMPRESSED and MSG_FLAG_DELTA) are always staged, and set once complete
+ * (see set_encoded_value()).
+ * A fragment of a new transfer abandons the previous one from the same node. Once all fragments have been received,
+ * waiting readers are woken up.
+ * An acknowledgment is sent every Config::fragment_window / 4 fragments, when a gap is detected
+ * (so that the sender can send again only missing fragments), for duplicates and upon completion
+ * (once the value is set, so that it stands for MSG_RELEASE_ACK, see release_transfer()).
+ * @param sender	ID of the sender (as returned by CommunicationHandler::peek_from(), or the remote node)
+ * @param msg		Message at the beginning of the datagram
+ * @param frag		Fragment header
+ * @param payload	Content of the fragment; nullptr if it must still be received from
+ *			channel (it has been only peeked)
+ * @param channel	Receive channel the fragment has been peeked from (only if payload is nullptr)
+ */
+void Policy::handle_fragment(int sender, const msg_t& msg, const fragment_t& frag, const char* payload, int channel)
+{
+	int rem_node = CommunicationHandler::getInstance().node_of(sender);
+	fragment_header drop;
+	dictionary<var_data>::reader guard (dictionary_);
+	var_data* v = dictionary_.find(msg.id);
+	std::unique_lock<std::mutex> lock;
+	if (v != nullptr)
+		lock = std::unique_lock<std::mutex>(v->policy_data_.mutex_);
+	if ((v == nullptr) || (v->variable_ == nullptr)) {
+		ERROR("Fragment for unknown variable " << msg.id);
+		if (payload == nullptr)
+			CommunicationHandler::getInstance().recv_from(&drop, sizeof(drop), channel, sender);
+		return;
+	}
 
-					delete[] data;
+	AbstractShared* var = v->variable_;
+	incoming_value& in = cold_data_of(v).incoming_[rem_node];
+	bool encoded = (msg.flags & (MSG_FLAG_COMPRESSED | MSG_FLAG_DELTA));
+	std::size_t bound = (msg.flags & MSG_FLAG_RELEASE) ? exact_delta_bound(var->get_size()) : delta_bound(var->get_size());
+	// The sender splits the value as this node would (see send_fragmented_value()): the count is never trusted
+	std::size_t fragment_size = CommunicationHandler::getInstance().datagram_size(rem_node) - sizeof(fragment_header);
+	if ((encoded ? (msg.data.var_size > compress_bound(bound)) : (var->get_size() != msg.data.var_size)) ||
+	    (frag.count != (msg.data.var_size + fragment_size - 1) / fragment_size) ||
+	    (frag.index >= frag.count) ||
+	    ((std::size_t) frag.offset + frag.length > msg.data.var_size)) {
+		ERROR("Malformed fragment for variable " << msg.id);
+		if (payload == nullptr)
+			CommunicationHandler::getInstance().recv_from(&drop, sizeof(drop), channel, sender);
+		return;
+	}
 
-				}
+	if ((in.node != rem_node) || (in.transfer != frag.transfer) || (in.arrived.size() != frag.count)) {
+		DEBUG("New transfer of variable " << msg.id << " in " << frag.count << " fragments");
+		in.node = rem_node;
+		in.transfer = frag.transfer;
+		in.arrived.assign(frag.count, false);
+		in.received = 0;
+		in.unacked = 0;
+		in.scattered = false;
+		BufferPool::getInstance().release(in.staging);
+	}
+
+	bool duplicate = in.arrived[frag.index];
+	if (duplicate) {
+		if (payload == nullptr)
+			CommunicationHandler::getInstance().recv_from(&drop, sizeof(drop), channel, sender);
+	} else {
+		var->lock_value();
+		char* dst = nullptr;
+		if (!encoded && in.staging.empty() && (v->policy_data_.state_ == state::REMOTE_OWNER_NO_CACHED))
+			dst = (char*) var->value_buffer();
+		if (dst != nullptr) {
+			in.scattered = true;
+		} else if (in.staging.empty()) {
+			BufferPool::getInstance().acquire(in.staging, msg.data.var_size);
+			// The copy became valid during the transfer: the fragments already received are moved
+			if (in.scattered)
+				memcpy(&in.staging[0], var->value_buffer(), msg.data.var_size);
+			dst = &in.staging[0];
+		} else {
+			dst = &in.staging[0];
+		}
+		dst += frag.offset;
+		bool ok;
+		if (payload != nullptr) {
+			memcpy(dst, payload, frag.length);
+			ok = true;
+		} else {
+			struct iovec iov[2];
+			iov[0].iov_base = &drop;
+			iov[0].iov_len = sizeof(drop);
+			iov[1].iov_base = dst;
+			iov[1].iov_len = frag.length;
+			ok = CommunicationHandler::getInstance().recv_iov_from(iov, 2, channel, sender);
+		}
+		var->unlock_value();
+		if (!ok) {
+			ERROR("Error in receiving fragment of variable " << msg.id);
+			return;
+		}
+		in.arrived[frag.index] = true;
+		in.unacked++;
+		while ((in.received < frag.count) && in.arrived[in.received])
+			in.received++;
+	}
+
+	bool complete = (in.received == frag.count);
+	if (complete && !duplicate) {
+		DEBUG("All fragments of variable " << msg.id << " received");
+		if (accepts_value(v, msg.flags)) {
+			bool set = true;
+			begin_remote_write(v);
+			if (encoded) {
+				set = set_encoded_value(v, msg.flags, &in.staging[0], in.staging.size());
 			} else {
-				ERROR("Variable not found");
+				if (!in.staging.empty())
+					var->set_value(&in.staging[0]);
+				v->policy_data_.version_ = 0;
 			}
-			break;
+			end_remote_write(v);
+			if (set)
+				after_remote_write(v);
 		}
-		case (msg_type_t::MSG_SET_NEW_VALUE): {
-			DEBUG("Received MSG_SET_NEW_VALUE");
+		BufferPool::getInstance().release(in.staging);
+	}
+	if (complete || duplicate || (frag.index > in.received) ||
+	    (in.unacked >= std::max(1U, Config::getInstance().fragment_window / 4)))
+		send_fragment_ack(rem_node, msg.id, in);
+}
 
-			DEBUG("Need to receive data with length " << msg.data.var_size);
-			char* d = new char [msg.data.var_size];
-			if (!CommunicationHandler::getInstance().recv_from(d, msg.data.var_size, rem_node)){
-				ERROR("Error in receiving data of MSG_SET_NEW_VALUE");
-			} else {
-				DEBUG(msg.data.var_size << " bytes received.");
+/**
+ * @brief Method for acknowledging the fragments of a value received so far.
+ *
+ * Must be called with lock already acquired.
+ * @param rem_node	ID of the sender node
+ * @param var_id	ID of the variable
+ * @param in		Transfer being received
+ */
+void Policy::send_fragment_ack(int rem_node, uint32_t var_id, incoming_value& in)
+{
+	msg_t msg;
+	msg.type = msg_type_t::MSG_VALUE_FRAGMENT_ACK;
+	msg.id = var_id;
+	msg.data.node = pbsm_tid;
+	fragment_ack_t ack;
+	ack.transfer = in.transfer;
+	ack.received = in.received;
+	ack.selective = 0;
+	for (uint32_t i = 0; (i < 64) && (in.received + 1 + i < in.arrived.size()); ++i)
+		if (in.arrived[in.received + 1 + i])
+			ack.selective |= (1ULL << i);
+	in.unacked = 0;
+	if (!CommunicationHandler::getInstance().send_value_to(&msg, sizeof(msg), &ack, sizeof(ack), rem_node))
+		ERROR("ERROR in sending MSG_VALUE_FRAGMENT_ACK for variable " << var_id);
+}
+
+/**
+ * @brief Method for handling an acknowledgment of the fragments of a value.
+ *
+ * Fragments missing before the latest one received are sent again at once (each one only
+ * once until the next timeout), then the window slides forward and new fragments are sent.
+ * The transfer ends when all fragments have been acknowledged.
+ * @param rem_node	ID of the remote node
+ * @param msg		Message at the beginning of the datagram
+ * @param ack		Acknowledgment
+ */
+void Policy::handle_fragment_ack(int rem_node, const msg_t& msg, const fragment_ack_t& ack)
+{
+	std::unique_lock<std::mutex> lock (outgoing_mutex_);
+	auto it = outgoing_values_.find(std::make_pair(rem_node, msg.id));
+	if ((it == outgoing_values_.end()) || (it->second == nullptr) || (it->second->transfer != ack.transfer)) {
+		DEBUG("Acknowledgment for an old transfer of variable " << msg.id);
+		return;
+	}
+	outgoing_value* t = it->second;
+	t->last_ack = std::chrono::steady_clock::now();
+	t->retries = 0;
+	// The fragments newly covered by the cumulative acknowledgment arrived, before moving acked past them
+	uint32_t acked = std::min(ack.received, t->count);
+	for (uint32_t i = t->acked; i < acked; ++i)
+		t->arrived[i] = true;
+	if (acked > t->acked)
+		t->acked = acked;
+	uint32_t highest = t->acked;
+	for (uint32_t i = 0; i < 64; ++i) {
+		uint32_t index = ack.received + 1 + i;
+		if ((index < t->count) && (ack.selective & (1ULL << i))) {
+			t->arrived[index] = true;
+			highest = index;
+		}
+	}
+	if (t->acked == t->count) {
+		DEBUG("All fragments of variable " << msg.id << " acknowledged by node " << rem_node);
+		release_transfer(t);
+		it->second = nullptr;
+		return;
+	}
+
+	std::vector<uint32_t>& indexes = fragment_indexes_;
+	indexes.clear();
+	for (uint32_t i = t->acked; i < highest; ++i) {
+		if (!t->arrived[i] && !t->resent[i]) {
+			indexes.push_back(i);
+			t->resent[i] = true;
+		}
+	}
+	uint32_t end = std::min(t->count, t->acked + Config::getInstance().fragment_window);
+	for (uint32_t i = t->next; i < end; ++i)
+		indexes.push_back(i);
+	send_fragments(t, indexes);
+}
+
+/**
+ * @brief Method for sending again the fragments not acknowledged in time.
+ *
+ * This method is executed by a dedicated thread. Every Config::fragment_timeout_us / 2 microseconds,
+ * it sends again the in-flight fragments of the transfers without acknowledgments for
+ * Config::fragment_timeout_us microseconds. Transfers are abandoned after FRAGMENT_MAX_RETRIES timeouts.
+ */
+void Policy::resend_fragments()
+{
+	std::chrono::microseconds timeout (Config::getInstance().fragment_timeout_us);
+	for(;;) {
+		std::this_thread::sleep_for(timeout / 2);
+		std::unique_lock<std::mutex> lock (outgoing_mutex_);
+		auto now = std::chrono::steady_clock::now();
+		for (auto it = outgoing_values_.begin(); it != outgoing_values_.end();) {
+			outgoing_value* t = it->second;
+			if ((t == nullptr) || (now - t->last_ack < timeout)) {
+				++it;
+				continue;
+			}
+			if (++t->retries > FRAGMENT_MAX_RETRIES) {
+				ERROR("Transfer of variable " << t->var_id << " to node " << t->node << " abandoned");
+				release_transfer(t);
+				it->second = nullptr;
+				++it;
+				continue;
+			}
+			DEBUG("Timeout for transfer of variable " << t->var_id << " to node " << t->node);
+			t->last_ack = now;
+			t->resent.assign(t->count, false);
+			std::vector<uint32_t>& indexes = fragment_indexes_;
+			indexes.clear();
+			for (uint32_t i = t->acked; i < t->next; ++i)
+				if (!t->arrived[i])
+					indexes.push_back(i);
+			send_fragments(t, indexes);
+			++it;
+		}
+	}
+}
+
+/**
+ * @brief Method for handling a message received from a remote node.
+ *
+ * @param rem_node	ID of the remote node
+ * @param msg		Received message
+ * @param value		Buffer containing the value (only for MSG_SET_NEW_VALUE and MSG_WRITE_DONE), the nodes sharing
+ *			the variable (only for MSG_GRANT_OWNERSHIP, see node_set), or the write (only for
+ *			MSG_SHIP_WRITE, see shipped_op_t); nullptr otherwise
+ */
+void Policy::handle_message(int rem_node, const msg_t& msg, void* value)
+{
+	// The variables found can't be destroyed while handling the message
+	dictionary<var_data>::reader guard (dictionary_);
+	switch (msg.type) {
+	case (msg_type_t::MSG_REQUEST_OWNERSHIP): {
+		DEBUG("Received new message of type MSG_REQUEST_OWNERSHIP");
+
+		// We are the home node of the variable
+		var_data* v = dictionary_.find(msg.id);
+		std::unique_lock<std::mutex> lock;
+		if (v != nullptr)
+			lock = std::unique_lock<std::mutex>(v->policy_data_.mutex_);
+		forward_ownership_request(msg.id, msg.data.node, ((v != nullptr) && (v->variable_ != nullptr)) ? v : nullptr);
+		break;
+	}
+	case (msg_type_t::MSG_FORWARD_OWNERSHIP): {
+		DEBUG("Received MSG_FORWARD_OWNERSHIP for node " << msg.data.node);
+
+		var_data* v = dictionary_.find(msg.id);
+		if (v != nullptr){
+			std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+			if (v->variable_ != nullptr)
+				change_owner(v, msg.data.node);
+		} else {
+			ERROR("Variable " << msg.id << " not found");
+		}
+		break;
+	}
+	case (msg_type_t::MSG_GRANT_OWNERSHIP): {
+		DEBUG("Received MSG_GRANT_OWNERSHIP");
+
+		var_data* v = dictionary_.find(msg.id);
+		if (v == nullptr){
+			ERROR("Received MSG_GRANT_OWNERSHIP but no ownership was requested");
+		} else {
+			DEBUG("Waking up sleeping thread");
+			std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+			if (v->variable_ == nullptr)
+				break;
+			std::size_t bytes = msg.data.var_size;
+			if ((msg.flags & MSG_FLAG_VALUE) && (value != nullptr) && (bytes >= v->variable_->get_size())) {
+				bytes -= v->variable_->get_size();
+				begin_remote_write(v);
+				v->variable_->set_value((char*) value + bytes);
 			}
-			DEBUG("Data succesfully received");
+			if (value != nullptr)
+				v->policy_data_.sharers_.assign(value, bytes);
+			// Owners write locally (unless they are the home pinning the variable, see count_pinned_write())
+			if (home_of(msg.id) != pbsm_tid)
+				v->policy_data_.pinned_ = false;
+			// With the write-update protocol, all nodes keep a copy;
+			// otherwise, the nodes served by the previous owners may have one
+			set_state(v, ((v->variable_->get_coherence() == coherence_t::UPDATE) || !v->policy_data_.sharers_.empty()) ?
+			    state::OWNER_SHARED : state::OWNER_NO_SHARED);
+			DEBUG("UNBLOCKING waiting_ownership_grant_");
+			v->policy_data_.waiting_ownership_grant_.notify_all();
+			// Without a thread writing (e.g., the home node pinning the variable, or a write shipped
+			// meanwhile), the request forwarded while waiting for the grant is served at once
+			if (!v->policy_data_.writing_ && (v->policy_data_.forward_to_ >= 0)) {
+				int node = v->policy_data_.forward_to_;
+				v->policy_data_.forward_to_ = -1;
+				change_owner(v, node);
+			}
+		}
+
+		break;
+	}
+	case (msg_type_t::MSG_ASK_CURRENT_VALUE): {
+		DEBUG("Received MSG_ASK_CURRENT_VALUE");
+
+		// With MSG_FLAG_DELTA, the data carries the version of the copy of the requester
+		unsigned long int requester = (msg.flags & MSG_FLAG_DELTA) ? rem_node : msg.data.node;
+		var_data* v = dictionary_.find(msg.id);
+		if (v != nullptr){
+			std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+			if (v->variable_ == nullptr) {
+				ERROR("Variable " << msg.id << " destroyed");
+			} else if ((v->policy_data_.state_ == state::REMOTE_OWNER_CACHED) ||
+			    (v->policy_data_.state_ == state::REMOTE_OWNER_NO_CACHED)) {
+				DEBUG("We are not owners anymore. Sending MSG_SET_NEW_OWNER to the requesting node...");
 
-			var_data* v = dictionary_[msg.id];
-			if (v == nullptr){
-				ERROR("Variable " << msg.id << " not found");
+				DEBUG("Sending MSG_SET_NEW_OWNER...");
+				msg_t ans;
+				ans.type = msg_type_t::MSG_SET_NEW_OWNER;
+				ans.data.node = v->policy_data_.remote_owner_;
+				ans.id = msg.id;
+
+				if (!CommunicationHandler::getInstance().send_to(&ans, sizeof(ans), requester))
+					ERROR("ERROR in sending MSG_SET_NEW_OWNER message to " << requester);
+
+			} else if (v->policy_data_.writing_) {
+				// The copies have already been invalidated: the value is sent by after_local_write()
+				DEBUG("Variable " << msg.id << " being written. Deferring the answer");
+				v->policy_data_.deferred_readers_.insert(requester);
+			} else if (msg.flags & MSG_FLAG_DELTA) {
+				DEBUG("Setting cached status to variable " << msg.id);
+				set_state(v, state::OWNER_SHARED);
+				v->policy_data_.sharers_.insert(requester);
+				if (!send_delta(v, requester, msg.data.version))
+					ERROR("ERROR in sending MSG_SET_NEW_VALUE message to " << requester);
 			} else {
-				DEBUG("Variable " << msg.id <<" found. Changing its value");
-				std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
-				v->variable_->set_value((void*) d);
-				after_remote_write(msg.id);
-				DEBUG("New value succesfully set");
+				send_current_value(v, requester);
 			}
-			delete[] d;
-			break;
+		} else {
+			ERROR("Variable not found");
 		}
-		case (msg_type_t::MSG_BARRIER_BLOCK): {
-			DEBUG("Received MSG_BARRIER_BLOCK");
-			if (pbsm_tid != 0)
-				ERROR("Received message MSG_BARRIER_BLOCK but I'm not the master");
-
-			// We can't block in this function, otherwise we go in deadlock!
-			std::unique_lock<std::mutex> lock (mutex_);
-			semaphore* elem = master_waiting_barrier_grants_[msg.id];
-			if (elem == nullptr) {
-				DEBUG("Remote note is the first node to reach the barrier. Creating data structures...");
-				elem = new semaphore;
-				elem->counter_ = CommunicationHandler::getInstance().get_number_of_nodes();
-				master_waiting_barrier_grants_[msg.id] = elem;
+		break;
+	}
+	case (msg_type_t::MSG_SET_NEW_VALUE): {
+		DEBUG("Received MSG_SET_NEW_VALUE");
+		if (value == nullptr)
+			break;
+
+		var_data* v = dictionary_.find(msg.id);
+		if (v == nullptr){
+			ERROR("Variable " << msg.id << " not found");
+		} else {
+			std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+			if (v->variable_ == nullptr){
+				ERROR("Variable " << msg.id << " destroyed");
+			} else if (accepts_value(v, msg.flags)) {
+				DEBUG("Variable " << msg.id <<" found. Changing its value");
+				bool set = true;
+				begin_remote_write(v);
+				if (msg.flags & (MSG_FLAG_COMPRESSED | MSG_FLAG_DELTA)) {
+					set = set_encoded_value(v, msg.flags, (const char*) value, msg.data.var_size);
+				} else {
+					v->variable_->set_value(value);
+					v->policy_data_.version_ = 0;
+				}
+				end_remote_write(v);
+				if (set) {
+					after_remote_write(v);
+					DEBUG("New value succesfully set");
+				}
 			}
-			elem->counter_--;
-			if (elem->counter_ == 0) {
-				DEBUG("UNBLOCKING elem->wait_condition_");
-				elem->wait_condition_.notify_all();
+		}
+		// The releasing (or updating) node waits for the writes to be applied (or dropped)
+		if (msg.flags & (MSG_FLAG_RELEASE | MSG_FLAG_UPDATE))
+			send_release_ack(rem_node, msg.id);
+		break;
+	}
+	case (msg_type_t::MSG_BARRIER_BLOCK): {
+		DEBUG("Received MSG_BARRIER_BLOCK");
+		if (pbsm_tid != 0)
+			ERROR("Received message MSG_BARRIER_BLOCK but I'm not the master");
+
+		// We can't block in this function, otherwise we go in deadlock!
+		std::unique_lock<std::mutex> lock (mutex_);
+		semaphore* elem = master_waiting_barrier_grants_[msg.id];
+		if (elem == nullptr) {
+			DEBUG("Remote note is the first node to reach the barrier. Creating data structures...");
+			elem = semaphore_pool_.acquire();
+			elem->counter_ = CommunicationHandler::getInstance().get_number_of_nodes();
+			master_waiting_barrier_grants_[msg.id] = elem;
+		}
+		elem->counter_--;
+		if (elem->counter_ == 0) {
+			DEBUG("UNBLOCKING elem->wait_condition_");
+			elem->wait_condition_.notify_all();
+		}
+		break;
+	}
+	case (msg_type_t::MSG_BARRIER_UNBLOCK): {
+		DEBUG("Received MSG_BARRIER_UNBLOCK");
+		if (pbsm_tid == 0)
+			ERROR("Received message MSG_BARRIER_UNBLOCK but I'm the master");
+
+		DEBUG("Waking up blocked thread...");
+		// The slave holds the lock from sending MSG_BARRIER_BLOCK until waiting:
+		// taking it here avoids losing the notification.
+		std::unique_lock<std::mutex> lock (mutex_);
+		DEBUG("UNBLOCKING slave_wait_barrier_");
+		slave_wait_barrier_.notify_all();
+		break;
+	}
+	case (msg_type_t::MSG_SET_NEW_OWNER): {
+		DEBUG("Received MSG_SET_NEW_OWNER");
+
+		var_data* v = dictionary_.find(msg.id);
+		if (v != nullptr){
+			std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+			// Ownership requests go through the home node: only reads are redirected
+			if ((v->variable_ != nullptr) && ((int) msg.data.node != pbsm_tid) &&
+			    (v->policy_data_.state_ == state::REMOTE_OWNER_NO_CACHED)) {
+				v->policy_data_.remote_owner_ = msg.data.node;
+				requestCurrentValue(v);
 			}
-			break;
 		}
-		case (msg_type_t::MSG_BARRIER_UNBLOCK): {
-			DEBUG("Received MSG_BARRIER_UNBLOCK");
-			if (pbsm_tid == 0)
-				ERROR("Received message MSG_BARRIER_UNBLOCK but I'm the master");
+		break;
+	}
+	case (msg_type_t::MSG_INVALIDATE_COPY): {
+		DEBUG("Received MSG_INVALIDATE_COPY");
 
-			DEBUG("Waking up blocked thread...");
-			DEBUG("UNBLOCKING slave_wait_barrier_");
-			slave_wait_barrier_.notify_all();
-			break;
+		var_data* v = dictionary_.find(msg.id);
+		if (v != nullptr){
+			std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+			set_state(v, state::REMOTE_OWNER_NO_CACHED);
+			v->policy_data_.invalidations_++;
+			// Only the owner invalidates copies
+			v->policy_data_.remote_owner_ = msg.data.node;
+		}
+		DEBUG("Sending MSG_INVALIDATE_COPY_ACK...");
+		msg_t ans;
+		ans.type = msg_type_t::MSG_INVALIDATE_COPY_ACK;
+		ans.data.node = pbsm_tid;
+		ans.id = msg.id;
+		if (!CommunicationHandler::getInstance().send_to(&ans, sizeof(ans), msg.data.node)) {
+			ERROR("ERROR in sending MSG_INVALIDATE_COPY_ACK for variable " << msg.id);
+		} else {
+			DEBUG("MSG_INVALIDATE_COPY_ACK sent for variable " << msg.id);
 		}
-		case (msg_type_t::MSG_SET_NEW_OWNER): {
-			DEBUG("Received MSG_SET_NEW_OWNER");
 
-			var_data* v = dictionary_[msg.id];
-			if (v != nullptr){
-				std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
-				change_owner(v, msg.data.node);
-				// Request again ownership to the right node but do not lock
-				send_request_ownership(v);
+		break;
+	}
+	case (msg_type_t::MSG_INVALIDATE_COPY_ACK): {
+		DEBUG("Received MSG_INVALIDATE_COPY_ACK");
+
+		var_data* v = dictionary_.find(msg.id);
+		if (v != nullptr){
+			std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+			v->policy_data_.waiting_invalidate_copies_.counter_--;
+			if (v->policy_data_.waiting_invalidate_copies_.counter_ == 0){
+				DEBUG("UNBLOCKING waiting_invalidate_copies_");
+				v->policy_data_.waiting_invalidate_copies_.wait_condition_.notify_all();
+			}
+		}
+		break;
+	}
+	case (msg_type_t::MSG_PINNED): {
+		DEBUG("Received MSG_PINNED for variable " << msg.id);
+
+		var_data* v = dictionary_.find(msg.id);
+		if (v != nullptr){
+			std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+			if ((v->variable_ != nullptr) &&
+			    ((v->policy_data_.state_ == state::REMOTE_OWNER_NO_CACHED) ||
+			     (v->policy_data_.state_ == state::REMOTE_OWNER_CACHED))) {
+				v->policy_data_.pinned_ = true;
+				// The thread waiting for the grant ships its write instead
+				DEBUG("UNBLOCKING waiting_ownership_grant_");
+				v->policy_data_.waiting_ownership_grant_.notify_all();
 			}
+		}
+		break;
+	}
+	case (msg_type_t::MSG_SHIP_WRITE): {
+		DEBUG("Received MSG_SHIP_WRITE for variable " << msg.id);
+		if ((value == nullptr) || (msg.data.var_size < sizeof(shipped_op_t)))
 			break;
+
+		// The write may wait for other nodes (e.g., invalidations): it is executed by execute_shipped_writes()
+		std::unique_lock<std::mutex> lock (shipped_mutex_);
+		incoming_write& in = shipped_queue_.push_back();
+		in.node = rem_node;
+		in.var_id = msg.id;
+		in.op = (write_op_t) ((shipped_op_t*) value)->op;
+		in.operand.assign((char*) value + sizeof(shipped_op_t), (char*) value + msg.data.var_size);
+		shipped_available_.notify_one();
+		break;
+	}
+	case (msg_type_t::MSG_WRITE_DONE): {
+		DEBUG("Received MSG_WRITE_DONE for variable " << msg.id);
+
+		var_data* v = dictionary_.find(msg.id);
+		if (v != nullptr){
+			std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+			const shipped_write* w = v->policy_data_.shipping_;
+			if (w == nullptr)
+				break;
+			std::size_t size = (v->variable_ != nullptr) ? v->variable_->get_size() : 0;
+			if ((w->previous != nullptr) && (value != nullptr) && (msg.data.var_size >= size))
+				memcpy(w->previous, value, size);
+			if (msg.flags & MSG_FLAG_UNPINNED) {
+				v->policy_data_.pinned_ = false;
+				// The current value follows (cached unless invalidated meanwhile, see ship_write())
+				if ((value != nullptr) && (size > 0) && (msg.data.var_size == 2 * size)) {
+					begin_remote_write(v);
+					v->variable_->set_value((char*) value + size);
+					set_state(v, state::REMOTE_OWNER_CACHED);
+				}
+			}
+			v->policy_data_.shipping_ = nullptr;
+			DEBUG("UNBLOCKING write_done_");
+			v->policy_data_.write_done_.notify_all();
 		}
-		case (msg_type_t::MSG_INVALIDATE_COPY): {
-			DEBUG("Received MSG_INVALIDATE_COPY");
+		break;
+	}
+	case (msg_type_t::MSG_RELEASE_ACK): {
+		DEBUG("Received MSG_RELEASE_ACK for variable " << msg.id);
 
-			var_data* v = dictionary_[msg.id];
-			if (v != nullptr){
-				std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
-				v->policy_data_.state_ = state::REMOTE_OWNER_NO_CACHED;
+		// Late acknowledgments of datagrams whose sending failed are ignored (see expect_release_acks())
+		std::unique_lock<std::mutex> lock (dirty_mutex_);
+		if ((release_acks_ > 0) && (--release_acks_ == 0)) {
+			DEBUG("UNBLOCKING release_acked_");
+			release_acked_.notify_all();
+		}
+		break;
+	}
+
+	default: {
+		ERROR("ERROR: Unrecognized message");
+	}
+	}
+}
+
+/**
+ * @brief Method for recording the first write of a release-consistent variable since the latest barrier.
+ *
+ * A twin of the value is taken, so that release_writes() can find the bytes written,
+ * and the following writes are allowed without calling the policy (see set_state()).
+ * Must be called with lock already acquired.
+ * @param v		Pointer to var_data of the variable
+ */
+void Policy::record_write(var_data* v)
+{
+	AbstractShared* var = v->variable_;
+	std::vector<char>& twin = cold_data_of(v).release_twin_;
+	BufferPool::getInstance().acquire(twin, var->get_size());
+	var->lock_value();
+	void* buffer = var->value_buffer();
+	if (buffer != nullptr)
+		memcpy(&twin[0], buffer, twin.size());
+	var->unlock_value();
+	if (buffer == nullptr)
+		var->get_value(&twin[0]);
+
+	v->policy_data_.dirty_ = true;
+	set_state(v, v->policy_data_.state_);
+	std::unique_lock<std::mutex> lock (dirty_mutex_);
+	dirty_variables_.push_back(v);
+}
+
+/**
+ * @brief Method for sending to all nodes the writes of release-consistent variables since the latest barrier.
+ *
+ * The bytes of each variable written are sent as a delta with exact ranges (see MSG_FLAG_RELEASE),
+ * so that the writes of different nodes to different bytes of the same variable are merged,
+ * and the variable is read-only again until the next write.
+ * It returns once all nodes have applied the deltas, and the write-update values sent
+ * since the latest barrier (see MSG_RELEASE_ACK): therefore, after the barrier, all nodes see the writes.
+ */
+void Policy::release_writes()
+{
+	std::unique_lock<std::mutex> release_lock (release_mutex_);
+	{
+		std::unique_lock<std::mutex> lock (dirty_mutex_);
+		released_variables_.swap(dirty_variables_);
+	}
+
+	int nodes = CommunicationHandler::getInstance().get_number_of_nodes();
+	bool ret = true;
+	for (auto v: released_variables_) {
+		std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+		AbstractShared* var = v->variable_;
+		if ((var == nullptr) || !v->policy_data_.dirty_)
+			continue;
+		// The writes in progress end, and the following ones are recorded again (see record_write())
+		v->policy_data_.dirty_ = false;
+		set_state(v, v->policy_data_.state_);
+		std::size_t size = var->get_size();
+		std::vector<char> value;
+		BufferPool::getInstance().acquire(value, size);
+		var->lock_value();
+		void* buffer = var->value_buffer();
+		if (buffer != nullptr)
+			memcpy(&value[0], buffer, size);
+		var->unlock_value();
+		if (buffer == nullptr)
+			var->get_value(&value[0]);
+
+		delta_header h;
+		h.base = 0;
+		h.version = 0;
+		std::vector<char> delta;
+		BufferPool::getInstance().acquire(delta, exact_delta_bound(size));
+		delta.resize(sizeof(h));
+		diff_ranges(&v->policy_data_.cold_->release_twin_[0], &value[0], size, delta, exact_delta_bound(size), true);
+		memcpy(&delta[0], &h, sizeof(h));
+		BufferPool::getInstance().release(value);
+		BufferPool::getInstance().release(v->policy_data_.cold_->release_twin_);
+		if ((delta.size() == sizeof(h)) || (nodes < 2)) {
+			BufferPool::getInstance().release(delta);
+			continue;
+		}
+
+		DEBUG("Releasing " << delta.size() << " bytes of writes of variable " << var->get_id());
+		expect_release_acks(nodes - 1);
+		msg_t ans;
+		ans.type = msg_type_t::MSG_SET_NEW_VALUE;
+		ans.flags = MSG_FLAG_DELTA | MSG_FLAG_RELEASE;
+		ans.id = var->get_id();
+		ans.data.var_size = delta.size();
+		if ((sizeof(ans) + delta.size() <= BATCH_DATAGRAM_SIZE) &&
+		    (delta.size() < Config::getInstance().compression_threshold)) {
+			// Small deltas (never compressed) are sent in a single datagram for all nodes
+			if (!CommunicationHandler::getInstance().send_value_to_all(&ans, sizeof(ans), &delta[0], delta.size(), true)) {
+				expect_release_acks(-(nodes - 1));
+				ret = false;
 			}
-			DEBUG("Sending MSG_INVALIDATE_COPY_ACK...");
-			msg_t ans;
-			ans.type = msg_type_t::MSG_INVALIDATE_COPY_ACK;
-			ans.data.node = pbsm_tid;
-			ans.id = msg.id;
-			if (!CommunicationHandler::getInstance().send_to(&ans, sizeof(ans), msg.data.node)) {
-				ERROR("ERROR in sending MSG_INVALIDATE_COPY_ACK for variable " << msg.id);
-			} else {
-				DEBUG("MSG_INVALIDATE_COPY_ACK sent for variable " << msg.id);
+			BufferPool::getInstance().release(delta);
+			continue;
+		}
+		for (int i = 0; i < nodes; ++i){
+			if (i == pbsm_tid)
+				continue;
+			std::vector<char> copy;
+			BufferPool::getInstance().acquire(copy, delta.size());
+			memcpy(&copy[0], &delta[0], delta.size());
+			if (!send_encoded_value(i, var->get_id(), copy, ans.flags, compressible(var->get_compression(), delta.size(), i))) {
+				expect_release_acks(-1);
+				ret = false;
 			}
+		}
+		BufferPool::getInstance().release(delta);
+	}
+	if (!released_variables_.empty()) {
+		released_variables_.clear();
+		CommunicationHandler::getInstance().flush_all();
+	}
 
-			break;
+	// The acknowledgments of the writes not sent are not waited for (see expect_release_acks())
+	if (!ret)
+		ERROR("ERROR in releasing the writes of variables");
+	std::unique_lock<std::mutex> lock (dirty_mutex_);
+	DEBUG("BLOCKING on release_acked_");
+	while (release_acks_ > 0)
+		release_acked_.wait(lock);
+}
+
+/**
+ * @brief Method for queuing the writes of a release-consistent variable released by another node.
+ *
+ * They are applied at the next barrier (see apply_released_writes()), so that they never
+ * mix with the writes of the current interval (e.g., a copy of the value read before them and
+ * written back after them).
+ * Must be called with lock already acquired.
+ * @param v		Pointer to var_data of the variable
+ * @param ranges	Ranges written (see diff_ranges())
+ * @param len		Size of the ranges
+ */
+void Policy::queue_released_writes(var_data* v, const char* ranges, std::size_t len)
+{
+	std::vector<char>& pending = cold_data_of(v).released_writes_;
+	if (pending.empty()) {
+		BufferPool::getInstance().acquire(pending, len);
+		memcpy(&pending[0], ranges, len);
+		std::unique_lock<std::mutex> lock (dirty_mutex_);
+		pending_variables_.push_back(v);
+	} else {
+		pending.insert(pending.end(), ranges, ranges + len);
+	}
+}
+
+/**
+ * @brief Method for applying the writes of release-consistent variables released by other nodes.
+ *
+ * It is called when leaving a barrier: all nodes have released their writes by then.
+ * Writes released by nodes already past the barrier (i.e., of the next interval) are applied too.
+ */
+void Policy::apply_released_writes()
+{
+	std::unique_lock<std::mutex> release_lock (release_mutex_);
+	{
+		std::unique_lock<std::mutex> lock (dirty_mutex_);
+		if (pending_variables_.empty())
+			return;
+		released_variables_.swap(pending_variables_);
+	}
+	for (auto v: released_variables_) {
+		std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+		AbstractShared* var = v->variable_;
+		std::vector<char>& pending = cold_data_of(v).released_writes_;
+		if ((var == nullptr) || pending.empty())
+			continue;
+		DEBUG("Applying " << pending.size() << " bytes of writes of variable " << var->get_id() << " released by other nodes");
+		std::size_t size = var->get_size();
+		bool ok;
+		// Accesses of other threads without calling the policy wait meanwhile (see set_state())
+		begin_remote_write(v);
+		var->lock_value();
+		char* buffer = (char*) var->value_buffer();
+		if (buffer != nullptr)
+			ok = apply_ranges(&pending[0], pending.size(), buffer, size);
+		var->unlock_value();
+		if (buffer == nullptr) {
+			std::vector<char> copy;
+			BufferPool::getInstance().acquire(copy, size);
+			var->get_value(&copy[0]);
+			ok = apply_ranges(&pending[0], pending.size(), &copy[0], size);
+			if (ok)
+				var->set_value(&copy[0]);
+			BufferPool::getInstance().release(copy);
+		}
+		// Writes of the next interval, done by other threads, must not include the ones applied
+		if (ok && v->policy_data_.dirty_)
+			apply_ranges(&pending[0], pending.size(), &v->policy_data_.cold_->release_twin_[0], size);
+		if (!ok)
+			ERROR("Malformed writes of variable " << var->get_id() << " released by other nodes");
+		v->policy_data_.version_ = 0;
+		BufferPool::getInstance().release(pending);
+		set_state(v, v->policy_data_.state_);
+	}
+	released_variables_.clear();
+}
+
+/**
+ * @brief Method for forwarding a request of ownership of a variable whose home is this node to its owner.
+ *
+ * The requesting node is recorded as the owner (see directory_): therefore, a request takes
+ * two hops at most (to the home and to the owner), plus the grant.
+ * A node requesting again the ownership it is waiting for (e.g., from another thread) is
+ * already going to get it, and its request is dropped.
+ * If the ownership migrates too often (see count_migration()), the home takes it instead
+ * and pins the variable: the requesting node, as any other one asking for the ownership while
+ * the variable is pinned, gets MSG_PINNED and ships its writes (see ship_write()).
+ * If this node is the owner, it gives the ownership directly.
+ * Must be called with the lock of the variable already acquired.
+ * @param var_id	ID of the variable
+ * @param node		Requesting node
+ * @param v		Pointer to var_data of the variable (nullptr if unknown)
+ * @return		true in case of success; false in case of network error
+ */
+bool Policy::forward_ownership_request(uint32_t var_id, int node, var_data* v)
+{
+	if ((v != nullptr) && v->policy_data_.pinned_ && (node != pbsm_tid)) {
+		DEBUG("Variable " << var_id << " pinned: sending MSG_PINNED to node " << node);
+		msg_t msg;
+		msg.type = msg_type_t::MSG_PINNED;
+		msg.data.node = pbsm_tid;
+		msg.id = var_id;
+		if (!CommunicationHandler::getInstance().send_to(&msg, sizeof(msg), node)) {
+			ERROR("ERROR in sending MSG_PINNED to " << node);
+			return false;
 		}
-		case (msg_type_t::MSG_INVALIDATE_COPY_ACK): {
-			DEBUG("Received MSG_INVALIDATE_COPY_ACK");
+		return true;
+	}
 
-			var_data* v = dictionary_[msg.id];
-			if (v != nullptr){
+	int owner;
+	bool pin = false;
+	{
+		std::unique_lock<std::mutex> lock (directory_mutex_);
+		std::map<uint32_t, int>::iterator i = directory_.insert(std::make_pair(var_id, 0)).first;
+		owner = i->second;
+		if (owner != node) {
+			pin = (v != nullptr) && !v->policy_data_.pinned_ && count_migration(v);
+			i->second = pin ? pbsm_tid : node;
+		}
+	}
+	if (owner == node) {
+		DEBUG("Node " << node << " is already going to own variable " << var_id);
+		return true;
+	}
+
+	if (pin) {
+		DEBUG("Ownership of variable " << var_id << " ping-ponging: pinning it here");
+		v->policy_data_.pinned_ = true;
+		v->policy_data_.pins_++;
+		v->policy_data_.window_start_ = std::chrono::steady_clock::now();
+		v->policy_data_.window_count_ = 0;
+		v->policy_data_.window_writer_ = -1;
+		set_state(v, v->policy_data_.state_);
+		bool ret = true;
+		if (node != pbsm_tid) {
+			msg_t msg;
+			msg.type = msg_type_t::MSG_PINNED;
+			msg.data.node = pbsm_tid;
+			msg.id = var_id;
+			ret = CommunicationHandler::getInstance().send_to(&msg, sizeof(msg), node);
+			if (!ret)
+				ERROR("ERROR in sending MSG_PINNED to " << node);
+		}
+		// The home requests the ownership for itself, unless it is already the owner (or going to be)
+		if (owner == pbsm_tid)
+			return ret;
+		node = pbsm_tid;
+	}
+
+	if (owner == pbsm_tid) {
+		if (v == nullptr) {
+			ERROR("Variable " << var_id << " not found");
+			return false;
+		}
+		return change_owner(v, node);
+	}
+
+	DEBUG("Forwarding MSG_REQUEST_OWNERSHIP of node " << node << " to owner " << owner);
+	msg_t msg;
+	msg.type = msg_type_t::MSG_FORWARD_OWNERSHIP;
+	msg.data.node = node;
+	msg.id = var_id;
+	if (!CommunicationHandler::getInstance().send_to(&msg, sizeof(msg), owner)) {
+		ERROR("ERROR in sending MSG_FORWARD_OWNERSHIP to " << owner);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Method for counting a migration of the ownership of a variable whose home is this node.
+ *
+ * Only variables with the write-invalidate protocol whose writes (and two values, see MSG_WRITE_DONE)
+ * fit a single datagram are counted: the other ones are never pinned.
+ * Must be called with lock already acquired.
+ * @param v	Pointer to var_data of the variable
+ * @return	true if the migrations in the current window have reached Config::pingpong_migrations
+ */
+bool Policy::count_migration(var_data* v)
+{
+	const Config& config = Config::getInstance();
+	// MSG_WRITE_DONE carries up to two values (see execute_shipped_writes()),
+	// and the grant taking the variable back to the home the value and the sharers (see change_owner())
+	std::size_t sharers = (CommunicationHandler::getInstance().get_number_of_nodes() + 63) / 64 * sizeof(uint64_t);
+	if ((config.pingpong_migrations == 0) || (v->variable_->get_coherence() != coherence_t::INVALIDATE) ||
+	    (sizeof(msg_t) + std::max(sizeof(shipped_op_t) + v->variable_->get_size(), sharers) +
+	     v->variable_->get_size() > BATCH_DATAGRAM_SIZE))
+		return false;
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (now - v->policy_data_.window_start_ >= std::chrono::microseconds(config.pingpong_window_us)) {
+		v->policy_data_.window_start_ = now;
+		v->policy_data_.window_count_ = 0;
+	}
+	return (++v->policy_data_.window_count_ >= config.pingpong_migrations);
+}
+
+/**
+ * @brief Method for counting a write of a variable pinned at this node (i.e., its home).
+ *
+ * When a window is over, the variable is unpinned if the pattern has stopped: i.e., if the window
+ * had fewer writes than Config::pingpong_migrations, or writes of a single node, or if it ended
+ * long before (no writes at all in the meantime). Then, the ownership migrates again, starting
+ * from the next request (nodes shipping writes learn it from MSG_FLAG_UNPINNED).
+ * Must be called with lock already acquired.
+ * @param v	Pointer to var_data of the variable
+ * @param node	Writing node
+ */
+void Policy::count_pinned_write(var_data* v, int node)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::chrono::microseconds window (Config::getInstance().pingpong_window_us);
+	if (now - v->policy_data_.window_start_ >= window) {
+		if ((now - v->policy_data_.window_start_ >= 2 * window) ||
+		    (v->policy_data_.window_count_ < Config::getInstance().pingpong_migrations) ||
+		    (v->policy_data_.window_writer_ != -2)) {
+			DEBUG("Ownership of variable " << v->variable_->get_id() << " not ping-ponging anymore: unpinning it");
+			v->policy_data_.pinned_ = false;
+			set_state(v, v->policy_data_.state_);
+		}
+		v->policy_data_.window_start_ = now;
+		v->policy_data_.window_count_ = 0;
+		v->policy_data_.window_writer_ = -1;
+	}
+	if (!v->policy_data_.pinned_)
+		return;
+	v->policy_data_.window_count_++;
+	if (v->policy_data_.window_writer_ == -1)
+		v->policy_data_.window_writer_ = node;
+	else if (v->policy_data_.window_writer_ != node)
+		v->policy_data_.window_writer_ = -2;
+}
+
+/**
+ * @brief Method for shipping a write to the home node of a pinned variable, which executes it.
+ *
+ * It returns once the home has executed the write (see MSG_WRITE_DONE): the copies of the other nodes
+ * (including the one of this node) have then been invalidated, as for a local write.
+ * Each node ships a single write of a variable at a time.
+ * Must be called with lock already acquired (it is released while waiting).
+ * @param v	Pointer to var_data of the variable
+ * @param w	Write
+ * @param lock	Lock of the variable
+ * @return	true if the write has been shipped (or lost because of a network error); false if it
+ *		must be done locally (i.e., the variable is not pinned, or this node is its owner or home)
+ */
+bool Policy::ship_write(var_data* v, const shipped_write& w, std::unique_lock<std::mutex>& lock)
+{
+	while (v->policy_data_.shipping_ != nullptr)
+		v->policy_data_.write_done_.wait(lock);
+	AbstractShared* var = v->variable_;
+	if ((var == nullptr) || !v->policy_data_.pinned_ ||
+	    (v->policy_data_.state_ == state::OWNER_NO_SHARED) || (v->policy_data_.state_ == state::OWNER_SHARED))
+		return false;
+	uint32_t var_id = var->get_id();
+	int home = home_of(var_id);
+	if (home == pbsm_tid)
+		return false;
+	unsigned int invalidations = v->policy_data_.invalidations_;
+
+	std::size_t size = (w.op == write_op_t::ASSIGN) ? var->get_size() : 0;
+	std::vector<char> payload;
+	BufferPool::getInstance().acquire(payload, sizeof(shipped_op_t) + size);
+	((shipped_op_t*) &payload[0])->op = (uint8_t) w.op;
+	if (size > 0)
+		memcpy(&payload[sizeof(shipped_op_t)], w.operand, size);
+
+	DEBUG("Sending MSG_SHIP_WRITE of variable " << var_id << " to home node " << home);
+	msg_t msg;
+	msg.type = msg_type_t::MSG_SHIP_WRITE;
+	msg.id = var_id;
+	msg.data.var_size = payload.size();
+	v->policy_data_.shipping_ = &w;
+	bool ret = CommunicationHandler::getInstance().send_value_to(&msg, sizeof(msg), &payload[0], payload.size(), home);
+	BufferPool::getInstance().release(payload);
+	if (!ret) {
+		ERROR("ERROR in sending MSG_SHIP_WRITE of variable " << var_id);
+		v->policy_data_.shipping_ = nullptr;
+		v->policy_data_.write_done_.notify_all();
+		return true;
+	}
+	CommunicationHandler::getInstance().flush_all();
+	v->policy_data_.shipped_writes_++;
+	DEBUG("BLOCKING on write_done_");
+	while (v->policy_data_.shipping_ == &w)
+		v->policy_data_.write_done_.wait(lock);
+	// The write is lost if the variable has been destroyed in the meantime (see at_variable_destruction())
+	if (v->variable_ == nullptr)
+		return true;
+	// The copy sent with MSG_FLAG_UNPINNED may have been overtaken by an invalidation
+	if ((v->policy_data_.invalidations_ != invalidations) && (v->policy_data_.state_ == state::REMOTE_OWNER_CACHED))
+		set_state(v, state::REMOTE_OWNER_NO_CACHED);
+	return true;
+}
+
+/**
+ * @brief Method for executing the writes shipped by other nodes (see MSG_SHIP_WRITE).
+ *
+ * It runs on a dedicated thread, because a write may wait for other nodes (e.g., for the ownership,
+ * or for the invalidation of their copies), which receiving threads can't do.
+ * Each write is executed as a local write, and acknowledged with the value before it.
+ */
+void Policy::execute_shipped_writes()
+{
+	incoming_write w;
+	std::vector<char> previous;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock (shipped_mutex_);
+			while (shipped_queue_.empty())
+				shipped_available_.wait(lock);
+			incoming_write& front = shipped_queue_.front();
+			w.node = front.node;
+			w.var_id = front.var_id;
+			w.op = front.op;
+			w.operand.swap(front.operand);
+			shipped_queue_.pop_front();
+		}
+
+		msg_t ans;
+		ans.type = msg_type_t::MSG_WRITE_DONE;
+		ans.id = w.var_id;
+		ans.data.var_size = 0;
+		// The reader is not held while executing the write, which may wait for other nodes: the variable
+		// can't be destroyed (see at_variable_destruction()) while the write is marked as being executed
+		var_data* v = nullptr;
+		{
+			dictionary<var_data>::reader guard (dictionary_);
+			v = dictionary_.find(w.var_id);
+			if (v != nullptr) {
 				std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
-				v->policy_data_.waiting_invalidate_copies_.counter_--;
-				if (v->policy_data_.waiting_invalidate_copies_.counter_ == 0){
-					DEBUG("UNBLOCKING waiting_invalidate_copies_");
-					v->policy_data_.waiting_invalidate_copies_.wait_condition_.notify_all();
+				if (v->variable_ != nullptr)
+					v->policy_data_.executing_ = true;
+				else
+					v = nullptr;
+			}
+		}
+		if (v == nullptr) {
+			ERROR("Write shipped for unknown variable " << w.var_id);
+			ans.flags = MSG_FLAG_UNPINNED;
+		} else {
+			// The ownership is taken back, if needed, and the copies of the other nodes invalidated
+			before_local_write(v);
+			{
+				std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+				AbstractShared* var = v->variable_;
+				if (var == nullptr) {
+					ERROR("Write shipped for destroyed variable " << w.var_id);
+				} else if ((w.op == write_op_t::ASSIGN) && (w.operand.size() != var->get_size())) {
+					ERROR("Malformed write shipped for variable " << w.var_id);
+				} else {
+					DEBUG("Executing write of node " << w.node << " to variable " << w.var_id);
+					// Room for the current value too (see MSG_FLAG_UNPINNED)
+					BufferPool::getInstance().acquire(previous, 2 * var->get_size());
+					if (var->apply_write(w.op, w.operand.data(), &previous[0]))
+						ans.data.var_size = var->get_size();
+					else
+						ERROR("Write shipped not supported by variable " << w.var_id);
+					if (v->policy_data_.pinned_)
+						count_pinned_write(v, w.node);
+					v->policy_data_.shipped_writes_++;
+					if (!v->policy_data_.pinned_ && (ans.data.var_size > 0)) {
+						// The writer is going to migrate the ownership again: it gets a copy
+						// of the current value, which the grant does not carry
+						var->get_value(&previous[var->get_size()]);
+						ans.data.var_size = 2 * var->get_size();
+						v->policy_data_.sharers_.insert(w.node);
+						set_state(v, state::OWNER_SHARED);
+					}
 				}
+				if (!v->policy_data_.pinned_)
+					ans.flags = MSG_FLAG_UNPINNED;
 			}
-			break;
+			after_local_write(v);
+			std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+			v->policy_data_.executing_ = false;
+			v->policy_data_.write_done_.notify_all();
 		}
+		if (!CommunicationHandler::getInstance().send_value_to(&ans, sizeof(ans), previous.data(), ans.data.var_size, w.node))
+			ERROR("ERROR in sending MSG_WRITE_DONE to " << w.node);
+		CommunicationHandler::getInstance().flush_all();
+		BufferPool::getInstance().release(previous);
+	}
+}
+
+/**
+ * @brief Method for printing the variables whose home is this node that have been pinned, and the
+ * writes shipped by this node (see Config::pingpong_migrations).
+ * @param out	Stream where statistics must be printed
+ */
+void Policy::print_stats(std::ostream& out)
+{
+	dictionary_.for_each([&](uint32_t var_id, var_data* v) {
+		std::unique_lock<std::mutex> lock (v->policy_data_.mutex_);
+		if ((v->variable_ == nullptr) || ((v->policy_data_.pins_ == 0) && (v->policy_data_.shipped_writes_ == 0)))
+			return;
+		int home = home_of(var_id);
+		out << "Variable " << var_id << ": ";
+		if (home == pbsm_tid)
+			out << (v->policy_data_.pinned_ ? "pinned here" : "migrating") << ", pinned " << v->policy_data_.pins_
+			    << " times, " << v->policy_data_.shipped_writes_ << " writes of other nodes executed" << std::endl;
+		else
+			out << (v->policy_data_.pinned_ ? "pinned at node " : "migrating, home node ") << home
+			    << ", " << v->policy_data_.shipped_writes_ << " writes shipped" << std::endl;
+	});
+}
 
-		default: {
-			ERROR("ERROR: Unrecognized message");
+/**
+ * @brief Method for invalidating the copies of the nodes sharing an owned variable (see var_data).
+ *
+ * Only the nodes which may hold a copy (i.e., the ones served by this node or by the previous owners)
+ * get MSG_INVALIDATE_COPY: if all nodes do, it is sent through send_to_all().
+ * It returns once all of them have acknowledged: then, no other node shares the variable.
+ * Must be called with lock already acquired (it is released while waiting).
+ * @param v		Pointer to var_data of the variable
+ * @param lock		Lock of the variable
+ * @return		true in case of success; false in case of network error
+ */
+bool Policy::invalidate_copies(var_data* v, std::unique_lock<std::mutex>& lock)
+{
+	bool ret = true;
+	node_set& sharers = v->policy_data_.sharers_;
+	sharers.erase(pbsm_tid);
+	int count = sharers.size();
+	if (count > 0) {
+		DEBUG("Sending MSG_INVALIDATE_COPY to " << count << " nodes...");
+		msg_t ans;
+		ans.type = msg_type_t::MSG_INVALIDATE_COPY;
+		ans.data.node = pbsm_tid;
+		ans.id = v->variable_->get_id();
+		semaphore& acks = v->policy_data_.waiting_invalidate_copies_;
+		acks.counter_ = count;
+		if (count == CommunicationHandler::getInstance().get_number_of_nodes() - 1) {
+			ret = CommunicationHandler::getInstance().send_to_all(&ans, sizeof(ans));
+		} else {
+			sharers.for_each([&](int node) {
+				ret = CommunicationHandler::getInstance().send_to(&ans, sizeof(ans), node) && ret;
+			});
 		}
+		CommunicationHandler::getInstance().flush_all();
+		if (ret) {
+			DEBUG("BLOCKING on waiting_invalidate_copies_");
+			while ((acks.counter_ > 0) && (v->variable_ != nullptr))
+				acks.wait_condition_.wait(lock);
+		} else {
+			ERROR("ERROR in sending MSG_INVALIDATE_COPY");
 		}
 	}
+	sharers.clear();
+	return ret;
 }
 
+/**
+ * @brief Method for acknowledging a delta of release-consistent writes (see MSG_FLAG_RELEASE).
+ * @param rem_node	ID of the releasing node
+ * @param var_id	ID of the variable
+ */
+void Policy::send_release_ack(int rem_node, uint32_t var_id)
+{
+	msg_t ans;
+	ans.type = msg_type_t::MSG_RELEASE_ACK;
+	ans.data.node = pbsm_tid;
+	ans.id = var_id;
+	if (!CommunicationHandler::getInstance().send_to(&ans, sizeof(ans), rem_node))
+		ERROR("ERROR in sending MSG_RELEASE_ACK for variable " << var_id);
+}
 
 void Policy::thread_wait_master_barrier(uint32_t s)
 {
@@ -240,7 +1992,7 @@ void Policy::thread_wait_master_barrier(uint32_t s)
 	semaphore* elem = master_waiting_barrier_grants_[s];
 	if (elem == nullptr) {
 		DEBUG("I'm first node to reach the barrier. Creating data structures...");
-		elem = new semaphore;
+		elem = semaphore_pool_.acquire();
 		elem->counter_ = CommunicationHandler::getInstance().get_number_of_nodes();
 		master_waiting_barrier_grants_[s] = elem;
 	}
@@ -252,15 +2004,18 @@ void Policy::thread_wait_master_barrier(uint32_t s)
 	}
 	DEBUG("All nodes already reached the barrier.");
 
-	delete elem;
+	semaphore_pool_.release(elem);
 	master_waiting_barrier_grants_[s] = nullptr;
 
+	// The messages which must precede the unblock have already been acknowledged (e.g., the released writes,
+	// see thread_wait_barrier()), as for the other nodes, whose messages are never ordered with it anyway
 	DEBUG("Sending MSG_BARRIER_UNBLOCK to everybody...");
 	msg_t ans;
 	ans.type = msg_type_t::MSG_BARRIER_UNBLOCK;
 	ans.id = s;
-	if (!CommunicationHandler::getInstance().send_to_all(&ans, sizeof(ans)))
+	if (!CommunicationHandler::getInstance().send_to_all(&ans, sizeof(ans), false))
 			ERROR("ERROR in sending MSG_BARRIER_UNBLOCK");
+	CommunicationHandler::getInstance().flush_all();
 }
 
 
@@ -277,6 +2032,7 @@ void Policy::thread_wait_slave_barrier(uint32_t s)
 	DEBUG("Sending MSG_BARRIER_BLOCK...");
 	if (!CommunicationHandler::getInstance().send_to(&ans, sizeof(ans), 0))
 		ERROR("ERROR in sending MSG_BARRIER_BLOCK");
+	CommunicationHandler::getInstance().flush_all();
 	DEBUG("Waiting master's answer...");
 	DEBUG("BLOCKING on slave_wait_barrier_");
 	slave_wait_barrier_.wait(lock);
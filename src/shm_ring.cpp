@@ -0,0 +1,217 @@
+#include <stdexcept>
+#include <cstring>	// memcpy()
+#include <cerrno>
+#include <thread>	// std::this_thread::yield()
+#include <fcntl.h>	// open()
+#include <signal.h>	// kill()
+#include <unistd.h>	// close(), ftruncate(), unlink(), getpid(), syscall()
+#include <sys/mman.h>	// mmap()
+#include <sys/stat.h>	// fstat()
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shm_ring.hpp"
+#include "logger.hpp"
+
+/// Length of the header preceding each record (it keeps payloads 8-byte aligned)
+const std::uint32_t SHM_RECORD_HEADER = 8;
+
+/// Record length marking that the next record starts from the beginning of the ring
+const std::uint32_t SHM_WRAP = 0xFFFFFFFF;
+
+/// Number of polls of an empty ring before sleeping
+const int SHM_SPIN_COUNT = 1000;
+
+/// Space taken in the ring by a record with the given length
+static inline std::uint32_t record_space(std::size_t len)
+{
+	return (SHM_RECORD_HEADER + len + 7) & ~7U;
+}
+
+/**
+ * @brief Create the ring (consumer side)
+ *
+ * Any stale file with the same name (e.g., left by a previous run) is removed first.
+ * @param name Name of the file in /dev/shm
+ * @return Pointer to the new ring
+ * @throw std::runtime_error in case of error
+ */
+ShmRing* ShmRing::create(const std::string& name)
+{
+	std::string path = "/dev/shm/" + name;
+	unlink(path.c_str());
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if ((fd >= 0) && (ftruncate(fd, sizeof(header) + SHM_RING_SIZE) < 0)) {
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0) {
+		ERROR("Opening shared memory ring " << path);
+		throw std::runtime_error ("Shared memory error");
+	}
+	ShmRing* ring = new ShmRing(name, fd, true);
+	ring->header_->owner.store(getpid(), std::memory_order_release);
+	return ring;
+}
+
+/**
+ * @brief Map a ring already created by the consumer (producer side)
+ *
+ * The consumer is then notified (see connected()).
+ * @param name Name of the file in /dev/shm
+ * @return Pointer to the ring; nullptr if the consumer has not created it yet
+ * (i.e., the file does not exist, is not yet initialized, or has been left by a process no longer running)
+ * @throw std::runtime_error in case of error
+ */
+ShmRing* ShmRing::open(const std::string& name)
+{
+	std::string path = "/dev/shm/" + name;
+	int fd = ::open(path.c_str(), O_RDWR);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return nullptr;
+		ERROR("Opening shared memory ring " << path);
+		throw std::runtime_error ("Shared memory error");
+	}
+	struct stat st;
+	if ((fstat(fd, &st) < 0) || ((std::size_t) st.st_size < sizeof(header) + SHM_RING_SIZE)) {
+		close(fd);
+		return nullptr;
+	}
+	ShmRing* ring = new ShmRing(name, fd, false);
+	pid_t owner = ring->header_->owner.load(std::memory_order_acquire);
+	if ((owner == 0) || ((kill(owner, 0) < 0) && (errno == ESRCH))) {
+		delete ring;
+		return nullptr;
+	}
+	ring->header_->attached.store(1, std::memory_order_release);
+	return ring;
+}
+
+ShmRing::ShmRing(const std::string& name, int fd, bool owner):
+	name_("/dev/shm/" + name), owner_(owner), peeked_(0)
+{
+	DEBUG("Mapping shared memory ring " << name_);
+	mapping_ = mmap(nullptr, sizeof(header) + SHM_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping_ == MAP_FAILED) {
+		ERROR("mmap() of shared memory ring " << name_);
+		throw std::runtime_error ("Shared memory error");
+	}
+	header_ = (header*) mapping_;
+	data_ = (char*) mapping_ + sizeof(header);
+}
+
+ShmRing::~ShmRing()
+{
+	munmap(mapping_, sizeof(header) + SHM_RING_SIZE);
+	if (owner_)
+		unlink(name_.c_str());
+}
+
+/**
+ * @brief Check if the producer has mapped the ring (consumer side)
+ *
+ * Once it has, the file is removed from /dev/shm, since no other process needs to open it.
+ * @return true if the producer has mapped the ring
+ */
+bool ShmRing::connected()
+{
+	if (header_->attached.load(std::memory_order_acquire) == 0)
+		return false;
+	if (owner_) {
+		unlink(name_.c_str());
+		owner_ = false;
+	}
+	return true;
+}
+
+/**
+ * @brief Write a record, gathered from a set of buffers, into the ring
+ *
+ * If there is not enough room, the method waits until the consumer frees it.
+ * @param iov Buffers composing the record
+ * @param iovcnt Number of buffers
+ * @return true in case of success; false if the record is too big for the ring
+ */
+bool ShmRing::write(const struct iovec* iov, int iovcnt)
+{
+	std::size_t len = 0;
+	for (int i = 0; i < iovcnt; ++i)
+		len += iov[i].iov_len;
+	std::uint32_t space = record_space(len);
+	if (space > SHM_RING_SIZE / 2) {
+		ERROR("Record of size " << len << " too big for the shared memory ring");
+		return false;
+	}
+
+	std::uint32_t pos = header_->tail.load(std::memory_order_relaxed);
+	std::uint32_t to_end = SHM_RING_SIZE - (pos & (SHM_RING_SIZE - 1));
+	std::uint32_t needed = (space > to_end) ? space + to_end : space;
+	while (SHM_RING_SIZE - (pos - header_->head.load(std::memory_order_acquire)) < needed)
+		std::this_thread::yield();
+
+	if (space > to_end) {
+		*(std::uint32_t*) &data_[pos & (SHM_RING_SIZE - 1)] = SHM_WRAP;
+		pos += to_end;
+	}
+	char* record = &data_[pos & (SHM_RING_SIZE - 1)];
+	*(std::uint32_t*) record = len;
+	record += SHM_RECORD_HEADER;
+	for (int i = 0; i < iovcnt; ++i) {
+		memcpy(record, iov[i].iov_base, iov[i].iov_len);
+		record += iov[i].iov_len;
+	}
+
+	header_->tail.store(pos + space, std::memory_order_seq_cst);
+	if (header_->consumer_waiting.load(std::memory_order_seq_cst))
+		syscall(SYS_futex, &header_->tail, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+	return true;
+}
+
+/**
+ * @brief Get the next record of the ring, without consuming it
+ *
+ * The record must be released through consume() once handled.
+ * @param size Pointer where the length of the record must be put
+ * @param block true to wait until a record is available
+ * @return Pointer to the record inside the ring; nullptr if the ring is empty (only when not blocking)
+ */
+char* ShmRing::peek(std::size_t* size, bool block)
+{
+	int spins = 0;
+	for (;;) {
+		std::uint32_t pos = header_->head.load(std::memory_order_relaxed);
+		std::uint32_t tail = header_->tail.load(std::memory_order_acquire);
+		if (pos != tail) {
+			char* record = &data_[pos & (SHM_RING_SIZE - 1)];
+			std::uint32_t len = *(std::uint32_t*) record;
+			if (len == SHM_WRAP) {
+				header_->head.store(pos + SHM_RING_SIZE - (pos & (SHM_RING_SIZE - 1)), std::memory_order_release);
+				continue;
+			}
+			peeked_ = len;
+			*size = len;
+			return record + SHM_RECORD_HEADER;
+		}
+		if (!block)
+			return nullptr;
+		if (++spins < SHM_SPIN_COUNT)
+			continue;
+
+		header_->consumer_waiting.store(1, std::memory_order_seq_cst);
+		if (header_->tail.load(std::memory_order_seq_cst) == tail)
+			syscall(SYS_futex, &header_->tail, FUTEX_WAIT, tail, nullptr, nullptr, 0);
+		header_->consumer_waiting.store(0, std::memory_order_relaxed);
+		spins = 0;
+	}
+}
+
+/**
+ * @brief Release the record returned by the latest peek()
+ */
+void ShmRing::consume()
+{
+	std::uint32_t pos = header_->head.load(std::memory_order_relaxed);
+	header_->head.store(pos + record_space(peeked_), std::memory_order_release);
+}
@@ -0,0 +1,496 @@
+#include <stdexcept>
+#include <cstring>	// memset()
+#include <cerrno>
+#include <algorithm>
+#include <chrono>
+#include <unistd.h>	// syscall(), close()
+#include <sys/mman.h>	// mmap()
+#include <sys/syscall.h>
+#include <arpa/inet.h>	// htonl()
+
+#include "uring.hpp"
+#include "logger.hpp"
+
+/// Id of the group of buffers provided for multishot receives
+const unsigned short URING_BUFFER_GROUP = 0;
+
+/// Tag of the completions of buffers provided to the kernel
+const unsigned long long URING_PROVIDE_TAG = ~0ULL;
+
+/// Tag of the completions of the multishot receive posted by the constructor (see probe_multishot())
+const unsigned long long URING_PROBE_TAG = ~0ULL - 1;
+
+/// Tag of the completion of the cancellation of the probe
+const unsigned long long URING_CANCEL_TAG = ~0ULL - 2;
+
+/// Number of entries of the send ring
+const unsigned int URING_SEND_ENTRIES = 256;
+
+/**
+ * @brief Constructor
+ *
+ * It creates the io_uring instance and maps its rings in memory.
+ * @param entries Number of entries of the submission queue
+ * @throw std::runtime_error in case of error (e.g., io_uring not supported by the kernel)
+ */
+Uring::Uring(unsigned int entries): sq_ptr_(MAP_FAILED), cq_ptr_(MAP_FAILED), sqes_((struct io_uring_sqe*) MAP_FAILED)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	fd_ = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd_ < 0) {
+		ERROR("io_uring_setup()");
+		throw std::runtime_error ("io_uring error");
+	}
+
+	sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_size_ > sq_size_)
+			sq_size_ = cq_size_;
+		cq_size_ = sq_size_;
+	}
+	sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq_ptr_ = sq_ptr_;
+	else
+		cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+	sqes_ = (struct io_uring_sqe*) mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+	if ((sq_ptr_ == MAP_FAILED) || (cq_ptr_ == MAP_FAILED) || (sqes_ == MAP_FAILED)) {
+		ERROR("mmap() of io_uring rings");
+		this->~Uring();
+		throw std::runtime_error ("io_uring error");
+	}
+
+	char* sq = (char*) sq_ptr_;
+	sq_head_ = (unsigned*) (sq + p.sq_off.head);
+	sq_tail_ = (unsigned*) (sq + p.sq_off.tail);
+	sq_array_ = (unsigned*) (sq + p.sq_off.array);
+	sq_mask_ = *(unsigned*) (sq + p.sq_off.ring_mask);
+	sq_entries_ = p.sq_entries;
+	sqe_tail_ = *sq_tail_;
+
+	char* cq = (char*) cq_ptr_;
+	cq_head_ = (unsigned*) (cq + p.cq_off.head);
+	cq_tail_ = (unsigned*) (cq + p.cq_off.tail);
+	cq_mask_ = *(unsigned*) (cq + p.cq_off.ring_mask);
+	cqes_ = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+}
+
+Uring::~Uring()
+{
+	if (sqes_ != MAP_FAILED)
+		munmap(sqes_, sqes_size_);
+	if ((cq_ptr_ != MAP_FAILED) && (cq_ptr_ != sq_ptr_))
+		munmap(cq_ptr_, cq_size_);
+	if (sq_ptr_ != MAP_FAILED)
+		munmap(sq_ptr_, sq_size_);
+	close(fd_);
+}
+
+/**
+ * @brief Get a free submission queue entry
+ *
+ * The entry is queued, but it is actually submitted to the kernel only by submit().
+ * @return Pointer to the (zeroed) entry; nullptr if the submission queue is full
+ */
+struct io_uring_sqe* Uring::get_sqe()
+{
+	unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+	if (sqe_tail_ - head >= sq_entries_)
+		return nullptr;
+	unsigned index = sqe_tail_ & sq_mask_;
+	sq_array_[index] = index;
+	struct io_uring_sqe* sqe = &sqes_[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe_tail_++;
+	return sqe;
+}
+
+/**
+ * @brief Submit the queued entries and wait for completions
+ * @param wait_nr Number of completions to wait for (0 to not wait)
+ * @return Number of entries submitted; -1 in case of error
+ */
+int Uring::submit(unsigned int wait_nr)
+{
+	unsigned to_submit = sqe_tail_ - *sq_tail_;
+	__atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+	int ret;
+	do {
+		ret = syscall(__NR_io_uring_enter, fd_, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+	} while ((ret < 0) && (errno == EINTR));
+	if (ret < 0)
+		ERROR("io_uring_enter()");
+	return ret;
+}
+
+/**
+ * @brief Get the oldest completion queue entry not yet seen
+ * @return Pointer to the entry; nullptr if there are no completions
+ */
+struct io_uring_cqe* Uring::peek_cqe()
+{
+	unsigned head = *cq_head_;
+	if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+		return nullptr;
+	return &cqes_[head & cq_mask_];
+}
+
+/**
+ * @brief Mark the entry returned by peek_cqe() as seen
+ */
+void Uring::cqe_seen()
+{
+	__atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE);
+}
+
+
+
+/**
+ * @brief Constructor
+ *
+ * It creates the send and receive rings and provides the receive buffers to the kernel.
+ * Then, it checks that the kernel supports multishot receives (see probe_multishot()).
+ * @throw std::runtime_error in case of error (e.g., io_uring or multishot receives not supported by the kernel)
+ */
+UringTransport::UringTransport(unsigned int spin_poll_us):
+	send_ring_(URING_SEND_ENTRIES),
+	queued_sends_(0),
+	send_error_(false),
+	recv_ring_(2 * URING_RECV_BUFFERS),
+	buffers_((char*) MAP_FAILED),
+	spin_poll_us_(spin_poll_us)
+{
+	DEBUG("Creating io_uring transport...");
+	memset(&recv_msg_, 0, sizeof(recv_msg_));
+	recv_msg_.msg_namelen = sizeof(struct sockaddr_in);
+	buffers_ = (char*) mmap(nullptr, URING_RECV_BUFFERS * URING_BUFFER_SIZE,
+			PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (buffers_ == MAP_FAILED) {
+		ERROR("mmap() of receive buffers");
+		throw std::runtime_error ("io_uring error");
+	}
+
+	provide_buffers(0, URING_RECV_BUFFERS);
+	struct io_uring_cqe* cqe = nullptr;
+	if (recv_ring_.submit(1) >= 0)
+		cqe = recv_ring_.peek_cqe();
+	if ((cqe == nullptr) || (cqe->res < 0)) {
+		ERROR("Providing receive buffers");
+		munmap(buffers_, URING_RECV_BUFFERS * URING_BUFFER_SIZE);
+		throw std::runtime_error ("io_uring error");
+	}
+	recv_ring_.cqe_seen();
+
+	if (!probe_multishot()) {
+		ERROR("Multishot receives not supported by the kernel");
+		munmap(buffers_, URING_RECV_BUFFERS * URING_BUFFER_SIZE);
+		throw std::runtime_error ("io_uring error");
+	}
+}
+
+/**
+ * @brief Check that the kernel supports multishot receives of messages (Linux 6.0)
+ *
+ * Older kernels with io_uring complete them with -EINVAL as soon as they are posted.
+ * Therefore, a multishot receive is posted on a socket which has already received a datagram
+ * from itself: it must return the datagram and remain active. Then, it is cancelled.
+ * @return true if multishot receives are supported
+ */
+bool UringTransport::probe_multishot()
+{
+	bool ok = false;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	char byte = 0;
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if ((fd < 0) || (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) ||
+	    (getsockname(fd, (struct sockaddr*) &addr, &len) < 0) ||
+	    (sendto(fd, &byte, sizeof(byte), 0, (struct sockaddr*) &addr, sizeof(addr)) != sizeof(byte))) {
+		ERROR("Socket for probing multishot receives");
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	struct io_uring_sqe* sqe = recv_ring_.get_sqe();
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) &recv_msg_;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = URING_PROBE_TAG;
+
+	// Completions expected: the datagram (or the error), then the end of the receive and the cancellation
+	bool active = true;
+	bool cancelling = false;
+	while (active || cancelling) {
+		if (recv_ring_.submit(1) < 0)
+			break;
+		struct io_uring_cqe* cqe;
+		while ((cqe = recv_ring_.peek_cqe()) != nullptr) {
+			if (cqe->user_data == URING_PROBE_TAG) {
+				if ((cqe->res >= 0) && (cqe->flags & IORING_CQE_F_MORE))
+					ok = true;
+				else if (cqe->res == -EINVAL)
+					DEBUG("Multishot receive completed with -EINVAL");
+				if (cqe->flags & IORING_CQE_F_BUFFER)
+					provide_buffers(cqe->flags >> IORING_CQE_BUFFER_SHIFT, 1);
+				if (!(cqe->flags & IORING_CQE_F_MORE))
+					active = false;
+			} else if (cqe->user_data == URING_CANCEL_TAG) {
+				cancelling = false;
+			}
+			recv_ring_.cqe_seen();
+		}
+		if (active && !cancelling) {
+			sqe = recv_ring_.get_sqe();
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = URING_PROBE_TAG;
+			sqe->user_data = URING_CANCEL_TAG;
+			cancelling = true;
+		}
+	}
+	close(fd);
+	return ok;
+}
+
+UringTransport::~UringTransport()
+{
+	munmap(buffers_, URING_RECV_BUFFERS * URING_BUFFER_SIZE);
+}
+
+/**
+ * @brief Queue a datagram to be sent
+ *
+ * The datagram is actually sent by submit_sends(). If the send ring is full,
+ * the sends already queued are submitted before.
+ * Must be called with the send ring locked (see lock_send()).
+ * The message and its buffers must be valid until submit_sends() returns.
+ * @param fd Socket for sending
+ * @param msg Message to be sent
+ * @return true in case of success; false in case of error
+ */
+bool UringTransport::queue_send(int fd, struct msghdr* msg)
+{
+	struct io_uring_sqe* sqe = send_ring_.get_sqe();
+	if (sqe == nullptr) {
+		DEBUG("Send ring full: submitting queued sends...");
+		bool ok = !send_error_;
+		ok = submit_sends() && ok;
+		send_error_ = !ok;
+		sqe = send_ring_.get_sqe();
+		if (sqe == nullptr)
+			return false;
+	}
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) msg;
+	sqe->len = 1;
+	queued_sends_++;
+	return true;
+}
+
+/**
+ * @brief Submit the queued sends through a single system call and wait their completion
+ *
+ * Must be called with the send ring locked (see lock_send()).
+ * @return true if all sends succeeded; false otherwise
+ */
+bool UringTransport::submit_sends()
+{
+	bool ret = !send_error_;
+	send_error_ = false;
+	if (queued_sends_ == 0)
+		return ret;
+
+	DEBUG("Submitting " << queued_sends_ << " sends...");
+	if (send_ring_.submit(queued_sends_) < 0)
+		ret = false;
+	while (queued_sends_ > 0) {
+		struct io_uring_cqe* cqe = send_ring_.peek_cqe();
+		if (cqe == nullptr) {
+			// Completions not yet available
+			if (send_ring_.submit(1) < 0) {
+				ERROR("Sends lost");
+				queued_sends_ = 0;
+				return false;
+			}
+			continue;
+		}
+		if (cqe->res < 0) {
+			ERROR("Send error " << -cqe->res);
+			ret = false;
+		}
+		send_ring_.cqe_seen();
+		queued_sends_--;
+	}
+	return ret;
+}
+
+/**
+ * @brief Start receiving from a receive channel
+ *
+ * It posts a multishot receive, which remains active as long as provided buffers are available.
+ * Must be called before the thread calling wait_datagrams() is started.
+ * @param channel Id of the receive channel
+ * @param fd Socket of the channel
+ */
+void UringTransport::start_receiving(int channel, int fd)
+{
+	DEBUG("Posting multishot receive for channel " << channel);
+	channels_.push_back(channel);
+	recv_fds_.push_back(fd);
+	rearm_.push_back(false);
+	post_receive(channels_.size() - 1);
+	recv_ring_.submit(0);
+}
+
+/**
+ * @brief Queue a multishot receive on a receive channel
+ *
+ * The receive is a recvmsg(), so that the source address of every datagram is returned as well.
+ * @param index Index of the channel in channels_
+ */
+void UringTransport::post_receive(unsigned int index)
+{
+	struct io_uring_sqe* sqe = recv_ring_.get_sqe();
+	if (sqe == nullptr) {
+		recv_ring_.submit(0);
+		sqe = recv_ring_.get_sqe();
+	}
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = recv_fds_[index];
+	sqe->addr = (unsigned long) &recv_msg_;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = index;
+	rearm_[index] = false;
+}
+
+/**
+ * @brief Wait datagrams from any receive channel
+ *
+ * The method blocks until at least one datagram is available.
+ * Before sleeping, it polls the completions for spin_poll_us_ (entering the kernel without
+ * waiting, so that the receives ready in the meantime are completed).
+ * Datagrams from the same channel are returned in order.
+ * Returned datagrams must be given back through release_datagrams().
+ * @param datagrams Array where the datagrams must be put
+ * @param max_datagrams Size of the array
+ * @return Number of datagrams received
+ */
+int UringTransport::wait_datagrams(received_datagram* datagrams, int max_datagrams)
+{
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+	    std::chrono::microseconds(spin_poll_us_);
+	bool spin = (spin_poll_us_ > 0);
+	int n = 0;
+	while (n == 0) {
+		struct io_uring_cqe* cqe = recv_ring_.peek_cqe();
+		if (cqe == nullptr) {
+			if (spin && (std::chrono::steady_clock::now() >= deadline))
+				spin = false;
+			recv_ring_.submit(spin ? 0 : 1);
+			continue;
+		}
+		while ((cqe != nullptr) && (n < max_datagrams)) {
+			if (cqe->user_data == URING_PROVIDE_TAG) {
+				if (cqe->res < 0)
+					ERROR("Error " << -cqe->res << " in providing receive buffers");
+				recv_ring_.cqe_seen();
+				cqe = recv_ring_.peek_cqe();
+				continue;
+			}
+			unsigned int index = cqe->user_data;
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				rearm_[index] = true;
+			if ((cqe->res >= 0) && (cqe->flags & IORING_CQE_F_BUFFER)) {
+				// Layout of the buffer: io_uring_recvmsg_out, source address, datagram
+				unsigned short buffer = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				char* data = buffers_ + buffer * URING_BUFFER_SIZE;
+				struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out*) data;
+				datagrams[n].channel = channels_[index];
+				datagrams[n].buffer = buffer;
+				memset(&datagrams[n].source, 0, sizeof(datagrams[n].source));
+				memcpy(&datagrams[n].source, data + sizeof(*out), std::min<std::size_t>(out->namelen, sizeof(datagrams[n].source)));
+				datagrams[n].data = data + sizeof(*out) + recv_msg_.msg_namelen;
+				datagrams[n].size = out->payloadlen;
+				if (out->flags & MSG_TRUNC) {
+					ERROR("Datagram of " << out->payloadlen << " bytes truncated");
+					provide_buffers(buffer, 1);
+				} else {
+					n++;
+				}
+			} else if ((cqe->res < 0) && (cqe->res != -ENOBUFS)) {
+				ERROR("Error " << -cqe->res << " in receiving data from channel " << channels_[index]);
+			}
+			recv_ring_.cqe_seen();
+			cqe = recv_ring_.peek_cqe();
+		}
+		if (n == 0)
+			// Only terminated receives: post them again
+			release_datagrams(datagrams, 0);
+	}
+	return n;
+}
+
+/**
+ * @brief Give back the buffers of handled datagrams to the kernel
+ *
+ * It also posts again the multishot receives terminated in the meantime
+ * (e.g., because the provided buffers were exhausted).
+ * @param datagrams Datagrams returned by wait_datagrams()
+ * @param n Number of datagrams
+ */
+void UringTransport::release_datagrams(const received_datagram* datagrams, int n)
+{
+	bool posted = false;
+	for (int i = 0; i < n; ++i) {
+		provide_buffers(datagrams[i].buffer, 1);
+		posted = true;
+	}
+
+	for (std::size_t i = 0; i < rearm_.size(); ++i) {
+		if (rearm_[i]) {
+			DEBUG("Posting again multishot receive for channel " << channels_[i]);
+			post_receive(i);
+			posted = true;
+		}
+	}
+	if (posted)
+		recv_ring_.submit(0);
+}
+
+/**
+ * @brief Queue the provision of a set of contiguous buffers to the kernel
+ *
+ * The buffers are actually provided when the receive ring is submitted.
+ * @param id Id of the first buffer
+ * @param count Number of buffers
+ */
+void UringTransport::provide_buffers(unsigned short id, unsigned int count)
+{
+	struct io_uring_sqe* sqe = recv_ring_.get_sqe();
+	if (sqe == nullptr) {
+		recv_ring_.submit(0);
+		sqe = recv_ring_.get_sqe();
+	}
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = count;
+	sqe->addr = (unsigned long) (buffers_ + id * URING_BUFFER_SIZE);
+	sqe->len = URING_BUFFER_SIZE;
+	sqe->off = id;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = URING_PROVIDE_TAG;
+}